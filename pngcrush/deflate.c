@@ -250,6 +250,8 @@ int ZEXPORT deflateInit2_(strm, level, method, windowBits, memLevel, strategy,
 {
     deflate_state *s;
     int wrap = 1;
+    int block_split = 0;
+    int opt_huffman = 0;
     static const char my_version[] = ZLIB_VERSION;
 
     ushf *overlay;
@@ -295,6 +297,11 @@ int ZEXPORT deflateInit2_(strm, level, method, windowBits, memLevel, strategy,
         windowBits -= 16;
     }
 #endif
+    if (strategy >= 0) {
+        block_split = (strategy & Z_SPLIT_BLOCKS) != 0;
+        opt_huffman = (strategy & Z_OPTIMAL_HUFFMAN) != 0;
+        strategy &= ~(Z_SPLIT_BLOCKS | Z_OPTIMAL_HUFFMAN);
+    }
     if (memLevel < 1 || memLevel > MAX_MEM_LEVEL || method != Z_DEFLATED ||
         windowBits < 8 || windowBits > 15 || level < 0 || level > 9 ||
         strategy < 0 || strategy > Z_FIXED || (windowBits == 8 && wrap != 1)) {
@@ -343,6 +350,10 @@ int ZEXPORT deflateInit2_(strm, level, method, windowBits, memLevel, strategy,
     s->level = level;
     s->strategy = strategy;
     s->method = (Byte)method;
+    s->block_split = block_split;
+    s->split_buf = Z_NULL;
+    s->opt_huffman = opt_huffman;
+    s->huff_buf = Z_NULL;
 
     return deflateReset(strm);
 }
@@ -572,6 +583,8 @@ int ZEXPORT deflateParams(strm, level, strategy)
 {
     deflate_state *s;
     compress_func func;
+    int block_split = 0;
+    int opt_huffman = 0;
 
     if (deflateStateCheck(strm)) return Z_STREAM_ERROR;
     s = strm->state;
@@ -581,6 +594,11 @@ int ZEXPORT deflateParams(strm, level, strategy)
 #else
     if (level == Z_DEFAULT_COMPRESSION) level = 6;
 #endif
+    if (strategy >= 0) {
+        block_split = (strategy & Z_SPLIT_BLOCKS) != 0;
+        opt_huffman = (strategy & Z_OPTIMAL_HUFFMAN) != 0;
+        strategy &= ~(Z_SPLIT_BLOCKS | Z_OPTIMAL_HUFFMAN);
+    }
     if (level < 0 || level > 9 || strategy < 0 || strategy > Z_FIXED) {
         return Z_STREAM_ERROR;
     }
@@ -610,6 +628,8 @@ int ZEXPORT deflateParams(strm, level, strategy)
         s->max_chain_length = configuration_table[level].max_chain;
     }
     s->strategy = strategy;
+    s->block_split = block_split;
+    s->opt_huffman = opt_huffman;
     return Z_OK;
 }
 
@@ -1083,6 +1103,8 @@ int ZEXPORT deflateEnd (strm)
     status = strm->state->status;
 
     /* Deallocate in reverse order of allocations: */
+    TRY_FREE(strm, strm->state->huff_buf);
+    TRY_FREE(strm, strm->state->split_buf);
     TRY_FREE(strm, strm->state->pending_buf);
     TRY_FREE(strm, strm->state->head);
     TRY_FREE(strm, strm->state->prev);
@@ -1130,6 +1152,8 @@ int ZEXPORT deflateCopy (dest, source)
     ds->head   = (Posf *)  ZALLOC(dest, ds->hash_size, sizeof(Pos));
     overlay = (ushf *) ZALLOC(dest, ds->lit_bufsize, sizeof(ush)+2);
     ds->pending_buf = (uchf *) overlay;
+    ds->split_buf = Z_NULL;     /* allocated again when needed */
+    ds->huff_buf = Z_NULL;
 
     if (ds->window == Z_NULL || ds->prev == Z_NULL || ds->head == Z_NULL ||
         ds->pending_buf == Z_NULL) {
@@ -273,6 +273,23 @@ typedef struct internal_state {
      * updated to the new high water mark.
      */
 
+    int block_split;
+    /* Nonzero if Z_SPLIT_BLOCKS was given with the strategy */
+
+    uchf *split_buf;
+    /* Work area for block splitting, allocated in trees.c when first used */
+
+    int opt_huffman;
+    /* Nonzero if Z_OPTIMAL_HUFFMAN was given with the strategy */
+
+    uchf *huff_buf;
+    /* Work area for optimal trees, allocated in trees.c when first used */
+
+    unsigned rle_tokens;
+    /* Number of code length tokens in huff_buf for send_all_trees(), or
+     * zero to send the trees with send_tree()
+     */
+
 } FAR deflate_state;
 
 /* Output a byte on the stream.
@@ -162,6 +162,7 @@ png_calculate_crc(png_structrp png_ptr, png_const_bytep ptr, png_size_t length)
    {
       uLong crc = png_ptr->crc; /* Should never issue a warning */
 
+      PNGCRUSH_PHASE_START(PNGCRUSH_TIMER_CRC);
       do
       {
          uInt safe_length = (uInt)length;
@@ -180,6 +181,7 @@ png_calculate_crc(png_structrp png_ptr, png_const_bytep ptr, png_size_t length)
          length -= safe_length;
       }
       while (length > 0);
+      PNGCRUSH_PHASE_STOP(PNGCRUSH_TIMER_CRC);
 
       /* And the following is always safe because the crc is only 32 bits. */
       png_ptr->crc = (png_uint_32)crc;
@@ -0,0 +1,853 @@
+/* pngbench.c - synthetic corpus and report for "make bench"
+ *
+ * This software is released under a license derived from the libpng
+ * license (see LICENSE, in pngcrush.c).
+ *
+ * Usage:
+ *
+ *    pngbench corpus dir
+ *
+ *       Writes a deterministic set of PNG files into dir (which must
+ *       exist), in seven classes: photo, ui, sprite, gray16, rgba,
+ *       adam7 and icon, plus dir/corpus.txt listing each file with its
+ *       class and its uncompressed image size in bytes.  Each class is
+ *       written with the row filters a typical encoder would choose for
+ *       it, so that decoding the corpus goes through every unfilter
+ *       path.  The same files are written on every platform, so results
+ *       can be compared between builds.
+ *
+ *    pngbench report dir stats.json [baseline]
+ *
+ *       Reads the "-stats_json" records that pngcrush wrote while
+ *       crushing the corpus and prints, per class, the number of files,
+ *       the image MB, MB/s decoded and MB/s encoded (image bytes per
+ *       second of decode and encode time, over all trials), files per
+ *       second, and the compression ratio (output bytes / input bytes).
+ *       The same figures are written to dir/results.txt.  If a baseline
+ *       (a results.txt saved from an earlier run) is given, the change
+ *       against it is shown as a percentage after each figure.  The
+ *       exit status is 1 if pngcrush wrote no output for a corpus file.
+ *
+ * The PNG files are written directly with zlib, without libpng, so the
+ * corpus does not depend on the code being measured.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zlib.h"
+
+#define PNGBENCH_CLASSES 7
+
+static const char *class_name[PNGBENCH_CLASSES] = {
+   "photo", "ui", "sprite", "gray16", "rgba", "adam7", "icon"
+};
+
+/* Files per class, and their dimensions */
+static const int class_files[PNGBENCH_CLASSES] =  {  3,   3,   8,   3,   4,   3,  48};
+static const int class_width[PNGBENCH_CLASSES] =  {512, 800, 128, 512, 480, 512,  16};
+static const int class_height[PNGBENCH_CLASSES] = {384, 600, 128, 512, 360, 384,  16};
+
+/* Row filter per class: 0-4 for None, Sub, Up, Average or Paeth on every
+ * row, or PNGBENCH_ADAPTIVE to choose one per row as libpng does.
+ */
+#define PNGBENCH_ADAPTIVE 5
+static const int class_filter[PNGBENCH_CLASSES] = {  5,   1,   0,   2,   5,   5,   4};
+
+#define CLASS_PHOTO  0
+#define CLASS_UI     1
+#define CLASS_SPRITE 2
+#define CLASS_GRAY16 3
+#define CLASS_RGBA   4
+#define CLASS_ADAM7  5
+#define CLASS_ICON   6
+
+/* Deterministic pseudo-random numbers; no rand(), which varies by libc */
+static unsigned long bench_seed;
+
+static unsigned long bench_random(void)
+{
+   bench_seed = (bench_seed * 1103515245UL + 12345UL) & 0xffffffffUL;
+   return bench_seed >> 8;
+}
+
+static unsigned int bench_hash(unsigned long x, unsigned long y,
+   unsigned long seed)
+{
+   unsigned long h = (x * 374761393UL + y * 668265263UL +
+      seed * 2246822519UL) & 0xffffffffUL;
+
+   h = ((h ^ (h >> 13)) * 1274126177UL) & 0xffffffffUL;
+   return (unsigned int)((h ^ (h >> 16)) & 0xffff);
+}
+
+static int bench_clamp(long v)
+{
+   return v < 0 ? 0 : v > 255 ? 255 : (int)v;
+}
+
+static voidpf bench_zalloc(voidpf opaque, uInt items, uInt size)
+{
+   (void)opaque;
+   return calloc(items, size);
+}
+
+static void bench_zfree(voidpf opaque, voidpf address)
+{
+   (void)opaque;
+   free(address);
+}
+
+/* Write a chunk with its length and CRC */
+static void bench_put_chunk(FILE *fp, const char *name,
+   const unsigned char *data, unsigned long length)
+{
+   unsigned char buf[4];
+   uLong crc;
+
+   buf[0] = (unsigned char)(length >> 24);
+   buf[1] = (unsigned char)(length >> 16);
+   buf[2] = (unsigned char)(length >> 8);
+   buf[3] = (unsigned char)length;
+   fwrite(buf, 1, 4, fp);
+   fwrite(name, 1, 4, fp);
+   crc = crc32(0, (const Bytef *)name, 4);
+   if (length)
+   {
+      fwrite(data, 1, length, fp);
+      crc = crc32(crc, data, (uInt)length);
+   }
+   buf[0] = (unsigned char)(crc >> 24);
+   buf[1] = (unsigned char)(crc >> 16);
+   buf[2] = (unsigned char)(crc >> 8);
+   buf[3] = (unsigned char)crc;
+   fwrite(buf, 1, 4, fp);
+}
+
+static int bench_paeth(int a, int b, int c)
+{
+   int p = a + b - c;
+   int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+   return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+/* Filter one row of rowbytes bytes with the given filter type, into out.
+ * prev is the row above, all zeros for the first row of a pass.
+ */
+static void bench_filter_row(int filter, unsigned char *out,
+   const unsigned char *row, const unsigned char *prev,
+   unsigned long rowbytes, int bpp)
+{
+   unsigned long i;
+
+   for (i = 0; i < rowbytes; i++)
+   {
+      int a = i >= (unsigned long)bpp ? row[i - bpp] : 0;
+      int b = prev[i];
+      int c = i >= (unsigned long)bpp ? prev[i - bpp] : 0;
+      int pred;
+
+      switch (filter)
+      {
+         case 1:  pred = a; break;
+         case 2:  pred = b; break;
+         case 3:  pred = (a + b) >> 1; break;
+         case 4:  pred = bench_paeth(a, b, c); break;
+         default: pred = 0; break;
+      }
+      out[i] = (unsigned char)(row[i] - pred);
+   }
+}
+
+/* The filter that gives the smallest sum of the filtered bytes taken as
+ * signed, which is libpng's heuristic.
+ */
+static int bench_adaptive_filter(unsigned char *out,
+   const unsigned char *row, const unsigned char *prev,
+   unsigned long rowbytes, int bpp)
+{
+   unsigned long best_sum = 0;
+   int best = 0, filter;
+
+   for (filter = 0; filter < 5; filter++)
+   {
+      unsigned long sum = 0, i;
+
+      bench_filter_row(filter, out, row, prev, rowbytes, bpp);
+      for (i = 0; i < rowbytes; i++)
+         sum += out[i] < 128 ? out[i] : 256 - out[i];
+      if (filter == 0 || sum < best_sum)
+      {
+         best_sum = sum;
+         best = filter;
+      }
+   }
+   return best;
+}
+
+/* Write an image whose pixels (bpp bytes each, rows packed) are in img,
+ * with the row filter "filter" (0-4, or PNGBENCH_ADAPTIVE).
+ */
+static int bench_write_png(const char *name, const unsigned char *img,
+   int width, int height, int bit_depth, int color_type, int bpp,
+   int interlaced, int filter, const unsigned char *plte, int plte_len,
+   const unsigned char *trns, int trns_len)
+{
+   static const int xstart[7] = {0, 4, 0, 2, 0, 1, 0};
+   static const int ystart[7] = {0, 0, 4, 0, 2, 0, 1};
+   static const int xinc[7] = {8, 8, 4, 4, 2, 2, 1};
+   static const int yinc[7] = {8, 8, 8, 4, 4, 2, 2};
+   static const unsigned char signature[8] =
+      {137, 80, 78, 71, 13, 10, 26, 10};
+
+   unsigned char ihdr[13];
+   unsigned long raw_size = (unsigned long)height * (width * bpp + 1) * 2;
+   unsigned char *raw = (unsigned char *)malloc(raw_size);
+   unsigned char *row = (unsigned char *)malloc(2 * (size_t)width * bpp);
+   unsigned char *prev = row + (size_t)width * bpp;
+   unsigned char *zbuf;
+   unsigned long zlen;
+   z_stream zs;
+   unsigned long n = 0;
+   int passes = interlaced ? 7 : 1;
+   int pass, x, y;
+   FILE *fp;
+
+   if (raw == NULL || row == NULL)
+   {
+      free(raw);
+      free(row);
+      return 1;
+   }
+
+   for (pass = 0; pass < passes; pass++)
+   {
+      int x0 = interlaced ? xstart[pass] : 0;
+      int y0 = interlaced ? ystart[pass] : 0;
+      int dx = interlaced ? xinc[pass] : 1;
+      int dy = interlaced ? yinc[pass] : 1;
+
+      unsigned long rowbytes = 0;
+
+      if (x0 >= width)
+         continue;
+      memset(prev, 0, (size_t)width * bpp);
+      for (y = y0; y < height; y += dy)
+      {
+         int row_filter = filter;
+
+         rowbytes = 0;
+         for (x = x0; x < width; x += dx)
+         {
+            memcpy(row + rowbytes,
+               img + ((unsigned long)y * width + x) * bpp, bpp);
+            rowbytes += bpp;
+         }
+         if (filter == PNGBENCH_ADAPTIVE)
+            row_filter = bench_adaptive_filter(raw + n + 1, row, prev,
+               rowbytes, bpp);
+         bench_filter_row(row_filter, raw + n + 1, row, prev, rowbytes, bpp);
+         raw[n] = (unsigned char)row_filter;
+         n += rowbytes + 1;
+         memcpy(prev, row, rowbytes);
+      }
+   }
+   free(row);
+
+   /* The bundled zlib is built with Z_SOLO, so there is no compress2() */
+   memset(&zs, 0, sizeof zs);
+   zs.zalloc = bench_zalloc;
+   zs.zfree = bench_zfree;
+   zbuf = NULL;
+   if (deflateInit(&zs, 6) == Z_OK)
+   {
+      zlen = deflateBound(&zs, n);
+      zbuf = (unsigned char *)malloc(zlen);
+      if (zbuf != NULL)
+      {
+         zs.next_in = raw;
+         zs.avail_in = (uInt)n;
+         zs.next_out = zbuf;
+         zs.avail_out = (uInt)zlen;
+         if (deflate(&zs, Z_FINISH) == Z_STREAM_END)
+            zlen = zs.total_out;
+         else
+         {
+            free(zbuf);
+            zbuf = NULL;
+         }
+      }
+      deflateEnd(&zs);
+   }
+   if (zbuf == NULL)
+   {
+      fprintf(stderr, "pngbench: cannot compress %s\n", name);
+      free(raw);
+      return 1;
+   }
+
+   fp = fopen(name, "wb");
+   if (fp == NULL)
+   {
+      fprintf(stderr, "pngbench: cannot write %s\n", name);
+      free(raw);
+      free(zbuf);
+      return 1;
+   }
+
+   ihdr[0] = (unsigned char)(width >> 24);
+   ihdr[1] = (unsigned char)(width >> 16);
+   ihdr[2] = (unsigned char)(width >> 8);
+   ihdr[3] = (unsigned char)width;
+   ihdr[4] = (unsigned char)(height >> 24);
+   ihdr[5] = (unsigned char)(height >> 16);
+   ihdr[6] = (unsigned char)(height >> 8);
+   ihdr[7] = (unsigned char)height;
+   ihdr[8] = (unsigned char)bit_depth;
+   ihdr[9] = (unsigned char)color_type;
+   ihdr[10] = 0;
+   ihdr[11] = 0;
+   ihdr[12] = (unsigned char)interlaced;
+
+   fwrite(signature, 1, 8, fp);
+   bench_put_chunk(fp, "IHDR", ihdr, 13);
+   if (plte_len)
+      bench_put_chunk(fp, "PLTE", plte, 3 * plte_len);
+   if (trns_len)
+      bench_put_chunk(fp, "tRNS", trns, trns_len);
+   bench_put_chunk(fp, "IDAT", zbuf, zlen);
+   bench_put_chunk(fp, "IEND", NULL, 0);
+   fclose(fp);
+
+   free(raw);
+   free(zbuf);
+   return 0;
+}
+
+/* Smooth gradients with a few soft blobs and a little sensor noise */
+static void bench_photo(unsigned char *img, int width, int height, int bpp,
+   unsigned long seed)
+{
+   long cx[4], cy[4], r2[4];
+   int c[4][3];
+   int i, x, y;
+
+   for (i = 0; i < 4; i++)
+   {
+      cx[i] = (long)(bench_random() % width);
+      cy[i] = (long)(bench_random() % height);
+      r2[i] = (long)(width * height / (4 + bench_random() % 8));
+      c[i][0] = (int)(bench_random() % 160) - 80;
+      c[i][1] = (int)(bench_random() % 160) - 80;
+      c[i][2] = (int)(bench_random() % 160) - 80;
+   }
+
+   for (y = 0; y < height; y++)
+   {
+      for (x = 0; x < width; x++)
+      {
+         unsigned char *p = img + ((unsigned long)y * width + x) * bpp;
+         long v[3];
+         int noise = (int)(bench_hash(x, y, seed) & 15) - 8;
+
+         v[0] = 40 + 160L * x / width;
+         v[1] = 60 + 120L * y / height;
+         v[2] = 200 - 100L * (x + y) / (width + height);
+         for (i = 0; i < 4; i++)
+         {
+            long d2 = (x - cx[i]) * (x - cx[i]) + (y - cy[i]) * (y - cy[i]);
+
+            if (d2 < r2[i])
+            {
+               v[0] += c[i][0] * (r2[i] - d2) / r2[i];
+               v[1] += c[i][1] * (r2[i] - d2) / r2[i];
+               v[2] += c[i][2] * (r2[i] - d2) / r2[i];
+            }
+         }
+         p[0] = (unsigned char)bench_clamp(v[0] + noise);
+         p[1] = (unsigned char)bench_clamp(v[1] + noise);
+         p[2] = (unsigned char)bench_clamp(v[2] + noise);
+      }
+   }
+}
+
+/* Flat panels, buttons and rows of glyph-like marks */
+static void bench_ui(unsigned char *img, int width, int height,
+   unsigned long seed)
+{
+   int i, x, y;
+
+   for (y = 0; y < height; y++)
+      for (x = 0; x < width; x++)
+      {
+         unsigned char *p = img + ((unsigned long)y * width + x) * 3;
+
+         p[0] = 236; p[1] = 236; p[2] = 240;
+         if (y < 28)
+         {
+            p[0] = 48; p[1] = 64; p[2] = 96;
+         }
+      }
+
+   for (i = 0; i < 24; i++)
+   {
+      int x0 = (int)(bench_random() % (width - 40));
+      int y0 = 28 + (int)(bench_random() % (height - 60));
+      int w = 20 + (int)(bench_random() % (width / 3));
+      int h = 12 + (int)(bench_random() % (height / 4));
+      int r = 160 + (int)(bench_random() % 96);
+      int g = 160 + (int)(bench_random() % 96);
+      int b = 160 + (int)(bench_random() % 96);
+      int text = (int)(bench_random() & 1);
+
+      if (x0 + w > width)
+         w = width - x0;
+      if (y0 + h > height)
+         h = height - y0;
+
+      for (y = y0; y < y0 + h; y++)
+         for (x = x0; x < x0 + w; x++)
+         {
+            unsigned char *p = img + ((unsigned long)y * width + x) * 3;
+            int border = (x == x0 || y == y0 || x == x0 + w - 1 ||
+               y == y0 + h - 1);
+            int glyph = text && (y - y0) % 14 > 3 && (y - y0) % 14 < 11 &&
+               x > x0 + 4 && x < x0 + w - 4 &&
+               ((x - x0) / 6) % 9 != 8 &&
+               (bench_hash((x - x0) / 2, (y - y0) / 2, seed) & 3) == 0;
+
+            if (border)
+            {
+               p[0] = 128; p[1] = 128; p[2] = 136;
+            }
+            else if (glyph)
+            {
+               p[0] = 24; p[1] = 24; p[2] = 32;
+            }
+            else
+            {
+               p[0] = (unsigned char)r;
+               p[1] = (unsigned char)g;
+               p[2] = (unsigned char)b;
+            }
+         }
+   }
+}
+
+/* Palette sprite: transparent background, outlined blobs */
+static void bench_sprite(unsigned char *img, int width, int height,
+   unsigned long seed)
+{
+   int i, x, y;
+
+   memset(img, 0, (size_t)width * height);
+   for (i = 0; i < 6; i++)
+   {
+      long cx = (long)(width / 4 + bench_random() % (width / 2));
+      long cy = (long)(height / 4 + bench_random() % (height / 2));
+      long r = (long)(6 + bench_random() % (width / 5));
+      int index = 2 + (int)(bench_random() % 14);
+
+      for (y = 0; y < height; y++)
+         for (x = 0; x < width; x++)
+         {
+            long d2 = (x - cx) * (x - cx) + (y - cy) * (y - cy);
+
+            if (d2 <= r * r)
+            {
+               unsigned char *p = img + (unsigned long)y * width + x;
+
+               if (d2 > (r - 2) * (r - 2))
+                  *p = 1; /* outline */
+               else if ((bench_hash(x / 4, y / 4, seed) & 7) == 0)
+                  *p = (unsigned char)(index == 15 ? 2 : index + 1);
+               else
+                  *p = (unsigned char)index;
+            }
+         }
+   }
+}
+
+/* 16-bit gray ramp with noise in the low byte */
+static void bench_gray16(unsigned char *img, int width, int height,
+   unsigned long seed)
+{
+   int x, y;
+
+   for (y = 0; y < height; y++)
+      for (x = 0; x < width; x++)
+      {
+         unsigned char *p = img + ((unsigned long)y * width + x) * 2;
+         unsigned long v = 65535UL * ((unsigned long)x + y) /
+            (width + height) + (bench_hash(x, y, seed) & 255);
+
+         if (v > 65535UL)
+            v = 65535UL;
+         p[0] = (unsigned char)(v >> 8);
+         p[1] = (unsigned char)v;
+      }
+}
+
+/* Alpha: opaque disc with a soft edge, fully transparent outside */
+static void bench_alpha(unsigned char *img, int width, int height)
+{
+   long cx = width / 2, cy = height / 2;
+   long r = (width < height ? width : height) / 2 - 1;
+   int x, y;
+
+   for (y = 0; y < height; y++)
+      for (x = 0; x < width; x++)
+      {
+         unsigned char *p = img + ((unsigned long)y * width + x) * 4;
+         long d2 = (x - cx) * (x - cx) + (y - cy) * (y - cy);
+         long inner = (r * 3 / 4) * (r * 3 / 4);
+
+         if (d2 >= r * r)
+            p[3] = 0;
+         else if (d2 <= inner)
+            p[3] = 255;
+         else
+            p[3] = (unsigned char)(255 * (r * r - d2) / (r * r - inner));
+      }
+}
+
+static int bench_corpus(const char *dir)
+{
+   char name[1024];
+   char list[1024];
+   FILE *fp;
+   int cls, i;
+
+   sprintf(list, "%.1000s/corpus.txt", dir);
+   fp = fopen(list, "w");
+   if (fp == NULL)
+   {
+      fprintf(stderr, "pngbench: cannot write %s\n", list);
+      return 1;
+   }
+
+   for (cls = 0; cls < PNGBENCH_CLASSES; cls++)
+   {
+      for (i = 0; i < class_files[cls]; i++)
+      {
+         int width = class_width[cls];
+         int height = class_height[cls];
+         int bpp, bit_depth = 8, color_type, err;
+         unsigned char plte[3 * 16];
+         unsigned char trns[1];
+         unsigned char *img;
+         unsigned long seed = 1000UL * (cls + 1) + i;
+         unsigned long rgb_size;
+
+         bench_seed = seed;
+         if (cls == CLASS_ICON)
+         {
+            width = height = 16 * (1 + i % 3);
+         }
+
+         switch (cls)
+         {
+            case CLASS_SPRITE:
+               bpp = 1; color_type = 3;
+               break;
+            case CLASS_GRAY16:
+               bpp = 2; bit_depth = 16; color_type = 0;
+               break;
+            case CLASS_RGBA:
+            case CLASS_ICON:
+               bpp = 4; color_type = 6;
+               break;
+            default:
+               bpp = 3; color_type = 2;
+               break;
+         }
+
+         img = (unsigned char *)malloc((size_t)width * height * bpp);
+         if (img == NULL)
+         {
+            fclose(fp);
+            return 1;
+         }
+
+         switch (cls)
+         {
+            case CLASS_UI:
+               bench_ui(img, width, height, seed);
+               break;
+            case CLASS_SPRITE:
+               bench_sprite(img, width, height, seed);
+               break;
+            case CLASS_GRAY16:
+               bench_gray16(img, width, height, seed);
+               break;
+            case CLASS_RGBA:
+            case CLASS_ICON:
+               /* Draw RGB packed, then spread it out to make room for
+                * alpha.
+                */
+               rgb_size = (unsigned long)width * height;
+               bench_photo(img, width, height, 3, seed);
+               while (rgb_size--)
+               {
+                  memmove(img + rgb_size * 4, img + rgb_size * 3, 3);
+               }
+               bench_alpha(img, width, height);
+               break;
+            default:
+               bench_photo(img, width, height, 3, seed);
+               break;
+         }
+
+         if (cls == CLASS_SPRITE)
+         {
+            int j;
+
+            for (j = 0; j < 16; j++)
+            {
+               plte[3 * j] = (unsigned char)(j * 16);
+               plte[3 * j + 1] = (unsigned char)(255 - j * 12);
+               plte[3 * j + 2] = (unsigned char)(j * 37);
+            }
+            trns[0] = 0;
+         }
+
+         sprintf(name, "%.1000s/%s-%02d.png", dir, class_name[cls], i);
+         err = bench_write_png(name, img, width, height, bit_depth,
+            color_type, bpp, cls == CLASS_ADAM7, class_filter[cls],
+            plte, cls == CLASS_SPRITE ? 16 : 0,
+            trns, cls == CLASS_SPRITE ? 1 : 0);
+         free(img);
+         if (err)
+         {
+            fclose(fp);
+            return 1;
+         }
+         fprintf(fp, "%s-%02d.png %s %lu\n", class_name[cls], i,
+            class_name[cls], (unsigned long)width * height * bpp);
+      }
+   }
+   fclose(fp);
+   return 0;
+}
+
+/* Per-class totals */
+typedef struct
+{
+   int files;
+   double image_bytes;
+   double input_bytes;
+   double output_bytes;
+   double decode;
+   double encode;
+   double total;
+} bench_totals;
+
+/* The figures that are reported and compared */
+#define PNGBENCH_FIGURES 5
+static const char *figure_name[PNGBENCH_FIGURES] = {
+   "image MB", "dec MB/s", "enc MB/s", "files/s", "ratio"
+};
+
+static void bench_figures(const bench_totals *t, double *f)
+{
+   f[0] = t->image_bytes / 1.e6;
+   f[1] = t->decode > 0 ? t->image_bytes / 1.e6 / t->decode : 0;
+   f[2] = t->encode > 0 ? t->image_bytes / 1.e6 / t->encode : 0;
+   f[3] = t->total > 0 ? t->files / t->total : 0;
+   f[4] = t->input_bytes > 0 ? t->output_bytes / t->input_bytes : 0;
+}
+
+/* Find "key": in a -stats_json line and return the value after it */
+static const char *bench_json_value(const char *line, const char *key)
+{
+   char pattern[64];
+   const char *p;
+
+   sprintf(pattern, "\"%.50s\":", key);
+   p = strstr(line, pattern);
+   return p == NULL ? NULL : p + strlen(pattern);
+}
+
+static double bench_json_number(const char *line, const char *key)
+{
+   const char *p = bench_json_value(line, key);
+
+   return p == NULL ? 0 : strtod(p, NULL);
+}
+
+static int bench_report(const char *dir, const char *stats,
+   const char *baseline)
+{
+   bench_totals t[PNGBENCH_CLASSES + 1];
+   double base[PNGBENCH_CLASSES + 1][PNGBENCH_FIGURES];
+   int have_base[PNGBENCH_CLASSES + 1];
+   char list[1024];
+   char line[4096];
+   char file[256], cls_name[32];
+   unsigned long image_bytes;
+   FILE *fp, *out;
+   int cls, j, missing = 0, unwritten = 0;
+
+   memset(t, 0, sizeof t);
+   memset(have_base, 0, sizeof have_base);
+
+   fp = fopen(stats, "r");
+   if (fp == NULL)
+   {
+      fprintf(stderr, "pngbench: cannot read %s\n", stats);
+      return 1;
+   }
+
+   sprintf(list, "%.1000s/corpus.txt", dir);
+   out = fopen(list, "r");
+   if (out == NULL)
+   {
+      fprintf(stderr, "pngbench: cannot read %s\n", list);
+      fclose(fp);
+      return 1;
+   }
+
+   /* Match each corpus file with its stats record */
+   while (fscanf(out, "%255s %31s %lu", file, cls_name, &image_bytes) == 3)
+   {
+      int found = 0;
+
+      for (cls = 0; cls < PNGBENCH_CLASSES; cls++)
+         if (!strcmp(cls_name, class_name[cls]))
+            break;
+      if (cls == PNGBENCH_CLASSES)
+         continue;
+
+      rewind(fp);
+      while (fgets(line, sizeof line, fp) != NULL)
+      {
+         const char *in = bench_json_value(line, "input");
+         const char *base_name;
+         size_t len = strlen(file);
+
+         if (in == NULL || *in++ != '"')
+            continue;
+         base_name = strchr(in, '"');
+         if (base_name == NULL || base_name - in < (long)len ||
+             strncmp(base_name - len, file, len) ||
+             (base_name - in > (long)len && base_name[-(long)len - 1] != '/'))
+            continue;
+
+         for (j = 0; j < 2; j++)
+         {
+            bench_totals *p = &t[j ? PNGBENCH_CLASSES : cls];
+
+            p->files++;
+            p->image_bytes += image_bytes;
+            p->input_bytes += bench_json_number(line, "input_bytes");
+            p->output_bytes += bench_json_number(line, "output_bytes");
+            p->decode += bench_json_number(line, "decode");
+            p->encode += bench_json_number(line, "encode");
+            p->total += bench_json_number(line, "decode") +
+               bench_json_number(line, "encode") +
+               bench_json_number(line, "misc");
+         }
+         found = 1;
+         in = bench_json_value(line, "output");
+         if (in != NULL && !strncmp(in, "null", 4))
+            unwritten++;
+         break;
+      }
+      if (!found)
+         missing++;
+   }
+   fclose(out);
+   fclose(fp);
+
+   if (missing)
+      fprintf(stderr, "pngbench: %d corpus files have no stats record\n",
+         missing);
+   if (unwritten)
+      fprintf(stderr, "pngbench: pngcrush wrote no output for %d corpus"
+         " files\n", unwritten);
+
+   if (baseline != NULL)
+   {
+      fp = fopen(baseline, "r");
+      if (fp == NULL)
+         fprintf(stderr, "pngbench: no baseline %s\n", baseline);
+      else
+      {
+         while (fgets(line, sizeof line, fp) != NULL)
+         {
+            double f[PNGBENCH_FIGURES];
+            int files;
+
+            if (sscanf(line, "%31s %d %lf %lf %lf %lf %lf", cls_name, &files,
+                &f[0], &f[1], &f[2], &f[3], &f[4]) != 7)
+               continue;
+            for (cls = 0; cls <= PNGBENCH_CLASSES; cls++)
+               if (!strcmp(cls_name, cls < PNGBENCH_CLASSES ?
+                   class_name[cls] : "total"))
+               {
+                  memcpy(base[cls], f, sizeof f);
+                  have_base[cls] = 1;
+               }
+         }
+         fclose(fp);
+      }
+   }
+
+   sprintf(list, "%.1000s/results.txt", dir);
+   out = fopen(list, "w");
+
+   printf("%-8s %5s", "class", "files");
+   for (j = 0; j < PNGBENCH_FIGURES; j++)
+      printf(baseline != NULL ? " %17s" : " %9s", figure_name[j]);
+   printf("\n");
+
+   for (cls = 0; cls <= PNGBENCH_CLASSES; cls++)
+   {
+      const char *name = cls < PNGBENCH_CLASSES ? class_name[cls] : "total";
+      double f[PNGBENCH_FIGURES];
+
+      if (t[cls].files == 0)
+         continue;
+      bench_figures(&t[cls], f);
+
+      printf("%-8s %5d", name, t[cls].files);
+      if (out != NULL)
+         fprintf(out, "%s %d", name, t[cls].files);
+      for (j = 0; j < PNGBENCH_FIGURES; j++)
+      {
+         printf(j == 4 ? " %9.4f" : " %9.2f", f[j]);
+         if (baseline != NULL)
+         {
+            if (have_base[cls] && base[cls][j] > 0)
+               printf(" (%+5.1f%%)", 100. * (f[j] - base[cls][j]) /
+                  base[cls][j]);
+            else
+               printf(" %8s", "");
+         }
+         if (out != NULL)
+            fprintf(out, " %.6f", f[j]);
+      }
+      printf("\n");
+      if (out != NULL)
+         fprintf(out, "\n");
+   }
+
+   if (out != NULL)
+      fclose(out);
+   return unwritten != 0;
+}
+
+int main(int argc, char *argv[])
+{
+   if (argc == 3 && !strcmp(argv[1], "corpus"))
+      return bench_corpus(argv[2]);
+
+   if ((argc == 4 || argc == 5) && !strcmp(argv[1], "report"))
+      return bench_report(argv[2], argv[3], argc == 5 ? argv[4] : NULL);
+
+   fprintf(stderr, "usage: pngbench corpus dir\n"
+      "       pngbench report dir stats.json [baseline]\n");
+   return 1;
+}
@@ -5,7 +5,7 @@
  * Portions Copyright (C) 2005 Greg Roelofs
  */
 
-#define PNGCRUSH_VERSION "1.8.14"
+#define PNGCRUSH_VERSION "1.8.15"
 
 #undef BLOCKY_DEINTERLACE
 
@@ -250,10 +250,8 @@
  *      operation.  ImageMagick already does this, as of version 6.7.0.
  *      If the lossy "-blacken" option is present, do that operation first.
  *
- *   3. Add choice of interlaced or non-interlaced output. Currently you
- *   can change interlaced to non-interlaced and vice versa by using
- *   ImageMagick before running pngcrush.  Note, when implementing this,
- *   disallow changing interlacing if APNG chunks are being copied.
+ *   3. (Done: "-interlace n" and "-interlace_search" choose interlaced
+ *   or non-interlaced output; interlacing is never changed in APNG files.)
  *
  *   4. Use a better compression algorithm for "deflating" (result must
  *   still be readable with zlib!)  e.g., http://en.wikipedia.org/wiki/7-Zip
@@ -349,6 +347,109 @@
 
 Change log:
 
+Version 1.8.15 (built with libpng-1.6.34 and zlib-1.2.11)
+  Added "-time_budget ms" and "-batch_budget ms" options.  When a budget
+    is given, cheap methods are tried before expensive ones, no new trial
+    is started once the deadline (per file or for the whole run) would be
+    missed, and the best result found so far is written.
+  Added "-server address" and "-workers n" options, to crush requests
+    read from a Unix domain socket or from stdin without starting a new
+    pngcrush for each file.
+  Accept "-" as the input filename (stdin) and the output filename (stdout).
+    Stdin is read into memory once and every trial reads it from there,
+    so pngcrush can be used in a pipe without temporary files.
+  Added "-stats_json file" option, to append one line of JSON per input
+    file with sizes, the chosen method, per-trial results, reductions,
+    and timings.
+  PNGCRUSH_TIMERS are now compiled in by default, keep 64-bit nanosecond
+    totals, and use a monotonic clock_gettime() clock where available.
+    Added "-timers" option, to also time inflate, unfilter, deinterlace,
+    transforms, filter selection, deflate, CRC and I/O, using hooks in
+    the bundled libpng.
+  Added pngbench.c and "make bench", which writes a deterministic synthetic
+    corpus (photo, ui, sprite, gray16, rgba, adam7 and icon classes),
+    crushes it, and reports MB/s decoded and encoded, files/s and ratio
+    per class, compared with a baseline saved by "make bench-baseline".
+  Added pngkbench.c and "make kbench", to time the unfilter, filter setup
+    and selection, longest_match, inflate, crc32 and adler32 kernels in
+    isolation, in cycles per byte.
+  "-bench n" now reports the minimum, median, 95th percentile and standard
+    deviation of each timer over the passes, the throughput, and the
+    encode time of each method.  Added "-warmup n" option, to run untimed
+    passes before the timed ones.
+  Added "-trace file.json" option, to write Trace Event Format spans for
+    each file, file open, measure_idats, trial (with its method, filter,
+    level, strategy and decode and encode times), row loop, bail point,
+    final write and rename.
+  libpng and zlib memory is now always allocated through a counting
+    allocator.  "-v" reports the peak and largest allocation for each file
+    and the peak for the run, and -stats_json records the peak, largest
+    allocation, and the number and size of allocations per file and per
+    trial.
+  The fdAT frame data of APNG files written with the ".apng" extension is
+    now recompressed, with the best method found for the main image, or
+    with the best filter and strategy for each frame with the new
+    "-apng_search" option.  Each frame is written as a single fdAT chunk
+    and the fcTL and fdAT sequence numbers are renumbered.
+  Added "-alpha_fill" option, a variant of "-blacken" that sets the color
+    under fully transparent pixels to the value predicted by the filter of
+    each trial (left, up, average or Paeth) instead of to zero.
+  Replace an 8-bit alpha channel that is only 0 or 255 with a tRNS key
+    color, reducing RGBA to RGB or GA to gray, when all of the fully
+    transparent pixels have one color that no opaque pixel has (part of
+    "-reduce"; 16-bit images are not examined).
+  Reduce 8-bit grayscale images (and 16-bit ones that reduce to 8 bits)
+    whose samples are all multiples of 17, 85, or 255 to 4, 2, or 1 bits,
+    and try indexed images at the 1, 2, or 4-bit depth implied by the
+    reduced palette length (the computed depth used to be discarded).
+    Each method is also run at the unreduced depth, and the smaller
+    result is kept.
+  Added "-interlace n" and "-interlace_search" options.  With the latter
+    each method is also tried with the other interlacing, and the decoded
+    image is kept between trials instead of being decoded again.
+  Added "-block_split" option, which has the bundled zlib split each
+    buffer of symbols into the deflate blocks that make it smallest,
+    instead of always sending it as one block.
+  Added "-optimal_huffman" option, which has the bundled zlib build
+    optimal 15-bit-limited Huffman codes (package-merge) instead of
+    fixing up overlong ones heuristically, and choose the cheapest
+    run-length coding of the code lengths in each block header.
+  Added "-tune_search" option, which runs each lazy-matching method
+    again with several deflateTune() profiles, through a new hook in
+    png_deflate_claim() of the bundled libpng.  These runs also bail
+    when their projected IDAT length exceeds the best so far.
+  Copy iCCP, sPLT, tEXt, zTXt and iTXt chunks verbatim: they are captured
+    once by measure_idats(), checked once against "-rem", and written
+    to the final output as they are, instead of being inflated, parsed
+    and deflated again by libpng in the final trial.
+    A captured iCCP profile still gets the header and tag table
+    checks of libpng, and is not written along with an sRGB chunk.
+  Recompress the zlib data of captured zTXt, compressed iTXt and iCCP
+    chunks at level 9 with a few strategies, in a z_stream separate from
+    the IDAT one, keeping the result only when it is smaller.
+  Added "-recursive directory" and "-readahead n" options.  The tree is
+    walked as files are needed rather than listed on the command line,
+    and the next files are passed to posix_fadvise(POSIX_FADV_WILLNEED)
+    ahead of time.  Defined _POSIX_C_SOURCE as 200112L.
+  Added "-mem_budget n" option.  The -server workers start a request only
+    when the memory it needs, estimated from the IHDR, fits in what the
+    requests already running have left of the budget, in the order the
+    requests came.
+  Added "-scan" option, which reports the predicted savings, available
+    reductions and removable metadata of each file without crushing it.
+    The rows read by the examine pass are deflated at a low level, as
+    they are read, to predict the size of the IDAT, and again after the
+    reductions that the pass found.
+  Added "-verify" option, which compares the decoded pixels of the output
+    with those of the input and keeps the original if they differ.
+  Fixed "Stripping 16-bit depth to 8" of images with a lower bit depth
+    when the gray and opaque reductions were off, e.g. after an earlier
+    file with a tRNS or iCCP chunk in the same run.
+  Added "-manifest file", "-shard i/N", "-journal file" and
+    "-journal_merge file..." options, for splitting a batch run between
+    machines and resuming it after it is interrupted.  A resumed run
+    tries the files that failed again.
+
 Version 1.8.14 (built with libpng-1.6.34 and zlib-1.2.11)
   Recognize the "-bail" option properly (bug fix by Hadrien Lacour).
   Fix documentation about "-force/-noforce" to represent the default
@@ -1436,30 +1537,38 @@ static int copy_idat = 0; /* = 1 to simply copy the IDAT chunk data */
 #endif
 
 #ifndef PNGCRUSH_TIMERS
-# define PNGCRUSH_TIMERS 4
+# define PNGCRUSH_TIMERS 16
 #endif
 
 #if PNGCRUSH_TIMERS > 0
 
 /* TIMER function
    ===== ====================== 
-   set in pngcrush.c:
+   set in pngcrush.c (run unless "-q" or "-s"):
      0   total time
      1   total decode
      2   total encode
      3   total other
-   set in pngread.c:
+   set in pngread.c (phase timers, run only with "-timers"):
      4   decode deinterlace
      5   decode filter 0 (none)
      6   decode filter 1 (sub)
      7   decode filter 2 (up)
      8   decode filter 3 (avg)
      9   decode filter 4 (paeth)
+    12   decode transforms (also encode transforms, in pngwrite.c)
    set in pngwutil.c:
-    10   encode filter setup
+    10   encode filter setup (filter selection)
+    13   encode deflate
+   set in pngrutil.c:
+    11   decode inflate
+   set in png.c:
+    14   CRC, reading and writing
+   set in pngrio.c and pngwio.c:
+    15   I/O, reading and writing
 */
 #undef _POSIX_C_SOURCE
-#define _POSIX_C_SOURCE 199309L /* for clock_gettime */
+#define _POSIX_C_SOURCE 200112L /* for clock_gettime and posix_fadvise */
 
 #include <time.h>
 
@@ -1487,6 +1596,17 @@ static int copy_idat = 0; /* = 1 to simply copy the IDAT chunk data */
 #  include <AvailabilityMacros.h>
 #endif
 
+/* Use a monotonic clock by default where clock_gettime() is likely to be
+ * available; define PNGCRUSH_USE_CLOCK_GETTIME=0 to fall back to clock().
+ */
+#ifndef PNGCRUSH_USE_CLOCK_GETTIME
+#  if defined(__unix__) || defined(__APPLE__)
+#    define PNGCRUSH_USE_CLOCK_GETTIME 1
+#  else
+#    define PNGCRUSH_USE_CLOCK_GETTIME 0
+#  endif
+#endif
+
 /* As in GraphicsMagick */
 #  if PNGCRUSH_USE_CLOCK_GETTIME == 0
 #    define PNGCRUSH_USING_CLOCK "clock()"
@@ -1526,16 +1646,33 @@ static int copy_idat = 0; /* = 1 to simply copy the IDAT chunk data */
 #define PNGCRUSH_TIMER_VOID_API void
 #endif
 
-#define PNGCRUSH_TIMER_DECODE 1
-#define PNGCRUSH_TIMER_ENCODE 2
-#define PNGCRUSH_TIMER_MISC   3
-#define PNGCRUSH_TIMER_TOTAL  0 
+#define PNGCRUSH_TIMER_TOTAL       0
+#define PNGCRUSH_TIMER_DECODE      1
+#define PNGCRUSH_TIMER_ENCODE      2
+#define PNGCRUSH_TIMER_MISC        3
+#define PNGCRUSH_TIMER_DEINTERLACE 4
+#define PNGCRUSH_TIMER_UNFILTER    5  /* plus the filter type */
+#define PNGCRUSH_TIMER_FILTER      10
+#define PNGCRUSH_TIMER_INFLATE     11
+#define PNGCRUSH_TIMER_TRANSFORM   12
+#define PNGCRUSH_TIMER_DEFLATE     13
+#define PNGCRUSH_TIMER_CRC         14
+#define PNGCRUSH_TIMER_IO          15
+
+/* Timers accumulate 64-bit nanoseconds, so they don't wrap on long runs */
+#if defined(_MSC_VER)
+typedef unsigned __int64 pngcrush_nsec_t;
+#elif defined(__GNUC__)
+__extension__ typedef unsigned long long pngcrush_nsec_t;
+#else
+typedef unsigned long long pngcrush_nsec_t;
+#endif
+
+static int phase_timers = 0;  /* set by "-timers" */
 
 static unsigned int pngcrush_timer_hits[PNGCRUSH_TIMERS];
-static unsigned int pngcrush_timer_secs[PNGCRUSH_TIMERS];
-static unsigned int pngcrush_timer_nsec[PNGCRUSH_TIMERS];
-static unsigned int pngcrush_clock_secs[PNGCRUSH_TIMERS];
-static unsigned int pngcrush_clock_nsec[PNGCRUSH_TIMERS];
+static pngcrush_nsec_t pngcrush_timer_nsec[PNGCRUSH_TIMERS];
+static pngcrush_nsec_t pngcrush_clock_nsec[PNGCRUSH_TIMERS];
 
 PNGCRUSH_TIMER_UINT_API
 pngcrush_timer_get_seconds(unsigned int n);
@@ -1551,6 +1688,34 @@ PNGCRUSH_TIMER_VOID_API
 pngcrush_timer_stop(unsigned int n);
 
 #if PNGCRUSH_TIMERS > 0
+/* The phase hooks in the bundled libpng (see pngcrush.h) cost only a test
+ * of phase_timers when "-timers" is not given.
+ */
+#define PNGCRUSH_PHASE_START(n) \
+   (phase_timers ? pngcrush_timer_start(n) : (void)0)
+#define PNGCRUSH_PHASE_STOP(n) \
+   (phase_timers ? pngcrush_timer_stop(n) : (void)0)
+
+static pngcrush_nsec_t pngcrush_timer_now(void)
+{
+#if PNGCRUSH_USE_CLOCK_GETTIME
+   struct timespec t;
+   clock_gettime(PNGCRUSH_CLOCK_ID, &t);
+   return (pngcrush_nsec_t)t.tv_sec * 1000000000 + (pngcrush_nsec_t)t.tv_nsec;
+#else
+   return (pngcrush_nsec_t)((double)clock() * (1.e9 / CLOCKS_PER_SEC));
+#endif
+}
+
+static int pngcrush_timer_enabled(unsigned int n)
+{
+   if (n >= PNGCRUSH_TIMERS)
+      return 0;
+   if (n < PNGCRUSH_TIMER_DEINTERLACE)
+      return verbose >= 0;
+   return phase_timers;
+}
+
 PNGCRUSH_TIMER_UINT_API
 pngcrush_timer_get_hits(unsigned int n)
 {
@@ -1565,7 +1730,7 @@ pngcrush_timer_get_seconds(unsigned int n)
 {
    if (n < PNGCRUSH_TIMERS)
    {
-      return pngcrush_timer_secs[n];
+      return (unsigned int)(pngcrush_timer_nsec[n] / 1000000000);
    }
    return 0;
 }
@@ -1574,7 +1739,7 @@ pngcrush_timer_get_nanoseconds(unsigned int n)
 {
    if (n < PNGCRUSH_TIMERS)
    {
-      return pngcrush_timer_nsec[n];
+      return (unsigned int)(pngcrush_timer_nsec[n] % 1000000000);
    }
    return 0;
 }
@@ -1583,7 +1748,6 @@ pngcrush_timer_reset(unsigned int n)
 {
    if (n < PNGCRUSH_TIMERS)
    {
-      pngcrush_timer_secs[n] = 0;
       pngcrush_timer_nsec[n] = 0;
       pngcrush_timer_hits[n] = 0;
    }
@@ -1591,63 +1755,20 @@ pngcrush_timer_reset(unsigned int n)
 PNGCRUSH_TIMER_VOID_API
 pngcrush_timer_start(unsigned int n)
 {
-   if (verbose >= 0 && n < PNGCRUSH_TIMERS)
-   {
-#if PNGCRUSH_USE_CLOCK_GETTIME
-      struct timespec t;
-      clock_gettime(PNGCRUSH_CLOCK_ID, &t);
-      pngcrush_clock_secs[n] = t.tv_sec;
-      pngcrush_clock_nsec[n] = t.tv_nsec;
-#else
-     TIME_T t = clock();
-     pngcrush_clock_secs[n] = t/CLOCKS_PER_SEC;
-     pngcrush_clock_nsec[n] = (t*1000000000/CLOCKS_PER_SEC) -
-       pngcrush_clock_secs[n]*1000000000;
-#endif
-   }
+   if (pngcrush_timer_enabled(n))
+      pngcrush_clock_nsec[n] = pngcrush_timer_now();
 }
 PNGCRUSH_TIMER_VOID_API
 pngcrush_timer_stop(unsigned int n)
 {
-   if (verbose >= 0 && n < PNGCRUSH_TIMERS)
+   if (pngcrush_timer_enabled(n))
    {
-      unsigned long seconds;
-      unsigned long nseconds;
-      unsigned long delta_secs;
-      unsigned long delta_nsec;
-#if PNGCRUSH_USE_CLOCK_GETTIME
-      struct timespec t;
-      clock_gettime(PNGCRUSH_CLOCK_ID, &t);
-      seconds = t.tv_sec;
-      nseconds = t.tv_nsec;
-#else
-     TIME_T t = clock();
-     seconds = t/CLOCKS_PER_SEC;
-     nseconds = (t*1000000000/CLOCKS_PER_SEC) - seconds*1000000000;
-#endif
-      delta_secs = (unsigned int)seconds - pngcrush_clock_secs[n];
-      if ((unsigned long)nseconds < pngcrush_clock_nsec[n])
-      {
-         delta_nsec  = 1000000000;
-         delta_secs--;
-      }
-      else
-      {
-         delta_nsec  = 0;
-      }
-
-      delta_nsec  += (unsigned long)nseconds - pngcrush_clock_nsec[n];
-      pngcrush_timer_secs[n] += delta_secs;
-      pngcrush_timer_nsec[n] += delta_nsec;
+      pngcrush_nsec_t now = pngcrush_timer_now();
 
-      if (pngcrush_timer_nsec[n] >= 1000000000)
-      {
-         pngcrush_timer_nsec[n] -= 1000000000;
-         pngcrush_timer_secs[n]++;
-      }
+      if (now > pngcrush_clock_nsec[n])
+         pngcrush_timer_nsec[n] += now - pngcrush_clock_nsec[n];
 
-      pngcrush_clock_secs[n] = (unsigned long)seconds;
-      pngcrush_clock_nsec[n] = (unsigned long)nseconds;
+      pngcrush_clock_nsec[n] = now;
       pngcrush_timer_hits[n]++;
    }
 }
@@ -1710,6 +1831,12 @@ static unsigned long pngcrush_timer_min_nsec[PNGCRUSH_TIMERS];
 #endif /* ZLIB_UNIFIED */
 
 #ifdef LIBPNG_UNIFIED
+/* deflateTune() hook in the bundled libpng (see pngcrush.h) */
+struct png_struct_def;
+static void pngcrush_deflate_claimed(struct png_struct_def *png_ptr,
+    unsigned long owner);
+#define PNGCRUSH_DEFLATE_CLAIMED(png_ptr, owner) \
+   pngcrush_deflate_claimed(png_ptr, owner)
 #include "pngcrush.h"
 #include "png.c"
 #include "pngerror.c"
@@ -2080,11 +2207,33 @@ png_uint_32 pngcrush_crc;
 #include <time.h>
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
 
 #if defined(_MBCS) || defined(WIN32) || defined(__WIN32__)
 #  include <direct.h>
 #endif
 
+#if !defined(PNGCRUSH_NO_SERVER) && (defined(__unix__) || defined(__APPLE__))
+#  define PNGCRUSH_SERVER
+#  include <fcntl.h>
+#  include <signal.h>
+#  include <sys/mman.h>
+#  include <sys/socket.h>
+#  include <sys/un.h>
+#  include <sys/wait.h>
+#endif
+
+#if !defined(PNGCRUSH_NO_FORK) && (defined(__unix__) || defined(__APPLE__))
+#  define PNGCRUSH_HAVE_FORK
+#  include <sys/wait.h>
+#endif
+
+#if !defined(PNGCRUSH_NO_RECURSIVE) && (defined(__unix__) || defined(__APPLE__))
+#  define PNGCRUSH_RECURSIVE
+#  include <dirent.h>
+#  include <fcntl.h>
+#endif
+
 #define DEFAULT_MODE     0
 #define DIRECTORY_MODE   1
 #define EXTENSION_MODE   2
@@ -2158,6 +2307,43 @@ static int found_tRNS = 0;
 static int premultiply = 0;
 static int printed_version_info = 0;
 static int interlace_method = 0;
+static int output_interlace_method = 0;
+static int force_interlace = -1; /* -interlace n; -1 keeps the input's */
+static int interlace_search = 0; /* -interlace_search: try 0 and 1 */
+static int interlace_trials = 0; /* interlace_search, if allowed for file */
+static int trial_interlace[MAX_METHODSP1]; /* for idat_length[trial] */
+/* When the output interlacing differs from the input's, each trial reads
+ * the whole image before writing it.  That image is the same in every
+ * trial after the first (except with -alpha_fill), so it is kept, and
+ * trials other than the final one write it without decoding again.
+ */
+static png_bytep decoded_image = NULL;
+static png_size_t decoded_image_size = 0;
+static int decoded_image_ready = 0;
+static int decoded_image_depth = 0; /* the output bit depth it was read for */
+
+/* deflateTune() profiles tried by -tune_search with each method that uses
+ * lazy matching (levels 4 to 9, strategies 0 and 1).  Level 9 itself is
+ * { 32, 258, 258, 4096 }.
+ */
+typedef struct
+{
+    int good_length, max_lazy, nice_length, max_chain;
+} pngcrush_tune_profile;
+static const pngcrush_tune_profile tune_profiles[] =
+{
+    {  32, 258, 258, 16384 },  /* level 9 with longer hash chains */
+    { 258, 258, 258, 32768 },  /* full chains even after a good match */
+    {   8,  32, 258, 32768 },  /* less lazy evaluation, full chains */
+    {   4,  16, 128,  8192 }   /* short lazy matches, as for level 6 */
+};
+#define NUM_TUNE_PROFILES \
+    ((int) (sizeof(tune_profiles) / sizeof(tune_profiles[0])))
+static int tune_search = 0;  /* -tune_search */
+static int tune_trials = 0;  /* tune_search, for this file */
+static int deflate_tune = 0; /* profile of this run, plus 1; 0 for none */
+static int trial_tune[MAX_METHODSP1]; /* for idat_length[trial] */
+static int projected_bail = 0; /* this run bailed on its projected length */
 #if (PNGCRUSH_LIBPNG_VER < 10400)
 png_size_t max_bytes;
 #else
@@ -2181,9 +2367,34 @@ static int found_CgBI = 0;
 static int found_any_chunk = 0;
 static int save_apng_chunks = 0; /* 0: output not .apng 1: .apng 2: rejected */
 static int found_acTL_chunk = 0; /* 0: not found, 1: found, 2: rejected */
+static int apng_search = 0; /* -apng_search: search methods for each frame */
+static int apng_frames = 0; /* frames recompressed in the current file */
+static unsigned long apng_fdat_in = 0;  /* fdAT bytes read */
+static unsigned long apng_fdat_out = 0; /* fdAT bytes written */
 static int image_is_immutable = 0;
 static int pngcrush_must_exit = 0;
 static int all_chunks_are_safe = 0;
+
+/* iCCP, sPLT and text chunks captured by measure_idats() and copied
+ * verbatim into the final output, instead of being parsed (and inflated)
+ * by libpng and rebuilt (and deflated again) by png_set_iCCP() etc.
+ */
+#define PNGCRUSH_RAW_iCCP 1
+#define PNGCRUSH_RAW_sPLT 2
+#define PNGCRUSH_RAW_TEXT 4
+typedef struct pngcrush_raw_chunk_struct
+{
+    struct pngcrush_raw_chunk_struct *next;
+    png_byte name[5];
+    int where;          /* 0: before PLTE; 1: before IDAT; 2: after IDAT */
+    png_uint_32 length;
+    png_bytep data;
+} pngcrush_raw_chunk;
+static pngcrush_raw_chunk *raw_chunks = NULL;
+static int raw_chunk_types = 0; /* types for which every chunk was captured */
+static int raw_chunk_refused = 0; /* types with a chunk we could not capture */
+#define PNGCRUSH_RAW_INFLATE_MAX 8000000L /* as png_user_chunk_malloc_max */
+
 static int number_of_open_files;
 static int do_pplt = 0;
 #ifdef PNGCRUSH_MULTIPLE_ROWS
@@ -2239,6 +2450,19 @@ static int input_color_type;
 static int input_bit_depth;
 static int trial;
 static int last_trial = 0;
+/* These are kept across the longjmp() out of a failed trial, so they are
+ * not locals of main().
+ */
+static int trial_pos;       /* index in trial_order[] */
+static int trials_timed = 0;
+static int trials_skipped = 0; /* by -time_budget or -batch_budget */
+static unsigned long file_start_ms = 0;
+static unsigned long trial_start_ms = 0;
+static unsigned long trial_ms_spent = 0;
+static int repeat = 0;      /* times this run has repeated the method */
+static int repeat_trial = -1; /* the method to run again, or -1 */
+static int interlace_flip = 0; /* the repeat is with the other interlacing */
+static int image_reused = 0; /* the trial wrote the kept decoded image */
 static png_uint_32 pngcrush_write_byte_count;
 static png_uint_32 pngcrush_best_byte_count=0xffffffff;
 
@@ -2248,9 +2472,40 @@ static int check_crc = 0;  /* if 0, skip CRC and ADLER32 checks */
                            /* otherwise check both */
 static int force = 1; /* if 1, force output even if IDAT is larger */
 static unsigned int benchmark_iterations = 0;
+static unsigned int benchmark_warmup = 0; /* -warmup: untimed iterations */
+#if PNGCRUSH_TIMERS > 0
+/* Per-iteration -bench samples, in seconds: bench_samples[timer][iteration],
+ * bench_method_samples[trial][iteration] (encode time, with the final write
+ * in trial 0), and bench_bytes[iteration] (input bytes read).
+ */
+static double *bench_samples = NULL;
+static double *bench_method_samples = NULL;
+static double *bench_bytes = NULL;
+static int bench_sample = -1; /* current iteration, or -1 while warming up */
+#endif
+static unsigned long time_budget = 0; /* -time_budget: ms per file; 0: none */
+static unsigned long batch_time_budget = 0; /* -batch_budget: ms per run */
+static unsigned long batch_start_ms = 0;
 
 static int blacken = 0; /* if 0, or 2 after the first trial,
                            do not blacken color samples */
+static int alpha_fill = 0; /* -alpha_fill: predict, rather than blacken */
+static int block_split = 0; /* -block_split: Z_SPLIT_BLOCKS in every trial */
+static int optimal_huffman = 0; /* -optimal_huffman: Z_OPTIMAL_HUFFMAN */
+#ifdef PNGCRUSH_RECURSIVE
+#define PNGCRUSH_READAHEAD_MAX 256
+static char *recursive_dir = NULL; /* -recursive */
+static long readahead = 16; /* -readahead: files queued ahead of the current */
+#endif
+static int file_list = 0; /* the files come from -recursive or -manifest */
+static char *manifest_name = NULL; /* -manifest: file names, one per line */
+static FILE *manifest_fp = NULL;
+static char manifest_line[STR_BUF_SIZE];
+static long shard_index = 0, shard_count = 0; /* -shard i/N */
+static char *journal_name = NULL; /* -journal: results of finished files */
+static FILE *journal_fp = NULL;
+static png_bytep alpha_fill_row = NULL; /* the previous row, as written */
+static png_size_t alpha_fill_rowbytes = 0;
 
 /* Delete these in pngcrush-1.8.0 */
 #if 0
@@ -2274,6 +2529,22 @@ static int make_8_bit = 1; /* if 0, 2, or 3 after the first trial,
                            do not reduce bit_depth from 16 */
 static int reduce_palette = 1;
 #endif
+static int reduce_trns = 1; /* if 0, do not try make_trns */
+static int make_trns = 0; /* if 0, 2, or 3 after the first trial, do not
+                             replace the alpha channel with a tRNS key */
+static png_uint_32 trns_key = 0;    /* the color of the transparent pixels */
+static int trns_key_found = 0;
+static png_bytep trns_seen = NULL;  /* bitmap of opaque colors, in trial 0 */
+static int reduce_gray_depth = 1; /* if 0, do not try gray_bit_depth */
+static int gray_bit_depth = -1; /* smallest bit depth that can hold every
+                                   8-bit gray sample exactly, or -1 */
+/* A gray or indexed image that fits in fewer bits is not always smaller
+ * when packed, so each method is run again at the unreduced bit depth,
+ * and the smaller result is kept as for interlacing.
+ */
+static int depth_trials = 0; /* 1 if the bit depth can be reduced */
+static int depth_flip = 0;   /* this run keeps the unreduced bit depth */
+static int trial_depth_flip[MAX_METHODSP1]; /* for idat_length[trial] */
 
 static int compression_window;
 static int default_compression_window = 15;
@@ -2362,6 +2633,20 @@ static png_infop end_info_ptr;
 static png_infop write_end_info_ptr;
 static FILE *fpin, *fpout;
 png_uint_32 measure_idats(FILE * fp);
+
+/* "-" as the input or output filename means stdin or stdout.  The input is
+ * read from stdin once, as it arrives, and all of the trials then read it
+ * from memory (fpin stays NULL).  The PNG output goes to pngcrush_stdout, a
+ * duplicate of the original stdout, while stdout itself is redirected to
+ * stderr so that the P1/P2 messages cannot get into the PNG datastream.
+ */
+#define PNGCRUSH_IS_STDIO(name) ((name)[0] == '-' && (name)[1] == '\0')
+static int stdin_input = 0;
+static int stdout_output = 0;
+static png_bytep stdin_data = NULL;
+static png_size_t stdin_data_length = 0;
+static png_size_t stdin_data_pos = 0;
+static FILE *pngcrush_stdout = NULL;
 #ifdef PNGCRUSH_LOCO
 static FILE *mng_out;
 static int do_loco = 0;
@@ -2372,6 +2657,76 @@ static int do_color_count;
 png_uint_32 pngcrush_measure_idat(png_structp png_ptr);
 
 static png_uint_32 idat_length[MAX_METHODSP1];
+static int trial_order[MAX_METHODSP1]; /* order in which trials are run */
+static png_uint_32 bail_row[MAX_METHODSP1]; /* 0: trial did not bail */
+static int bail_pass[MAX_METHODSP1];
+
+/* Memory used through libpng (including zlib's), counted by pngcrush_malloc()
+ * and pngcrush_debug_malloc().  The peaks and the largest allocation are
+ * per file; mem_peak is the peak over the whole run.
+ */
+static unsigned long mem_trial_allocs[MAX_METHODSP1];
+static unsigned long mem_trial_bytes[MAX_METHODSP1];
+static unsigned long mem_file_allocs = 0; /* allocations for this file */
+static unsigned long mem_file_bytes = 0;  /* bytes allocated for this file */
+static unsigned long mem_current = 0;   /* bytes allocated and not freed */
+static unsigned long mem_file_peak = 0;
+static unsigned long mem_file_largest = 0;
+static unsigned long mem_peak = 0;
+static FILE *stats_json = NULL; /* -stats_json: one JSON line per file */
+static FILE *trace_json = NULL; /* -trace: Trace Event Format spans */
+static long trace_pid = 1;
+static double trace_file_us;   /* start of the current file's span */
+static double trace_trial_us;  /* start of the current trial's span */
+static double trace_phase_us;  /* start of a span inside the trial */
+
+/* -scan: the examine pass runs alone, with a fast deflate of the rows in
+ * place of the trials, and a report line per file goes to stdout.
+ */
+#ifndef PNGCRUSH_SCAN_LEVEL
+#  define PNGCRUSH_SCAN_LEVEL 4
+#endif
+#ifndef PNGCRUSH_SCAN_KEEP_MAX
+#  define PNGCRUSH_SCAN_KEEP_MAX (64UL << 20) /* bytes of rows kept */
+#endif
+#define PNGCRUSH_SCAN_CHUNKS 32
+static int scan = 0;
+static int scan_header = 0;       /* the report header has been printed */
+static z_stream scan_stream;
+static int scan_active = 0;       /* scan_stream is set up for this file */
+static png_bytep scan_rows = NULL; /* previous and current unfiltered row */
+static png_bytep scan_filtered = NULL;
+static png_bytep scan_image = NULL; /* the rows as read, for the reductions */
+static png_size_t scan_image_rowbytes;
+static png_size_t scan_rowbytes;
+static int scan_bpp;
+static int scan_filter;
+static unsigned long scan_estimate; /* deflated bytes, 0 if not measured */
+static int scan_read_ok;          /* the examine pass read every row */
+static unsigned long scan_plte_bytes; /* the PLTE chunk, with its overhead */
+static unsigned long scan_critical; /* predicted critical bytes, or 0 */
+static unsigned long scan_metadata; /* ancillary chunk bytes */
+static unsigned long scan_removable; /* ancillary bytes that -rem removes */
+static png_byte scan_chunk_name[PNGCRUSH_SCAN_CHUNKS][5];
+static unsigned long scan_chunk_bytes[PNGCRUSH_SCAN_CHUNKS];
+static int scan_chunks = 0;
+
+/* -verify: the pixels of the input are hashed, in a child process where
+ * fork() is available, while the trials run, and compared with those of
+ * the output once it is written.
+ */
+static int verify = 0;
+static int verify_result;    /* 1: verified, -1: restored, 0: not checked */
+static png_uint_32 verify_input_hash[2];
+static int verify_input_ok;
+static png_bytep verify_image = NULL;
+#ifdef PNGCRUSH_HAVE_FORK
+static pid_t verify_pid = -1;
+static int verify_fd = -1;
+#endif
+#if PNGCRUSH_TIMERS > 0
+static double stats_timer_start[PNGCRUSH_TIMERS];
+#endif
 static int filter_type, zlib_level;
 static png_bytep png_row_filters = NULL;
 
@@ -2435,10 +2790,23 @@ void PNGCBAPI pngcrush_default_write_data(png_structp png_ptr, png_bytep data,
 
 void pngcrush_write_png(png_structp write_pointer, png_bytep data,
      png_size_t length);
+int pngcrush_apng_recompress(png_structp png_ptr, png_unknown_chunkp chunks,
+     int num, png_unknown_chunkp *out, int filter, int level, int strategy);
+void pngcrush_apng_free(png_structp png_ptr, png_unknown_chunkp chunks,
+     int num);
+
+void pngcrush_read_stdin(void);
+void PNGCBAPI pngcrush_read_stdin_data(png_structp png_ptr, png_bytep data,
+  png_size_t length);
+void pngcrush_init_read(png_structp png_ptr, FILE *fp);
+FILE *pngcrush_open_output(void);
+void pngcrush_close_output(void);
 
 #ifdef PNG_USER_MEM_SUPPORTED
 png_voidp pngcrush_debug_malloc(png_structp png_ptr, png_uint_32 size);
 void pngcrush_debug_free(png_structp png_ptr, png_voidp ptr);
+png_voidp pngcrush_malloc(png_structp png_ptr, png_alloc_size_t size);
+void pngcrush_free(png_structp png_ptr, png_voidp ptr);
 #endif
 
 void pngcrush_pause(void);
@@ -2453,8 +2821,41 @@ static void setfiletype(const char *name)
 int keep_unknown_chunk(png_const_charp name, char *argv[]);
 int keep_chunk(png_const_charp name, char *argv[]);
 void show_result(void);
+void pngcrush_show_phases(float *t);
+void pngcrush_bench_report(int last_method, int *fm, int *lv, int *zs);
+void pngcrush_write_stats(const char *out, png_uint_32 output_length,
+  int last_method, int *fm, int *lv, int *zs);
+double pngcrush_trace_now(void);
+void pngcrush_trace(const char *name, const char *cat, double start,
+  double end, const char *args);
+unsigned long pngcrush_clock_ms(void);
+void pngcrush_schedule_trials(int last_method, int *fm, int *lv, int *zs);
 png_uint_32 measure_idats(FILE * fp);
 png_uint_32 pngcrush_measure_idat(png_structp png_ptr);
+int pngcrush_raw_chunk_type(png_bytep name);
+void pngcrush_free_raw_chunks(void);
+void pngcrush_keep_raw_chunks(char *argv[]);
+const char *pngcrush_check_raw_iccp(pngcrush_raw_chunk *chunk);
+void pngcrush_write_raw_chunks(png_structp png_ptr, int where);
+void pngcrush_recompress_raw_chunks(void);
+
+#ifdef PNGCRUSH_SERVER
+int pngcrush_server(int argc, char *argv[], int server_arg);
+#endif
+#ifdef PNGCRUSH_RECURSIVE
+int pngcrush_walk_start(const char *dir, const char *skip_dir);
+char *pngcrush_walk_next(void);
+const char *pngcrush_walk_relative(const char *name);
+void pngcrush_walk_mirror(char *out, int outlen);
+#endif
+char *pngcrush_manifest_next(void);
+int pngcrush_batch_skip(const char *name);
+int pngcrush_journal_load(const char *path);
+void pngcrush_journal_open(void);
+void pngcrush_journal_record(const char *status, unsigned long in,
+    unsigned long out, unsigned long ms);
+void pngcrush_journal_summary(void);
+void pngcrush_show_overall(unsigned long in, unsigned long out);
 
 void print_version_info(void);
 void print_usage(int retval);
@@ -2615,6 +3016,13 @@ void PNGCBAPI pngcrush_default_read_data(png_structp png_ptr, png_bytep data,
 
    io_ptr = png_get_io_ptr(png_ptr);
 
+   if (io_ptr == NULL && stdin_input)
+   {
+      /* Reading "-" from memory; see pngcrush_init_read() */
+      pngcrush_read_stdin_data(png_ptr, data, length);
+      return;
+   }
+
    if (fileno(io_ptr) == -1)
       png_error(png_ptr, "Read Error: invalid io_ptr");
 
@@ -2756,6 +3164,56 @@ static memory_infop pinformation = NULL;
 static int current_allocation = 0;
 static int maximum_allocation = 0;
 
+static void pngcrush_count_alloc(png_alloc_size_t size)
+{
+    mem_file_allocs++;
+    mem_file_bytes += (unsigned long) size;
+    mem_current += (unsigned long) size;
+    if (mem_current > mem_file_peak)
+        mem_file_peak = mem_current;
+    if (mem_current > mem_peak)
+        mem_peak = mem_current;
+    if (size > mem_file_largest)
+        mem_file_largest = (unsigned long) size;
+}
+
+/*
+ * The counting allocator, used unless the debugging allocator above is
+ * (with -v).  The size of each block is kept in a header in front of it;
+ * the header is 16 bytes so that the alignment of the block is unchanged.
+ */
+typedef union pngcrush_mem_header {
+    png_alloc_size_t size;
+    char align[16];
+} pngcrush_mem_header;
+
+png_voidp pngcrush_malloc(png_structp png_ptr, png_alloc_size_t size)
+{
+    pngcrush_mem_header *header;
+
+    PNGCRUSH_UNUSED(png_ptr)
+    if (size == 0 || size > (png_alloc_size_t)-1 - sizeof *header)
+        return (png_voidp) (NULL);
+    header = (pngcrush_mem_header *) malloc(sizeof *header + size);
+    if (header == NULL)
+        return (png_voidp) (NULL);
+    header->size = size;
+    pngcrush_count_alloc(size);
+    return (png_voidp) (header + 1);
+}
+
+void pngcrush_free(png_structp png_ptr, png_voidp ptr)
+{
+    pngcrush_mem_header *header;
+
+    PNGCRUSH_UNUSED(png_ptr)
+    if (ptr == NULL)
+        return;
+    header = (pngcrush_mem_header *) ptr - 1;
+    mem_current -= (unsigned long) header->size;
+    free(header);
+}
+
 
 png_voidp pngcrush_debug_malloc(png_structp png_ptr, png_uint_32 size)
 {
@@ -2778,6 +3236,7 @@ png_voidp pngcrush_debug_malloc(png_structp png_ptr, png_uint_32 size)
         if (pinfo == NULL)
            return (png_voidp) (NULL);
         pinfo->size = size;
+        pngcrush_count_alloc(size);
         current_allocation += size;
         if (current_allocation > maximum_allocation)
             maximum_allocation = current_allocation;
@@ -2813,6 +3272,7 @@ void pngcrush_debug_free(png_structp png_ptr, png_voidp ptr)
             if (pinfo->pointer == ptr) {
                 *ppinfo = pinfo->next;
                 current_allocation -= pinfo->size;
+                mem_current -= pinfo->size;
                 if (current_allocation < 0)
                     fprintf(STDERR, "Duplicate free of memory\n");
                 /* We must free the list element too, but first kill
@@ -3097,24 +3557,321 @@ int keep_chunk(png_const_charp name, char *argv[])
 
 
 
-void show_result(void)
+/* Which raw chunk type, if any, the named chunk belongs to */
+int pngcrush_raw_chunk_type(png_bytep name)
 {
-    if (total_output_length) {
-        if (total_input_length == total_output_length)
-            fprintf(STDERR, "   Overall result: no change\n");
-        else if (total_input_length > total_output_length)
-            fprintf(STDERR,
-                    "   Overall result: %4.2f%% reduction, %lu bytes\n",
-                    (100.0 -
-                     (100.0 * total_output_length) / total_input_length),
-                    (unsigned long)(total_input_length-total_output_length));
+    png_uint_32 chunk = pngcrush_get_uint_32(name);
+
+#ifdef PNG_iCCP_SUPPORTED
+    if (chunk == PNG_UINT_iCCP)
+        return PNGCRUSH_RAW_iCCP;
+#endif
+#ifdef PNG_sPLT_SUPPORTED
+    if (chunk == PNG_UINT_sPLT)
+        return PNGCRUSH_RAW_sPLT;
+#endif
+#ifdef PNG_TEXT_SUPPORTED
+    if (chunk == PNG_UINT_tEXt || chunk == PNG_UINT_zTXt ||
+        chunk == PNG_UINT_iTXt)
+        return PNGCRUSH_RAW_TEXT;
+#endif
+    return 0;
+}
+
+
+
+
+void pngcrush_free_raw_chunks(void)
+{
+    while (raw_chunks != NULL)
+    {
+        pngcrush_raw_chunk *next = raw_chunks->next;
+
+        free(raw_chunks->data);
+        free(raw_chunks);
+        raw_chunks = next;
+    }
+    raw_chunk_types = 0;
+    raw_chunk_refused = 0;
+}
+
+
+
+
+/* Decide once, with keep_chunk(), which of the captured chunks go into the
+ * output, and drop the rest along with any type that was not captured
+ * completely (libpng handles that type in the final trial as before).
+ */
+void pngcrush_keep_raw_chunks(char *argv[])
+{
+    pngcrush_raw_chunk **link = &raw_chunks;
+
+    raw_chunk_types &= ~raw_chunk_refused;
+    while (*link != NULL)
+    {
+        pngcrush_raw_chunk *chunk = *link;
+        int type = pngcrush_raw_chunk_type(chunk->name);
+        int keep = (raw_chunk_types & type) != 0;
+
+        if (keep && type == PNGCRUSH_RAW_iCCP)
+        {
+            const char *problem = pngcrush_check_raw_iccp(chunk);
+
+            keep = intent < 0 && keep_chunk("iCCP", argv);
+            if (keep && problem != NULL)
+            {
+                /* as libpng's checks would have done on the old path */
+                if (verbose >= 0)
+                    fprintf(STDERR, "pngcrush: iCCP: %s\n", problem);
+                keep = 0;
+            }
+        }
+        else if (keep && type == PNGCRUSH_RAW_sPLT)
+            keep = keep_chunk("sPLT", argv);
+        else if (keep)
+            keep = keep_chunk("text", argv) &&
+                   keep_chunk((png_const_charp) chunk->name, argv);
+
+        if (keep)
+            link = &chunk->next;
         else
-            fprintf(STDERR,
-                    "   Overall result: %4.2f%% increase, %lu bytes\n",
-                    -(100.0 -
-                      (100.0 * total_output_length) / total_input_length),
-                    (unsigned long)(total_output_length - total_input_length));
+        {
+            if (verbose > 0 && (raw_chunk_types & type))
+                fprintf(STDERR, "   Removed the %s chunk.\n", chunk->name);
+            *link = chunk->next;
+            free(chunk->data);
+            free(chunk);
+        }
+    }
+}
+
+
+
+
+/* Write the captured chunks that belong at this point of the output; like
+ * the other ancillary chunks, they are left out of all but the last trial.
+ */
+void pngcrush_write_raw_chunks(png_structp png_ptr, int where)
+{
+    pngcrush_raw_chunk *chunk;
+
+    if (last_trial == 0)
+        return;
+
+    for (chunk = raw_chunks; chunk != NULL; chunk = chunk->next)
+    {
+        int type = pngcrush_raw_chunk_type(chunk->name);
+
+        /* iCCP goes before PLTE, the others wherever they were, except
+         * that (as with png_set_text()) nothing is written before PLTE.
+         */
+        if (type == PNGCRUSH_RAW_iCCP)
+        {
+            if (where != 0)
+                continue;
+        }
+        else if (where == 0 || (where == 2) != (chunk->where == 2))
+            continue;
+
+        if (type == PNGCRUSH_RAW_iCCP &&
+            ((output_color_type & 2) != (input_color_type & 2) ||
+            intent >= 0))
+        {
+            /* The profile does not suit the new color type, or an sRGB
+             * chunk is being written instead
+             */
+            if (verbose > 0)
+                fprintf(STDERR, "   Removed the iCCP chunk.\n");
+            continue;
+        }
+
+        png_write_chunk(png_ptr, chunk->name, chunk->data,
+            (png_size_t) chunk->length);
+        if (verbose > 1)
+            fprintf(STDERR, "   Copied the %s chunk, %lu bytes.\n",
+                chunk->name, (unsigned long) chunk->length);
+    }
+}
+
+
+
+
+/* Print the "-timers" phase breakdown from t_filter-style seconds */
+void pngcrush_show_phases(float *t)
+{
+#if PNGCRUSH_TIMERS > PNGCRUSH_TIMER_IO
+    float t_unfilter = 0;
+    int j;
+
+    for (j = PNGCRUSH_TIMER_UNFILTER; j < PNGCRUSH_TIMER_UNFILTER + 5; j++)
+        t_unfilter += t[j];
+
+    fprintf(STDERR, "   Phase time inflate %.4f, unfilter %.4f,"
+        " deinterlace %.4f, transform %.4f,\n",
+        t[PNGCRUSH_TIMER_INFLATE], t_unfilter,
+        t[PNGCRUSH_TIMER_DEINTERLACE], t[PNGCRUSH_TIMER_TRANSFORM]);
+    fprintf(STDERR, "     filter %.4f, deflate %.4f, crc %.4f, io %.4f sec\n",
+        t[PNGCRUSH_TIMER_FILTER], t[PNGCRUSH_TIMER_DEFLATE],
+        t[PNGCRUSH_TIMER_CRC], t[PNGCRUSH_TIMER_IO]);
+#else
+    PNGCRUSH_UNUSED(t)
+#endif
+}
+
+#if PNGCRUSH_TIMERS > 0
+static int pngcrush_bench_compare(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Sort n samples in place and return their minimum, median, 95th percentile
+ * (nearest rank) and sample standard deviation in st[0..3].
+ */
+static void pngcrush_bench_stats(double *x, int n, double *st)
+{
+    double mean = 0, var = 0;
+    int i;
+
+    qsort(x, (size_t)n, sizeof (double), pngcrush_bench_compare);
+    for (i = 0; i < n; i++)
+        mean += x[i];
+    mean /= n;
+    for (i = 0; i < n; i++)
+        var += (x[i] - mean) * (x[i] - mean);
+
+    st[0] = x[0];
+    st[1] = (n & 1) ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2;
+    st[2] = x[(95 * n + 99) / 100 - 1];
+    st[3] = n > 1 ? sqrt(var / (n - 1)) : 0;
+}
+
+static void pngcrush_bench_row(const char *name, double *x, int n)
+{
+    double st[4];
+
+    pngcrush_bench_stats(x, n, st);
+    fprintf(STDERR, "   %-12s %11.6f %11.6f %11.6f %11.6f\n", name,
+        st[0], st[1], st[2], st[3]);
+}
+#endif /* PNGCRUSH_TIMERS */
+
+/* Print the distribution of the timed "-bench" iterations */
+void pngcrush_bench_report(int last_method, int *fm, int *lv, int *zs)
+{
+#if PNGCRUSH_TIMERS > 0
+    static const char *phase_names[PNGCRUSH_TIMERS] = {
+        "total", "decode", "encode", "other"
+    };
+    int n = (int) benchmark_iterations;
+    double *x, st[4];
+    double rate_median, rate_best, rate_stddev;
+    int j, k;
+
+    if (bench_samples == NULL || n < 1)
+        return;
+    x = (double *) malloc(n * sizeof (double));
+    if (x == NULL)
+        return;
+
+    fprintf(STDERR, "\nBenchmark: %d timed iteration%s", n, n > 1 ? "s" : "");
+    if (benchmark_warmup)
+        fprintf(STDERR, " after %u warm-up", benchmark_warmup);
+    fprintf(STDERR, ", %.0f input bytes each\n", bench_bytes[0]);
+    fprintf(STDERR, "   %-12s %11s %11s %11s %11s\n", "seconds", "min",
+        "median", "p95", "stddev");
+
+    /* Throughput first, while the samples are still in iteration order */
+    for (k = 0; k < n; k++)
+    {
+        double t = bench_samples[PNGCRUSH_TIMER_TOTAL * n + k];
+        x[k] = t > 0 ? bench_bytes[k] / t / 1000000. : 0;
+    }
+    pngcrush_bench_stats(x, n, st);
+    rate_median = st[1];
+    rate_best = x[n - 1];
+    rate_stddev = st[3];
+
+    for (j = 0; j <= PNGCRUSH_TIMER_MISC && j < PNGCRUSH_TIMERS; j++)
+        pngcrush_bench_row(phase_names[j], bench_samples + j * n, n);
+
+#  if PNGCRUSH_TIMERS > PNGCRUSH_TIMER_IO
+    if (phase_timers)
+    {
+        for (k = 0; k < n; k++)
+        {
+            x[k] = 0;
+            for (j = PNGCRUSH_TIMER_UNFILTER; j < PNGCRUSH_TIMER_UNFILTER + 5;
+                 j++)
+                x[k] += bench_samples[j * n + k];
+        }
+        pngcrush_bench_row("inflate",
+            bench_samples + PNGCRUSH_TIMER_INFLATE * n, n);
+        pngcrush_bench_row("unfilter", x, n);
+        pngcrush_bench_row("deinterlace",
+            bench_samples + PNGCRUSH_TIMER_DEINTERLACE * n, n);
+        pngcrush_bench_row("transform",
+            bench_samples + PNGCRUSH_TIMER_TRANSFORM * n, n);
+        pngcrush_bench_row("filter",
+            bench_samples + PNGCRUSH_TIMER_FILTER * n, n);
+        pngcrush_bench_row("deflate",
+            bench_samples + PNGCRUSH_TIMER_DEFLATE * n, n);
+        pngcrush_bench_row("crc", bench_samples + PNGCRUSH_TIMER_CRC * n, n);
+        pngcrush_bench_row("io", bench_samples + PNGCRUSH_TIMER_IO * n, n);
+    }
+#  endif
+
+    fprintf(STDERR, "   Throughput %.3f MB/s median, %.3f best,"
+        " %.3f stddev\n", rate_median, rate_best, rate_stddev);
+
+    fprintf(STDERR, "   Encode seconds per method:\n");
+    fprintf(STDERR, "   %-12s %11s %11s %11s %11s\n", "method  f l z", "min",
+        "median", "p95", "stddev");
+    for (j = 1; j <= last_method; j++)
+    {
+        char name[4 * 11 + 8]; /* four ints and their separators */
+
+        for (k = 0; k < n; k++)
+            if (bench_method_samples[j * n + k] > 0)
+                break;
+        if (k == n)
+            continue;
+        sprintf(name, "%4d  %d %d %d", j, fm[j], lv[j], zs[j]);
+        pngcrush_bench_row(name, bench_method_samples + j * n, n);
     }
+    pngcrush_bench_row("final write", bench_method_samples, n);
+
+    free(x);
+#else
+    PNGCRUSH_UNUSED(last_method)
+    PNGCRUSH_UNUSED(fm)
+    PNGCRUSH_UNUSED(lv)
+    PNGCRUSH_UNUSED(zs)
+#endif
+}
+
+void pngcrush_show_overall(unsigned long in, unsigned long out)
+{
+    if (in == out)
+        fprintf(STDERR, "   Overall result: no change\n");
+    else if (in > out)
+        fprintf(STDERR,
+                "   Overall result: %4.2f%% reduction, %lu bytes\n",
+                (100.0 - (100.0 * out) / in), in - out);
+    else
+        fprintf(STDERR,
+                "   Overall result: %4.2f%% increase, %lu bytes\n",
+                -(100.0 - (100.0 * out) / in), out - in);
+}
+
+void show_result(void)
+{
+    if (total_output_length)
+        pngcrush_show_overall(total_input_length, total_output_length);
+    if (verbose > 0)
+        fprintf(STDERR, "   Peak memory: %lu bytes\n", mem_peak);
 
 #if PNGCRUSH_TIMERS > 0
     for (pc_timer=0;pc_timer < PNGCRUSH_TIMERS; pc_timer++)
@@ -3136,6 +3893,8 @@ void show_result(void)
       fprintf(STDERR, " total %.4f sec\n", t_filter[0]);
     }
 #endif
+    if (phase_timers && verbose >= 0)
+        pngcrush_show_phases(t_filter);
 
    if (verbose <= 0)
      return;
@@ -3227,5466 +3986,9489 @@ void show_result(void)
         "   **** Discarded APNG chunks. ****\n");
 }
 
-void pngcrush_write_png(png_structp write_pointer, png_bytep data,
-     png_size_t length)
+static void pngcrush_json_string(FILE *fp, const char *string)
 {
-    pngcrush_write_byte_count += (int) length;
-    if (nosave == 0 && last_trial == 1)
-      pngcrush_default_write_data(write_pointer, data, length);
+    putc('"', fp);
+    for (; *string != '\0'; string++)
+    {
+        unsigned char c = (unsigned char) *string;
+
+        if (c == '"' || c == '\\')
+        {
+            putc('\\', fp);
+            putc(c, fp);
+        }
+        else if (c < 0x20)
+            fprintf(fp, "\\u%04x", c);
+        else
+            putc(c, fp);
+    }
+    putc('"', fp);
 }
 
-static void pngcrush_flush(png_structp png_ptr)
+/* The -trace clock, in microseconds.  It is monotonic and system-wide where
+ * clock_gettime() is used, so the spans of -server workers line up.
+ */
+double pngcrush_trace_now(void)
 {
-   /* Do nothing. */
-   PNGCRUSH_UNUSED(png_ptr)
+#if PNGCRUSH_TIMERS > 0
+    return (double) pngcrush_timer_now() / 1000.;
+#else
+    return (double) pngcrush_clock_ms() * 1000.;
+#endif
 }
 
-
-void pngcrush_examine_pixels_fn(png_structp png_ptr, png_row_infop
-    row_info, png_bytep data)
+/* Append one event to the -trace file: a complete ("X") span from start to
+ * end, or an instant ("i") event at start when end is negative.  "args" is
+ * the inside of a JSON object, or NULL.  Events are written in the JSON
+ * Array Format, one per line and flushed, without the closing bracket (which
+ * trace viewers do not require), so that several processes can append to
+ * the same file.
+ */
+void pngcrush_trace(const char *name, const char *cat, double start,
+  double end, const char *args)
 {
-   if (blacken == 1 || make_gray == 1 || make_opaque == 1)
-   {
-      /* Check if there are any fully transparent pixels.  If one is found,
-       * without the underlying color already black, set blacken==2. If the
-       * PNG colortype does not support an alpha channel, set blacken==3.
-       *
-       * Check if there are any transparent pixels.  If one is found,
-       * set make_opaque==2. If the PNG colortype does not support an alpha
-       * channel, set make_opaque==3.
-       *
-       * Check if there are any non-gray pixels.  If one is found,
-       * set make_gray == 2. If the PNG colortype is already gray, set
-       * make_gray = 3.
-       *
-       * Check if any 16-bit pixels do not have identical high and low
-       * bytes.  If one is found, set make_8_bit == 2. If the PNG bit_depth
-       * is not 16-bits, set make_8_bit = 3.
-       *
-       * Find the maximum palette entry present in the IDAT chunks of
-       * an indexed PNG.
-       *
-       */
-
-      int i;
+    FILE *fp = trace_json;
 
-      if (row_info->color_type < 4)
-      {
-        blacken = 3;  /* It doesn't have an alpha channel */
-        /* To do: check if tRNS chunk can be removed from color type 0 or 2 */
-        make_opaque = 3;
-      }
+    if (fp == NULL)
+        return;
+    fprintf(fp, "{\"name\":");
+    pngcrush_json_string(fp, name);
+    fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f", cat,
+        end < 0 ? "i" : "X", start);
+    if (end < 0)
+        fprintf(fp, ",\"s\":\"t\"");
+    else
+        fprintf(fp, ",\"dur\":%.3f", end > start ? end - start : 0);
+    fprintf(fp, ",\"pid\":%ld,\"tid\":%ld", trace_pid, trace_pid);
+    if (args != NULL)
+        fprintf(fp, ",\"args\":{%s}", args);
+    fprintf(fp, "},\n");
+    fflush(fp);
+}
 
-      if (row_info->color_type == 0 || row_info->color_type == 4)
-        make_gray = 3; /* It's already gray! */
+/* Write the -stats_json record for the current file, as one line of JSON.
+ * "out" is NULL when nothing was written (-n).  Trials that were skipped are
+ * left out; the sizes of trials that bailed are the byte counts at the point
+ * where they bailed.
+ */
+void pngcrush_write_stats(const char *out, png_uint_32 output_length,
+  int last_method, int *fm, int *lv, int *zs)
+{
+    FILE *fp = stats_json;
+    int j, first = 1;
+
+    fprintf(fp, "{\"input\":");
+    pngcrush_json_string(fp, inname);
+    fprintf(fp, ",\"output\":");
+    if (out != NULL)
+        pngcrush_json_string(fp, out);
+    else
+        fprintf(fp, "null");
+    fprintf(fp, ",\"input_bytes\":%lu,\"output_bytes\":%lu",
+        (unsigned long) input_length, (unsigned long) output_length);
+    fprintf(fp, ",\"critical_bytes_in\":%lu",
+        (unsigned long) idat_length[0]);
+    if (out != NULL)
+        fprintf(fp, ",\"method\":%d,\"fm\":%d,\"lv\":%d,\"zs\":%d"
+            ",\"critical_bytes_out\":%lu",
+            best, fm[best], lv[best], zs[best],
+            (unsigned long) idat_length[best]);
+    fprintf(fp, ",\"color_type_in\":%d,\"color_type_out\":%d",
+        input_color_type, out != NULL ? output_color_type : input_color_type);
+    fprintf(fp, ",\"bit_depth_in\":%d,\"bit_depth_out\":%d",
+        input_bit_depth, out != NULL ? output_bit_depth : input_bit_depth);
+    fprintf(fp, ",\"interlace_in\":%d,\"interlace_out\":%d",
+        interlace_method, out != NULL ? output_interlace_method :
+        interlace_method);
+    fprintf(fp, ",\"reductions\":{\"gray\":%d,\"opaque\":%d,"
+        "\"8_bit\":%d,\"blacken\":%d,\"trns_key\":%d,"
+        "\"palette_length\":%d}",
+        make_gray == 1, make_opaque == 1, make_8_bit == 1,
+        make_opaque != 1 && make_trns != 1 && blacken == 2, make_trns == 1,
+        reduce_palette == 1 ? plte_len : -1);
+
+    if (verify)
+        fprintf(fp, ",\"verified\":%d", verify_result);
+    if (scan)
+        fprintf(fp, ",\"scan\":{\"critical_bytes_predicted\":%lu,"
+            "\"metadata_bytes\":%lu,\"removable_bytes\":%lu}",
+            scan_critical, scan_metadata, scan_removable);
+
+    fprintf(fp, ",\"trials\":[");
+    for (j = 1; out != NULL && j < last_method; j++)
+    {
+        if (idat_length[j] == (png_uint_32) 0xffffffff)
+            continue;
+        fprintf(fp, "%s{\"method\":%d,\"fm\":%d,\"lv\":%d,\"zs\":%d,"
+            "\"bytes\":%lu", first ? "" : ",", j, fm[j], lv[j], zs[j],
+            (unsigned long) idat_length[j]);
+        if (interlace_trials)
+            fprintf(fp, ",\"interlace\":%d", trial_interlace[j]);
+        if (tune_trials)
+            fprintf(fp, ",\"tune\":%d", trial_tune[j]);
+        if (bail_row[j])
+            fprintf(fp, ",\"bail_pass\":%d,\"bail_row\":%lu",
+                bail_pass[j], (unsigned long) bail_row[j]);
+        fprintf(fp, ",\"allocs\":%lu,\"alloc_bytes\":%lu",
+            mem_trial_allocs[j], mem_trial_bytes[j]);
+        fprintf(fp, "}");
+        first = 0;
+    }
+    fprintf(fp, "]");
 
-      if (row_info->color_type == 3)
-        make_gray = 3; /* Don't change indexed PNG */
+    if (apng_frames > 0)
+        fprintf(fp, ",\"apng\":{\"frames\":%d,\"fdat_bytes_in\":%lu,"
+            "\"fdat_bytes_out\":%lu}", apng_frames, apng_fdat_in,
+            apng_fdat_out);
 
-      if (row_info->bit_depth < 16)
-        make_8_bit = 3;
+    fprintf(fp, ",\"memory\":{\"peak\":%lu,\"largest\":%lu,\"allocs\":%lu,"
+        "\"bytes\":%lu}", mem_file_peak, mem_file_largest, mem_file_allocs,
+        mem_file_bytes);
 
-      i = (int) row_info->rowbytes-1;
+#if PNGCRUSH_TIMERS > 3
+    if (verbose >= 0)
+    {
+        double t[PNGCRUSH_TIMERS];
+
+        for (j = 1; j <= 3; j++)
+            t[j] = pngcrush_timer_get_seconds(j) +
+                1.e-9 * pngcrush_timer_get_nanoseconds(j) -
+                stats_timer_start[j];
+        fprintf(fp, ",\"seconds\":{\"decode\":%.6f,\"encode\":%.6f,"
+            "\"misc\":%.6f", t[PNGCRUSH_TIMER_DECODE],
+            t[PNGCRUSH_TIMER_ENCODE], t[PNGCRUSH_TIMER_MISC]);
+#  if PNGCRUSH_TIMERS > PNGCRUSH_TIMER_IO
+        if (phase_timers)
+        {
+            for (j = PNGCRUSH_TIMER_DEINTERLACE; j < PNGCRUSH_TIMERS; j++)
+                t[j] = pngcrush_timer_get_seconds(j) +
+                    1.e-9 * pngcrush_timer_get_nanoseconds(j) -
+                    stats_timer_start[j];
+            for (j = PNGCRUSH_TIMER_UNFILTER + 1;
+                 j < PNGCRUSH_TIMER_UNFILTER + 5; j++)
+                t[PNGCRUSH_TIMER_UNFILTER] += t[j];
+            fprintf(fp, ",\"inflate\":%.6f,\"unfilter\":%.6f,"
+                "\"deinterlace\":%.6f,\"transform\":%.6f,\"filter\":%.6f,"
+                "\"deflate\":%.6f,\"crc\":%.6f,\"io\":%.6f",
+                t[PNGCRUSH_TIMER_INFLATE], t[PNGCRUSH_TIMER_UNFILTER],
+                t[PNGCRUSH_TIMER_DEINTERLACE], t[PNGCRUSH_TIMER_TRANSFORM],
+                t[PNGCRUSH_TIMER_FILTER], t[PNGCRUSH_TIMER_DEFLATE],
+                t[PNGCRUSH_TIMER_CRC], t[PNGCRUSH_TIMER_IO]);
+        }
+#  endif
+        fprintf(fp, "}");
+    }
+#endif
+    fprintf(fp, "}\n");
+    fflush(fp);
+}
 
-      if ((row_info->color_type == 2 || row_info->color_type == 6) &&
-          make_gray == 1) /* RGB */
-      {
-        if (row_info->bit_depth == 8)
-          {
-            int incr=3;
-            if (row_info->color_type == 6)
-            {
-               incr=4;
-               i--;
-            }
-            for ( ; i > 0 ; )
-            {
-               if (data[i] != data[i-1] || data[i] != data[i-2])
-                 {
-                   make_gray = 2;
-                 }
+#ifdef LIBPNG_UNIFIED
+/* Called by png_deflate_claim() in the bundled libpng when the zlib stream
+ * has been initialized or reset for a new owner.  deflateReset() restores
+ * the parameters of the level, so the profile of a -tune_search run is
+ * applied to each IDAT stream here.
+ */
+static void pngcrush_deflate_claimed(struct png_struct_def *png_ptr,
+    unsigned long owner)
+{
+    if (deflate_tune > 0 && owner == png_IDAT)
+    {
+        const pngcrush_tune_profile *p = &tune_profiles[deflate_tune - 1];
 
-               i-=incr;
-            }
-          }
+        deflateTune(&png_ptr->zstream, p->good_length, p->max_lazy,
+            p->nice_length, p->max_chain);
+    }
+}
+#endif
 
-        else /* bit depth == 16 */
-          {
-            int incr = 6;
-            if (row_info->color_type == 6)
-            {
-               incr = 8;
-               i-=2;
-            }
-            for ( ; i > 0 ; )
-            {
-               if (data[i] != data[i-2] || data[i] != data[i-4] ||
-                   data[i-1] != data[i-3] || data[i-1] != data[i-5])
-               {
-                  make_gray = 2;
-               }
-               i-=incr;
-            }
-          }
-      }
+/* A -tune_search run also bails when the IDAT written so far, scaled up
+ * to the whole image, is larger than the best so far.  zlib holds back up
+ * to a block of output, so the projection is low early on; it is not made
+ * before an eighth of the rows.
+ */
+static int pngcrush_bail_projected(png_uint_32 rows_done, png_uint_32 rows)
+{
+    if (deflate_tune > 0 && rows_done >= rows / 8 && rows_done < rows &&
+        (double) pngcrush_write_byte_count * rows >
+        (double) pngcrush_best_byte_count * rows_done)
+    {
+        projected_bail = 1;
+        return 1;
+    }
+    return 0;
+}
 
-      else if (row_info->color_type == 4 && (blacken == 1 ||
-               make_opaque == 1)) /* GA */
-      {
-        i = (int) row_info->rowbytes-1;
+/*
+ * APNG frame recompression (output files named *.apng).
+ *
+ * The fcTL and fdAT chunks after IDAT reach us as unknown chunks.  The data
+ * of each frame (the fdAT chunks that follow its fcTL, less their sequence
+ * numbers) is inflated and unfiltered, then filtered and deflated again,
+ * either with the method that won for the main image or, with -apng_search,
+ * with the best of filters 0-5 and strategies 0-1 at level 9.  The frame is
+ * written as a single fdAT unless the original was smaller, and the sequence
+ * numbers of the fcTL and fdAT chunks that follow are renumbered.
+ * Interlaced frames are only deflated again, with their filters kept.
+ */
+static voidpf pngcrush_apng_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    PNGCRUSH_UNUSED(opaque)
+    return (voidpf) calloc(items, size);
+}
 
-        if (row_info->bit_depth == 8)
-          {
-            for ( ; i > 0 ; )
-            {
-               if (blacken == 1 && data[i] == 0 &&  data[i-1] != 0)
-               {
-                   blacken = 2;
-               }
+static void pngcrush_apng_zfree(voidpf opaque, voidpf ptr)
+{
+    PNGCRUSH_UNUSED(opaque)
+    free(ptr);
+}
 
-               if (make_opaque == 1 && data[i] != 255)
-               {
-                   make_opaque = 2;
-               }
-               i-=2;
-            }
-          }
+/* Inflate exactly "size" bytes, or return NULL */
+static png_bytep pngcrush_apng_inflate(png_bytep in, png_size_t in_len,
+    png_size_t size)
+{
+    z_stream zs;
+    png_bytep out = (png_bytep) malloc(size + 1);
+    int ret;
 
-        else /* bit depth == 16 */
-          {
-            for ( ; i > 0 ; )
-            {
-               if (blacken == 1 && (data[i] == 0 && data[i-1] == 0) &&
-                   (data[i-2] != 0 || data[i-3] != 0))
-               {
-                  blacken = 2;
-               }
+    if (out == NULL)
+        return NULL;
+    memset(&zs, 0, sizeof zs);
+    zs.zalloc = pngcrush_apng_zalloc;
+    zs.zfree = pngcrush_apng_zfree;
+    if (inflateInit(&zs) != Z_OK)
+    {
+        free(out);
+        return NULL;
+    }
+    zs.next_in = in;
+    zs.avail_in = (uInt) in_len;
+    zs.next_out = out;
+    zs.avail_out = (uInt) size + 1;
+    ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || zs.total_out != size)
+    {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
 
-               if (make_opaque == 1 && (data[i] != 255 || data[i-1] != 255))
-               {
-                   make_opaque = 2;
-               }
-               i-=4;
-            }
-          }
-      }
+/* Deflate "len" bytes into a new buffer, returning its length or 0 */
+static png_size_t pngcrush_apng_deflate(png_bytep in, png_size_t len,
+    int level, int strategy, png_bytep *out)
+{
+    z_stream zs;
+    png_size_t bound;
+    int ret;
 
-      /* color_type == 6, RGBA */
-      if (row_info->color_type == 6 && (blacken == 1 || make_gray == 1 ||
-               make_opaque == 1))
-      {
-        i = (int) row_info->rowbytes-1;
+    *out = NULL;
+    memset(&zs, 0, sizeof zs);
+    zs.zalloc = pngcrush_apng_zalloc;
+    zs.zfree = pngcrush_apng_zfree;
+    if (deflateInit2(&zs, level, Z_DEFLATED, 15, 9, strategy) != Z_OK)
+        return 0;
+    bound = deflateBound(&zs, (uLong) len);
+    *out = (png_bytep) malloc(bound);
+    if (*out == NULL)
+    {
+        deflateEnd(&zs);
+        return 0;
+    }
+    zs.next_in = in;
+    zs.avail_in = (uInt) len;
+    zs.next_out = *out;
+    zs.avail_out = (uInt) bound;
+    ret = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END)
+    {
+        free(*out);
+        *out = NULL;
+        return 0;
+    }
+    return (png_size_t) zs.total_out;
+}
 
-        if (row_info->bit_depth == 8)
-          {
-            for ( ; i > 0 ; )
-            {
-               if (blacken == 1 && data[i] == 0 &&
-                   (data[i-1] != 0 || data[i-2] != 0 || data[i-3] != 0))
-                 {
-                   blacken = 2;
-                 }
+/* Inflate a whole zlib stream into a new buffer; returns 0 if the stream
+ * is damaged, is followed by other bytes, or inflates to too much.
+ */
+static int pngcrush_inflate_all(png_bytep in, png_size_t in_len,
+    png_bytep *out, png_size_t *out_len)
+{
+    z_stream zs;
+    png_size_t size = 4 * in_len + 256;
+    int ret;
 
-               if (make_gray == 1 &&
-                  (data[i-1] != data[i-2] || data[i-1] != data[i-3]))
-                 {
-                   make_gray = 2;
-                 }
+    *out = (png_bytep) malloc(size);
+    if (*out == NULL)
+        return 0;
+    memset(&zs, 0, sizeof zs);
+    zs.zalloc = pngcrush_apng_zalloc;
+    zs.zfree = pngcrush_apng_zfree;
+    if (inflateInit(&zs) != Z_OK)
+    {
+        free(*out);
+        *out = NULL;
+        return 0;
+    }
+    zs.next_in = in;
+    zs.avail_in = (uInt) in_len;
+    for (;;)
+    {
+        zs.next_out = *out + zs.total_out;
+        zs.avail_out = (uInt) (size - zs.total_out);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret == Z_OK && zs.avail_out == 0 &&
+            size < PNGCRUSH_RAW_INFLATE_MAX)
+        {
+            png_bytep bigger = (png_bytep) realloc(*out, 2 * size);
 
-               if (make_opaque == 1 && data[i] != 255)
-                 {
-                   make_opaque = 2;
-                 }
+            if (bigger == NULL)
+                break;
+            *out = bigger;
+            size *= 2;
+            continue;
+        }
+        break;
+    }
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || zs.avail_in != 0)
+    {
+        free(*out);
+        *out = NULL;
+        return 0;
+    }
+    *out_len = (png_size_t) zs.total_out;
+    return 1;
+}
 
-               i-=4;
-            }
-          }
+/* Check a captured iCCP chunk as png_handle_iCCP() would have when libpng
+ * read it: the keyword, the compression method, and then the header and
+ * tag table of the profile, as png_icc_check_header() and
+ * png_icc_check_tag_table() do, for the input's color type.  Returns NULL
+ * if the chunk is good, or else what is wrong with it.  Only the checks
+ * that make libpng drop the profile are made, not those that just warn.
+ */
+const char *pngcrush_check_raw_iccp(pngcrush_raw_chunk *chunk)
+{
+    png_bytep p = (png_bytep) memchr(chunk->data, 0,
+        chunk->length < 80 ? chunk->length : 80);
+    png_bytep profile;
+    png_size_t length;
+    png_uint_32 tags, j;
+    const char *problem = NULL;
+
+    if (p == NULL || p == chunk->data)
+        return "bad keyword";
+    if (chunk->data + chunk->length - p < 3 || p[1] != 0)
+        return "bad compression method";
+    p += 2;
+    if (!pngcrush_inflate_all(p, chunk->length - (p - chunk->data),
+        &profile, &length))
+        return "damaged profile data";
+
+    tags = length >= 132 ? pngcrush_get_uint_32(profile + 128) : 0;
+    if (length < 132)
+        problem = "profile too short";
+    else if (pngcrush_get_uint_32(profile) != length)
+        problem = "length does not match profile";
+    else if (profile[8] > 3 && (length & 3) != 0)
+        problem = "invalid length";
+    else if (tags > 357913930 || length < 132 + 12 * tags)
+        problem = "tag count too large";
+    else if (pngcrush_get_uint_32(profile + 64) >= 0xffff)
+        problem = "invalid rendering intent";
+    else if (pngcrush_get_uint_32(profile + 36) != 0x61637370) /* acsp */
+        problem = "invalid signature";
+    else if (pngcrush_get_uint_32(profile + 16) == 0x52474220) /* RGB */
+    {
+        if ((input_color_type & 2) == 0)
+            problem = "RGB color space not permitted on grayscale PNG";
+    }
+    else if (pngcrush_get_uint_32(profile + 16) == 0x47524159) /* GRAY */
+    {
+        if ((input_color_type & 2) != 0)
+            problem = "Gray color space not permitted on RGB PNG";
+    }
+    else
+        problem = "invalid ICC profile color space";
 
-        else /* bit depth == 16 */
-          {
-            for ( ; i > 0 ; )
-            {
-               if (blacken == 1 && (data[i] == 0 && data[i-1]== 0) &&
-                   (data[i-2] != 0 || data[i-3] != 0 || data[i-4] != 0 ||
-                   data[i-5] != 0 || data[i-6] != 0 || data[i-7] != 0))
-                 {
-                   blacken = 2;
-                 }
+    if (problem == NULL)
+    {
+        switch (pngcrush_get_uint_32(profile + 12)) /* profile class */
+        {
+            case 0x61627374: /* abst */
+                problem = "invalid embedded Abstract ICC profile";
+                break;
+            case 0x6c696e6b: /* link */
+                problem = "unexpected DeviceLink ICC profile class";
+                break;
+            default:
+                break;
+        }
+    }
+    if (problem == NULL &&
+        pngcrush_get_uint_32(profile + 20) != 0x58595a20 && /* XYZ */
+        pngcrush_get_uint_32(profile + 20) != 0x4c616220)   /* Lab */
+        problem = "unexpected ICC PCS encoding";
 
-               if (make_gray == 1 &&
-                   (data[i-2] != data[i-4] || data[i-2] != data[i-6] ||
-                   data[i-3] != data[i-5] || data[i-3] != data[i-7]))
-                 {
-                   make_gray = 2;
-                 }
+    for (j = 0; problem == NULL && j < tags; j++)
+    {
+        png_uint_32 start = pngcrush_get_uint_32(profile + 136 + 12 * j);
+        png_uint_32 tag_length = pngcrush_get_uint_32(profile + 140 + 12 * j);
 
-               if (make_opaque == 1 && (data[i] != 255 || data[i-1] != 255))
-                 {
-                   make_opaque = 2;
-                 }
+        if (start > length || tag_length > length - start)
+            problem = "ICC profile tag outside profile";
+    }
 
-               i-=8;
-            }
-          }
-      }
-   }
+    free(profile);
+    return problem;
+}
 
-   if (make_8_bit == 1)
-   {
-      int i;
-      i = (int) row_info->rowbytes-1;
+/* Recompress the zlib stream of a captured zTXt, compressed iTXt or iCCP
+ * chunk with a few strategies at level 9, in a z_stream of its own, and
+ * keep the smallest result if it is smaller than the original.
+ */
+static void pngcrush_recompress_raw_chunk(pngcrush_raw_chunk *chunk)
+{
+    png_uint_32 type = pngcrush_get_uint_32(chunk->name);
+    png_bytep end = chunk->data + chunk->length;
+    png_bytep p = (png_bytep) memchr(chunk->data, 0, chunk->length);
+    png_bytep text, best = NULL;
+    png_size_t head, text_len, best_len, z_len;
+    int strategy;
+
+    if (p == NULL || end - p < 3)
+        return;
+    if (type == PNG_UINT_zTXt || type == PNG_UINT_iCCP)
+        p++;                             /* compression method */
+    else if (type == PNG_UINT_iTXt)
+    {
+        if (p[1] != 1 || p[2] != 0)      /* not compressed, or not zlib */
+            return;
+        p += 2;
+        if ((p = (png_bytep) memchr(p + 1, 0, end - p - 1)) == NULL ||
+            (p = (png_bytep) memchr(p + 1, 0, end - p - 1)) == NULL)
+            return;                      /* language tag, translated key */
+    }
+    else
+        return;
+    if (*p++ != 0 || p >= end)           /* compression method, or end */
+        return;
 
-      if (row_info->color_type == 0)
-      {
-         for ( ; i > 0 ; )
-         {
-               if (data[i] != data[i-1])
-                  make_8_bit = 2;
-               i-=2;
-         }
-      }
+    head = p - chunk->data;
+    best_len = chunk->length - head;
+    if (!pngcrush_inflate_all(p, best_len, &text, &text_len))
+        return;
 
-      if (row_info->color_type == 2)
-      {
-         for ( ; i > 0 ; )
-         {
-               if (data[i] != data[i-1] || data[i-2] != data[i-3] ||
-                   data[i-4] != data [i-5])
-                  make_8_bit = 2;
-               i-=6;
-         }
-      }
+    for (strategy = 0; strategy < 4; strategy++)
+    {
+        png_bytep z;
+        int flags = (strategy & 1) ? Z_FILTERED : Z_DEFAULT_STRATEGY;
 
-      if (row_info->color_type == 4)
-      {
-         for ( ; i > 0 ; )
-         {
-               if (data[i] != data[i-1] || data[i-2] != data[i-3])
-                  make_8_bit = 2;
-               i-=4;
-         }
-      }
+        if (strategy & 2)
+        {
+#if defined(Z_SPLIT_BLOCKS) && defined(Z_OPTIMAL_HUFFMAN)
+            flags |= Z_SPLIT_BLOCKS | Z_OPTIMAL_HUFFMAN;
+#else
+            break;
+#endif
+        }
+        z_len = pngcrush_apng_deflate(text, text_len, 9, flags, &z);
+        if (z_len != 0 && z_len < best_len)
+        {
+            free(best);
+            best = z;
+            best_len = z_len;
+        }
+        else
+            free(z);
+    }
+    free(text);
 
-      if (row_info->color_type == 6)
-      {
-         for ( ; i > 0 ; )
-         {
-               if (data[i] != data[i-1] || data[i-2] != data[i-3] ||
-                   data[i-4] != data [i-5] || data[i-6] != data[i-7])
-                  make_8_bit = 2;
-               i-=8;
-         }
-      }
-   }
+    if (best != NULL)
+    {
+        png_bytep data = (png_bytep) malloc(head + best_len + 1);
 
-   if (reduce_palette == 1 && row_info->color_type == 3)
-   {
-      int i;
-      i = (int) row_info->rowbytes-1;
-      
-      for ( ; i > 0 ; i--)
-      {
-         if (data[i] >= plte_len)
-            plte_len = data[i] + 1;
-      }
-   }
+        if (data != NULL)
+        {
+            png_memcpy(data, chunk->data, head);
+            png_memcpy(data + head, best, best_len);
+            if (verbose > 0)
+                fprintf(STDERR,
+                    "   Recompressed the %s chunk, %lu to %lu bytes.\n",
+                    chunk->name, (unsigned long) chunk->length,
+                    (unsigned long) (head + best_len));
+            free(chunk->data);
+            chunk->data = data;
+            chunk->length = (png_uint_32) (head + best_len);
+        }
+        free(best);
+    }
 }
 
-void pngcrush_transform_pixels_fn(png_structp png_ptr, png_row_infop row_info,
-     png_bytep data)
+void pngcrush_recompress_raw_chunks(void)
 {
+    pngcrush_raw_chunk *chunk;
 
-   int i;
+    for (chunk = raw_chunks; chunk != NULL; chunk = chunk->next)
+        pngcrush_recompress_raw_chunk(chunk);
+}
 
-   if (blacken == 2)
-   {
-   /* change the underlying color of any fully transparent pixels to black */
-      i=(int) row_info->rowbytes-1;
+static int pngcrush_paeth(int a, int b, int c)
+{
+    int p = b - c;
+    int pc = a - c;
+    int pa = p < 0 ? -p : p;
+    int pb = pc < 0 ? -pc : pc;
+
+    pc = (p + pc) < 0 ? -(p + pc) : p + pc;
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
 
-      if (row_info->color_type == 4) /* GA */
-      {
-        if (row_info->bit_depth == 8)
-          {
-            for ( ; i > 0 ; )
-            {
-               if (data[i] == 0 &&  data[i-1] != 0)
-                  {
-                     data[i-1]=0;
-                  }
-               i-=2;
-            }
-          }
+/* Undo the filters of "rows" rows in place; returns 0 for a bad filter */
+static int pngcrush_apng_unfilter(png_bytep data, png_uint_32 rows,
+    png_size_t rowbytes, int bpp)
+{
+    png_bytep prev = NULL;
+    png_uint_32 y;
+    png_size_t x;
 
-        else /* bit depth == 16 */
-          {
-            for ( ; i > 0 ; )
-            {
-               if (data[i] == 0 && data[i-1] == 0)
-                  {
-                    data[i-2]=0;
-                    data[i-3]=0;
-                  }
-               i-=4;
-            }
-          }
-      }
+    for (y = 0; y < rows; y++, data += rowbytes + 1)
+    {
+        png_bytep row = data + 1;
+        int filter = data[0];
 
-      else /* color_type == 6, RGBA */
-      {
-        if (row_info->bit_depth == 8)
-          {
-            for ( ; i > 0 ; )
-            {
-               if (data[i] == 0)
-                 {
-                   data[i-1]=0;
-                   data[i-2]=0;
-                   data[i-3]=0;
-                 }
-               i-=4;
-            }
-          }
+        for (x = 0; x < rowbytes; x++)
+        {
+            int a = x >= (png_size_t) bpp ? row[x - bpp] : 0;
+            int b = prev != NULL ? prev[x] : 0;
+            int c = prev != NULL && x >= (png_size_t) bpp ? prev[x - bpp] : 0;
 
-        else /* bit depth == 16 */
-          {
-            for ( ; i > 0 ; )
+            switch (filter)
             {
-               if (data[i] == 0 && data[i-1] == 0)
-                 {
-                   data[i-2]=0;
-                   data[i-3]=0;
-                   data[i-4]=0;
-                   data[i-5]=0;
-                   data[i-6]=0;
-                   data[i-7]=0;
-                 }
-               i-=8;
+                case 0: break;
+                case 1: row[x] = (png_byte) (row[x] + a); break;
+                case 2: row[x] = (png_byte) (row[x] + b); break;
+                case 3: row[x] = (png_byte) (row[x] + ((a + b) >> 1)); break;
+                case 4: row[x] = (png_byte) (row[x] +
+                            pngcrush_paeth(a, b, c)); break;
+                default: return 0;
             }
-          }
-      }
-   }
+        }
+        data[0] = 0;
+        prev = row;
+    }
+    return 1;
 }
 
-
-int main(int argc, char *argv[])
+/* Filter one row with filter type 0-4 */
+static void pngcrush_apng_filter_row(png_bytep out, png_bytep row,
+    png_bytep prev, png_size_t rowbytes, int bpp, int filter)
 {
-    unsigned int bench = 0;
-    png_uint_32 y;
-    int bit_depth = 0;
-    int color_type = 0;
-    int num_pass, pass;
-    int num_methods;
-
-    int try10 = 0;
+    png_size_t x;
 
-    char *endptr = NULL;
-
-    /* try_method[n]: 0 means try this method;
-     *
-     *              : 1 means do not try this method.
-     */
-    int try_method[MAX_METHODSP1];
-    int methods_enabled = 0;
-    int last_method = MAX_METHODS;
+    out[0] = (png_byte) filter;
+    for (x = 0; x < rowbytes; x++)
+    {
+        int a = x >= (png_size_t) bpp ? row[x - bpp] : 0;
+        int b = prev != NULL ? prev[x] : 0;
+        int c = prev != NULL && x >= (png_size_t) bpp ? prev[x - bpp] : 0;
+        int v = row[x];
 
-    int fm[MAX_METHODSP1];
-    int lv[MAX_METHODSP1];
-    int zs[MAX_METHODSP1];
-    int lev, strat, filt;
+        switch (filter)
+        {
+            case 1: v -= a; break;
+            case 2: v -= b; break;
+            case 3: v -= (a + b) >> 1; break;
+            case 4: v -= pngcrush_paeth(a, b, c); break;
+        }
+        out[x + 1] = (png_byte) v;
+    }
+}
 
-#ifdef PNG_gAMA_SUPPORTED
-#  ifdef PNG_FIXED_POINT_SUPPORTED
-    png_fixed_point file_gamma = 0;
-#  else
-    double file_gamma = 0.;
-#  endif
-#endif
-    char *cp;
-    int i;
+/* Filter one row with filter 0-4, or choose its filter by the minimum sum
+ * of absolute differences from filters 0-4 (5) or 0-2 (6), as libpng does.
+ */
+static void pngcrush_apng_filter_best(png_bytep dst, png_bytep row,
+    png_bytep prev, png_size_t rowbytes, int bpp, int filter)
+{
+    int f, best_f = 0, last = filter == 6 ? 2 : 4;
+    unsigned long best_sum = (unsigned long) -1;
 
-#if PNGCRUSH_TIMERS >= 0
-    for (pc_timer=0;pc_timer< PNGCRUSH_TIMERS; pc_timer++)
+    if (filter < 5)
     {
-        pngcrush_timer_reset(pc_timer);
-        pngcrush_timer_min_secs[pc_timer]=0xffffffff;
-        pngcrush_timer_min_nsec[pc_timer]=0xffffffff;
+        pngcrush_apng_filter_row(dst, row, prev, rowbytes, bpp, filter);
+        return;
     }
-    pngcrush_timer_start(PNGCRUSH_TIMER_TOTAL);
-    pngcrush_timer_start(PNGCRUSH_TIMER_MISC);
-#endif
-
-    if (strcmp(png_libpng_ver, PNG_LIBPNG_VER_STRING))
+    for (f = 0; f <= last; f++)
     {
-        fprintf(STDERR,
-                "Warning: versions are different between png.h and png.c\n");
-        fprintf(STDERR, "  png.h version: %s\n", PNG_LIBPNG_VER_STRING);
-        fprintf(STDERR, "  png.c version: %s\n\n", png_libpng_ver);
+        unsigned long sum = 0;
+        png_size_t x;
+
+        pngcrush_apng_filter_row(dst, row, prev, rowbytes, bpp, f);
+        for (x = 1; x <= rowbytes && sum < best_sum; x++)
+            sum += dst[x] < 128 ? dst[x] : 256 - dst[x];
+        if (sum < best_sum)
+        {
+            best_sum = sum;
+            best_f = f;
+        }
     }
+    if (best_f != last)
+        pngcrush_apng_filter_row(dst, row, prev, rowbytes, bpp, best_f);
+}
 
-    row_buf = (png_bytep) NULL;
-    P2(" row_buf = %p\n",row_buf);
-    number_of_open_files = 0;
-    do_color_count = 0;
-    PNGCRUSH_UNUSED(do_color_count) /* silence compiler warning */
+/* Filter unfiltered rows with pngcrush_apng_filter_best() */
+static void pngcrush_apng_filter(png_bytep out, png_bytep raw,
+    png_uint_32 rows, png_size_t rowbytes, int bpp, int filter)
+{
+    png_bytep prev = NULL;
+    png_uint_32 y;
 
-    strncpy(prog_string, argv[0], STR_BUF_SIZE);
-    prog_string[STR_BUF_SIZE-1] = '\0';
-    progname = prog_string;
-    for (i = 0, cp = prog_string; *cp != '\0'; i++, cp++)
+    for (y = 0; y < rows; y++)
     {
-#ifdef __riscos
-        if (*cp == '.' || *cp == ':')
-            progname = ++cp;
-#else
-        if (*cp == '\\' || *cp == '/')
-            progname = ++cp;
-#endif
+        png_bytep row = raw + y * (rowbytes + 1) + 1;
+
+        pngcrush_apng_filter_best(out + y * (rowbytes + 1), row, prev,
+            rowbytes, bpp, filter);
+        prev = row;
     }
+}
 
-    /*
-     * Definition of methods ("canonical list" is methods 11 and up)
-     */
-    for (i = 0; i <= MAX_METHODS; i++)
+/* -scan: deflate the rows of the examine pass as they are read, filtered
+ * as libpng would by default (adaptively, or not at all for indexed color
+ * and bit depths below 8) at PNGCRUSH_SCAN_LEVEL, keeping only the count
+ * of output bytes.  Rows of less than 8 bits per pixel, which the examine
+ * pass reads unpacked, are packed again first.  Up to
+ * PNGCRUSH_SCAN_KEEP_MAX bytes of the rows are also kept as read, so that
+ * the rows can be deflated again with the reductions that the pass found.
+ */
+static void pngcrush_scan_end(void)
+{
+    if (scan_active)
     {
-        try_method[i] = 1;  /* 1 means do not try this method */
-        fm[i] = 6; lv[i] = 9; zs[i] = 1;  /* default:  method 136 */
+        static png_byte sink[4096];
+
+        scan_stream.next_in = scan_filtered;
+        scan_stream.avail_in = 0;
+        do
+        {
+            scan_stream.next_out = sink;
+            scan_stream.avail_out = sizeof sink;
+        } while (deflate(&scan_stream, Z_FINISH) == Z_OK);
+        scan_estimate = (unsigned long) scan_stream.total_out;
+        deflateEnd(&scan_stream);
+        scan_active = 0;
     }
+    free(scan_rows);
+    free(scan_filtered);
+    scan_rows = NULL;
+    scan_filtered = NULL;
+}
 
+static void pngcrush_scan_begin(void)
+{
+    static const int channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    int pixel_bits = channels[input_color_type & 7] * input_bit_depth;
+
+    pngcrush_scan_end();
+    scan_estimate = 0;
+    free(scan_image);
+    scan_image = NULL;
+    scan_image_rowbytes = input_bit_depth < 8 ? (png_size_t) width :
+        ((png_size_t) width * pixel_bits) >> 3;
+    if (scan_image_rowbytes != 0 && height <= PNGCRUSH_SCAN_KEEP_MAX /
+        scan_image_rowbytes)
+        scan_image = (png_bytep) malloc(scan_image_rowbytes * height);
+    scan_bpp = (pixel_bits + 7) >> 3;
+    scan_filter = input_color_type == 3 || input_bit_depth < 8 ? 0 : 5;
+    scan_rowbytes = ((png_size_t) width * pixel_bits + 7) >> 3;
+    scan_rows = (png_bytep) calloc(2, scan_rowbytes);
+    scan_filtered = (png_bytep) malloc(scan_rowbytes + 1);
+    memset(&scan_stream, 0, sizeof scan_stream);
+    scan_stream.zalloc = pngcrush_apng_zalloc;
+    scan_stream.zfree = pngcrush_apng_zfree;
+    if (scan_rows != NULL && scan_filtered != NULL &&
+        deflateInit2(&scan_stream, PNGCRUSH_SCAN_LEVEL, Z_DEFLATED, 15, 9,
+        Z_FILTERED) == Z_OK)
+        scan_active = 1;
+}
 
-    fm[0] = 0;   lv[0] = 0;   zs[0] = 0;   /* method  0 == uncompressed */
-    fm[1] = 0;   lv[1] = 4;   zs[1] = 0;   /* method  1 == method  53 */
-    fm[2] = 1;   lv[2] = 4;   zs[2] = 0;   /* method  2 == method  54 */
- /* fm[3] = 6;*/ lv[3] = 4;/* zs[3] = 1;*/ /* method  3 == method 161 */
-    fm[4] = 0;/* lv[4] = 9;   zs[4] = 1;*/ /* method  4 == method 119 */
-    fm[5] = 1;/* lv[5] = 9;   zs[5] = 0;*/ /* method  5 == method 114 */
- /* fm[6] = 6;   lv[6] = 9;*/ zs[6] = 0;   /* method  6 == method 157 */
-    fm[7] = 0;/* lv[7] = 9;*/ zs[7] = 0;   /* method  7 == method 113 */
-    fm[8] = 1;/* lv[8] = 9;   zs[8] = 1;*/ /* method  8 == method 120 */
- /* fm[9] = 6;*/ lv[9] = 2;   zs[9] = 2;   /* method  9 == method xxx */
- /* fm[10]= 6;   lv[10]= 9;   zs[10]= 1;*/ /* method 10 == method 166 */
+static void pngcrush_scan_row(png_bytep row, png_uint_32 y)
+{
+    static png_byte sink[4096];
+    png_bytep cur = scan_rows + (y & 1) * scan_rowbytes;
+    png_bytep prev = y == 0 ? NULL : scan_rows + (~y & 1) * scan_rowbytes;
 
-    /* methods 11 through 16
-     *
-     * [strategy 2 (Z_HUFFMAN_ONLY) is independent of zlib compression level]
-     */
-    method = 11;
-    for (filt = 0; filt <= 5; filt++)
+    if (!scan_active)
+        return;
+    if (scan_image != NULL)
+        memcpy(scan_image + y * scan_image_rowbytes, row,
+            scan_image_rowbytes);
+    if (input_bit_depth < 8)
     {
-        fm[method] = filt;
-        lv[method] = 2;
-        zs[method] = 2;
-        method++;
-    }
+        int per_byte = 8 / input_bit_depth;
+        png_size_t x;
 
-    /*
-     * methods 17 through 136 (10*2*6 = 120)
-     */
-    for (lev = 1; lev <= 9; lev++)
+        memset(cur, 0, scan_rowbytes);
+        for (x = 0; x < width; x++)
+            cur[x / per_byte] |= (png_byte) (row[x] <<
+                (8 - input_bit_depth * (int) (x % per_byte + 1)));
+    }
+    else
+        memcpy(cur, row, scan_rowbytes);
+    pngcrush_apng_filter_best(scan_filtered, cur, prev, scan_rowbytes,
+        scan_bpp, scan_filter);
+    scan_stream.next_in = scan_filtered;
+    scan_stream.avail_in = (uInt) scan_rowbytes + 1;
+    while (scan_stream.avail_in != 0)
     {
-        for (strat = 0; strat <= 1; strat++)
+        scan_stream.next_out = sink;
+        scan_stream.avail_out = sizeof sink;
+        if (deflate(&scan_stream, Z_NO_FLUSH) != Z_OK)
         {
-            for (filt = 0; filt <= 5; filt++)
-            {
-                fm[method] = filt;
-                lv[method] = lev;
-                zs[method] = strat;
-                method++;
-            }
+            deflateEnd(&scan_stream);
+            scan_active = 0;
+            return;
         }
     }
+}
 
-#ifdef Z_RLE
-    /* methods 125 through 136
-     *
-     * [strategy 3 (Z_RLE) is mostly independent of level; 1-3 and 4-9 are
-     * same]
-     */
-    for (filt = 0; filt <= 5; filt++)
+static void pngcrush_scan_chunk(png_bytep name, png_uint_32 length)
+{
+    int i;
+
+    for (i = 0; i < scan_chunks; i++)
+        if (!memcmp(scan_chunk_name[i], name, 4))
+            break;
+    if (i == PNGCRUSH_SCAN_CHUNKS)
+        i--; /* lump the rarest names together with the last one */
+    else if (i == scan_chunks)
     {
-        fm[method] = filt;
-        lv[method] = 1;
-        zs[method] = 3;
-        method++;
+        memcpy(scan_chunk_name[i], name, 5);
+        scan_chunk_bytes[i] = 0;
+        scan_chunks++;
     }
-    for (filt = 0; filt <= 5; filt++)
+    scan_chunk_bytes[i] += (unsigned long) length + 12;
+}
+
+/* Deflate the kept rows as pngcrush_scan_row() does, after the reductions
+ * the examine pass found: to gray, dropping the alpha channel, to 8 bits,
+ * and packing to "depth" bits.  Returns the deflated bytes, or 0.
+ */
+static unsigned long pngcrush_scan_reduced(int gray, int opaque, int depth)
+{
+    static const int channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    static png_byte sink[4096];
+    int in_ch = channels[input_color_type & 7];
+    int in_bytes = input_bit_depth == 16 ? 2 : 1;
+    int out_ch = in_ch - (gray ? 2 : 0) - (opaque ? 1 : 0);
+    int alpha = (input_color_type & 4) && !opaque;
+    int filter = input_color_type == 3 || depth < 8 ? 0 : 5;
+    int bpp = (out_ch * depth + 7) >> 3;
+    png_size_t rowbytes = ((png_size_t) width * out_ch * depth + 7) >> 3;
+    png_bytep rows = (png_bytep) calloc(2, rowbytes);
+    png_bytep filtered = (png_bytep) malloc(rowbytes + 1);
+    unsigned long total = 0;
+    z_stream zs;
+    png_uint_32 y;
+    int ret = Z_OK;
+
+    memset(&zs, 0, sizeof zs);
+    zs.zalloc = pngcrush_apng_zalloc;
+    zs.zfree = pngcrush_apng_zfree;
+    if (rows == NULL || filtered == NULL ||
+        deflateInit2(&zs, PNGCRUSH_SCAN_LEVEL, Z_DEFLATED, 15, 9,
+        Z_FILTERED) != Z_OK)
     {
-        fm[method] = filt;
-        lv[method] = 4;
-        zs[method] = 3;
-        method++;
+        free(rows);
+        free(filtered);
+        return 0;
     }
-#endif /* Z_RLE */
+    for (y = 0; y < height && ret == Z_OK; y++)
+    {
+        png_bytep in = scan_image + y * scan_image_rowbytes;
+        png_bytep cur = rows + (y & 1) * rowbytes;
+        png_bytep prev = y == 0 ? NULL : rows + (~y & 1) * rowbytes;
+        png_bytep out = cur;
+        png_uint_32 x;
+        int c;
+
+        if (depth < 8)
+            memset(cur, 0, rowbytes);
+        for (x = 0; x < width; x++)
+        {
+            for (c = 0; c < out_ch; c++)
+            {
+                /* the alpha channel is the last one of the input */
+                int i = alpha && c == out_ch - 1 ? in_ch - 1 : c;
+                png_bytep sample = in + ((png_size_t) x * in_ch + i) *
+                    in_bytes;
 
-    /* methods 137 through 148 (12*1*1 = 12), level 0 */
+                if (depth < 8)
+                {
+                    int shift = 8 - depth * (int) (x % (8 / depth) + 1);
 
-    for (strat = 0; strat <= 1; strat++)
-    {
-        for (filt = 0; filt <= 5; filt++)
+                    if (input_color_type == 3 || input_bit_depth < 8)
+                        *out |= (png_byte) (*sample << shift);
+                    else
+                        *out |= (png_byte) ((*sample >> (8 - depth)) <<
+                            shift);
+                    if (shift == 0)
+                        out++;
+                }
+                else
+                {
+                    *out++ = sample[0];
+                    if (depth == 16)
+                        *out++ = sample[1];
+                }
+            }
+        }
+        pngcrush_apng_filter_best(filtered, cur, prev, rowbytes, bpp,
+            filter);
+        zs.next_in = filtered;
+        zs.avail_in = (uInt) rowbytes + 1;
+        while (zs.avail_in != 0 && ret == Z_OK)
         {
-            fm[method] = filt;
-            lv[method] = 0;
-            zs[method] = strat;
-            method++;
+            zs.next_out = sink;
+            zs.avail_out = sizeof sink;
+            ret = deflate(&zs, Z_NO_FLUSH);
         }
     }
-
-    /*
-     * methods 149 through 176 (9*3*1 + 1 = 28), speedy
-     */
-    for (strat = 0; strat <= 3; strat++)
+    while (ret == Z_OK)
     {
-        for (lev = 1; lev <= 9; lev++)
-        {
-           lv[method] = lev;
-           zs[method] = strat;
-           fm[method] = 6;
-           method++;
-           if (strat == 2)
-              break; /* HUFFMAN ONLY is independent of level */
-        }
+        zs.next_out = sink;
+        zs.avail_out = sizeof sink;
+        ret = deflate(&zs, Z_FINISH);
     }
+    if (ret == Z_STREAM_END)
+        total = (unsigned long) zs.total_out;
+    deflateEnd(&zs);
+    free(rows);
+    free(filtered);
+    return total;
+}
 
+/* Print the -scan line for the current file.  The critical bytes that
+ * pngcrush would write are predicted from the estimate, or, when the
+ * examine pass found reductions, from deflating the kept rows again after
+ * them.  Without the kept rows (for images over PNGCRUSH_SCAN_KEEP_MAX),
+ * the estimate is scaled by the bits per pixel left after the reductions,
+ * which usually predicts too few bytes.
+ */
+static void pngcrush_scan_report(char *argv[])
+{
+    static const int channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    int ch = channels[input_color_type & 7];
+    int depth = input_bit_depth;
+    int in_bits = ch * depth;
+    int gray = 0, opaque = 0;
+    unsigned long savings, reduced = 0;
+    char reductions[64];
+    int i;
 
-    num_methods = method;   /* GRR */
-
-    /* method 177 */
-    fm[method] = 0; lv[method] = 0; zs[method] = 0;  /* copy_idat */
-    method++;
-
-#define pngcrush_get_long strtol(argv[i],&endptr,10)
-
-#define pngcrush_check_long \
-    {if (errno || endptr == argv[i] || *endptr != '\0') \
-      { fprintf(STDERR, "pngcrush: malformed or missing argument\n"); \
-        exit(1); \
-      } \
+    reductions[0] = '\0';
+    if (make_gray == 1 && (input_color_type & 3) == 2)
+    {
+        strcat(reductions, ",gray");
+        ch -= 2;
+        gray = 1;
+    }
+    if (make_opaque == 1 && (input_color_type & 4))
+    {
+        strcat(reductions, ",opaque");
+        ch--;
+        opaque = 1;
+    }
+    else if (make_trns == 1 && (input_color_type & 4))
+    {
+        strcat(reductions, ",trns");
+        ch--;
+        opaque = 1;
+    }
+    if (make_8_bit == 1 && depth == 16)
+    {
+        strcat(reductions, ",8bit");
+        depth = 8;
+    }
+    if (ch == 1 && input_color_type != 3 && depth == 8 &&
+        gray_bit_depth > 0 && gray_bit_depth < 8)
+    {
+        strcat(reductions, ",graydepth");
+        depth = gray_bit_depth;
+    }
+    if (input_color_type == 3 && reduce_palette == 1 && plte_len > 0)
+    {
+        int reduced = plte_len <= 2 ? 1 : plte_len <= 4 ? 2 :
+            plte_len <= 16 ? 4 : 8;
+
+        if (reduced < depth || 12 + 3 * (unsigned long) plte_len <
+            scan_plte_bytes)
+            strcat(reductions, ",palette");
+        if (reduced < depth)
+            depth = reduced;
+        scan_plte_bytes = 12 + 3 * (unsigned long) plte_len;
     }
 
-#define BUMP_I \
-        { i++; \
-        if(i >= argc) {fprintf(STDERR,"pngcrush: insufficient parameters\n");\
-        exit(1);} }
+    scan_critical = 0;
+    if (scan_estimate != 0 && scan_image != NULL && ch * depth != in_bits)
+        reduced = pngcrush_scan_reduced(gray, opaque, depth);
+    free(scan_image);
+    scan_image = NULL;
+    if (scan_estimate != 0)
+    {
+        unsigned long idat = reduced != 0 ? reduced :
+            (unsigned long) ((double) scan_estimate * ch * depth / in_bits +
+            0.5);
 
-    names = 1;
+        scan_critical = 45 + scan_plte_bytes + idat +
+            12 * (idat / max_idat_size);
+    }
 
-    /* ===================================================================== */
-    /* FIXME:  move args-processing block into separate function (470 lines) */
-    for (i = 1; i < argc; i++)
+    scan_metadata = 0;
+    scan_removable = 0;
+    for (i = 0; i < scan_chunks; i++)
     {
-        errno=0;
+        png_bytep name = scan_chunk_name[i];
 
-        if (!strncmp(argv[i], "--", 2))
-            argv[i]++;
+        scan_metadata += scan_chunk_bytes[i];
+        if (!keep_chunk((png_const_charp) name, argv) ||
+            (intent >= 0 && !memcmp(name, "iCCP", 4)))
+            scan_removable += scan_chunk_bytes[i];
+    }
 
-        if (!strncmp(argv[i], "-", 1))
-            names++;
+    savings = scan_removable;
+    if (scan_critical != 0 && scan_critical < idat_length[0])
+        savings += idat_length[0] - scan_critical;
 
-        /* GRR:  start of giant else-if block */
+    if (scan_header == 0)
+    {
+        printf("file\tbytes\tcritical\tpredicted\tsavings\treductions"
+            "\tmetadata\tremovable\n");
+        scan_header = 1;
+    }
+    printf("%s\t%lu\t%lu\t", inname, (unsigned long) input_length,
+        (unsigned long) idat_length[0]);
+    if (scan_critical != 0)
+        printf("%lu", scan_critical);
+    else
+        printf("-");
+    printf("\t%lu\t%s\t%lu\t%lu\n", savings,
+        reductions[0] != '\0' ? reductions + 1 : "-", scan_metadata,
+        scan_removable);
+    fflush(stdout);
+}
 
-        if (!strncmp(argv[i], "-bail", 5))
-            bail=0;
+/* Recompress one frame, returning a new zlib stream shorter than the
+ * original, or NULL.
+ */
+static png_bytep pngcrush_apng_frame(png_bytep zdata, png_size_t zlen,
+    png_uint_32 width, png_uint_32 height, png_size_t *out_len,
+    int filter, int level, int strategy)
+{
+    static const int channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    int pixel_bits = channels[input_color_type & 7] * input_bit_depth;
+    int bpp = (pixel_bits + 7) >> 3;
+    png_size_t rowbytes = ((png_size_t) width * pixel_bits + 7) >> 3;
+    png_size_t size = 0;
+    png_bytep raw, filtered = NULL, best = NULL;
+    png_size_t best_len = zlen;
+    int f, s, f_first, f_last, s_first, s_last;
+
+    if (pixel_bits == 0 || width == 0 || height == 0 ||
+        width > PNG_UINT_31_MAX ||
+        height > (PNG_SIZE_MAX / 2 - 1) / (rowbytes + 1))
+        return NULL;
+    if (interlace_method != 0)
+    {
+        int pass;
 
-        else if (!strncmp(argv[i], "-bench", 6))
+        for (pass = 0; pass < 7; pass++)
         {
-            names++;
-            BUMP_I;
-            benchmark_iterations = (unsigned int) pngcrush_get_long;
-            pngcrush_check_long;
-        }
+            png_uint_32 cols = PNG_PASS_COLS(width, pass);
+            png_uint_32 rows = PNG_PASS_ROWS(height, pass);
 
-        else if (!strncmp(argv[i], "-bkgd", 5) ||
-                 !strncmp(argv[i], "-bKGD", 5))
-        {
-            names += 3;
-            have_bkgd = 1;
-            BUMP_I;
-            bkgd_red = (png_uint_16) pngcrush_get_long;
-            pngcrush_check_long;
-            BUMP_I;
-            bkgd_green = (png_uint_16) pngcrush_get_long;
-            pngcrush_check_long;
-            BUMP_I;
-            bkgd_blue = (png_uint_16) pngcrush_get_long;
-            pngcrush_check_long;
-            bkgd_index = 0;
+            if (cols != 0 && rows != 0)
+                size += rows * ((((png_size_t) cols * pixel_bits + 7) >> 3)
+                    + 1);
         }
+    }
+    else
+        size = height * (rowbytes + 1);
 
-        else if (!strncmp(argv[i], "-blacken", 8))
-            blacken=1;
-
-        else if (!strncmp(argv[i], "-brute", 6))
-            /* brute force:  try everything */
-        {
-            methods_specified = 1;
-            brute_force++;
-            for (method = 1; method < num_methods; method++)
-                try_method[method] = 0;
-            if (brute_force_filter == 0)
-                for (filt = 0; filt < 6; filt++)
-                    brute_force_filters[filt] = 0;
-            if (brute_force_level == 0)
-                for (lev = 0; lev < 10; lev++)
-                    brute_force_levels[lev] = 0;
-            if (brute_force_strategy == 0)
-                for (strat = 0; strat < NUM_STRATEGIES; strat++)
-                    brute_force_strategies[strat] = 0;
-        }
+    raw = pngcrush_apng_inflate(zdata, zlen, size);
+    if (raw == NULL)
+        return NULL;
 
-        else if (!strncmp(argv[i], "-check", 6))
-        {
-            check_crc = 1;
-        }
+    if (apng_search)
+    {
+        f_first = 0;
+        f_last = 5;
+        s_first = Z_DEFAULT_STRATEGY;
+        s_last = Z_FILTERED;
+        level = 9;
+    }
+    else
+    {
+        f_first = f_last = filter;
+        s_first = s_last = strategy;
+    }
+    if (interlace_method != 0)
+        f_first = f_last = -1; /* keep the filters */
+    else if (!pngcrush_apng_unfilter(raw, height, rowbytes, bpp) ||
+        (filtered = (png_bytep) malloc(size)) == NULL)
+    {
+        free(raw);
+        return NULL;
+    }
 
-        else if (!strncmp(argv[i], "-c", 3) || !strncmp(argv[i], "-col", 4))
+    for (f = f_first; f <= f_last; f++)
+    {
+        if (f >= 0)
+            pngcrush_apng_filter(filtered, raw, height, rowbytes, bpp, f);
+        for (s = s_first; s <= s_last; s++)
         {
-            names++;
-            BUMP_I;
-            force_output_color_type = pngcrush_get_long;
-            pngcrush_check_long;
-        }
+            png_bytep z;
+            png_size_t zl = pngcrush_apng_deflate(f >= 0 ? filtered : raw,
+                size, level, s, &z);
 
-        else if (!strncmp(argv[i], "-d", 3) || !strncmp(argv[i], "-dir", 4))
-        {
-            BUMP_I;
-            if (pngcrush_mode == EXTENSION_MODE)
-                pngcrush_mode = DIREX_MODE;
+            if (zl != 0 && zl < best_len)
+            {
+                free(best);
+                best = z;
+                best_len = zl;
+            }
             else
-                pngcrush_mode = DIRECTORY_MODE;
-            directory_name = argv[names++];
+                free(z);
         }
+    }
+    free(filtered);
+    free(raw);
+    *out_len = best_len;
+    return best;
+}
 
-        else if (!strncmp(argv[i], "-exit", 5))
-        {
-            pngcrush_must_exit = 1;
-        }
+static int pngcrush_apng_copy(png_structp png_ptr, png_unknown_chunkp dst,
+    png_unknown_chunkp src, png_size_t prefix)
+{
+    png_memcpy(dst, src, sizeof *dst);
+    dst->data = NULL;
+    if (src->size + prefix == 0)
+        return 1;
+    dst->data = (png_bytep) png_malloc_warn(png_ptr, src->size + prefix);
+    if (dst->data == NULL)
+        return 0;
+    if (src->size)
+        png_memcpy(dst->data + prefix, src->data, src->size);
+    dst->size = src->size + prefix;
+    return 1;
+}
 
-        else if (!strncmp(argv[i], "-e", 3) || !strncmp(argv[i], "-ext", 4))
-        {
-            BUMP_I;
-            if (pngcrush_mode == DIRECTORY_MODE)
-                pngcrush_mode = DIREX_MODE;
-            else
-                pngcrush_mode = EXTENSION_MODE;
-            extension = argv[names++];
-        }
+void pngcrush_apng_free(png_structp png_ptr, png_unknown_chunkp chunks,
+     int num)
+{
+    int i;
 
-        else if (!strncmp(argv[i], "-fast", 5))
-        {
-            /* try two fast filters */
-            methods_specified = 1;
-            try_method[16] = 0;
-            try_method[53] = 0;
-        }
+    for (i = 0; i < num; i++)
+        png_free(png_ptr, chunks[i].data);
+    png_free(png_ptr, chunks);
+}
 
-        else if (!strncmp(argv[i], "-force", 6))
-        {
-            force = 1;
-        }
+/* Recompress the APNG frames in the unknown chunks that follow IDAT.  On
+ * success the new chunks, all allocated with png_malloc(png_ptr), are
+ * returned in *out and the number of them is returned; 0 means that the
+ * chunks are to be written unchanged.
+ */
+int pngcrush_apng_recompress(png_structp png_ptr, png_unknown_chunkp chunks,
+     int num, png_unknown_chunkp *out, int filter, int level, int strategy)
+{
+    png_unknown_chunkp new_chunks;
+    png_uint_32 width = 0, height = 0, seq = 0;
+    int i, n = 0, have_seq = 0;
 
-        else if (!strncmp(argv[i], "-fix", 4))
-        {
-            salvage++;
-        }
+    for (i = 0; i < num; i++)
+        if (!png_memcmp(chunks[i].name, "fdAT", 4))
+            break;
+    if (i == num)
+        return 0;
 
-        else if (!strncmp(argv[i], "-f", 3) || !strncmp(argv[i], "-fil", 4))
+    new_chunks = (png_unknown_chunkp) png_malloc_warn(png_ptr,
+        num * sizeof (png_unknown_chunk));
+    if (new_chunks == NULL)
+        return 0;
+
+    for (i = 0; i < num;)
+    {
+        png_unknown_chunkp c = &chunks[i];
+
+        if (!png_memcmp(c->name, "fdAT", 4))
         {
-            int specified_filter;
-            BUMP_I;
-            specified_filter = pngcrush_get_long;
-            pngcrush_check_long;
-            if (specified_filter > 5 || specified_filter < 0)
-                specified_filter = 5;
-            names++;
-            if (brute_force == 0)
-                fm[method] = specified_filter;
-            else
+            png_size_t zlen = 0, new_len = 0;
+            png_bytep zdata, new_data = NULL;
+            int j;
+
+            for (j = i; j < num && !png_memcmp(chunks[j].name, "fdAT", 4);
+                 j++)
             {
-                if (brute_force_filter == 0)
-                  for (filt = 0; filt < 6; filt++)
-                    brute_force_filters[filt] = 1;
-                brute_force_filters[specified_filter] = 0;
-                brute_force_filter++;
+                if (chunks[j].size < 4)
+                    goto unchanged;
+                zlen += chunks[j].size - 4;
             }
-        }
+            if (!have_seq || width == 0 || zlen == 0)
+                goto unchanged;
 
-#ifdef PNG_gAMA_SUPPORTED
-        else if (!strncmp(argv[i], "-g", 3) || !strncmp(argv[i], "-gam", 4))
-        {
-            names++;
-            BUMP_I;
-            found_gAMA=1;
-            if (specified_intent < 0)
+            zdata = (png_bytep) malloc(zlen);
+            if (zdata == NULL)
+                goto unchanged;
+            for (zlen = 0; i < j; i++)
             {
-#ifdef PNG_FIXED_POINT_SUPPORTED
-                int c;
-                char number[16];
-                char *n = number;
-                int nzeroes = -1;
-                int length = strlen(argv[i]);
-                for (c = 0; c < length; c++)
+                png_memcpy(zdata + zlen, chunks[i].data + 4,
+                    chunks[i].size - 4);
+                zlen += chunks[i].size - 4;
+            }
+            apng_fdat_in += (unsigned long) zlen;
+            new_data = pngcrush_apng_frame(zdata, zlen, width, height,
+                &new_len, filter, level, strategy);
+
+            if (new_data != NULL)
+            {
+                png_unknown_chunk one;
+
+                png_memcpy(&one, c, sizeof one);
+                one.data = new_data;
+                one.size = new_len;
+                if (!pngcrush_apng_copy(png_ptr, &new_chunks[n], &one, 4))
                 {
-                    if (*(argv[i] + c) == '.')
+                    free(new_data);
+                    free(zdata);
+                    goto unchanged;
+                }
+                free(new_data);
+                pngcrush_save_uint_32(new_chunks[n++].data, seq++);
+                apng_fdat_out += (unsigned long) new_len;
+                apng_frames++;
+            }
+            else
+            {
+                /* Keep the original chunks, renumbered */
+                apng_fdat_out += (unsigned long) zlen;
+                for (i = (int) (c - chunks); i < j; i++)
+                {
+                    if (!pngcrush_apng_copy(png_ptr, &new_chunks[n],
+                        &chunks[i], 0))
                     {
-                        nzeroes = 5;
-                    }
-                    else if (nzeroes)
-                    {
-                        *n++ = *(argv[i] + c);
-                        nzeroes--;
+                        free(zdata);
+                        goto unchanged;
                     }
+                    pngcrush_save_uint_32(new_chunks[n++].data, seq++);
                 }
-                for (c = 0; c < nzeroes; c++)
-                    *n++ = '0';
-                *n = '\0';
-                specified_gamma = strtol(number,&endptr,10);
-#else
-                specified_gamma = strtof(argv[i],&endptr);
-#endif
-                pngcrush_check_long;
             }
-        }
-#endif /* PNG_gAMA_SUPPORTED */
-
-        else if (!strncmp(argv[i], "-h", 3) || !strncmp(argv[i], "-hel", 4))
-        {
-            ++verbose;
-            print_version_info();
-            printed_version_info++;
-            print_usage(0);   /* this exits */
+            free(zdata);
+            continue;
         }
 
-        else if (!strncmp(argv[i], "-huffman", 8))
+        if (!pngcrush_apng_copy(png_ptr, &new_chunks[n], c, 0))
+            goto unchanged;
+        if (!png_memcmp(c->name, "fcTL", 4) && c->size >= 26)
         {
-            /* try all filters with huffman */
-            methods_specified = 1;
-            for (method = 11; method <= 16; method++)
-            {
-                try_method[method] = 0;
-            }
+            if (!have_seq)
+                seq = pngcrush_get_uint_32(c->data);
+            have_seq = 1;
+            pngcrush_save_uint_32(new_chunks[n].data, seq++);
+            width = pngcrush_get_uint_32(c->data + 4);
+            height = pngcrush_get_uint_32(c->data + 8);
         }
+        n++;
+        i++;
+    }
 
-#ifdef PNG_iCCP_SUPPORTED
-        else if (!strncmp(argv[i], "-iccp", 5))
-        {
-            FILE *iccp_fn;
-            if (iccp_length)
-                free(iccp_text);
-            BUMP_I;
-            iccp_length = pngcrush_get_long;
-            pngcrush_check_long;
-            names += 3;
-            BUMP_I;
-            strncpy(iccp_name, argv[i], 80);
-            iccp_name[79] = '\0';
-            BUMP_I;
-            iccp_file = argv[i];
-            if ((iccp_fn = FOPEN(iccp_file, "rb")) == NULL) {
-                fprintf(STDERR, "Could not find file: %s\n", iccp_file);
-                iccp_length = 0;
-            }
-            else
-            {
-                int ic;
-                number_of_open_files++;
-                iccp_text = (char*)malloc(iccp_length);
-                if (iccp_text == NULL)
-                {
-                   fprintf(STDERR, "malloc of iccp_text failed\n");
-                   iccp_length = 0;
-                }
-
-                for (ic = 0; ic < iccp_length; ic++)
-                {
-                    png_size_t num_in;
-                    num_in = fread((void *)buffer, 1, 1, iccp_fn);
-
-                    if (!num_in)
-                        break;
-
-                    iccp_text[ic] = buffer[0];
-                }
+    *out = new_chunks;
+    return n;
 
-                FCLOSE(iccp_fn);
-            }
-        }
-#endif /* PNG_iCCP_SUPPORTED */
+unchanged:
+    pngcrush_apng_free(png_ptr, new_chunks, n);
+    apng_frames = 0;
+    apng_fdat_in = apng_fdat_out = 0;
+    return 0;
+}
 
-        else if (!strncmp(argv[i], "-keep", 5))
-        {
-            names++;
-            BUMP_I;
-            if (!strncmp(argv[i], "-dSIG", 5)
-                    && (!strncmp(argv[i], "-dsig", 5) ))
-              found_any_chunk=1;
-        }
+void pngcrush_write_png(png_structp write_pointer, png_bytep data,
+     png_size_t length)
+{
+    pngcrush_write_byte_count += (int) length;
+    if (nosave == 0 && last_trial == 1)
+      pngcrush_default_write_data(write_pointer, data, length);
+}
 
-        else if (!strncmp(argv[i], "-l", 3) || !strncmp(argv[i], "-lev", 4))
-        {
-            int specified_level;
-            BUMP_I;
-            specified_level = pngcrush_get_long;
-            pngcrush_check_long;
-            if (specified_level > 9 || specified_level < 0)
-                specified_level = 9;
-            names++;
-            if (brute_force == 0)
-                lv[method] = specified_level;
-            else
-            {
-                if (brute_force_level == 0)
-                    for (lev = 0; lev < 10; lev++)
-                        brute_force_levels[lev] = 1;
-                brute_force_levels[specified_level] = 0;
-                brute_force_level++;
-            }
-        }
+static void pngcrush_flush(png_structp png_ptr)
+{
+   /* Do nothing. */
+   PNGCRUSH_UNUSED(png_ptr)
+}
 
-        else if (!strncmp(argv[i], "-loco", 5))
-        {
-#ifdef PNGCRUSH_LOCO
-            do_loco = 1;
-#else
-            fprintf
-                (STDERR,"Cannot do -loco because libpng was compiled"
-                 " without MNG features");
-#endif
-        }
+/* Read all of stdin into stdin_data */
+void pngcrush_read_stdin(void)
+{
+    png_size_t size = 65536;
 
-        else if (!strncmp(argv[i], "-max", 4))
-        {
-            names++;
-            BUMP_I;
-            max_idat_size = (png_uint_32) pngcrush_get_long;
-            pngcrush_check_long;
-            if (max_idat_size == 0 || max_idat_size > PNG_UINT_31_MAX)
-                max_idat_size = PNG_ZBUF_SIZE;
-        }
+    stdin_data_length = 0;
+    stdin_data = (png_bytep) malloc(size);
+    while (stdin_data != NULL)
+    {
+        png_size_t num_in = fread(stdin_data + stdin_data_length, 1,
+            size - stdin_data_length, stdin);
 
-        else if (!strncmp(argv[i], "-m", 3) || !strncmp(argv[i], "-met", 4))
+        stdin_data_length += num_in;
+        if (num_in == 0)
+            break;
+        if (stdin_data_length == size)
         {
-            names++;
-            BUMP_I;
-            method = pngcrush_get_long;
-            pngcrush_check_long;
-            if (method >= 1 && method <= MAX_METHODS)
+            png_bytep bigger = (png_bytep) realloc(stdin_data, 2 * size);
+            if (bigger == NULL)
             {
-              methods_specified = 1;
-              brute_force = 0;
-              try_method[method] = 0;
+                free(stdin_data);
+                stdin_data = NULL;
             }
             else
             {
-              fprintf(STDERR, "\n  Ignoring invalid method: %d\n",
-                      method);
-              method = MAX_METHODS;
+                stdin_data = bigger;
+                size *= 2;
             }
         }
+    }
+    if (stdin_data == NULL)
+    {
+        fprintf(STDERR, "pngcrush: out of memory reading stdin\n");
+        exit(1);
+    }
+    P1("   read %lu bytes from stdin\n", (unsigned long) stdin_data_length);
+}
 
-#ifdef PNGCRUSH_LOCO
-        else if (!strncmp(argv[i], "-mng", 4))
-        {
-            names++;
-            BUMP_I;
-            mngname = argv[i];
-            new_mng++;
-        }
+void PNGCBAPI pngcrush_read_stdin_data(png_structp png_ptr, png_bytep data,
+  png_size_t length)
+{
+    if (length > stdin_data_length - stdin_data_pos)
+        png_error(png_ptr, "Read Error");
+    memcpy(data, stdin_data + stdin_data_pos, length);
+    stdin_data_pos += length;
+}
+
+/* Set up png_ptr to read from fp, or from stdin_data if fp is NULL */
+void pngcrush_init_read(png_structp png_ptr, FILE *fp)
+{
+    if (fp == NULL)
+    {
+        stdin_data_pos = 0;
+        png_set_read_fn(png_ptr, (png_voidp) NULL,
+            (png_rw_ptr) pngcrush_read_stdin_data);
+        return;
+    }
+#ifdef PNG_STDIO_SUPPORTED
+    png_init_io(png_ptr, fp);
+#else
+    png_set_read_fn(png_ptr, (png_voidp) fp, (png_rw_ptr) NULL);
 #endif
+}
 
-        else if (!strncmp(argv[i], "-new", 4))
+FILE *pngcrush_open_output(void)
+{
+    if (stdout_output)
+    {
+        if (pngcrush_stdout == NULL)
         {
-            make_opaque = 1;                 /* -reduce */
-            make_gray = 1;                   /* -reduce */
-            make_8_bit = 1;                  /* -reduce */
-            reduce_palette = 1;              /* -reduce */
+#if defined(__unix__) || defined(__APPLE__)
+            fflush(stdout);
+            pngcrush_stdout = fdopen(dup(1), "wb");
+            dup2(2, 1);
+#else
+            pngcrush_stdout = stdout;
+#endif
         }
+        return pngcrush_stdout;
+    }
+    return FOPEN(outname, "wb");
+}
 
-        else if (!strncmp(argv[i], "-nobail", 7))
-            bail=1;
+void pngcrush_close_output(void)
+{
+    if (fpout != NULL && fpout == pngcrush_stdout)
+    {
+        fflush(fpout);
+        fpout = NULL;
+        --number_of_open_files;
+    }
+    else if (fpout != NULL)
+        FCLOSE(fpout);
+}
 
-        else if (!strncmp(argv[i], "-nocheck", 8))
-        {
-            check_crc = 0;
-        }
+/* Hash the pixels of a PNG file, or of stdin_data if name is NULL, as
+ * 16-bit RGBA with the color of fully transparent pixels zeroed, since
+ * -blacken and -alpha_fill change it.  The lossless reductions (gray,
+ * opaque, tRNS key, 8-bit, palette and gray bit depth) and the interlacing
+ * leave this unchanged.  Returns 0 if the file cannot be decoded; the
+ * input is read as leniently as the trials read it, the output strictly.
+ */
+static int pngcrush_verify_hash(const char *name, int strict,
+    png_uint_32 *hash)
+{
+    static FILE *fp;
+    static png_structp png_ptr;
+    static png_infop info_ptr;
+    static int ok;
+
+    fp = NULL;
+    png_ptr = NULL;
+    info_ptr = NULL;
+    ok = 0;
+    if (name != NULL && (fp = fopen(name, "rb")) == NULL)
+        return 0;
 
-        else if (!strncmp(argv[i], "-nofilecheck", 5))
-        {
-            nofilecheck++;
-        }
-        else if (!strncmp(argv[i], "-noforce", 6))
+    Try {
+        png_uint_32 w, h, y;
+        png_size_t rowbytes;
+        int pass, passes, interlaced;
+
+        png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+            (png_voidp) NULL, (png_error_ptr) pngcrush_cexcept_error,
+            (png_error_ptr) NULL);
+        if (png_ptr == NULL)
+            Throw "pngcrush could not create the verify read_ptr";
+        info_ptr = png_create_info_struct(png_ptr);
+        png_set_error_fn(png_ptr, (png_voidp) NULL,
+            (png_error_ptr) pngcrush_cexcept_error, (png_error_ptr) NULL);
+#ifdef PNG_BENIGN_ERRORS_SUPPORTED
+        png_set_benign_errors(png_ptr, 1);
+#endif
+#ifdef PNG_CRC_QUIET_USE
+        if (!strict)
         {
-            force = 0;
+            png_set_option(png_ptr, PNG_IGNORE_ADLER32, PNG_OPTION_ON);
+            png_set_crc_action(png_ptr, PNG_CRC_QUIET_USE,
+                PNG_CRC_QUIET_USE);
         }
+#endif
+        pngcrush_init_read(png_ptr, fp);
+        png_read_info(png_ptr, info_ptr);
+        png_set_expand(png_ptr);
+#ifdef PNG_READ_EXPAND_16_SUPPORTED
+        png_set_expand_16(png_ptr);
+#else
+        png_set_strip_16(png_ptr);
+#endif
+        png_set_gray_to_rgb(png_ptr);
+        png_set_add_alpha(png_ptr, 0xffff, PNG_FILLER_AFTER);
+        passes = png_set_interlace_handling(png_ptr);
+        png_read_update_info(png_ptr, info_ptr);
+
+        w = png_get_image_width(png_ptr, info_ptr);
+        h = png_get_image_height(png_ptr, info_ptr);
+        rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+        interlaced = passes > 1;
+        if (interlaced && (png_size_t) h * rowbytes / rowbytes != h)
+            png_error(png_ptr, "Image is too large to verify");
+        verify_image = (png_bytep) calloc(interlaced ? h : 1, rowbytes);
+        if (verify_image == NULL)
+            png_error(png_ptr, "Insufficient memory to verify");
+
+        hash[0] = crc32(0L, Z_NULL, 0);
+        hash[1] = adler32(0L, Z_NULL, 0);
+        for (pass = 0; pass < passes; pass++)
+            for (y = 0; y < h; y++)
+            {
+                png_bytep row = verify_image +
+                    (interlaced ? y * rowbytes : 0);
 
+                png_read_row(png_ptr, row, (png_bytep) NULL);
+                if (pass == passes - 1)
+                {
+                    int bytes = (int) (rowbytes / w); /* per pixel */
+                    int color = bytes - bytes / 4;
+                    png_uint_32 x;
 
-        else if (!strncmp(argv[i], "-nolimits", 5))
-        {
-            no_limits++;
-        }
+                    for (x = 0; x < w; x++)
+                    {
+                        png_bytep px = row + x * bytes;
 
-        else if (!strncmp(argv[i], "-noreduce_pal", 13))
-        {
-            reduce_palette = 0;
-        }
+                        if (px[color] == 0 && px[bytes - 1] == 0)
+                            memset(px, 0, color);
+                    }
+                    hash[0] = crc32(hash[0], row, (uInt) rowbytes);
+                    hash[1] = adler32(hash[1], row, (uInt) rowbytes);
+                }
+            }
+        ok = 1;
+    }
+    Catch(msg) {
+        if (verbose > 0)
+            fprintf(STDERR, "   Could not verify %s: %s\n",
+                name != NULL ? name : "stdin", msg);
+    }
+    png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp) NULL);
+    free(verify_image);
+    verify_image = NULL;
+    if (fp != NULL)
+        fclose(fp);
+    return ok;
+}
 
-        else if (!strncmp(argv[i], "-noreduce", 9))
-        {
-            make_opaque = 0;
-            make_gray = 0;
-            make_8_bit = 0;
-            reduce_palette = 0;
-        }
+/* Collect the hash of the input */
+static void pngcrush_verify_wait(void)
+{
+#ifdef PNGCRUSH_HAVE_FORK
+    if (verify_pid > 0)
+    {
+        png_byte result[9];
+        ssize_t got = 0, n;
+
+        while (got < 9 &&
+            ((n = read(verify_fd, result + got, 9 - got)) > 0 ||
+            (n < 0 && errno == EINTR)))
+            if (n > 0)
+                got += n;
+        close(verify_fd);
+        while (waitpid(verify_pid, NULL, 0) < 0 && errno == EINTR)
+            ;
+        verify_pid = -1;
+        verify_fd = -1;
+        verify_input_ok = got == 9 && result[0] != 0;
+        verify_input_hash[0] = png_get_uint_32(result + 1);
+        verify_input_hash[1] = png_get_uint_32(result + 5);
+    }
+#endif
+}
 
-        else if (!strncmp(argv[i], "-n", 3) || !strncmp(argv[i], "-nos", 4))
+/* Start hashing the input, in a child process if possible */
+static void pngcrush_verify_start(void)
+{
+    const char *name = stdin_input ? NULL : inname;
+#ifdef PNGCRUSH_HAVE_FORK
+    int fds[2];
+
+    pngcrush_verify_wait();
+    verify_result = 0;
+    verify_input_ok = 0;
+    if (pipe(fds) == 0)
+    {
+        fflush(stdout);
+        fflush(STDERR);
+        verify_pid = fork();
+        if (verify_pid == 0)
         {
-            /* no save; I just use this for testing decode speed */
-            /* also to avoid saving if a CgBI chunk was found */
-            nosave++;
-            pngcrush_mode = EXTENSION_MODE;
+            png_byte result[9];
+
+            close(fds[0]);
+            result[0] = (png_byte) pngcrush_verify_hash(name, 0,
+                verify_input_hash);
+            png_save_uint_32(result + 1, verify_input_hash[0]);
+            png_save_uint_32(result + 5, verify_input_hash[1]);
+            if (write(fds[1], result, 9) != 9)
+                _exit(1);
+            _exit(0);
         }
-
-        else if (!strncmp(argv[i], "-oldtimestamp", 5))
+        close(fds[1]);
+        if (verify_pid > 0)
         {
-            new_time_stamp=0;
+            verify_fd = fds[0];
+            return;
         }
+        close(fds[0]);
+    }
+#endif
+    verify_input_ok = pngcrush_verify_hash(name, 0, verify_input_hash);
+}
 
-        else if (!strncmp(argv[i], "-old", 4))
-        {
-            make_opaque = 0;                 /* no -reduce */
-            make_gray = 0;                   /* no -reduce */
-            make_8_bit = 0;                  /* no -reduce */
-            reduce_palette = 0;              /* no -reduce */
-        }
+/* Replace the output with a copy of the input */
+static int pngcrush_verify_restore(void)
+{
+    FILE *in = NULL, *out;
+    png_byte buf[65536];
+    size_t n;
+    int ok = 1;
+
+    if (!stdin_input && (in = fopen(inname, "rb")) == NULL)
+        return 0;
+    if ((out = fopen(outname, "wb")) == NULL)
+    {
+        if (in != NULL)
+            fclose(in);
+        return 0;
+    }
+    if (in == NULL)
+        ok = fwrite(stdin_data, 1, stdin_data_length, out) ==
+            stdin_data_length;
+    else
+    {
+        while ((n = fread(buf, 1, sizeof buf, in)) > 0)
+            if (fwrite(buf, 1, n, out) != n)
+                ok = 0;
+        if (ferror(in))
+            ok = 0;
+        fclose(in);
+    }
+    if (fclose(out) != 0)
+        ok = 0;
+    return ok;
+}
 
-        else if(!strncmp(argv[i], "-ow",3))
-        {
-            overwrite = 1;
-        }
+/* Compare the pixels of the output just written with those of the input,
+ * and put the original back in its place if they differ.  Files for which
+ * -c was asked to drop the alpha channel or the color are not checked.
+ */
+static void pngcrush_verify_output(void)
+{
+    png_uint_32 hash[2];
+
+    pngcrush_verify_wait();
+    verify_result = 0;
+    if (force_output_color_type != 8 &&
+        (((input_color_type & 4) && !(output_color_type & 4) &&
+        make_opaque != 1 && make_trns != 1) ||
+        ((input_color_type & 2) && !(output_color_type & 2) &&
+        make_gray != 1)))
+    {
+        if (verbose > 0)
+            fprintf(STDERR, "   Not verified: -c %d is lossy for %s\n",
+                output_color_type, inname);
+        return;
+    }
+    if (!verify_input_ok)
+    {
+        if (verbose >= 0)
+            fprintf(STDERR, "   Could not verify %s: the input could not"
+                " be decoded\n", inname);
+        return;
+    }
+    if (pngcrush_verify_hash(outname, 1, hash) &&
+        hash[0] == verify_input_hash[0] && hash[1] == verify_input_hash[1])
+    {
+        verify_result = 1;
+        if (verbose > 0)
+            fprintf(STDERR, "   Verified the pixels of %s\n", outname);
+        return;
+    }
+    verify_result = -1;
+    if (pngcrush_verify_restore())
+        fprintf(STDERR, "pngcrush: the output for %s does not decode to"
+            " the same pixels; kept the original\n", inname);
+    else
+    {
+        fprintf(STDERR, "pngcrush: the output for %s does not decode to"
+            " the same pixels, and the original could not be copied to %s\n",
+            inname, outname);
+        remove(outname);
+        exit(1);
+    }
+}
 
-        else if (!strncmp(argv[i], "-pplt", 3))
-        {
-            names++;
-            do_pplt++;
-            BUMP_I;
-            strncpy(pplt_string, argv[i], STR_BUF_SIZE);
-            pplt_string[STR_BUF_SIZE-1] = '\0';
-        }
+/* Milliseconds from an arbitrary origin, used by -time_budget.  This is
+ * independent of the PNGCRUSH_TIMERS, which only run when verbose >= 0.
+ */
+unsigned long pngcrush_clock_ms(void)
+{
+#if PNGCRUSH_USE_CLOCK_GETTIME
+   struct timespec t;
+   clock_gettime(PNGCRUSH_CLOCK_ID, &t);
+   return (unsigned long)t.tv_sec * 1000UL +
+       (unsigned long)(t.tv_nsec / 1000000L);
+#else
+   return (unsigned long)((double)clock() * 1000. / CLOCKS_PER_SEC);
+#endif
+}
 
-        else if (!strncmp(argv[i], "-premultiply", 5))
-        {
-            premultiply=2;
-        }
+/* Fill trial_order[] with the order in which the trials will be run.
+ *
+ * Without a time budget the methods are simply run in numerical order.
+ * With one, trial 0 (examine) and the default heuristic methods 1-10 run
+ * first, in order because the best_of_three selection depends on it, and
+ * the remaining methods are sorted so that cheap ones (low zlib level,
+ * huffman-only, RLE) come before expensive ones, and adaptive filtering
+ * (which usually wins) before the fixed filters at the same cost.  Level 0
+ * rarely wins and goes last.  The final write-the-best trial always stays
+ * at the end.
+ */
+void pngcrush_schedule_trials(int last_method, int *fm, int *lv, int *zs)
+{
+   int i, j, key_i;
+   int key[MAX_METHODSP1];
 
-        else if (!strncmp(argv[i], "-p", 3) || !strncmp(argv[i], "-pau", 4))
-        {
-            pauses++;
-        }
+   for (i = 0; i <= last_method; i++)
+   {
+      trial_order[i] = i;
 
-        else if (!strncmp(argv[i], "-q", 3) || !strncmp(argv[i], "-qui", 4))
-        {
-            /* quiet, does not suppress warnings or timing */
-            verbose = 0;
-        }
+      if (zs[i] == 2 || zs[i] == 3)
+         key[i] = 1;
+      else if (lv[i] == 0)
+         key[i] = 10;
+      else
+         key[i] = lv[i];
+      key[i] = 2 * key[i] + (fm[i] < 5);
+   }
 
-        else if (!strncmp(argv[i], "-reduce_pal", 11))
-        {
-            reduce_palette = 1;
-        }
+   if (time_budget == 0 && batch_time_budget == 0)
+      return;
 
-        else if (!strncmp(argv[i], "-reduce", 7))
-        {
-            noreduce = 0;
-            make_opaque = 1;
-            make_gray = 1;
-            make_8_bit = 1;
-            reduce_palette = 1;
-        }
+   /* Stable insertion sort of the methods after the heuristics */
+   for (i = DEFAULT_METHODS + 2; i < last_method; i++)
+   {
+      int t = trial_order[i];
+      key_i = key[t];
+      for (j = i; j > DEFAULT_METHODS + 1 && key[trial_order[j-1]] > key_i;
+           j--)
+         trial_order[j] = trial_order[j-1];
+      trial_order[j] = t;
+   }
+}
 
-#ifdef PNG_gAMA_SUPPORTED
-        else if (!strncmp(argv[i], "-replace_gamma", 4))
-        {
-            names++;
-            BUMP_I;
-            found_gAMA=1;
-            {
-#ifdef PNG_FIXED_POINT_SUPPORTED
-                int c;
-                char number[16];
-                char *n = number;
-                int nzeroes = -1;
-                int length = strlen(argv[i]);
-                for (c = 0; c < length; c++)
-                {
-                    if (*(argv[i] + c) == '.')
-                    {
-                        nzeroes = 5;
-                    }
-                    else if (nzeroes)
-                    {
-                        *n++ = *(argv[i] + c);
-                        nzeroes--;
-                    }
-                }
-                for (c = 0; c < nzeroes; c++)
-                    *n++ = '0';
-                *n = '\0';
-                force_specified_gamma = strtol(number,&endptr,10);
-#else
-                force_specified_gamma = strtof(argv[i],&endptr);
-#endif
-                pngcrush_check_long;
-            }
-        }
-#endif /* PNG_gAMA_SUPPORTED */
 
-#ifdef PNG_pHYs_SUPPORTED
-        else if (!strncmp(argv[i], "-res", 4))
-        {
-            names++;
-            BUMP_I;
-            resolution = pngcrush_get_long;
-            pngcrush_check_long;
-        }
-#endif
+/* Check whether the alpha channel of an 8-bit GA or RGBA image can be
+ * replaced with a tRNS key color: alpha is only 0 or 255, all of the fully
+ * transparent pixels have the same color, and no opaque pixel has that
+ * color.  The key is not known until the first transparent pixel, so the
+ * opaque colors seen are kept in the trns_seen bitmap.
+ */
+static void pngcrush_examine_trns(png_row_infop row_info, png_bytep data)
+{
+   int channels = row_info->color_type == 6 ? 3 : 1;
+   png_size_t x;
 
-#ifdef Z_RLE
-        else if (!strncmp(argv[i], "-rle", 4))
-        {
-            /* try all filters with RLE */
-            methods_specified = 1;
-            for (method = 125; method <= 136; method++)
+   if (row_info->bit_depth != 8)
+   {
+      make_trns = 3;
+      return;
+   }
+   if (trns_seen == NULL)
+   {
+      trns_seen = (png_bytep) calloc(channels == 3 ? 1 << 21 : 32, 1);
+      if (trns_seen == NULL)
+      {
+         make_trns = 2;
+         return;
+      }
+   }
+
+   for (x = 0; x < row_info->rowbytes; x += channels + 1)
+   {
+      png_bytep px = data + x;
+      png_uint_32 color = channels == 3 ? ((png_uint_32) px[0] << 16) |
+          ((png_uint_32) px[1] << 8) | px[2] : px[0];
+
+      if (px[channels] == 255)
+      {
+         if (trns_key_found && color == trns_key)
+         {
+            make_trns = 2;
+            return;
+         }
+         trns_seen[color >> 3] |= (png_byte) (1 << (color & 7));
+      }
+      else if (px[channels] == 0)
+      {
+         if (!trns_key_found)
+         {
+            if (trns_seen[color >> 3] & (1 << (color & 7)))
             {
-                try_method[method] = 0;
+               make_trns = 2;
+               return;
             }
-        }
-#endif
+            trns_key = color;
+            trns_key_found = 1;
+         }
+         else if (color != trns_key)
+         {
+            make_trns = 2;
+            return;
+         }
+      }
+      else
+      {
+         make_trns = 2;
+         return;
+      }
+   }
+}
 
-#ifdef PNGCRUSH_MULTIPLE_ROWS
-        else if (!strncmp(argv[i], "-rows", 5))
-        {
-            names++;
-            BUMP_I;
-            max_rows_at_a_time = pngcrush_get_long;
-            pngcrush_check_long;
-        }
-#endif
+void pngcrush_examine_pixels_fn(png_structp png_ptr, png_row_infop
+    row_info, png_bytep data)
+{
+   if (make_trns == 1)
+   {
+      if (row_info->color_type == 4 || row_info->color_type == 6)
+         pngcrush_examine_trns(row_info, data);
+      else
+         make_trns = 3;
+   }
 
-        else if (!strncmp(argv[i], "-r", 3) || !strncmp(argv[i], "-rem", 4))
-        {
-            remove_chunks = i;
-            names++;
-            BUMP_I;
-            if (!strncmp(argv[i], "-dSIG", 5)
-                 && (!strncmp(argv[i], "-dsig", 5)))
-               image_is_immutable=0;
-        }
+   if (blacken == 1 || make_gray == 1 || make_opaque == 1)
+   {
+      /* Check if there are any fully transparent pixels.  If one is found,
+       * without the underlying color already black, set blacken==2. If the
+       * PNG colortype does not support an alpha channel, set blacken==3.
+       *
+       * Check if there are any transparent pixels.  If one is found,
+       * set make_opaque==2. If the PNG colortype does not support an alpha
+       * channel, set make_opaque==3.
+       *
+       * Check if there are any non-gray pixels.  If one is found,
+       * set make_gray == 2. If the PNG colortype is already gray, set
+       * make_gray = 3.
+       *
+       * Check if any 16-bit pixels do not have identical high and low
+       * bytes.  If one is found, set make_8_bit == 2. If the PNG bit_depth
+       * is not 16-bits, set make_8_bit = 3.
+       *
+       * Find the maximum palette entry present in the IDAT chunks of
+       * an indexed PNG.
+       *
+       */
 
-        else if (!strncmp(argv[i], "-save", 5))
-        {
-            all_chunks_are_safe++;
-        }
+      int i;
 
-        else if (!strncmp(argv[i], "-speed", 6))
-        {
-            speed = 1;
-        }
+      if (row_info->color_type < 4)
+      {
+        blacken = 3;  /* It doesn't have an alpha channel */
+        /* To do: check if tRNS chunk can be removed from color type 0 or 2 */
+        make_opaque = 3;
+      }
 
-        else if (!strncmp(argv[i], "-srgb", 5) ||
-                   !strncmp(argv[i], "-sRGB", 5))
-        {
-#ifdef PNG_gAMA_SUPPORTED
-#  ifdef PNG_FIXED_POINT_SUPPORTED
-            specified_gamma = 45455L;
-#  else
-            specified_gamma = 0.45455;
-#  endif
-#endif
-            specified_intent = 0;
-            BUMP_I;
-            if (!strncmp(argv[i], "0", 1) ||
-                !strncmp(argv[i], "1", 1) ||
-                !strncmp(argv[i], "2", 1) ||
-                !strncmp(argv[i], "3", 1))
-            {
-                names++;
-                specified_intent = (int) pngcrush_get_long;
-                pngcrush_check_long;
-            } else
-                i--;
-        }
+      if (row_info->color_type == 0 || row_info->color_type == 4)
+        make_gray = 3; /* It's already gray! */
 
-        else if (!strncmp(argv[i], "-ster", 5) ||
-                   !strncmp(argv[i], "-sTER", 5))
-        {
-            BUMP_I;
-            ster_mode = -1;
-            if (!strncmp(argv[i], "0", 1) ||
-                !strncmp(argv[i], "1", 1))
-            {
-                names++;
-                ster_mode = (int) pngcrush_get_long;
-                pngcrush_check_long;
-            }
-            else
-                i--;
-        }
+      if (row_info->color_type == 3)
+        make_gray = 3; /* Don't change indexed PNG */
 
-        else if (!strncmp(argv[i], "-s", 3) || !strncmp(argv[i], "-sil", 4))
-        {
-            /* silent, suppresses warnings, timing, and results */
-            verbose = -1;
-        }
+      if (row_info->bit_depth < 16)
+        make_8_bit = 3;
 
-        else if (!strncmp(argv[i], "-text", 5)
-                 || !strncmp(argv[i], "-tEXt", 5) ||
-#ifdef PNG_iTXt_SUPPORTED
-                 !strncmp(argv[i], "-itxt", 5)
-                 || !strncmp(argv[i], "-iTXt", 5)
-                 || !strncmp(argv[i], "-zitxt", 6)
-                 || !strncmp(argv[i], "-ziTXt", 6) ||
-#endif
-                 !strncmp(argv[i], "-ztxt", 5)
-                 || !strncmp(argv[i], "-zTXt", 5))
-        {
-            i += 2;
-            BUMP_I;
-            i -= 3;
-            if (strlen(argv[i + 2]) < 80 &&
-                strlen(argv[i + 3]) < STR_BUF_SIZE &&
-                text_inputs < 10)
+      i = (int) row_info->rowbytes-1;
+
+      if ((row_info->color_type == 2 || row_info->color_type == 6) &&
+          make_gray == 1) /* RGB */
+      {
+        if (row_info->bit_depth == 8)
+          {
+            int incr=3;
+            if (row_info->color_type == 6)
             {
-#ifdef PNG_iTXt_SUPPORTED
-                if (!strncmp(argv[i], "-zi", 3))
-                {
-                    text_compression[text_inputs] =
-                        PNG_ITXT_COMPRESSION_zTXt;
-                    /* names += 2; */
-                }
-                else
-#endif
-                if (!strncmp(argv[i], "-z", 2))
-                    text_compression[text_inputs] =
-                        PNG_TEXT_COMPRESSION_zTXt;
-                else if (!strncmp(argv[i], "-t", 2))
-                    text_compression[text_inputs] =
-                        PNG_TEXT_COMPRESSION_NONE;
-#ifdef PNG_iTXt_SUPPORTED
-                else
-                {
-                    text_compression[text_inputs] =
-                        PNG_ITXT_COMPRESSION_NONE;
-                    /* names += 2; */
-                }
-#endif
-                names += 3;
-                if (!strncmp(argv[++i], "b", 1))
-                    text_where[text_inputs] = 1;
-                if (!strncmp(argv[i], "a", 1))
-                    text_where[text_inputs] = 2;
-                strncpy(&text_keyword[text_inputs * 80], argv[++i],
-                    80);
-                text_keyword[text_inputs * 80 + 79] = '\0';
-#ifdef PNG_iTXt_SUPPORTED
-                if (text_compression[text_inputs] <= 0)
-                {
-                    text_lang[text_inputs * 80] = '\0';
-                    text_lang_key[text_inputs * 80] = '\0';
-                }
-                else
-                {
-                    i += 2;
-                    BUMP_I;
-                    i -= 3;
-                    names += 2;
-                    strncpy(&text_lang[text_inputs * 80], argv[++i], 80);
-                    text_lang[text_inputs * 80 + 79] = '\0';
-                    /* libpng-1.0.5j and later */
-                    strncpy(&text_lang_key[text_inputs * 80], argv[++i], 80);
-                    text_lang_key[text_inputs * 80 + 79] = '\0';
-                }
-#endif
-                strncpy(&text_text[text_inputs * STR_BUF_SIZE], argv[++i],
-                    STR_BUF_SIZE);
-                text_text[(text_inputs + 1) * STR_BUF_SIZE - 1] = '\0';
-                text_inputs++;
-            } else {
-                if (text_inputs > 9)
-                    fprintf(STDERR,
-                            "too many text/zTXt inputs; only 10 allowed\n");
-                else
-                    fprintf(STDERR,
-                            "keyword exceeds 79 characters or text"
-                            " exceeds 2047 characters\n");
-                i += 3;
-                names += 3;
-#ifdef PNG_iTXt_SUPPORTED
-                if (!strncmp(argv[i], "-i", 3) || !strncmp(argv[i], "-itx", 4))
-                {
-                    i++;
-                    BUMP_I;
-                    names += 2;
-                }
-#endif
+               incr=4;
+               i--;
             }
-        }
+            for ( ; i > 0 ; )
+            {
+               if (data[i] != data[i-1] || data[i] != data[i-2])
+                 {
+                   make_gray = 2;
+                 }
 
-        else if (!strncmp(argv[i], "-time_stamp", 5) ||  /* legacy */
-                 !strncmp(argv[i], "-newtimestamp", 5))
-            new_time_stamp=1;
+               i-=incr;
+            }
+          }
 
-#ifdef PNG_tRNS_SUPPORTED
-        else if (!strncmp(argv[i], "-trns_a", 7) ||
-                 !strncmp(argv[i], "-tRNS_a", 7))
-        {
-            num_trans_in = (png_uint_16) pngcrush_get_long;
-            pngcrush_check_long;
-            if (num_trans_in > 256)
-               num_trans_in = 256;
-            trns_index=num_trans_in-1;
-            have_trns = 1;
-            for (ia = 0; ia < num_trans_in; ia++)
+        else /* bit depth == 16 */
+          {
+            int incr = 6;
+            if (row_info->color_type == 6)
             {
-                BUMP_I;
-                trans_in[ia] = (png_byte) pngcrush_get_long;
-                pngcrush_check_long;
+               incr = 8;
+               i-=2;
             }
-            names += 1 + num_trans_in;
-        }
+            for ( ; i > 0 ; )
+            {
+               if (data[i] != data[i-2] || data[i] != data[i-4] ||
+                   data[i-1] != data[i-3] || data[i-1] != data[i-5])
+               {
+                  make_gray = 2;
+               }
+               i-=incr;
+            }
+          }
+      }
 
-        else if (!strncmp(argv[i], "-trns", 5) ||
-                   !strncmp(argv[i], "-tRNS", 5))
-        {
-            names += 5;
-            have_trns = 1;
-            BUMP_I;
-            trns_index = (png_uint_16) pngcrush_get_long;
-            pngcrush_check_long;
-            BUMP_I;
-            trns_red = (png_uint_16) pngcrush_get_long;
-            pngcrush_check_long;
-            BUMP_I;
-            trns_green = (png_uint_16) pngcrush_get_long;
-            pngcrush_check_long;
-            BUMP_I;
-            trns_blue = (png_uint_16) pngcrush_get_long;
-            pngcrush_check_long;
-            BUMP_I;
-            trns_gray = (png_uint_16) pngcrush_get_long;
-            pngcrush_check_long;
-        }
-#endif /* tRNS */
+      else if (row_info->color_type == 4 && (blacken == 1 ||
+               make_opaque == 1)) /* GA */
+      {
+        i = (int) row_info->rowbytes-1;
 
-        else if(!strncmp(argv[i], "-try10",6))
-        {
-            try10 = 1;
-        }
+        if (row_info->bit_depth == 8)
+          {
+            for ( ; i > 0 ; )
+            {
+               if (blacken == 1 && data[i] == 0 &&
+                   (alpha_fill || data[i-1] != 0))
+               {
+                   blacken = 2;
+               }
 
-        else if (!strncmp(argv[i], "-version", 8))
-        {
-            fprintf(STDERR, " pngcrush ");
-            fprintf(STDERR, PNGCRUSH_VERSION);
-            fprintf(STDERR, ", uses libpng ");
-            fprintf(STDERR, PNG_LIBPNG_VER_STRING);
-            fprintf(STDERR, " and zlib ");
-            fprintf(STDERR, ZLIB_VERSION);
-            fprintf(STDERR, "\n Check http://pmt.sf.net/\n");
-            fprintf(STDERR, " for the most recent version.\n");
-            verbose = 0;
-            exit(0);
-        }
+               if (make_opaque == 1 && data[i] != 255)
+               {
+                   make_opaque = 2;
+               }
+               i-=2;
+            }
+          }
 
-        else if (!strncmp(argv[i], "-v", 3) || !strncmp(argv[i], "-ver", 4))
-        {
-            verbose++;
-        }
+        else /* bit depth == 16 */
+          {
+            for ( ; i > 0 ; )
+            {
+               if (blacken == 1 && (data[i] == 0 && data[i-1] == 0) &&
+                   (alpha_fill || data[i-2] != 0 || data[i-3] != 0))
+               {
+                  blacken = 2;
+               }
 
-        else if (!strncmp(argv[i], "-warn", 5))
-        {
-            show_warnings++;
-            verbose = -1;
-        }
+               if (make_opaque == 1 && (data[i] != 255 || data[i-1] != 255))
+               {
+                   make_opaque = 2;
+               }
+               i-=4;
+            }
+          }
+      }
 
-        else if (!strncmp(argv[i], "-w", 3) || !strncmp(argv[i], "-win", 4))
-        {
-            BUMP_I;
-            default_compression_window = pngcrush_get_long;
-            pngcrush_check_long;
-            force_compression_window++;
-            names++;
-        }
+      /* color_type == 6, RGBA */
+      if (row_info->color_type == 6 && (blacken == 1 || make_gray == 1 ||
+               make_opaque == 1))
+      {
+        i = (int) row_info->rowbytes-1;
 
-        else if (!strncmp(argv[i], "-zm", 4) || !strncmp(argv[i], "-zmem", 5))
-        {
-            BUMP_I;
-            compression_mem_level = pngcrush_get_long;
-            pngcrush_check_long;
-            names++;
-        }
-
-        else if (!strncmp(argv[i], "-z", 3))
-        {
-            int specified_strategy;
-            BUMP_I;
-            specified_strategy = pngcrush_get_long;
-            pngcrush_check_long;
-            if (specified_strategy > 2 || specified_strategy < 0)
-                specified_strategy = 0;
-            names++;
-            if (brute_force == 0)
-                zs[method] = specified_strategy;
-            else
+        if (row_info->bit_depth == 8)
+          {
+            for ( ; i > 0 ; )
             {
-                if (brute_force_strategy == 0)
-                    for (strat = 0; strat < 2; strat++)
-                        brute_force_strategies[strat] = 1;
-                brute_force_strategies[specified_strategy] = 0;
-                brute_force_strategy++;
+               if (blacken == 1 && data[i] == 0 && (alpha_fill ||
+                   data[i-1] != 0 || data[i-2] != 0 || data[i-3] != 0))
+                 {
+                   blacken = 2;
+                 }
+
+               if (make_gray == 1 &&
+                  (data[i-1] != data[i-2] || data[i-1] != data[i-3]))
+                 {
+                   make_gray = 2;
+                 }
+
+               if (make_opaque == 1 && data[i] != 255)
+                 {
+                   make_opaque = 2;
+                 }
+
+               i-=4;
             }
-        }
+          }
 
-        else if (!strncmp(argv[i], "-", 1))
-        {
-            if (verbose > 0 && printed_version_info == 0)
+        else /* bit depth == 16 */
+          {
+            for ( ; i > 0 ; )
             {
-              print_version_info();
-              printed_version_info++;
+               if (blacken == 1 && (data[i] == 0 && data[i-1]== 0) &&
+                   (alpha_fill || data[i-2] != 0 || data[i-3] != 0 ||
+                   data[i-4] != 0 || data[i-5] != 0 || data[i-6] != 0 ||
+                   data[i-7] != 0))
+                 {
+                   blacken = 2;
+                 }
+
+               if (make_gray == 1 &&
+                   (data[i-2] != data[i-4] || data[i-2] != data[i-6] ||
+                   data[i-3] != data[i-5] || data[i-3] != data[i-7]))
+                 {
+                   make_gray = 2;
+                 }
+
+               if (make_opaque == 1 && (data[i] != 255 || data[i-1] != 255))
+                 {
+                   make_opaque = 2;
+                 }
+
+               i-=8;
             }
-            fprintf(STDERR, "\n  Ignoring invalid option: %s\n",
-                    argv[i]);
-        } /* GRR:  end of giant if-else block */
-    } /* end of loop over args ============================================ */
+          }
+      }
+   }
 
-    if (verbose > 0 && printed_version_info == 0)
-        print_version_info();
+   /* This is not checked above when -reduce was turned off for gray and
+    * opaque, by an option or by the chunks of an earlier file.
+    */
+   if (make_8_bit == 1 && row_info->bit_depth < 16)
+      make_8_bit = 3;
 
-    if (default_compression_window == 32)
-        default_compression_window = 15;
-    else if (default_compression_window == 16)
-        default_compression_window = 14;
-    else if (default_compression_window == 8)
-        default_compression_window = 13;
-    else if (default_compression_window == 4)
-        default_compression_window = 12;
-    else if (default_compression_window == 2)
-        default_compression_window = 11;
-    else if (default_compression_window == 1)
-        default_compression_window = 10;
-    else if (default_compression_window == 512)
-        default_compression_window = 9;
-    /* Use of compression window size 256 is not recommended. */
-    else if (default_compression_window == 256)
-        default_compression_window = 8;
-    else if (default_compression_window == 0)
-        /* do nothing */;
-    else if (default_compression_window != 15) {
-        fprintf(STDERR, "Invalid window size (%d); using window size=4\n",
-                default_compression_window);
-        default_compression_window = 12;
-    }
+   if (make_8_bit == 1)
+   {
+      int i;
+      i = (int) row_info->rowbytes-1;
 
-    if (pngcrush_mode == DEFAULT_MODE)
-    {
-        if (argc - names == 2)
-        {
-            inname = argv[names];
-            outname = argv[names + 1];
-        }
+      if (row_info->color_type == 0)
+      {
+         for ( ; i > 0 ; )
+         {
+               if (data[i] != data[i-1])
+                  make_8_bit = 2;
+               i-=2;
+         }
+      }
 
-        else if (overwrite)
-        {
-            inname = argv[names];
-        }
+      if (row_info->color_type == 2)
+      {
+         for ( ; i > 0 ; )
+         {
+               if (data[i] != data[i-1] || data[i-2] != data[i-3] ||
+                   data[i-4] != data [i-5])
+                  make_8_bit = 2;
+               i-=6;
+         }
+      }
 
-        else
-        {
-            if ((argc - names == 1 || nosave))
-            {
-                inname = argv[names];
-            }
-            if (verbose > 0 && !nosave)
-            {
-                print_usage(1);   /* this exits */
-            }
-        }
-    }
+      if (row_info->color_type == 4)
+      {
+         for ( ; i > 0 ; )
+         {
+               if (data[i] != data[i-1] || data[i-2] != data[i-3])
+                  make_8_bit = 2;
+               i-=4;
+         }
+      }
 
-    first_name = names;
+      if (row_info->color_type == 6)
+      {
+         for ( ; i > 0 ; )
+         {
+               if (data[i] != data[i-1] || data[i-2] != data[i-3] ||
+                   data[i-4] != data [i-5] || data[i-6] != data[i-7])
+                  make_8_bit = 2;
+               i-=8;
+         }
+      }
+   }
 
-    if (benchmark_iterations)
-        bench=1;
-    else
-        bench=0;
-    
-    for (; bench <= benchmark_iterations; bench++)
-    {
-        if (benchmark_iterations > 0)
-        {
-            P1("  Pngcrush benchmark iteration %d\n",bench);
-            names = first_name;
-        }
+   /* Find the smallest gray bit depth that holds every sample exactly:
+    * 8-bit samples that are all multiples of 17 fit in 4 bits, of 85 in
+    * 2 bits, and 0 or 255 in 1 bit.  For RGB the red sample stands in for
+    * gray; this only matters if make_gray succeeds, when R == G == B.
+    * Of 16-bit samples the high byte is used, which only matters if
+    * make_8_bit succeeds, when it equals the low byte.
+    */
+   if (gray_bit_depth > 0 && gray_bit_depth < 8)
+   {
+      if (row_info->bit_depth < 8 || row_info->color_type == 3)
+         gray_bit_depth = 8;
+      else
+      {
+         png_size_t i;
+         int incr = row_info->channels * (row_info->bit_depth >> 3);
 
-#if PNGCRUSH_TIMERS > 0
-        for (pc_timer = 0; pc_timer < PNGCRUSH_TIMERS; pc_timer++)
-        {
-            pngcrush_timer_reset(pc_timer);
-            filter_count[pc_timer]=0;
-        }
-        pngcrush_timer_start(PNGCRUSH_TIMER_TOTAL);
-        pngcrush_timer_start(PNGCRUSH_TIMER_MISC);
-#endif
+         for (i = 0; i < row_info->rowbytes; i += incr)
+         {
+            while (gray_bit_depth < 8 &&
+                data[i] % (255 / ((1 << gray_bit_depth) - 1)) != 0)
+               gray_bit_depth <<= 1;
+            if (gray_bit_depth == 8)
+               break;
+         }
+      }
+   }
 
-    for (ia = 0; ia < 256; ia++)
-        trns_array[ia]=255;
+   if (reduce_palette == 1 && row_info->color_type == 3)
+   {
+      int i;
+      i = (int) row_info->rowbytes-1;
+      
+      for ( ; i > 0 ; i--)
+      {
+         if (data[i] >= plte_len)
+            plte_len = data[i] + 1;
+      }
+   }
+}
 
-    for (;;)  /* loop on input files */
-    {
-        methods_enabled = 0;
-        last_trial = 0;
+#ifdef PNG_USER_TRANSFORM_INFO_SUPPORTED
+/* "-alpha_fill": set the color under each fully transparent pixel to the
+ * value that the filter of the current trial predicts for it, so that the
+ * filtered residual there is zero.  Adaptive filtering (5 and 6) uses the
+ * Paeth and Sub predictors, and filter 0 gets zero, as with "-blacken".
+ * Only the color samples of pixels with alpha == 0 are changed.
+ */
+static void pngcrush_alpha_fill(png_structp png_ptr, png_row_infop row_info,
+     png_bytep data)
+{
+   int bpp = row_info->pixel_depth >> 3;
+   int alpha_bytes = row_info->bit_depth >> 3;
+   int filter = filter_type == 5 ? 4 : filter_type == 6 ? 1 : filter_type;
+   png_size_t rowbytes = row_info->rowbytes;
+   png_size_t x;
+   png_bytep prev = NULL;
+
+   if (png_get_current_row_number(png_ptr) > 0 &&
+       alpha_fill_rowbytes == rowbytes)
+      prev = alpha_fill_row;
+
+   for (x = 0; x < rowbytes; x += bpp)
+   {
+      int k;
 
-        if (png_row_filters != NULL)
-        {
-            free(png_row_filters);
-            png_row_filters = NULL;
-        }
+      if (data[x + bpp - 1] != 0 ||
+          (alpha_bytes == 2 && data[x + bpp - 2] != 0))
+         continue;
 
-        image_specified_gamma = 0;
-        intent=specified_intent;
-        
-        inname = argv[names++];
+      for (k = 0; k < bpp - alpha_bytes; k++)
+      {
+         png_size_t j = x + k;
+         int a = x > 0 ? data[j - bpp] : 0;
+         int b = prev != NULL ? prev[j] : 0;
+         int c = prev != NULL && x > 0 ? prev[j - bpp] : 0;
 
-        if (inname == NULL)
-        {
-#if PNGCRUSH_TIMERS > 0
-            pngcrush_timer_stop(PNGCRUSH_TIMER_MISC);
-            pngcrush_timer_stop(PNGCRUSH_TIMER_TOTAL);
-#endif
-            if (verbose >= 0)
-            {
-                show_result();
-            }
-            break;
-        }
+         switch (filter)
+         {
+            case 1: data[j] = (png_byte) a; break;
+            case 2: data[j] = (png_byte) b; break;
+            case 3: data[j] = (png_byte) ((a + b) >> 1); break;
+            case 4: data[j] = (png_byte) pngcrush_paeth(a, b, c); break;
+            default: data[j] = 0; break;
+         }
+      }
+   }
 
-        if (pngcrush_mode == DIRECTORY_MODE || pngcrush_mode == DIREX_MODE) {
-            int inlen, outlen;
-#ifndef __riscos
-            struct stat stat_buf;
-            if (stat(directory_name, &stat_buf))
-#else
-            if (fileexists(directory_name) & 2)
+   if (alpha_fill_rowbytes != rowbytes)
+   {
+      free(alpha_fill_row);
+      alpha_fill_row = (png_bytep) malloc(rowbytes);
+      alpha_fill_rowbytes = alpha_fill_row != NULL ? rowbytes : 0;
+   }
+   if (alpha_fill_row != NULL)
+      png_memcpy(alpha_fill_row, data, rowbytes);
+}
 #endif
-            {
-#if defined(_MBCS) || defined(WIN32) || defined(__WIN32__)
-                if (_mkdir(directory_name))
-#else
-                if (mkdir(directory_name, 0755))
+
+void pngcrush_transform_pixels_fn(png_structp png_ptr, png_row_infop row_info,
+     png_bytep data)
+{
+
+   int i;
+
+#ifdef PNG_USER_TRANSFORM_INFO_SUPPORTED
+   if (blacken == 2 && alpha_fill && interlace_method == 0 &&
+       output_interlace_method == 0)
+   {
+      pngcrush_alpha_fill(png_ptr, row_info, data);
+      return;
+   }
 #endif
-                {
-                    fprintf(STDERR,
-                      "pngcrush: could not create directory %s\n",
-                      directory_name);
-                    exit(1);
-                }
-                nofilecheck = 1;
-            }
-            outlen = strlen(directory_name);
-            if (outlen >= STR_BUF_SIZE-1)
-            {
-                fprintf(STDERR,
-                  "pngcrush: directory %s is too long for buffer\n",
-                  directory_name);
-                exit(1);
-            }
 
-            strcpy(out_string, directory_name);
-            /* Append a slash if it hasn't already got one at the end. */
-            if (out_string[outlen-1] != SLASH[0] &&
-                out_string[outlen-1] != FWD_SLASH[0] &&
-                out_string[outlen-1] != BACK_SLASH[0])
-              out_string[outlen++] = SLASH[0];   /* (assume SLASH is 1 byte) */
-            out_string[outlen] = '\0';
+   if (blacken == 2)
+   {
+   /* change the underlying color of any fully transparent pixels to black */
+      i=(int) row_info->rowbytes-1;
 
-            inlen = strlen(inname);
-            if (inlen >= STR_BUF_SIZE)
-            {
-                fprintf(STDERR,
-                   "pngcrush: filename %s is too long for buffer\n", inname);
-                exit(1);
-            }
-            strcpy(in_string, inname);
-            in_string[inlen] = '\0';
-#ifdef __riscos
-            op = strrchr(in_string, '.');
-            if (!op)
-                op = in_string;
-            else
-                op++;
-#else
-            op = in_string;
-            ip = in_string + inlen - 1;   /* start at last char in string */
-            while (ip > in_string)
+      if (row_info->color_type == 4) /* GA */
+      {
+        if (row_info->bit_depth == 8)
+          {
+            for ( ; i > 0 ; )
             {
-                if (*ip == '\\' || *ip == '/')
-                {
-                    op = ip + 1;
-                    break;
-                }
-                --ip;
+               if (data[i] == 0 &&  data[i-1] != 0)
+                  {
+                     data[i-1]=0;
+                  }
+               i-=2;
             }
-#endif
+          }
 
-            if (outlen + (inlen - (op - in_string)) >= STR_BUF_SIZE)
+        else /* bit depth == 16 */
+          {
+            for ( ; i > 0 ; )
             {
-                fprintf(STDERR,
-                   "pngcrush: full path is too long for buffer\n");
-                exit(1);
+               if (data[i] == 0 && data[i-1] == 0)
+                  {
+                    data[i-2]=0;
+                    data[i-3]=0;
+                  }
+               i-=4;
             }
-            strcpy(out_string+outlen, op);
-            /*outlen += inlen - (op - in_string); */
-            outname = out_string;
-        }
+          }
+      }
 
-        if (overwrite && (pngcrush_mode == EXTENSION_MODE ||
-            pngcrush_mode == DIRECTORY_MODE ||
-            pngcrush_mode == DIREX_MODE))
-        {
-            if (overwrite > 0)
+      else /* color_type == 6, RGBA */
+      {
+        if (row_info->bit_depth == 8)
+          {
+            for ( ; i > 0 ; )
             {
-               P1( "Ignoring \"-ow\"; cannot use it with \"-d\" or \"-e\"");
-               overwrite=0;
+               if (data[i] == 0)
+                 {
+                   data[i-1]=0;
+                   data[i-2]=0;
+                   data[i-3]=0;
+                 }
+               i-=4;
             }
-        }
+          }
 
-        /*
-         * FIXME:  need same input-validation fixes (as above) here, too
-         *
-         * FIXME:  what was the point of setting in_string and out_string in
-         *         DIREX_MODE above if going to do all over again here?
-         */
-        if (pngcrush_mode == EXTENSION_MODE || pngcrush_mode == DIREX_MODE)
-        {
-            ip = in_string;
-            in_string[0] = '\0';
-            if (pngcrush_mode == EXTENSION_MODE)
-                strncat(in_string, inname, STR_BUF_SIZE-1);
-            else
-                strncat(in_string, outname, STR_BUF_SIZE-1);
-            ip = in_string;
-            op = dot = out_string;
-            while (*ip != '\0')
+        else /* bit depth == 16 */
+          {
+            for ( ; i > 0 ; )
             {
-                *op++ = *ip++;
-#ifdef __riscos
-                if (*ip == '/')
-                    dot = op;
-#else
-                if (*ip == '.')
-                    dot = op;
-#endif
+               if (data[i] == 0 && data[i-1] == 0)
+                 {
+                   data[i-2]=0;
+                   data[i-3]=0;
+                   data[i-4]=0;
+                   data[i-5]=0;
+                   data[i-6]=0;
+                   data[i-7]=0;
+                 }
+               i-=8;
             }
-            *op = '\0';
+          }
+      }
+   }
+}
 
-            if (dot != out_string)
-                *dot = '\0';
 
-            in_extension[0] = '\0';
-            if (dot != out_string)
-            {
-                strncat(in_extension, ++dot, STR_BUF_SIZE - 1);
-            }
+int main(int argc, char *argv[])
+{
+    unsigned int bench = 0;
+    png_uint_32 y;
+    int bit_depth = 0;
+    int color_type = 0;
+    int num_pass, pass;
+    int num_write_pass = 1;
+    int num_methods;
+    int tune_runs;
 
-            strncat(out_string, extension, STR_BUF_SIZE - 1);
-            outname = out_string;
-        }
+    int try10 = 0;
 
-        if ((outname[strlen(outname) - 4] == 'p') &&
-            (outname[strlen(outname) - 3] == 'p') &&
-            (outname[strlen(outname) - 2] == 'n') &&
-            (outname[strlen(outname) - 1] == 'g'))
-        {
-           /* Writing a *.ppng (png with premultiplied alpha) */
-            premultiply=2;
-#ifndef PNG_READ_PREMULTIPLY_ALPHA_SUPPORTED
-            png_error(read_ptr, "Premultiplied alpha is not supported");
+#if PNGCRUSH_TIMERS > 0
+    pngcrush_nsec_t trial_encode_nsec = 0;
+    pngcrush_nsec_t trial_decode_nsec = 0;
 #endif
-        }
-
-        if ((outname[strlen(outname) - 4] == 'a') &&
-            (outname[strlen(outname) - 3] == 'p') &&
-            (outname[strlen(outname) - 2] == 'n') &&
-            (outname[strlen(outname) - 1] == 'g'))
-        {
-           /* Writing an APNG */
-           save_apng_chunks=1;
-        }
+    unsigned long trial_mem_allocs = 0;
+    unsigned long trial_mem_bytes = 0;
 
-        if (nosave < 2)
-        {
-            P1( "Opening file %s for length measurement\n",
-                       inname);
+    char *endptr = NULL;
 
-            if ((fpin = FOPEN(inname, "rb")) == NULL)
-            {
-                fprintf(STDERR, "Could not find file: %s\n", inname);
-                continue;
-            }
-            number_of_open_files++;
+    /* try_method[n]: 0 means try this method;
+     *
+     *              : 1 means do not try this method.
+     */
+    int try_method[MAX_METHODSP1];
+    int methods_enabled = 0;
+    int last_method = MAX_METHODS;
 
-#ifdef PNGCRUSH_LOCO
-            if (new_mng)
-            {
+    int fm[MAX_METHODSP1];
+    int lv[MAX_METHODSP1];
+    int zs[MAX_METHODSP1];
+    int lev, strat, filt;
 
-#  ifdef PNG_USER_MEM_SUPPORTED
-               if (verbose > 0)
-                  mng_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING,
-                    (png_voidp) NULL, (png_error_ptr) pngcrush_cexcept_error,
-                    (png_error_ptr) pngcrush_warning, (png_voidp) NULL, 
-                    (png_malloc_ptr) pngcrush_debug_malloc,
-                    (png_free_ptr) pngcrush_debug_free);
-               else
+#ifdef PNG_gAMA_SUPPORTED
+#  ifdef PNG_FIXED_POINT_SUPPORTED
+    png_fixed_point file_gamma = 0;
+#  else
+    double file_gamma = 0.;
 #  endif
-                  mng_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-                    (png_voidp) NULL,
-                    (png_error_ptr) pngcrush_cexcept_error,
-                    (png_error_ptr) pngcrush_warning);
-               if (mng_ptr == NULL)
-                  fprintf(STDERR, "pngcrush could not create mng_ptr");
+#endif
+    char *cp;
+    int i;
 
-               if ((mng_out = FOPEN(mngname, "wb")) == NULL)
-               {
-                  fprintf(STDERR,
-                      "pngcrush: could not open output file %s\n",
-                      mngname);
-                  FCLOSE(fpin);
-                  exit(1);
-               }
-               number_of_open_files++;
-               png_init_io(mng_ptr, mng_out);
-               png_set_write_fn(mng_ptr, (png_voidp) mng_out,
-                                (png_rw_ptr) pngcrush_write_png,
-                                pngcrush_flush);
-            }
-#endif /* PNGCRUSH_LOCO */
+#ifdef PNGCRUSH_SERVER
+    /* Look for -server before anything else has been set up, so that each
+     * request is run by a process with the same fresh state as a new
+     * pngcrush.
+     */
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-server") || !strcmp(argv[i], "--server"))
+            return pngcrush_server(argc, argv, i);
+    }
+#endif
 
-            idat_length[0] = measure_idats(fpin);
+#if PNGCRUSH_TIMERS >= 0
+    for (pc_timer=0;pc_timer< PNGCRUSH_TIMERS; pc_timer++)
+    {
+        pngcrush_timer_reset(pc_timer);
+        pngcrush_timer_min_secs[pc_timer]=0xffffffff;
+        pngcrush_timer_min_nsec[pc_timer]=0xffffffff;
+    }
+    pngcrush_timer_start(PNGCRUSH_TIMER_TOTAL);
+    pngcrush_timer_start(PNGCRUSH_TIMER_MISC);
+#endif
 
-#ifdef PNGCRUSH_LOCO
-            if (new_mng)
-            {
-                    png_destroy_write_struct(&mng_ptr, NULL);
-                    FCLOSE(mng_out);
-            }
+    if (strcmp(png_libpng_ver, PNG_LIBPNG_VER_STRING))
+    {
+        fprintf(STDERR,
+                "Warning: versions are different between png.h and png.c\n");
+        fprintf(STDERR, "  png.h version: %s\n", PNG_LIBPNG_VER_STRING);
+        fprintf(STDERR, "  png.c version: %s\n\n", png_libpng_ver);
+    }
+
+    row_buf = (png_bytep) NULL;
+    P2(" row_buf = %p\n",row_buf);
+    number_of_open_files = 0;
+    do_color_count = 0;
+    PNGCRUSH_UNUSED(do_color_count) /* silence compiler warning */
+
+    strncpy(prog_string, argv[0], STR_BUF_SIZE);
+    prog_string[STR_BUF_SIZE-1] = '\0';
+    progname = prog_string;
+    for (i = 0, cp = prog_string; *cp != '\0'; i++, cp++)
+    {
+#ifdef __riscos
+        if (*cp == '.' || *cp == ':')
+            progname = ++cp;
+#else
+        if (*cp == '\\' || *cp == '/')
+            progname = ++cp;
 #endif
+    }
 
-            FCLOSE(fpin);
+    /*
+     * Definition of methods ("canonical list" is methods 11 and up)
+     */
+    for (i = 0; i <= MAX_METHODS; i++)
+    {
+        try_method[i] = 1;  /* 1 means do not try this method */
+        fm[i] = 6; lv[i] = 9; zs[i] = 1;  /* default:  method 136 */
+    }
 
 
-            if (verbose >= 0 && bench < 2)
+    fm[0] = 0;   lv[0] = 0;   zs[0] = 0;   /* method  0 == uncompressed */
+    fm[1] = 0;   lv[1] = 4;   zs[1] = 0;   /* method  1 == method  53 */
+    fm[2] = 1;   lv[2] = 4;   zs[2] = 0;   /* method  2 == method  54 */
+ /* fm[3] = 6;*/ lv[3] = 4;/* zs[3] = 1;*/ /* method  3 == method 161 */
+    fm[4] = 0;/* lv[4] = 9;   zs[4] = 1;*/ /* method  4 == method 119 */
+    fm[5] = 1;/* lv[5] = 9;   zs[5] = 0;*/ /* method  5 == method 114 */
+ /* fm[6] = 6;   lv[6] = 9;*/ zs[6] = 0;   /* method  6 == method 157 */
+    fm[7] = 0;/* lv[7] = 9;*/ zs[7] = 0;   /* method  7 == method 113 */
+    fm[8] = 1;/* lv[8] = 9;   zs[8] = 1;*/ /* method  8 == method 120 */
+ /* fm[9] = 6;*/ lv[9] = 2;   zs[9] = 2;   /* method  9 == method xxx */
+ /* fm[10]= 6;   lv[10]= 9;   zs[10]= 1;*/ /* method 10 == method 166 */
+
+    /* methods 11 through 16
+     *
+     * [strategy 2 (Z_HUFFMAN_ONLY) is independent of zlib compression level]
+     */
+    method = 11;
+    for (filt = 0; filt <= 5; filt++)
+    {
+        fm[method] = filt;
+        lv[method] = 2;
+        zs[method] = 2;
+        method++;
+    }
+
+    /*
+     * methods 17 through 136 (10*2*6 = 120)
+     */
+    for (lev = 1; lev <= 9; lev++)
+    {
+        for (strat = 0; strat <= 1; strat++)
+        {
+            for (filt = 0; filt <= 5; filt++)
             {
-                if (nosave)
-                {
-                  fprintf(STDERR, "  %s:\n", inname);
-                }
-                else if (overwrite)
-                {
-                  fprintf(STDERR,
-                    "  Recompressing IDAT chunks in %s\n", inname);
-                }
-                else
-                {
-                  fprintf(STDERR,
-                    "  Recompressing IDAT chunks in %s to %s\n",
-                    inname, outname);
-                }
-                fprintf(STDERR,
-                  "   Total length of data found in critical chunks        "
-                  "    =%10lu\n", (unsigned long)idat_length[0]);
-                fflush(STDERR);
+                fm[method] = filt;
+                lv[method] = lev;
+                zs[method] = strat;
+                method++;
             }
+        }
+    }
 
-            if (idat_length[0] == 0)
-                continue;
+#ifdef Z_RLE
+    /* methods 125 through 136
+     *
+     * [strategy 3 (Z_RLE) is mostly independent of level; 1-3 and 4-9 are
+     * same]
+     */
+    for (filt = 0; filt <= 5; filt++)
+    {
+        fm[method] = filt;
+        lv[method] = 1;
+        zs[method] = 3;
+        method++;
+    }
+    for (filt = 0; filt <= 5; filt++)
+    {
+        fm[method] = filt;
+        lv[method] = 4;
+        zs[method] = 3;
+        method++;
+    }
+#endif /* Z_RLE */
 
-        }
+    /* methods 137 through 148 (12*1*1 = 12), level 0 */
 
-        else
-            idat_length[0] = 1;
+    for (strat = 0; strat <= 1; strat++)
+    {
+        for (filt = 0; filt <= 5; filt++)
+        {
+            fm[method] = filt;
+            lv[method] = 0;
+            zs[method] = strat;
+            method++;
+        }
+    }
 
-        if (image_is_immutable)
+    /*
+     * methods 149 through 176 (9*3*1 + 1 = 28), speedy
+     */
+    for (strat = 0; strat <= 3; strat++)
+    {
+        for (lev = 1; lev <= 9; lev++)
         {
-            fprintf(STDERR,
-              "   Image %s has a dSIG chunk and is immutable.\n", inname);
+           lv[method] = lev;
+           zs[method] = strat;
+           fm[method] = 6;
+           method++;
+           if (strat == 2)
+              break; /* HUFFMAN ONLY is independent of level */
         }
+    }
 
-        if (!image_is_immutable)
+
+    num_methods = method;   /* GRR */
+
+    /* method 177 */
+    fm[method] = 0; lv[method] = 0; zs[method] = 0;  /* copy_idat */
+    method++;
+
+#define pngcrush_get_long strtol(argv[i],&endptr,10)
+
+#define pngcrush_check_long \
+    {if (errno || endptr == argv[i] || *endptr != '\0') \
+      { fprintf(STDERR, "pngcrush: malformed or missing argument\n"); \
+        exit(1); \
+      } \
+    }
+
+#define BUMP_I \
+        { i++; \
+        if(i >= argc) {fprintf(STDERR,"pngcrush: insufficient parameters\n");\
+        exit(1);} }
+
+    names = 1;
+
+    /* ===================================================================== */
+    /* FIXME:  move args-processing block into separate function (470 lines) */
+    for (i = 1; i < argc; i++)
+    {
+        errno=0;
+
+        if (!strncmp(argv[i], "--", 2))
+            argv[i]++;
+
+        if (!strncmp(argv[i], "-", 1) && !PNGCRUSH_IS_STDIO(argv[i]))
+            names++;
+
+        /* GRR:  start of giant else-if block */
+
+        if (PNGCRUSH_IS_STDIO(argv[i]))
+            /* filename meaning stdin or stdout */ ;
+
+        else if (!strncmp(argv[i], "-apng_search", 12) ||
+                 !strncmp(argv[i], "-apng-search", 12))
+            apng_search = 1;
+
+        else if (!strncmp(argv[i], "-bail", 5))
+            bail=0;
+
+        else if (!strncmp(argv[i], "-batch_budget", 13) ||
+                 !strncmp(argv[i], "-batch-budget", 13))
         {
+            names++;
+            BUMP_I;
+            batch_time_budget = (unsigned long) pngcrush_get_long;
+            pngcrush_check_long;
+        }
 
-        if (force_output_color_type != 8 &&
-            force_output_color_type != 0 &&
-            force_output_color_type != 2 &&
-            force_output_color_type != 3 &&
-            force_output_color_type != 4 &&
-            force_output_color_type != 6)
+        else if (!strncmp(argv[i], "-bench", 6))
         {
-            fprintf(STDERR, "\n  Ignoring invalid color_type: %d\n",
-              force_output_color_type);
-            force_output_color_type=8;
+            names++;
+            BUMP_I;
+            benchmark_iterations = (unsigned int) pngcrush_get_long;
+            pngcrush_check_long;
         }
-        output_color_type = force_output_color_type;
 
-        output_bit_depth = force_output_bit_depth;
+        else if (!strncmp(argv[i], "-bkgd", 5) ||
+                 !strncmp(argv[i], "-bKGD", 5))
+        {
+            names += 3;
+            have_bkgd = 1;
+            BUMP_I;
+            bkgd_red = (png_uint_16) pngcrush_get_long;
+            pngcrush_check_long;
+            BUMP_I;
+            bkgd_green = (png_uint_16) pngcrush_get_long;
+            pngcrush_check_long;
+            BUMP_I;
+            bkgd_blue = (png_uint_16) pngcrush_get_long;
+            pngcrush_check_long;
+            bkgd_index = 0;
+        }
 
-        best_of_three = 1;
-        pngcrush_best_byte_count=0xffffffff;
+        else if (!strncmp(argv[i], "-blacken", 8))
+            blacken=1;
 
-        if (blacken == 1 || make_gray == 1 || make_opaque == 1 ||
-            reduce_palette == 1)
+        else if (!strncmp(argv[i], "-alpha_fill", 11) ||
+                 !strncmp(argv[i], "-alpha-fill", 11))
         {
-           try_method[0] = 0;
+            blacken=1;
+            alpha_fill=1;
         }
 
-        /*
-         * From the PNG spec, various dependencies among chunk types
-         *   must be accounted for during any reduction of color type
-         *   or bit depth:
-         *
-         * IHDR valid bit depth depends on color type
-         *   valid filter type depends on color type (for MNG extensions)
-         * tRNS depends on color type
-         *   depends on num_palette for color type 3 (palette)
-         * iCCP valid profile depends on color type
-         * sBIT depends on color type and bit depth
-         * bKGD depends on color type and bit depth
-         * hIST depends on num_palette
-         *
-         * Chunk types present have been detected in the first pass over
-         *   the file, in the measure_idat() function.
-         */
+        else if (!strncmp(argv[i], "-block_split", 12) ||
+                 !strncmp(argv[i], "-block-split", 12))
+            block_split=1;
 
-        if (make_gray)
+        else if (!strncmp(argv[i], "-brute", 6))
+            /* brute force:  try everything */
         {
-           if ((found_iCCP && keep_unknown_chunk("iCCP", argv)) ||
-               (found_color_bKGD && keep_unknown_chunk("bKGD", argv)) ||
-               found_acTL_chunk == 1 ||
-               (found_sBIT_different_RGB_bits &&
-               keep_unknown_chunk("sBIT", argv)))
-           {
-              P1 ("Cannot change colortype to gray when iCCP,"
-                  " acTL, bKGD with color, or sBIT chunk is present\n");
-              make_gray = 0;
-           }
-           else
-           {
-              make_gray = 1;
-              try_method[0] = 0;
-           }
+            methods_specified = 1;
+            brute_force++;
+            for (method = 1; method < num_methods; method++)
+                try_method[method] = 0;
+            if (brute_force_filter == 0)
+                for (filt = 0; filt < 6; filt++)
+                    brute_force_filters[filt] = 0;
+            if (brute_force_level == 0)
+                for (lev = 0; lev < 10; lev++)
+                    brute_force_levels[lev] = 0;
+            if (brute_force_strategy == 0)
+                for (strat = 0; strat < NUM_STRATEGIES; strat++)
+                    brute_force_strategies[strat] = 0;
         }
 
-        if (make_opaque)
+        else if (!strncmp(argv[i], "-check", 6))
         {
-           if (found_tRNS || found_acTL_chunk == 1)
-           {
-             P1("Cannot remove the alpha channel when tRNS"
-                  " or acTL chunk is present\n");
-             make_opaque = 0;
-           }
-           else
-           {
-             make_opaque = 1;
-             try_method[0] = 0;
-           }
+            check_crc = 1;
         }
 
-        if (make_8_bit)
+        else if (!strncmp(argv[i], "-c", 3) || !strncmp(argv[i], "-col", 4))
         {
-           if ((found_bKGD && keep_unknown_chunk("bKGD", argv)) ||
-              found_acTL_chunk == 1 ||
-              (found_sBIT_max > 8 && keep_unknown_chunk("sBIT", argv)))
-           {
-              P1 ("Cannot reduce bit depth to 8 when bKGD,"
-                  " sBIT or acTL chunk is present\n");
-              make_8_bit = 0;
-           }
-           else
-           {
-             make_8_bit = 1;
-             try_method[0] = 0;
-           }
+            names++;
+            BUMP_I;
+            force_output_color_type = pngcrush_get_long;
+            pngcrush_check_long;
         }
 
-        if (input_color_type == 3 && reduce_palette)
+        else if (!strncmp(argv[i], "-d", 3) || !strncmp(argv[i], "-dir", 4))
         {
-           if ((found_hIST && keep_unknown_chunk("hIST", argv)) ||
-              found_acTL_chunk == 1)
-           {
-             P1("Cannot reduce palette length when hIST"
-                 " or acTL chunk is present\n");
-             reduce_palette = 0;
-             plte_len = -1;
-           }
-           else
-           {
-             try_method[0] = 0;
-             plte_len = 0;
-           }
+            BUMP_I;
+            if (pngcrush_mode == EXTENSION_MODE)
+                pngcrush_mode = DIREX_MODE;
+            else
+                pngcrush_mode = DIRECTORY_MODE;
+            directory_name = argv[names++];
         }
 
-        /* Handle specified brute_force options */
-        if (brute_force_level || brute_force_filter || brute_force_strategy)
+        else if (!strncmp(argv[i], "-exit", 5))
         {
-           for (method = 1; method < num_methods; method++)
-           {
-             int option;
-
-             try_method[method]=1;
-             if (brute_force_level)
-             {
-                for (option = 0; option < 10; option++)
-                   if (option == lv[method])
-                      try_method[method]=brute_force_levels[option];
-             }
-
-             if ((try_method[method] == 0) && brute_force_filter)
-             {
-                for (option = 0; option < 6; option++)
-                   if (option == fm[method])
-                      try_method[method]=brute_force_filters[option];
-             }
-
-             if ((try_method[method] == 0) && brute_force_strategy)
-             {
-                for (option = 0; option < NUM_STRATEGIES; option++)
-                   if (option == zs[method])
-                      try_method[method]=brute_force_strategies[option];
-             }
-
-             if (method && method < 11)
-                try_method[method] = 1;
-           }
-
-           if (speed)
-           {
-             /* Do not try AVG or PAETH */
-             for (method = 1; method < num_methods; method++)
-             {
-               if (try_method[method] == 0 && (fm[method] == 3 ||
-                   fm[method] == 4 || fm[method] == 5))
-                     try_method[method] = 1;
-             }
-           }
-         }
+            pngcrush_must_exit = 1;
+        }
 
-        if (methods_specified == 0 || try10 != 0)
+        else if (!strncmp(argv[i], "-e", 3) || !strncmp(argv[i], "-ext", 4))
         {
-            for (i = 0; i <= DEFAULT_METHODS; i++)
-                try_method[i] = 0;
-
-            try_method[6] = try10;
+            BUMP_I;
+            if (pngcrush_mode == DIRECTORY_MODE)
+                pngcrush_mode = DIREX_MODE;
+            else
+                pngcrush_mode = EXTENSION_MODE;
+            extension = argv[names++];
         }
 
-        for (i = 1; i <= MAX_METHODS; i++)
+        else if (!strncmp(argv[i], "-fast", 5))
         {
-           methods_enabled += (1 - try_method[i]);
+            /* try two fast filters */
+            methods_specified = 1;
+            try_method[16] = 0;
+            try_method[53] = 0;
         }
-        P1("%d methods enabled\n",methods_enabled);
-/* Skip trial 0 when a single method was specified and -reduce was not */
-        if (methods_specified != 0 && noreduce != 0)
+
+        else if (!strncmp(argv[i], "-force", 6))
         {
-          if (methods_enabled == 1)
-          {
-             try_method[0] = 1;
-             make_opaque = 0;
-             make_gray = 0;
-             make_8_bit = 0;
-             reduce_palette = 0;
-          }
+            force = 1;
         }
 
-        last_method = 0;
-        for (i = 1; i <= MAX_METHODS; i++)
+        else if (!strncmp(argv[i], "-fix", 4))
         {
-           if (try_method[i] == 0)
-              last_method = i;
+            salvage++;
         }
 
-        if (methods_enabled > 1)
-           last_method++;
-
-        P1("   pngcrush: methods     = %d\n",methods_enabled);
-        P1("   pngcrush: last_method = %d\n",last_method);
-        
-        if (methods_enabled == 1 && last_method == 176)
-           copy_idat = 1;
-
-        best_of_three = 1;
-
-#ifndef __riscos
+        else if (!strncmp(argv[i], "-f", 3) || !strncmp(argv[i], "-fil", 4))
         {
-            /* COVERITY complains about TOCTOU when inname is used later */
-            struct stat stat_buf;
-            stat(inname, &stat_buf);
-            input_length = (unsigned long) stat_buf.st_size;
+            int specified_filter;
+            BUMP_I;
+            specified_filter = pngcrush_get_long;
+            pngcrush_check_long;
+            if (specified_filter > 5 || specified_filter < 0)
+                specified_filter = 5;
+            names++;
+            if (brute_force == 0)
+                fm[method] = specified_filter;
+            else
+            {
+                if (brute_force_filter == 0)
+                  for (filt = 0; filt < 6; filt++)
+                    brute_force_filters[filt] = 1;
+                brute_force_filters[specified_filter] = 0;
+                brute_force_filter++;
+            }
         }
+
+#ifdef PNG_gAMA_SUPPORTED
+        else if (!strncmp(argv[i], "-g", 3) || !strncmp(argv[i], "-gam", 4))
+        {
+            names++;
+            BUMP_I;
+            found_gAMA=1;
+            if (specified_intent < 0)
+            {
+#ifdef PNG_FIXED_POINT_SUPPORTED
+                int c;
+                char number[16];
+                char *n = number;
+                int nzeroes = -1;
+                int length = strlen(argv[i]);
+                for (c = 0; c < length; c++)
+                {
+                    if (*(argv[i] + c) == '.')
+                    {
+                        nzeroes = 5;
+                    }
+                    else if (nzeroes)
+                    {
+                        *n++ = *(argv[i] + c);
+                        nzeroes--;
+                    }
+                }
+                for (c = 0; c < nzeroes; c++)
+                    *n++ = '0';
+                *n = '\0';
+                specified_gamma = strtol(number,&endptr,10);
 #else
-        input_length = (unsigned long) filesize(inname);
+                specified_gamma = strtof(argv[i],&endptr);
 #endif
+                pngcrush_check_long;
+            }
+        }
+#endif /* PNG_gAMA_SUPPORTED */
 
-        /* ////////////////////////////////////////////////////////////////////
-        ////////////////                                   ////////////////////
-        ////////////////  START OF MAIN LOOP OVER METHODS  ////////////////////
-        ////////////////                                   ////////////////////
-        //////////////////////////////////////////////////////////////////// */
-
-        /* MAX_METHODS is 177 */
-        P1("\n\nENTERING MAIN LOOP OVER %d METHODS\n", MAX_METHODS);
-        for (trial = 0; trial <= last_method; trial++)
+        else if (!strncmp(argv[i], "-h", 3) || !strncmp(argv[i], "-hel", 4))
         {
-            if (nosave || trial == last_method)
-               last_trial = 1;
-
-            if (verbose > 1)
-            fprintf(STDERR, "pngcrush: trial = %d\n",trial);
-
-            pngcrush_write_byte_count=0;
-#ifdef PNGCRUSH_H
-# if ZLIB_VERNUM > 0x1240
-            if (last_trial == 0)
-               pngcrush_write_byte_count=6; /* zlib header that isn't written */
-# endif
-#endif
-
-            found_IDAT = 0;
-
-            if (trial != 0)
-               idat_length[trial] = (png_uint_32) 0xffffffff;
+            ++verbose;
+            print_version_info();
+            printed_version_info++;
+            print_usage(0);   /* this exits */
+        }
 
-            /* this part of if-block is for final write-the-best-file
-               iteration */
-            if (trial == last_method)
+        else if (!strncmp(argv[i], "-huffman", 8))
+        {
+            /* try all filters with huffman */
+            methods_specified = 1;
+            for (method = 11; method <= 16; method++)
             {
-                png_uint_32 best_length;
+                try_method[method] = 0;
+            }
+        }
 
-                if (methods_enabled == 1)
-                {
-                   best = trial;
-                   best_length = idat_length[trial];
-                }
-                else
+#ifdef PNG_iCCP_SUPPORTED
+        else if (!strncmp(argv[i], "-iccp", 5))
+        {
+            FILE *iccp_fn;
+            if (iccp_length)
+                free(iccp_text);
+            BUMP_I;
+            iccp_length = pngcrush_get_long;
+            pngcrush_check_long;
+            names += 3;
+            BUMP_I;
+            strncpy(iccp_name, argv[i], 80);
+            iccp_name[79] = '\0';
+            BUMP_I;
+            iccp_file = argv[i];
+            if ((iccp_fn = FOPEN(iccp_file, "rb")) == NULL) {
+                fprintf(STDERR, "Could not find file: %s\n", iccp_file);
+                iccp_length = 0;
+            }
+            else
+            {
+                int ic;
+                number_of_open_files++;
+                iccp_text = (char*)malloc(iccp_length);
+                if (iccp_text == NULL)
                 {
-                   int j;
-
-                   /* check lengths */
-                   best = 0;  /* i.e., input file */
-                   best_length = (png_uint_32) 0xffffffff;
-                   for (j = 0; j <= last_method; j++)
-                   {
-                       if (best == 0 && best_length == idat_length[j])
-                       {
-                           /* If no change, report the first match */
-                           best = j;
-                       }
-                       if ((force == 0 || j != 0) &&
-                            best_length > idat_length[j])
-                       {
-                           best_length = idat_length[j];
-                           best = j;
-                       }
-                       if (j > 148 && j < 176 && best_length == idat_length[j])
-                       {
-                           /* break ties in favor of method 6 */
-                           best = j;
-                       }
-                   }
+                   fprintf(STDERR, "malloc of iccp_text failed\n");
+                   iccp_length = 0;
                 }
 
-                if (image_is_immutable ||
-                     (idat_length[best] == idat_length[0] &&
-                     force == 0 && nosave == 0))
+                for (ic = 0; ic < iccp_length; ic++)
                 {
-                    /* just copy input to output */
-
-                    P2("prepare to copy input to output\n");
-                    pngcrush_pause();
-
-                    if ((fpin = FOPEN(inname, "rb")) == NULL)
-                    {
-                        fprintf(STDERR, "Could not find input file %s\n",
-                                inname);
-                        continue;
-                    }
-
-                    number_of_open_files++;
-                    if ((fpout = FOPEN(outname, "wb")) == NULL)
-                    {
-                        fprintf(STDERR,
-                           "pngcrush: could not open output file %s\n",
-                           outname);
-                        FCLOSE(fpin);
-                        exit(1);
-                    }
-
-                    number_of_open_files++;
-                    P2("copying input to output...");
+                    png_size_t num_in;
+                    num_in = fread((void *)buffer, 1, 1, iccp_fn);
 
-                    for (;;)
-                    {
-                        png_size_t num_in, num_out;
+                    if (!num_in)
+                        break;
 
-                        num_in = fread((void *)buffer, 1, 1, fpin);
-                        if (!num_in)
-                            break;
-                        num_out = fwrite(buffer, 1, 1, fpout);
-                        if (num_out != num_in)
-                            P2("copy error.\n");
-                    }
-                    P2("copy complete.\n");
-                    pngcrush_pause();
-                    FCLOSE(fpin);
-                    FCLOSE(fpout);
-                    setfiletype(outname);
-                    break;
+                    iccp_text[ic] = buffer[0];
                 }
 
-                filter_type = fm[best];
-                zlib_level = lv[best];
-                if (zs[best] == 1)
-                    z_strategy = Z_FILTERED;
-                else if (zs[best] == 2)
-                    z_strategy = Z_HUFFMAN_ONLY;
-#ifdef Z_RLE
-                else if (zs[best] == 3)
-                    z_strategy = Z_RLE;
-#endif
-                else /* if (zs[best] == 0) */
-                    z_strategy = Z_DEFAULT_STRATEGY;
+                FCLOSE(iccp_fn);
             }
+        }
+#endif /* PNG_iCCP_SUPPORTED */
 
-            else /* Trial < last_method */
+        else if (!strncmp(argv[i], "-interlace_search", 17) ||
+                 !strncmp(argv[i], "-interlace-search", 17))
+        {
+            interlace_search = 1;
+        }
+
+        else if (!strncmp(argv[i], "-interlace", 10))
+        {
+            names++;
+            BUMP_I;
+            force_interlace = pngcrush_get_long;
+            pngcrush_check_long;
+            if (force_interlace != 0 && force_interlace != 1)
             {
-                if (trial > 2 && trial < 5 && idat_length[trial - 1]
-                    < idat_length[best_of_three])
-                    best_of_three = trial - 1;
+                fprintf(STDERR, "\n  Ignoring invalid interlace method: %d\n",
+                  force_interlace);
+                force_interlace = -1;
+            }
+        }
 
-                if (try_method[trial])
-                {
-                    P2("skipping \"late\" trial %d\n", trial);
-                    continue;
-                }
+        else if (!strcmp(argv[i], "-journal_merge") ||
+                 !strcmp(argv[i], "-journal-merge"))
+        {
+            /* Show the totals of the journals named after it, and exit */
+            for (i++; i < argc; i++)
+                if (!pngcrush_journal_load(argv[i]))
+                    fprintf(STDERR, "pngcrush: could not open %s\n",
+                        argv[i]);
+            pngcrush_journal_summary();
+            exit(0);
+        }
 
-                /* default behavior is to do the heuristics (6 of the first
-                 * 10 methods). try10 means try all of 1-10.
-                 */
-                if (!methods_specified && try10 == 0)
-                {
-                    if ((trial == 4 || trial == 7) && best_of_three != 1)
-                    {
-                        P2("skipping \"early\" trial %d\n", trial);
-                        continue;
-                    }
-                    if ((trial == 5 || trial == 8) && best_of_three != 2)
-                    {
-                        P2("skipping \"early\" trial %d\n", trial);
-                        continue;
-                    }
-                    if ((trial == 6 || trial == 9 || trial == 10)
-                        && best_of_three != 3)
-                    {
-                        P2("skipping \"early\" trial %d\n", trial);
-                        continue;
-                    }
-                }
-                filter_type = fm[trial];
-                zlib_level = lv[trial];
-                if (zs[trial] == 1)
-                    z_strategy = Z_FILTERED;
-                else if (zs[trial] == 2)
-                    z_strategy = Z_HUFFMAN_ONLY;
-#ifdef Z_RLE
-                else if (zs[trial] == 3)
-                    z_strategy = Z_RLE;
-#endif
-                else /* if (zs[trial] == 0) */
-                    z_strategy = Z_DEFAULT_STRATEGY;
-                final_method = trial;
-                if (!nosave)
-                {
-                    P2("\n\n------------------------------------------------\n"
-                       "Begin trial %d, filter %d, strategy %d, level %d\n",
-                       trial, filter_type, z_strategy, zlib_level);
-                }
-            }
+        else if (!strcmp(argv[i], "-journal"))
+        {
+            names++;
+            BUMP_I;
+            journal_name = argv[i];
+        }
 
-            P2("prepare to open files.\n");
-            pngcrush_pause();
+        else if (!strncmp(argv[i], "-keep", 5))
+        {
+            names++;
+            BUMP_I;
+            if (!strncmp(argv[i], "-dSIG", 5)
+                    && (!strncmp(argv[i], "-dsig", 5) ))
+              found_any_chunk=1;
+        }
 
-            if ((fpin = FOPEN(inname, "rb")) == NULL)
+        else if (!strncmp(argv[i], "-l", 3) || !strncmp(argv[i], "-lev", 4))
+        {
+            int specified_level;
+            BUMP_I;
+            specified_level = pngcrush_get_long;
+            pngcrush_check_long;
+            if (specified_level > 9 || specified_level < 0)
+                specified_level = 9;
+            names++;
+            if (brute_force == 0)
+                lv[method] = specified_level;
+            else
             {
-                fprintf(STDERR, "Could not find input file %s\n", inname);
-                continue;
+                if (brute_force_level == 0)
+                    for (lev = 0; lev < 10; lev++)
+                        brute_force_levels[lev] = 1;
+                brute_force_levels[specified_level] = 0;
+                brute_force_level++;
             }
-            number_of_open_files++;
+        }
 
-            if (last_trial && nosave == 0)
-            {
-#ifndef __riscos
-                /* Can't sensibly check this on RISC OS without opening a file
-                   for update or output
-                 */
-                struct stat stat_in, stat_out;
-                if (last_trial && !nofilecheck
-                    && (stat(inname, &stat_in) == 0)
-                    && (stat(outname, &stat_out) == 0) &&
-#if defined(_MSC_VER) || defined(__MINGW32__)   /* maybe others? */
-                    /* MSVC++6.0 will erroneously return 0 for both files, so
-                       we simply check the size instead.  It is possible that
-                       we will erroneously reject the attempt when inputsize
-                       and outputsize are equal, for different files
-                     */
-                    (stat_in.st_size == stat_out.st_size) &&
+        else if (!strncmp(argv[i], "-loco", 5))
+        {
+#ifdef PNGCRUSH_LOCO
+            do_loco = 1;
 #else
-                    (stat_in.st_ino == stat_out.st_ino) &&
-#endif
-                    (stat_in.st_dev == stat_out.st_dev))
-                {
-                    fprintf(STDERR,
-                            "\n   pngcrush: cannot overwrite input file %s\n",
-                            outname);
-                    P1("   st_ino=%d, st_size=%d\n\n",
-                       (int) stat_in.st_ino, (int) stat_in.st_size);
-                    FCLOSE(fpin);
-                    exit(1);
-                }
+            fprintf
+                (STDERR,"Cannot do -loco because libpng was compiled"
+                 " without MNG features");
 #endif
-                if ((fpout = FOPEN(outname, "wb")) == NULL)
-                {
-                    fprintf(STDERR,
-                            "pngcrush: could not open output file %s\n",
-                            outname);
-                    FCLOSE(fpin);
-                    exit(1);
-                }
-
-                number_of_open_files++;
-            }
+        }
 
-            P2("files are opened.\n");
-            pngcrush_pause();
+        else if (!strcmp(argv[i], "-manifest"))
+        {
+            names++;
+            BUMP_I;
+            manifest_name = argv[i];
+        }
 
-/* OK to ignore any warning about the address of exception__prev in "Try" */
-            Try {
-                png_uint_32 row_length;
-                P1( "Allocating read and write structures\n");
-#ifdef PNG_USER_MEM_SUPPORTED
-                if (verbose > 0)
-                   read_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING,
-                     (png_voidp) NULL,
-                     (png_error_ptr) pngcrush_cexcept_error,
-                     (png_error_ptr) pngcrush_warning,
-                     (png_voidp) NULL,
-                     (png_malloc_ptr) pngcrush_debug_malloc,
-                     (png_free_ptr) pngcrush_debug_free);
-                else
-#endif /* PNG_USER_MEM_SUPPORTED */
-                   read_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
-                     (png_voidp) NULL,
-                     (png_error_ptr) pngcrush_cexcept_error,
-                     (png_error_ptr) pngcrush_warning);
-                if (read_ptr == NULL)
-                    Throw "pngcrush could not create read_ptr";
+        else if (!strncmp(argv[i], "-max", 4))
+        {
+            names++;
+            BUMP_I;
+            max_idat_size = (png_uint_32) pngcrush_get_long;
+            pngcrush_check_long;
+            if (max_idat_size == 0 || max_idat_size > PNG_UINT_31_MAX)
+                max_idat_size = PNG_ZBUF_SIZE;
+        }
 
-#ifdef PNG_BENIGN_ERRORS_SUPPORTED
-# if PNGCRUSH_LIBPNG_VER >= 10400
-                /* Allow certain errors in the input file to be handled
-                 * as warnings.
-                 */
-                png_set_benign_errors(read_ptr, 1);
-# endif
-#endif
+        else if (!strcmp(argv[i], "-mem_budget") ||
+                 !strcmp(argv[i], "-mem-budget"))
+        {
+            /* Only used with -server, which handles it */
+            names++;
+            BUMP_I;
+        }
 
-#ifdef PNG_SET_USER_LIMITS_SUPPORTED
-                if (no_limits == 0)
-                {
-# if PNGCRUSH_LIBPNG_VER >= 10400
-                   png_set_user_limits(read_ptr, 500000L, 500000L);
-                   png_set_chunk_cache_max(read_ptr, 500);
-# endif
-# if PNGCRUSH_LIBPNG_VER >= 10401
-                   png_set_chunk_malloc_max(read_ptr, 2000000L);
-# endif
-                }
-#endif /* PNG_SET_USER_LIMITS_SUPPORTED */
+        else if (!strncmp(argv[i], "-m", 3) || !strncmp(argv[i], "-met", 4))
+        {
+            names++;
+            BUMP_I;
+            method = pngcrush_get_long;
+            pngcrush_check_long;
+            if (method >= 1 && method <= MAX_METHODS)
+            {
+              methods_specified = 1;
+              brute_force = 0;
+              try_method[method] = 0;
+            }
+            else
+            {
+              fprintf(STDERR, "\n  Ignoring invalid method: %d\n",
+                      method);
+              method = MAX_METHODS;
+            }
+        }
 
-#if defined(PNG_MAXIMUM_INFLATE_WINDOW) && defined(PNG_OPTION_ON)
-                if (salvage)
-                {
-                   P1(" Setting MAXIMUM_INFLATE_WINDOW\n");
-                   png_set_option(read_ptr, PNG_MAXIMUM_INFLATE_WINDOW,
-                       PNG_OPTION_ON);
-                }
+#ifdef PNGCRUSH_LOCO
+        else if (!strncmp(argv[i], "-mng", 4))
+        {
+            names++;
+            BUMP_I;
+            mngname = argv[i];
+            new_mng++;
+        }
 #endif
 
-#if 0
-                /* Use a smaller decompression buffer for speed */
-                png_set_compression_buffer_size(read_ptr,
-                    (png_size_t)256);
-#endif /* 0 */
-
-    /* Change the underlying color of any fully transparent pixel to black.
-     * Remove the alpha channel from any fully-opaque image.
-     * Change any all-gray image to a gray colortype.
-     * Reduce 16-bit image to 8-bit if possible without loss.
-     */
-    if (trial == 0 &&
-        (blacken == 1 || make_gray == 1 || make_opaque == 1 ||
-        make_8_bit == 1 || reduce_palette == 1))
-    {
-      P1(" Examine image for possible lossless reductions\n");
-      png_set_read_user_transform_fn(read_ptr, pngcrush_examine_pixels_fn);
-    }
-#ifdef PNG_READ_UNKNOWN_CHUNKS_SUPPORTED
-                if (last_trial == 0)
-                {
-                   png_set_keep_unknown_chunks(read_ptr,
-                        PNG_HANDLE_CHUNK_NEVER, (png_bytep) NULL, 0);
+        else if (!strncmp(argv[i], "-new", 4))
+        {
+            make_opaque = 1;                 /* -reduce */
+            reduce_trns = 1;                 /* -reduce */
+            reduce_gray_depth = 1;           /* -reduce */
+            make_gray = 1;                   /* -reduce */
+            make_8_bit = 1;                  /* -reduce */
+            reduce_palette = 1;              /* -reduce */
+        }
 
-                   png_set_keep_unknown_chunks(read_ptr,
-                        PNG_HANDLE_CHUNK_NEVER, chunks_to_ignore,
-                        sizeof (chunks_to_ignore)/5);
-                }
-#endif
+        else if (!strncmp(argv[i], "-nobail", 7))
+            bail=1;
 
-                if (nosave == 0)
-                {
-#ifdef PNG_USER_MEM_SUPPORTED
-                   if (verbose > 0)
-                       write_ptr = png_create_write_struct_2(
-                         PNG_LIBPNG_VER_STRING,
-                         (png_voidp) NULL,
-                         (png_error_ptr) pngcrush_cexcept_error,
-                         (png_error_ptr) pngcrush_warning,
-                         (png_voidp) NULL,
-                         (png_malloc_ptr) pngcrush_debug_malloc,
-                         (png_free_ptr) pngcrush_debug_free);
-                    else
-#endif
-                       write_ptr = png_create_write_struct(
-                         PNG_LIBPNG_VER_STRING,
-                         (png_voidp) NULL,
-                         (png_error_ptr) pngcrush_cexcept_error,
-                         (png_error_ptr) NULL);
-                    if (write_ptr == NULL)
-                        Throw "pngcrush could not create write_ptr";
+        else if (!strncmp(argv[i], "-nocheck", 8))
+        {
+            check_crc = 0;
+        }
 
-                }
-                P1("Allocating read_info, write_info, end_info structures\n");
-                read_info_ptr = png_create_info_struct(read_ptr);
+        else if (!strncmp(argv[i], "-nofilecheck", 5))
+        {
+            nofilecheck++;
+        }
+        else if (!strncmp(argv[i], "-noforce", 6))
+        {
+            force = 0;
+        }
 
-                if (read_info_ptr == NULL)
-                    Throw "pngcrush could not create read_info_ptr";
 
-                end_info_ptr = png_create_info_struct(read_ptr);
-                if (end_info_ptr == NULL)
-                    Throw "pngcrush could not create end_info_ptr";
+        else if (!strncmp(argv[i], "-nolimits", 5))
+        {
+            no_limits++;
+        }
 
-                if (nosave == 0)
-                {
-                    write_info_ptr = png_create_info_struct(write_ptr);
-                    if (write_info_ptr == NULL)
-                        Throw "pngcrush could not create write_info_ptr";
+        else if (!strncmp(argv[i], "-noreduce_pal", 13))
+        {
+            reduce_palette = 0;
+        }
 
-                    write_end_info_ptr = png_create_info_struct(write_ptr);
-                    if (write_end_info_ptr == NULL)
-                        Throw
-                            "pngcrush could not create write_end_info_ptr";
-                }
+        else if (!strncmp(argv[i], "-noreduce", 9))
+        {
+            make_opaque = 0;
+            reduce_trns = 0;
+            reduce_gray_depth = 0;
+            make_gray = 0;
+            make_8_bit = 0;
+            reduce_palette = 0;
+        }
 
-                P2("structures created.\n");
-                pngcrush_pause();
+        else if (!strncmp(argv[i], "-n", 3) || !strncmp(argv[i], "-nos", 4))
+        {
+            /* no save; I just use this for testing decode speed */
+            /* also to avoid saving if a CgBI chunk was found */
+            nosave++;
+            pngcrush_mode = EXTENSION_MODE;
+        }
 
-                P1( "Initializing input and output streams\n");
-#ifdef PNG_STDIO_SUPPORTED
-                png_init_io(read_ptr, fpin);
-#else
-                png_set_read_fn(read_ptr, (png_voidp) fpin,
-                                (png_rw_ptr) NULL);
-#endif /* PNG_STDIO_SUPPORTED */
+        else if (!strncmp(argv[i], "-oldtimestamp", 5))
+        {
+            new_time_stamp=0;
+        }
 
-                if (nosave == 0)
-                    png_set_write_fn(write_ptr, (png_voidp) fpout,
-                        (png_rw_ptr) pngcrush_write_png, pngcrush_flush);
+        else if (!strncmp(argv[i], "-old", 4))
+        {
+            make_opaque = 0;                 /* no -reduce */
+            reduce_trns = 0;                 /* no -reduce */
+            reduce_gray_depth = 0;           /* no -reduce */
+            make_gray = 0;                   /* no -reduce */
+            make_8_bit = 0;                  /* no -reduce */
+            reduce_palette = 0;              /* no -reduce */
+        }
 
-                P2("io has been initialized.\n");
-                pngcrush_pause();
+        else if (!strncmp(argv[i], "-optimal_huffman", 16) ||
+                 !strncmp(argv[i], "-optimal-huffman", 16))
+            optimal_huffman=1;
 
-#ifdef PNG_CRC_QUIET_USE
-                if (check_crc == 0)
-                {
-                    /* We don't need to check IDAT CRC's and ADLER32 because
-                     * they were already checked in the pngcrush_measure_idat
-                     * function
-                     */
-                    png_set_option(read_ptr, PNG_IGNORE_ADLER32,
-                        PNG_OPTION_ON);
-                    png_set_crc_action(read_ptr, PNG_CRC_QUIET_USE,
-                                       PNG_CRC_QUIET_USE);
-                }
-#endif
+        else if(!strncmp(argv[i], "-ow",3))
+        {
+            overwrite = 1;
+        }
 
-#ifndef PNGCRUSH_CHECK_ADLER32
-# ifdef PNG_IGNORE_ADLER32
-                if (last_trial == 0)
-                {
-                    /* During trials other than the final output, avoid
-                     * calculating CRC and ADLER32 checksums (just write
-                     * a DEFLATE datastream)
-                     */
-                    png_set_option(write_ptr, PNG_IGNORE_ADLER32,
-                        PNG_OPTION_ON);
-                }
-# endif
+        else if (!strncmp(argv[i], "-pplt", 3))
+        {
+            names++;
+            do_pplt++;
+            BUMP_I;
+            strncpy(pplt_string, argv[i], STR_BUF_SIZE);
+            pplt_string[STR_BUF_SIZE-1] = '\0';
+        }
+
+        else if (!strncmp(argv[i], "-premultiply", 5))
+        {
+            premultiply=2;
+        }
+
+        else if (!strncmp(argv[i], "-p", 3) || !strncmp(argv[i], "-pau", 4))
+        {
+            pauses++;
+        }
+
+        else if (!strncmp(argv[i], "-q", 3) || !strncmp(argv[i], "-qui", 4))
+        {
+            /* quiet, does not suppress warnings or timing */
+            verbose = 0;
+        }
+
+#ifdef PNGCRUSH_RECURSIVE
+        else if (!strcmp(argv[i], "-readahead"))
+        {
+            names++;
+            BUMP_I;
+            readahead = pngcrush_get_long;
+            pngcrush_check_long;
+            if (readahead < 0)
+                readahead = 0;
+            if (readahead > PNGCRUSH_READAHEAD_MAX)
+                readahead = PNGCRUSH_READAHEAD_MAX;
+        }
+
+        else if (!strcmp(argv[i], "-recursive"))
+        {
+            names++;
+            BUMP_I;
+            recursive_dir = argv[i];
+        }
 #endif
 
-#ifdef PNG_READ_CHECK_FOR_INVALID_INDEX_SUPPORTED
-                /* Only run this test (new in libpng-1.5.10) during the
-                 * 0th and last trial
-                 */
-                if ((input_color_type == 3) &&
-                    ((last_trial && reduce_palette == 0) ||
-                    (trial == 0 && reduce_palette == 1)))
+        else if (!strncmp(argv[i], "-reduce_pal", 11))
+        {
+            reduce_palette = 1;
+        }
+
+        else if (!strncmp(argv[i], "-reduce", 7))
+        {
+            noreduce = 0;
+            make_opaque = 1;
+            reduce_trns = 1;
+            reduce_gray_depth = 1;
+            make_gray = 1;
+            make_8_bit = 1;
+            reduce_palette = 1;
+        }
+
+#ifdef PNG_gAMA_SUPPORTED
+        else if (!strncmp(argv[i], "-replace_gamma", 4))
+        {
+            names++;
+            BUMP_I;
+            found_gAMA=1;
+            {
+#ifdef PNG_FIXED_POINT_SUPPORTED
+                int c;
+                char number[16];
+                char *n = number;
+                int nzeroes = -1;
+                int length = strlen(argv[i]);
+                for (c = 0; c < length; c++)
                 {
-                   P1(" Check the read palette\n");
-                   png_set_check_for_invalid_index (read_ptr, 1);
+                    if (*(argv[i] + c) == '.')
+                    {
+                        nzeroes = 5;
+                    }
+                    else if (nzeroes)
+                    {
+                        *n++ = *(argv[i] + c);
+                        nzeroes--;
+                    }
                 }
+                for (c = 0; c < nzeroes; c++)
+                    *n++ = '0';
+                *n = '\0';
+                force_specified_gamma = strtol(number,&endptr,10);
+#else
+                force_specified_gamma = strtof(argv[i],&endptr);
 #endif
-#ifdef PNG_WRITE_CHECK_FOR_INVALID_INDEX_SUPPORTED
-                if (last_trial && nosave == 0 && output_color_type == 3)
-                {
-                   P1(" Check the written palette\n");
-                   png_set_check_for_invalid_index (write_ptr, 1);
-                }
+                pngcrush_check_long;
+            }
+        }
+#endif /* PNG_gAMA_SUPPORTED */
+
+#ifdef PNG_pHYs_SUPPORTED
+        else if (!strncmp(argv[i], "-res", 4))
+        {
+            names++;
+            BUMP_I;
+            resolution = pngcrush_get_long;
+            pngcrush_check_long;
+        }
 #endif
 
-            if (last_trial == 1)
+#ifdef Z_RLE
+        else if (!strncmp(argv[i], "-rle", 4))
+        {
+            /* try all filters with RLE */
+            methods_specified = 1;
+            for (method = 125; method <= 136; method++)
             {
+                try_method[method] = 0;
+            }
+        }
+#endif
 
-#ifdef PNG_READ_UNKNOWN_CHUNKS_SUPPORTED
-                png_set_keep_unknown_chunks(read_ptr, PNG_HANDLE_CHUNK_ALWAYS,
-                                            (png_bytep) NULL, 0);
+#ifdef PNGCRUSH_MULTIPLE_ROWS
+        else if (!strncmp(argv[i], "-rows", 5))
+        {
+            names++;
+            BUMP_I;
+            max_rows_at_a_time = pngcrush_get_long;
+            pngcrush_check_long;
+        }
 #endif
 
-#ifdef PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED
-                if (nosave == 0)
-                {
-                    if (save_apng_chunks == 1)
-                    {
-                       /* To do: Why use write_ptr not read_ptr here? */
-                       png_set_keep_unknown_chunks(write_ptr,
-                                                PNG_HANDLE_CHUNK_ALWAYS,
-                                                (png_bytep) "acTL", 1);
-                       png_set_keep_unknown_chunks(write_ptr,
-                                                PNG_HANDLE_CHUNK_ALWAYS,
-                                                (png_bytep) "fcTL", 1);
-                       png_set_keep_unknown_chunks(write_ptr,
-                                                PNG_HANDLE_CHUNK_ALWAYS,
-                                                (png_bytep) "fdAT", 1);
-                    }
+        else if (!strncmp(argv[i], "-r", 3) || !strncmp(argv[i], "-rem", 4))
+        {
+            remove_chunks = i;
+            names++;
+            BUMP_I;
+            if (!strncmp(argv[i], "-dSIG", 5)
+                 && (!strncmp(argv[i], "-dsig", 5)))
+               image_is_immutable=0;
+        }
 
-                    if (found_any_chunk == 1)
-                       png_set_keep_unknown_chunks(write_ptr,
-                                                PNG_HANDLE_CHUNK_ALWAYS,
-                                                (png_bytep) "dSIG", 1);
-                    if (all_chunks_are_safe)
-                    {
-                        png_set_keep_unknown_chunks(write_ptr,
-                                                    PNG_HANDLE_CHUNK_ALWAYS,
-                                                    (png_bytep) NULL, 0);
-    printf("while saving, all_chunks_are_safe=\n");
-                        if (save_apng_chunks == 0)
-                        {
-                           png_set_keep_unknown_chunks(write_ptr,
-                                                PNG_HANDLE_CHUNK_ALWAYS,
-                                                (png_bytep) "acTL", 1);
-                           png_set_keep_unknown_chunks(write_ptr,
-                                                PNG_HANDLE_CHUNK_ALWAYS,
-                                                (png_bytep) "fcTL", 1);
-                           png_set_keep_unknown_chunks(write_ptr,
-                                                PNG_HANDLE_CHUNK_ALWAYS,
-                                                (png_bytep) "fdAT", 1);
-                        }
-                    }
+        else if (!strncmp(argv[i], "-save", 5))
+        {
+            all_chunks_are_safe++;
+        }
 
-                    else
-                    {
-#if !defined(PNG_cHRM_SUPPORTED) || !defined(PNG_hIST_SUPPORTED) || \
-    !defined(PNG_iCCP_SUPPORTED) || !defined(PNG_sCAL_SUPPORTED) || \
-    !defined(PNG_pCAL_SUPPORTED) || !defined(PNG_sPLT_SUPPORTED) || \
-    !defined(PNG_sTER_SUPPORTED) || !defined(PNG_tIME_SUPPORTED)
-                        png_byte chunk_name[5];
-                        chunk_name[4] = '\0';
-#endif
+        else if (!strncmp(argv[i], "-scan", 5))
+        {
+            scan = 1;
+            nosave++;
+            pngcrush_mode = EXTENSION_MODE;
+        }
 
-                        /* To do: Why use write_ptr not read_ptr here? */
+        else if (!strcmp(argv[i], "-shard"))
+        {
+            char *end;
 
-                        if (keep_unknown_chunk("alla", argv) &&
-                            keep_unknown_chunk("allb", argv))
-                            png_set_keep_unknown_chunks(write_ptr,
-                                                    PNG_HANDLE_CHUNK_IF_SAFE,
-                                                    (png_bytep) NULL,
-                                                    0);
-                        else
-                            png_set_keep_unknown_chunks(write_ptr,
-                                                    PNG_HANDLE_CHUNK_NEVER,
-                                                    (png_bytep) NULL,
-                                                    0);
+            names++;
+            BUMP_I;
+            shard_index = strtol(argv[i], &end, 10);
+            shard_count = *end == '/' ? strtol(end + 1, &end, 10) : 0;
+            if (*end != '\0' || shard_count < 1 || shard_index < 0 ||
+                shard_index >= shard_count)
+            {
+                fprintf(STDERR, "pngcrush: -shard needs i/N, with"
+                    " 0 <= i < N\n");
+                exit(1);
+            }
+        }
 
-#ifndef PNG_cHRM_SUPPORTED
-                        if (keep_unknown_chunk("cHRM", argv))
-                        {
-                            pngcrush_save_uint_32(chunk_name, PNG_UINT_cHRM);
-                            png_set_keep_unknown_chunks(write_ptr,
-                                                    PNG_HANDLE_CHUNK_ALWAYS,
-                                                    chunk_name, 1);
-                        }
-#endif
-#ifndef PNG_hIST_SUPPORTED
-                        if (keep_unknown_chunk("hIST", argv))
-                        {
-                            pngcrush_save_uint_32(chunk_name, PNG_UINT_hIST);
-                            png_set_keep_unknown_chunks(write_ptr,
-                                                    PNG_HANDLE_CHUNK_ALWAYS,
-                                                    chunk_name, 1);
-                        }
-#endif
-#ifndef PNG_iCCP_SUPPORTED
-                        if (keep_unknown_chunk("iCCP", argv))
-                        {
-                            pngcrush_save_uint_32(chunk_name, PNG_UINT_iCCP);
-                            png_set_keep_unknown_chunks(write_ptr,
-                                                    PNG_HANDLE_CHUNK_ALWAYS,
-                                                    chunk_name, 1);
-                        }
-#endif
-#ifndef PNG_iTXt_SUPPORTED
-                        if (keep_unknown_chunk("iTXt", argv))
-                        {
-                            pngcrush_save_uint_32(chunk_name, PNG_UINT_iTXt);
-                            png_set_keep_unknown_chunks(write_ptr,
-                                                    PNG_HANDLE_CHUNK_ALWAYS,
-                                                    chunk_name, 1);
-                        }
+        else if (!strncmp(argv[i], "-speed", 6))
+        {
+            speed = 1;
+        }
+
+        else if (!strncmp(argv[i], "-srgb", 5) ||
+                   !strncmp(argv[i], "-sRGB", 5))
+        {
+#ifdef PNG_gAMA_SUPPORTED
+#  ifdef PNG_FIXED_POINT_SUPPORTED
+            specified_gamma = 45455L;
+#  else
+            specified_gamma = 0.45455;
+#  endif
 #endif
-#ifndef PNG_sCAL_SUPPORTED
-                        if (keep_unknown_chunk("sCAL", argv))
-                        {
-                            pngcrush_save_uint_32(chunk_name, PNG_UINT_sCAL);
-                            png_set_keep_unknown_chunks(write_ptr,
-                                                    PNG_HANDLE_CHUNK_ALWAYS,
-                                                    chunk_name, 1);
-                        }
+            specified_intent = 0;
+            BUMP_I;
+            if (!strncmp(argv[i], "0", 1) ||
+                !strncmp(argv[i], "1", 1) ||
+                !strncmp(argv[i], "2", 1) ||
+                !strncmp(argv[i], "3", 1))
+            {
+                names++;
+                specified_intent = (int) pngcrush_get_long;
+                pngcrush_check_long;
+            } else
+                i--;
+        }
+
+        else if (!strncmp(argv[i], "-ster", 5) ||
+                   !strncmp(argv[i], "-sTER", 5))
+        {
+            BUMP_I;
+            ster_mode = -1;
+            if (!strncmp(argv[i], "0", 1) ||
+                !strncmp(argv[i], "1", 1))
+            {
+                names++;
+                ster_mode = (int) pngcrush_get_long;
+                pngcrush_check_long;
+            }
+            else
+                i--;
+        }
+
+        else if (!strncmp(argv[i], "-stats_json", 11) ||
+                 !strncmp(argv[i], "-stats-json", 11))
+        {
+            names++;
+            BUMP_I;
+            if (stats_json != NULL)
+                fclose(stats_json);
+            if ((stats_json = FOPEN(argv[i], "a")) == NULL)
+            {
+                fprintf(STDERR, "pngcrush: could not open %s\n", argv[i]);
+                exit(1);
+            }
+        }
+
+        else if (!strncmp(argv[i], "-s", 3) || !strncmp(argv[i], "-sil", 4))
+        {
+            /* silent, suppresses warnings, timing, and results */
+            verbose = -1;
+        }
+
+        else if (!strncmp(argv[i], "-text", 5)
+                 || !strncmp(argv[i], "-tEXt", 5) ||
+#ifdef PNG_iTXt_SUPPORTED
+                 !strncmp(argv[i], "-itxt", 5)
+                 || !strncmp(argv[i], "-iTXt", 5)
+                 || !strncmp(argv[i], "-zitxt", 6)
+                 || !strncmp(argv[i], "-ziTXt", 6) ||
 #endif
-#ifndef PNG_pCAL_SUPPORTED
-                        if (keep_unknown_chunk("pCAL", argv))
-                        {
-                            pngcrush_save_uint_32(chunk_name, PNG_UINT_pCAL);
-                            png_set_keep_unknown_chunks(write_ptr,
-                                                    PNG_HANDLE_CHUNK_ALWAYS,
-                                                    chunk_name, 1);
-                        }
+                 !strncmp(argv[i], "-ztxt", 5)
+                 || !strncmp(argv[i], "-zTXt", 5))
+        {
+            i += 2;
+            BUMP_I;
+            i -= 3;
+            if (strlen(argv[i + 2]) < 80 &&
+                strlen(argv[i + 3]) < STR_BUF_SIZE &&
+                text_inputs < 10)
+            {
+#ifdef PNG_iTXt_SUPPORTED
+                if (!strncmp(argv[i], "-zi", 3))
+                {
+                    text_compression[text_inputs] =
+                        PNG_ITXT_COMPRESSION_zTXt;
+                    /* names += 2; */
+                }
+                else
 #endif
-#ifndef PNG_sPLT_SUPPORTED
-                        if (keep_unknown_chunk("sPLT", argv))
-                        {
-                            pngcrush_save_uint_32(chunk_name, PNG_UINT_sPLT);
-                            png_set_keep_unknown_chunks(write_ptr,
-                                                    PNG_HANDLE_CHUNK_ALWAYS,
-                                                    chunk_name, 1);
-                        }
+                if (!strncmp(argv[i], "-z", 2))
+                    text_compression[text_inputs] =
+                        PNG_TEXT_COMPRESSION_zTXt;
+                else if (!strncmp(argv[i], "-t", 2))
+                    text_compression[text_inputs] =
+                        PNG_TEXT_COMPRESSION_NONE;
+#ifdef PNG_iTXt_SUPPORTED
+                else
+                {
+                    text_compression[text_inputs] =
+                        PNG_ITXT_COMPRESSION_NONE;
+                    /* names += 2; */
+                }
 #endif
-#ifndef PNG_sTER_SUPPORTED
-                        if (keep_unknown_chunk("sTER", argv))
-                        {
-                            pngcrush_save_uint_32(chunk_name, PNG_UINT_sTER);
-                            png_set_keep_unknown_chunks(write_ptr,
-                                                    PNG_HANDLE_CHUNK_ALWAYS,
-                                                    chunk_name, 1);
-                        }
+                names += 3;
+                if (!strncmp(argv[++i], "b", 1))
+                    text_where[text_inputs] = 1;
+                if (!strncmp(argv[i], "a", 1))
+                    text_where[text_inputs] = 2;
+                strncpy(&text_keyword[text_inputs * 80], argv[++i],
+                    80);
+                text_keyword[text_inputs * 80 + 79] = '\0';
+#ifdef PNG_iTXt_SUPPORTED
+                if (text_compression[text_inputs] <= 0)
+                {
+                    text_lang[text_inputs * 80] = '\0';
+                    text_lang_key[text_inputs * 80] = '\0';
+                }
+                else
+                {
+                    i += 2;
+                    BUMP_I;
+                    i -= 3;
+                    names += 2;
+                    strncpy(&text_lang[text_inputs * 80], argv[++i], 80);
+                    text_lang[text_inputs * 80 + 79] = '\0';
+                    /* libpng-1.0.5j and later */
+                    strncpy(&text_lang_key[text_inputs * 80], argv[++i], 80);
+                    text_lang_key[text_inputs * 80 + 79] = '\0';
+                }
 #endif
-#ifndef PNG_tIME_SUPPORTED
-                        if (keep_unknown_chunk("tIME", argv))
-                        {
-                            pngcrush_save_uint_32(chunk_name, PNG_UINT_tIME);
-                            png_set_keep_unknown_chunks(write_ptr,
-                                                    PNG_HANDLE_CHUNK_ALWAYS,
-                                                    chunk_name, 1);
-                        }
+                strncpy(&text_text[text_inputs * STR_BUF_SIZE], argv[++i],
+                    STR_BUF_SIZE);
+                text_text[(text_inputs + 1) * STR_BUF_SIZE - 1] = '\0';
+                text_inputs++;
+            } else {
+                if (text_inputs > 9)
+                    fprintf(STDERR,
+                            "too many text/zTXt inputs; only 10 allowed\n");
+                else
+                    fprintf(STDERR,
+                            "keyword exceeds 79 characters or text"
+                            " exceeds 2047 characters\n");
+                i += 3;
+                names += 3;
+#ifdef PNG_iTXt_SUPPORTED
+                if (!strncmp(argv[i], "-i", 3) || !strncmp(argv[i], "-itx", 4))
+                {
+                    i++;
+                    BUMP_I;
+                    names += 2;
+                }
 #endif
-                    }
-                } /* nosave == 0 */
-#endif /* PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED */
-            } /* last trial */
+            }
+        }
 
-/* To do: Remove this? We already did this in measure_idats */
-            P1("   Reading signature bytes\n");
-            {
-#ifdef PNGCRUSH_LOCO
-              png_byte mng_signature[8] =
-                  { 138, 77, 78, 71, 13, 10, 26, 10 };
-#endif
-              png_byte png_signature[8] =
-                  { 137, 80, 78, 71, 13, 10, 26, 10 };
+        else if (!strncmp(argv[i], "-time_budget", 12) ||
+                 !strncmp(argv[i], "-time-budget", 12))
+        {
+            names++;
+            BUMP_I;
+            time_budget = (unsigned long) pngcrush_get_long;
+            pngcrush_check_long;
+        }
 
-              pngcrush_default_read_data(read_ptr, png_signature, 8);
-              png_set_sig_bytes(read_ptr, 8);
+        else if (!strncmp(argv[i], "-timers", 7))
+            phase_timers = 1;
 
-#ifdef PNGCRUSH_LOCO
-              if (!(int)(png_memcmp(mng_signature, png_signature, 8)))
-              {
-                  /* Skip the MHDR */
-                  png_permit_mng_features(read_ptr,
-                                      PNG_FLAG_MNG_FILTER_64);
-                  png_skip_chunk(read_ptr);
-                  input_format = 1;
-              }
+        else if (!strncmp(argv[i], "-time_stamp", 5) ||  /* legacy */
+                 !strncmp(argv[i], "-newtimestamp", 5))
+            new_time_stamp=1;
 
-              else
-#endif
-              if (png_sig_cmp(png_signature, 0, 8))
-              {
-                  if (png_sig_cmp(png_signature, 0, 4))
-                      png_error(read_ptr, "Not a PNG file!");
-              else
-                  png_error(read_ptr,
-                      "PNG file corrupted by ASCII conversion");
-              }
-              if (salvage && found_CgBI)
-              {
-                  /* Skip the CgBI chunk */
+#ifdef PNG_tRNS_SUPPORTED
+        else if (!strncmp(argv[i], "-trns_a", 7) ||
+                 !strncmp(argv[i], "-tRNS_a", 7))
+        {
+            num_trans_in = (png_uint_16) pngcrush_get_long;
+            pngcrush_check_long;
+            if (num_trans_in > 256)
+               num_trans_in = 256;
+            trns_index=num_trans_in-1;
+            have_trns = 1;
+            for (ia = 0; ia < num_trans_in; ia++)
+            {
+                BUMP_I;
+                trans_in[ia] = (png_byte) pngcrush_get_long;
+                pngcrush_check_long;
+            }
+            names += 1 + num_trans_in;
+        }
 
-                  png_skip_chunk(read_ptr);
+        else if (!strncmp(argv[i], "-trace", 7))
+        {
+            names++;
+            BUMP_I;
+            if (trace_json != NULL)
+                fclose(trace_json);
+            if ((trace_json = FOPEN(argv[i], "a")) == NULL)
+            {
+                fprintf(STDERR, "pngcrush: could not open %s\n", argv[i]);
+                exit(1);
+            }
+            fseek(trace_json, 0L, SEEK_END);
+            if (ftell(trace_json) == 0)
+                fprintf(trace_json, "[\n");
+#if !defined(__TURBOC__) && !defined(_MSC_VER) && !defined(_MBCS) && \
+    !defined(__riscos)
+            trace_pid = (long) getpid();
+#endif
+        }
 
-                  /* iCCP and zTXt are probably unreadable
-                   * because of the nonstandard deflate */
+        else if (!strncmp(argv[i], "-trns", 5) ||
+                   !strncmp(argv[i], "-tRNS", 5))
+        {
+            names += 5;
+            have_trns = 1;
+            BUMP_I;
+            trns_index = (png_uint_16) pngcrush_get_long;
+            pngcrush_check_long;
+            BUMP_I;
+            trns_red = (png_uint_16) pngcrush_get_long;
+            pngcrush_check_long;
+            BUMP_I;
+            trns_green = (png_uint_16) pngcrush_get_long;
+            pngcrush_check_long;
+            BUMP_I;
+            trns_blue = (png_uint_16) pngcrush_get_long;
+            pngcrush_check_long;
+            BUMP_I;
+            trns_gray = (png_uint_16) pngcrush_get_long;
+            pngcrush_check_long;
+        }
+#endif /* tRNS */
 
-#ifdef PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED
-                  png_set_keep_unknown_chunks(read_ptr,
-                      PNG_HANDLE_CHUNK_NEVER,
-                      (png_bytep)"iCCP", 1);
-                  png_set_keep_unknown_chunks(read_ptr,
-                      PNG_HANDLE_CHUNK_NEVER,
-                      (png_bytep)"zTXt", 1);
-#endif
-              }
-            }
+        else if(!strncmp(argv[i], "-try10",6))
+        {
+            try10 = 1;
+        }
 
-#ifndef PNG_READ_PREMULTIPLY_ALPHA_SUPPORTED
-            if (premultiply)
-                 png_error(read_ptr, "Premultiplied alpha is not supported");
-#endif
+        else if (!strncmp(argv[i], "-tune_search", 12) ||
+                 !strncmp(argv[i], "-tune-search", 12))
+        {
+            tune_search = 1;
+        }
 
-            P1( "   Reading info struct\n");
-            png_read_info(read_ptr, read_info_ptr);
+        else if (!strncmp(argv[i], "-verify", 7))
+        {
+            verify = 1;
+        }
 
-            if (trial != 0)
-            {
-               if (make_opaque == 1)
-               {
-                  P1(" Remove all-opaque alpha channel\n");
-                  if (output_color_type == 4)
-                     output_color_type = 0;
-                  if (output_color_type == 6)
-                     output_color_type = 2;
-               }
-               P1(" make_opaque=    %d\n",make_opaque);
+        else if (!strncmp(argv[i], "-version", 8))
+        {
+            fprintf(STDERR, " pngcrush ");
+            fprintf(STDERR, PNGCRUSH_VERSION);
+            fprintf(STDERR, ", uses libpng ");
+            fprintf(STDERR, PNG_LIBPNG_VER_STRING);
+            fprintf(STDERR, " and zlib ");
+            fprintf(STDERR, ZLIB_VERSION);
+            fprintf(STDERR, "\n Check http://pmt.sf.net/\n");
+            fprintf(STDERR, " for the most recent version.\n");
+            verbose = 0;
+            exit(0);
+        }
 
-               if (make_gray == 1)
-               {
-                  /* Note: Take care that iCCP, sBIT, and bKGD data are not
-                   * lost or become invalid when reducing images from
-                   * truecolor to grayscale or when reducing the bit depth.
-                   * (To do: test this; it's probably OK)
-                   */
-                  /* To do: check bKGD color */
+        else if (!strncmp(argv[i], "-v", 3) || !strncmp(argv[i], "-ver", 4))
+        {
+            verbose++;
+        }
 
-                  P1(" Encode all-gray image with a gray colortype\n");
-                  if (output_color_type == 6)
-                     output_color_type = 4;
-                  if (output_color_type == 2)
-                     output_color_type = 0;
-               }
-               P1(" make_gray=      %d\n",make_gray);
+        else if (!strncmp(argv[i], "-workers", 8))
+        {
+            /* Only used with -server, which handles it */
+            names++;
+            BUMP_I;
+        }
 
-               if (make_8_bit == 1)
-               {
-                  /* Note: Take care that sBIT and bKGD data are not
-                   * lost or become invalid when reducing the bit depth.
-                   * (To do: test this; it's probably OK)
-                   */
-                  P1(" Reduce 16-bit image losslessly to 8-bit\n");
-               }
-               P1(" make_8_bit=     %d\n",make_8_bit);
+        else if (!strncmp(argv[i], "-warmup", 7))
+        {
+            names++;
+            BUMP_I;
+            benchmark_warmup = (unsigned int) pngcrush_get_long;
+            pngcrush_check_long;
+        }
 
-               if (make_opaque != 1 && blacken == 2)
-               {
-                  P1(" Blacken the fully transparent pixels\n");
-                  png_set_read_user_transform_fn(read_ptr,
-                      pngcrush_transform_pixels_fn);
-               }
-               P1(" make_opaque=    %d\n",make_opaque);
-               P1(" blacken=        %d\n",blacken);
+        else if (!strncmp(argv[i], "-warn", 5))
+        {
+            show_warnings++;
+            verbose = -1;
+        }
 
-               if (reduce_palette == 1)
-               {
-                  /* Note: Take care that sBIT and bKGD data are not
-                   * lost or become invalid when reducing the bit depth.
-                   * (To do: test this; it's probably OK)
-                   */
-                  P1(" Reduce palette by truncating unused entries\n");
-               }
-               P1(" reduce_palette= %d\n",reduce_palette);
-               P1("  new plte_len = %d\n",plte_len);
-            }
+        else if (!strncmp(argv[i], "-w", 3) || !strncmp(argv[i], "-win", 4))
+        {
+            BUMP_I;
+            default_compression_window = pngcrush_get_long;
+            pngcrush_check_long;
+            force_compression_window++;
+            names++;
+        }
 
-            /* { GRR added for quick %-navigation (1) */
+        else if (!strncmp(argv[i], "-zm", 4) || !strncmp(argv[i], "-zmem", 5))
+        {
+            BUMP_I;
+            compression_mem_level = pngcrush_get_long;
+            pngcrush_check_long;
+            names++;
+        }
 
-            /* Start of chunk-copying/removal code, in order:
-             *  - IHDR
-             *  - bKGD
-             *  - cHRM
-             *  - gAMA
-             *  - sRGB
-             *  - iCCP
-             *  - oFFs
-             *  - pCAL
-             *  - pHYs
-             *  - hIST
-             *  - tRNS
-             *  - PLTE
-             *  - sBIT
-             *  - sCAL
-             *  - sPLT
-             *  - sTER
-             *  - tEXt/zTXt/iTXt
-             *  - tIME
-             *  - unknown chunks
-             */
+        else if (!strncmp(argv[i], "-z", 3))
+        {
+            int specified_strategy;
+            BUMP_I;
+            specified_strategy = pngcrush_get_long;
+            pngcrush_check_long;
+            if (specified_strategy > 2 || specified_strategy < 0)
+                specified_strategy = 0;
+            names++;
+            if (brute_force == 0)
+                zs[method] = specified_strategy;
+            else
             {
-                int compression_method,
-                    filter_method;
-
-                P1( "Transferring info struct\n");
+                if (brute_force_strategy == 0)
+                    for (strat = 0; strat < 2; strat++)
+                        brute_force_strategies[strat] = 1;
+                brute_force_strategies[specified_strategy] = 0;
+                brute_force_strategy++;
+            }
+        }
 
-                if (png_get_IHDR(read_ptr, read_info_ptr, &width, &height,
-                     &bit_depth, &color_type, &interlace_method,
-                     &compression_method, &filter_method))
-                {
-                    int need_expand = 0;
-                    input_color_type = color_type;
-                    input_bit_depth = bit_depth;
+        else if (!strncmp(argv[i], "-", 1))
+        {
+            if (verbose > 0 && printed_version_info == 0)
+            {
+              print_version_info();
+              printed_version_info++;
+            }
+            fprintf(STDERR, "\n  Ignoring invalid option: %s\n",
+                    argv[i]);
+        } /* GRR:  end of giant if-else block */
+    } /* end of loop over args ============================================ */
 
-                    if (output_color_type > 7)
-                    {
-                        output_color_type = input_color_type;
-                    }
+    if (verbose > 0 && printed_version_info == 0)
+        print_version_info();
 
-                    /* if (verbose > 1 && last_trial) */
-                    if (verbose > 1 && trial == 0)
-                    {
-                        fprintf(STDERR, "   IHDR chunk data:\n");
-                        fprintf(STDERR,
-                                "      Width=%lu, height=%lu\n",
-                                (unsigned long)width,
-                                (unsigned long)height);
-                        fprintf(STDERR, "      Bit depth =%d\n",
-                                bit_depth);
-                        fprintf(STDERR, "      Color type=%d\n",
-                                color_type);
-                        if (output_color_type != color_type)
-                            fprintf(STDERR,
-                                    "      Output color type=%d\n",
-                                    output_color_type);
-                        fprintf(STDERR, "      Interlace =%d\n",
-                                interlace_method);
-                    }
-
-                    output_bit_depth = input_bit_depth;
-
-                    if ((output_color_type != 3 || output_bit_depth > 8)
-                       && output_bit_depth >= 8
-                       && output_bit_depth > input_bit_depth)
-                      need_expand = 1;
+    if (default_compression_window == 32)
+        default_compression_window = 15;
+    else if (default_compression_window == 16)
+        default_compression_window = 14;
+    else if (default_compression_window == 8)
+        default_compression_window = 13;
+    else if (default_compression_window == 4)
+        default_compression_window = 12;
+    else if (default_compression_window == 2)
+        default_compression_window = 11;
+    else if (default_compression_window == 1)
+        default_compression_window = 10;
+    else if (default_compression_window == 512)
+        default_compression_window = 9;
+    /* Use of compression window size 256 is not recommended. */
+    else if (default_compression_window == 256)
+        default_compression_window = 8;
+    else if (default_compression_window == 0)
+        /* do nothing */;
+    else if (default_compression_window != 15) {
+        fprintf(STDERR, "Invalid window size (%d); using window size=4\n",
+                default_compression_window);
+        default_compression_window = 12;
+    }
 
-#ifdef PNG_READ_RGB_TO_GRAY_SUPPORTED
-                    if ((color_type == 2 ||
-                         color_type == 6 ||
-                         color_type == 3) &&
-                         (output_color_type == 0 ||
-                         output_color_type == 4))
-                    {
-                        if (verbose > 0 && last_trial)
-                        {
-                                fprintf(STDERR, "   Reducing truecolor "
-                                  "image to grayscale.\n");
-                        }
-#ifdef PNG_FIXED_POINT_SUPPORTED
-                        png_set_rgb_to_gray_fixed(read_ptr, 1,
-                           21260, 71520);
-#else
-                        png_set_rgb_to_gray(read_ptr, 1,
-                           0.21260, 0.71520);
+    file_list = manifest_name != NULL;
+#ifdef PNGCRUSH_RECURSIVE
+    if (recursive_dir != NULL && file_list)
+    {
+        fprintf(STDERR, "pngcrush: cannot use -recursive with -manifest\n");
+        exit(1);
+    }
+    file_list |= recursive_dir != NULL;
 #endif
-                        if (output_bit_depth < 8)
-                            output_bit_depth = 8;
-                        if (color_type == 3)
-                            need_expand = 1;
-                    }
-#endif /* PNG_READ_RGB_TO_GRAY_SUPPORTED */
+    if (file_list)
+    {
+        if (pngcrush_mode == DEFAULT_MODE && !overwrite && !nosave)
+        {
+            fprintf(STDERR, "pngcrush: %s needs -d, -e, -ow, or -n\n",
+                manifest_name != NULL ? "-manifest" : "-recursive");
+            exit(1);
+        }
+        if (argc > names)
+            fprintf(STDERR, "pngcrush: ignoring the file names after %s\n",
+                manifest_name != NULL ? "-manifest" : "-recursive");
+    }
+    else if ((shard_count > 0 || journal_name != NULL) &&
+        pngcrush_mode == DEFAULT_MODE)
+    {
+        fprintf(STDERR, "pngcrush: -shard and -journal need -d, -e, -n,"
+            " -recursive, or -manifest\n");
+        exit(1);
+    }
+    else if (pngcrush_mode == DEFAULT_MODE)
+    {
+        if (argc - names == 2)
+        {
+            inname = argv[names];
+            outname = argv[names + 1];
+        }
 
-                    if (color_type != 3 && output_color_type == 3)
-                    {
-                        fprintf(STDERR,"  Cannot change to indexed color "
-                          "(color_type 3)\n");
-                        output_color_type = input_color_type;
-                    }
+        else if (overwrite)
+        {
+            inname = argv[names];
+        }
 
-                    if ((color_type == 0 || color_type == 4) &&
-                        (output_color_type == 2
-                         || output_color_type == 6))
-                    {
-                        png_set_gray_to_rgb(read_ptr);
-                    }
+        else
+        {
+            if ((argc - names == 1 || nosave))
+            {
+                inname = argv[names];
+            }
+            if (verbose > 0 && !nosave)
+            {
+                print_usage(1);   /* this exits */
+            }
+        }
+    }
 
-                    if ((color_type == 4 || color_type == 6) &&
-                        (output_color_type != 4
-                         && output_color_type != 6))
-                    {
-                        if (verbose > 0 && last_trial)
-                        {
-                            fprintf(STDERR,
-                              "   Stripping existing alpha channel.\n");
-                        }
-#ifdef PNG_READ_STRIP_ALPHA_SUPPORTED
-                        png_set_strip_alpha(read_ptr);
+    first_name = names;
+
+    if (benchmark_iterations)
+    {
+        bench=1;
+#if PNGCRUSH_TIMERS > 0
+        bench_samples = (double *) calloc((size_t)benchmark_iterations *
+            PNGCRUSH_TIMERS, sizeof (double));
+        bench_method_samples = (double *) calloc((size_t)benchmark_iterations
+            * MAX_METHODSP1, sizeof (double));
+        bench_bytes = (double *) calloc((size_t)benchmark_iterations,
+            sizeof (double));
+        if (bench_samples == NULL || bench_method_samples == NULL ||
+            bench_bytes == NULL)
+        {
+            fprintf(STDERR, "   Insufficient memory for -bench statistics\n");
+            free(bench_samples);
+            free(bench_method_samples);
+            free(bench_bytes);
+            bench_samples = NULL;
+            bench_method_samples = NULL;
+            bench_bytes = NULL;
+        }
+#endif
+    }
+    else
+    {
+        bench=0;
+        benchmark_warmup=0;
+    }
+    
+    for (; bench <= benchmark_iterations + benchmark_warmup; bench++)
+    {
+        if (benchmark_iterations > 0)
+        {
+            P1("  Pngcrush benchmark iteration %d%s\n",bench,
+                bench <= benchmark_warmup ? " (warm-up)" : "");
+            names = first_name;
+        }
+#if PNGCRUSH_TIMERS > 0
+        bench_sample = (bench_samples != NULL && bench > benchmark_warmup) ?
+            (int) (bench - benchmark_warmup - 1) : -1;
 #endif
-                    }
 
-                    if ((output_color_type == 4
-                         || output_color_type == 6) && (color_type != 4
-                                                        && color_type != 6))
-                    {
-                        if (verbose > 0 && last_trial)
-                            fprintf(STDERR,
-                              "   Adding an opaque alpha channel.\n");
-#ifdef PNG_READ_FILLER_SUPPORTED
-                        png_set_filler(read_ptr, (png_uint_32) 65535L,
-                                       PNG_FILLER_AFTER);
+#if PNGCRUSH_TIMERS > 0
+        for (pc_timer = 0; pc_timer < PNGCRUSH_TIMERS; pc_timer++)
+        {
+            pngcrush_timer_reset(pc_timer);
+            filter_count[pc_timer]=0;
+        }
+        pngcrush_timer_start(PNGCRUSH_TIMER_TOTAL);
+        pngcrush_timer_start(PNGCRUSH_TIMER_MISC);
 #endif
-                        need_expand = 1;
-                    }
 
-                    if (output_color_type != 0 && output_color_type != 3 &&
-                        output_bit_depth < 8)
-                       output_bit_depth = 8;
+    batch_start_ms = pngcrush_clock_ms();
 
-                    if ((output_color_type == 2
-                         || output_color_type == 6)
-                        && color_type == 3)
-                    {
-                        if (verbose > 0 && last_trial)
-                            fprintf(STDERR,
-                              "   Expanding indexed color file.\n");
-                        need_expand = 1;
-                    }
-#ifdef PNG_READ_EXPAND_SUPPORTED
-                    if (need_expand == 1)
-                        png_set_expand(read_ptr);
-#endif
+    for (ia = 0; ia < 256; ia++)
+        trns_array[ia]=255;
 
-#ifdef PNG_READ_PACK_SUPPORTED
-                    if (input_bit_depth < 8)
-                    {
-                        png_set_packing(read_ptr);
-                    }
+    if (manifest_name != NULL)
+    {
+        manifest_fp = PNGCRUSH_IS_STDIO(manifest_name) ? stdin :
+            fopen(manifest_name, "r");
+        if (manifest_fp == NULL)
+        {
+            fprintf(STDERR, "pngcrush: could not open %s\n", manifest_name);
+            exit(1);
+        }
+    }
+    if (journal_name != NULL && journal_fp == NULL)
+        pngcrush_journal_open();
 
-                    if (output_color_type == 0 && output_bit_depth < 8)
-                    {
-                        png_color_8 true_bits;
-                        true_bits.gray = (png_byte) (output_bit_depth);
-                        png_set_shift(read_ptr, &true_bits);
-                    }
+#ifdef PNGCRUSH_RECURSIVE
+    if (recursive_dir != NULL &&
+        !pngcrush_walk_start(recursive_dir,
+        (pngcrush_mode == DIRECTORY_MODE || pngcrush_mode == DIREX_MODE) ?
+        directory_name : NULL))
+        exit(1);
 #endif
- 
-                    if (trial > 0)
-                    {
-                    /* To do: have we got the right plte_len now? */
-                      if (plte_len > 0 && output_color_type == 3 &&
-                          force_output_bit_depth == 0)
-                      {
-                        if (plte_len <= 2)
-                          force_output_bit_depth = 1;
-                        else if (plte_len <= 4)
-                          force_output_bit_depth = 2;
-                        else if (plte_len <= 16)
-                          force_output_bit_depth = 4;
-                        else
-                          force_output_bit_depth = 8;
-                      }
 
-                    if (make_8_bit == 1)
-                    {
-#if defined(PNG_READ_SCALE_16_TO_8_SUPPORTED) || \
-defined(PNG_READ_STRIP_16_TO_8_SUPPORTED)
-                       output_bit_depth = 8;
-                       force_output_bit_depth = 8;
-                       if (verbose > 0 && last_trial)
-                         fprintf(STDERR,
-                         "   Stripping 16-bit depth to 8, trial = %d\n",
-                         trial);
+    for (;;)  /* loop on input files */
+    {
+        methods_enabled = 0;
+        last_trial = 0;
 
-#ifdef PNG_READ_STRIP_16_TO_8_SUPPORTED
-                       png_set_strip_16(read_ptr);
-#else
-#ifdef PNG_READ_SCALE_16_TO_8_SUPPORTED
-                       png_set_scale_16(read_ptr);
-#else
-                       fprintf(STDERR,
-                       "   PNG_READ_STRIP_16_TO_8 NOT SUPPORTED\n");
+        if (png_row_filters != NULL)
+        {
+            free(png_row_filters);
+            png_row_filters = NULL;
+        }
+
+        image_specified_gamma = 0;
+        intent=specified_intent;
+        
+#ifdef PNGCRUSH_RECURSIVE
+        if (recursive_dir != NULL)
+            inname = pngcrush_walk_next();
+        else
 #endif
+        if (manifest_name != NULL)
+            inname = pngcrush_manifest_next();
+        else
+        inname = argv[names++];
+        if (inname != NULL && pngcrush_batch_skip(inname))
+            continue;
+        file_start_ms = pngcrush_clock_ms();
+        trace_file_us = pngcrush_trace_now();
+        mem_file_allocs = 0;
+        mem_file_bytes = 0;
+        apng_frames = 0;
+        apng_fdat_in = apng_fdat_out = 0;
+        mem_file_peak = mem_current;
+        mem_file_largest = 0;
+#if PNGCRUSH_TIMERS > 0
+        for (pc_timer = 0; pc_timer < PNGCRUSH_TIMERS; pc_timer++)
+            stats_timer_start[pc_timer] = pngcrush_timer_get_seconds(pc_timer)
+                + 1.e-9 * pngcrush_timer_get_nanoseconds(pc_timer);
 #endif
+        trials_timed = 0;
+        trials_skipped = 0;
+        trial_ms_spent = 0;
+
+        if (inname == NULL)
+        {
+#if PNGCRUSH_TIMERS > 0
+            pngcrush_timer_stop(PNGCRUSH_TIMER_MISC);
+            pngcrush_timer_stop(PNGCRUSH_TIMER_TOTAL);
 #endif
-                    }
-                      P1("force_output_bit_depth=%d\n",force_output_bit_depth);
-                    }
+            if (verbose >= 0)
+            {
+                show_result();
+                if (journal_fp != NULL)
+                    pngcrush_journal_summary();
+            }
+            break;
+        }
 
+        stdin_input = PNGCRUSH_IS_STDIO(inname);
+        stdout_output = outname != NULL && PNGCRUSH_IS_STDIO(outname) &&
+            pngcrush_mode == DEFAULT_MODE;
+        if ((stdin_input && pngcrush_mode != DEFAULT_MODE && !nosave) ||
+            (stdin_input && overwrite))
+        {
+            fprintf(STDERR, "pngcrush: cannot use \"-\" with -d, -e, or -ow\n");
+            exit(1);
+        }
+        if (stdin_input && stdin_data == NULL)
+            pngcrush_read_stdin();
 
-                    if (last_trial == 1)
-                    {
-                    if (save_apng_chunks == 1 || found_acTL_chunk == 1)
-                    {
-                       if (save_apng_chunks == 0)
-                       {
-                          if (verbose > 0) fprintf(STDERR,
-                          "   pngcrush will only save APNG chunks in an\n");
-                          if (verbose > 0) fprintf(STDERR,
-                          "   output file with the \".apng\" extension\n");
-                       }
-                       if (input_color_type != output_color_type)
-                       {
-                          if (verbose > 0) fprintf(STDERR,
-                          "   Cannot save APNG chunks with a color_type\n");
-                          if (verbose > 0) fprintf(STDERR,
-                          "   different from that of the main image.\n");
-                          save_apng_chunks = 2;
-                       }
-                       if (input_bit_depth != output_bit_depth)
-                       {
-                          if (verbose > 0) fprintf(STDERR,
-                          "   Cannot save APNG chunks with a bit_depth\n");
-                          if (verbose > 0) fprintf(STDERR,
-                          "   different from that of the main image.\n");
-                          save_apng_chunks = 2;
-                       }
-                       if (save_apng_chunks != 1 && found_acTL_chunk == 1)
-                          found_acTL_chunk = 2;
-                    }
-                    }
+        if (pngcrush_mode == DIRECTORY_MODE || pngcrush_mode == DIREX_MODE) {
+            int inlen, outlen;
+#ifndef __riscos
+            struct stat stat_buf;
+            if (stat(directory_name, &stat_buf))
+#else
+            if (fileexists(directory_name) & 2)
+#endif
+            {
+#if defined(_MBCS) || defined(WIN32) || defined(__WIN32__)
+                if (_mkdir(directory_name))
+#else
+                if (mkdir(directory_name, 0755))
+#endif
+                {
+                    fprintf(STDERR,
+                      "pngcrush: could not create directory %s\n",
+                      directory_name);
+                    exit(1);
+                }
+                nofilecheck = 1;
+            }
+            outlen = strlen(directory_name);
+            if (outlen >= STR_BUF_SIZE-1)
+            {
+                fprintf(STDERR,
+                  "pngcrush: directory %s is too long for buffer\n",
+                  directory_name);
+                exit(1);
+            }
 
-                    if (verbose > 1)
-                        fprintf(STDERR, "   Setting IHDR\n");
+            strcpy(out_string, directory_name);
+            /* Append a slash if it hasn't already got one at the end. */
+            if (out_string[outlen-1] != SLASH[0] &&
+                out_string[outlen-1] != FWD_SLASH[0] &&
+                out_string[outlen-1] != BACK_SLASH[0])
+              out_string[outlen++] = SLASH[0];   /* (assume SLASH is 1 byte) */
+            out_string[outlen] = '\0';
 
-#ifdef PNGCRUSH_LOCO
-                    output_format = 0;
-                    if (do_loco)
-                    {
-                        if (output_color_type == 2
-                            || output_color_type == 6)
-                        {
-                            output_format = 1;
-                            filter_method = 64;
-                            if (nosave == 0 && last_trial == 1)
-                               png_permit_mng_features(write_ptr,
-                                   PNG_FLAG_MNG_FILTER_64);
+            inlen = strlen(inname);
+            if (inlen >= STR_BUF_SIZE)
+            {
+                fprintf(STDERR,
+                   "pngcrush: filename %s is too long for buffer\n", inname);
+                exit(1);
+            }
+            strcpy(in_string, inname);
+            in_string[inlen] = '\0';
+#ifdef __riscos
+            op = strrchr(in_string, '.');
+            if (!op)
+                op = in_string;
+            else
+                op++;
+#else
+            op = in_string;
+            ip = in_string + inlen - 1;   /* start at last char in string */
+            while (ip > in_string)
+            {
+                if (*ip == '\\' || *ip == '/')
+                {
+                    op = ip + 1;
+                    break;
+                }
+                --ip;
+            }
+#endif
+#ifdef PNGCRUSH_RECURSIVE
+            if (recursive_dir != NULL)   /* mirror the tree */
+                op = in_string + (pngcrush_walk_relative(inname) - inname);
+#endif
 
-                        }
-                    } else
-                        filter_method = 0;
+            if (outlen + (inlen - (op - in_string)) >= STR_BUF_SIZE)
+            {
+                fprintf(STDERR,
+                   "pngcrush: full path is too long for buffer\n");
+                exit(1);
+            }
+            strcpy(out_string+outlen, op);
+            /*outlen += inlen - (op - in_string); */
+            outname = out_string;
+#ifdef PNGCRUSH_RECURSIVE
+            if (recursive_dir != NULL)
+                pngcrush_walk_mirror(out_string, outlen);
 #endif
+        }
 
-                    png_set_IHDR(write_ptr, write_info_ptr, width,
-                                 height, output_bit_depth,
-                                 output_color_type, interlace_method,
-                                 compression_method, filter_method);
+        if (overwrite && (pngcrush_mode == EXTENSION_MODE ||
+            pngcrush_mode == DIRECTORY_MODE ||
+            pngcrush_mode == DIREX_MODE))
+        {
+            if (overwrite > 0)
+            {
+               P1( "Ignoring \"-ow\"; cannot use it with \"-d\" or \"-e\"");
+               overwrite=0;
+            }
+        }
 
-                } /* IHDR */
+        /*
+         * FIXME:  need same input-validation fixes (as above) here, too
+         *
+         * FIXME:  what was the point of setting in_string and out_string in
+         *         DIREX_MODE above if going to do all over again here?
+         */
+        if (pngcrush_mode == EXTENSION_MODE || pngcrush_mode == DIREX_MODE)
+        {
+            ip = in_string;
+            in_string[0] = '\0';
+            if (pngcrush_mode == EXTENSION_MODE)
+                strncat(in_string, inname, STR_BUF_SIZE-1);
+            else
+                strncat(in_string, outname, STR_BUF_SIZE-1);
+            ip = in_string;
+            op = dot = out_string;
+            while (*ip != '\0')
+            {
+                *op++ = *ip++;
+#ifdef __riscos
+                if (*ip == '/')
+                    dot = op;
+#else
+                if (*ip == '.')
+                    dot = op;
+#endif
             }
+            *op = '\0';
 
-            if (premultiply == 1 || premultiply == 2)
+            if (dot != out_string)
+                *dot = '\0';
+
+            in_extension[0] = '\0';
+            if (dot != out_string)
             {
+                strncat(in_extension, ++dot, STR_BUF_SIZE - 1);
+            }
 
-#ifdef PNG_READ_PREMULTIPLY_ALPHA_SUPPORTED
-              /* 0: not premultipled
-               * 1: premultiplied input (input has .pngp suffix and the
-               *    PNGP chunk is present)
-               * 2: premultiplied output (output has .pngp suffix and the
-               *    -premultiply option is present; PNGP chunk is added)
-               * 3: premultiplied input and output (both have .pngp suffix)
-               */
-               P1("Calling png_set_premultiply_alpha\n");
-               png_set_premultiply_alpha(read_ptr,output_bit_depth);
+            strncat(out_string, extension, STR_BUF_SIZE - 1);
+            outname = out_string;
+        }
+
+        if ((outname[strlen(outname) - 4] == 'p') &&
+            (outname[strlen(outname) - 3] == 'p') &&
+            (outname[strlen(outname) - 2] == 'n') &&
+            (outname[strlen(outname) - 1] == 'g'))
+        {
+           /* Writing a *.ppng (png with premultiplied alpha) */
+            premultiply=2;
+#ifndef PNG_READ_PREMULTIPLY_ALPHA_SUPPORTED
+            png_error(read_ptr, "Premultiplied alpha is not supported");
 #endif
-            }
+        }
 
+        if ((outname[strlen(outname) - 4] == 'a') &&
+            (outname[strlen(outname) - 3] == 'p') &&
+            (outname[strlen(outname) - 2] == 'n') &&
+            (outname[strlen(outname) - 1] == 'g'))
+        {
+           /* Writing an APNG */
+           save_apng_chunks=1;
+        }
 
-            /* Handle ancillary chunks */
-            if (last_trial == 1)
+        if (nosave < 2)
+        {
+            P1( "Opening file %s for length measurement\n",
+                       inname);
+
+            if (!stdin_input)
             {
-#if defined(PNG_READ_bKGD_SUPPORTED) && defined(PNG_WRITE_bKGD_SUPPORTED)
+                trace_phase_us = pngcrush_trace_now();
+                if ((fpin = FOPEN(inname, "rb")) == NULL)
                 {
-                    png_color_16p background;
-                    if (!have_bkgd
-                        && png_get_bKGD(read_ptr, read_info_ptr,
-                                        &background))
-                    {
-                        if (keep_chunk("bKGD", argv))
-                        {
-                            if ((input_color_type == 2 ||
-                                input_color_type == 6) &&
-                                (output_color_type == 0 ||
-                                output_color_type == 4))
-                              background->gray = background->green;
-
-                            png_set_bKGD(write_ptr, write_info_ptr,
-                                         background);
-                        }
-                    }
-                    if (have_bkgd)
-                    {
-                        /* If we are reducing an RGB image to grayscale, but
-                         * the background color isn't gray, the green channel
-                         * is written.  That's not spec-compliant.  We should
-                         * really check for a non-gray bKGD and refuse to do
-                         * the reduction if one is present.
-                         */
-                        png_color_16 backgd;
-                        png_color_16p backgrnd = &backgd;
-                        backgrnd->red = bkgd_red;
-                        backgrnd->green = bkgd_green;
-                        backgrnd->blue = bkgd_blue;
-                        backgrnd->gray = backgrnd->green;
-                        backgrnd->index = bkgd_index;
-                        png_set_bKGD(write_ptr, write_info_ptr,
-                                     backgrnd);
-                    }
+                    fprintf(STDERR, "Could not find file: %s\n", inname);
+                    if (bench < 2)
+                        pngcrush_journal_record("ERR", 0, 0,
+                            pngcrush_clock_ms() - file_start_ms);
+                    continue;
                 }
-#endif /* PNG_READ_bKGD_SUPPORTED && PNG_WRITE_bKGD_SUPPORTED */
+                number_of_open_files++;
+                pngcrush_trace("open", "io", trace_phase_us,
+                    pngcrush_trace_now(), NULL);
+            }
 
-#if defined(PNG_READ_cHRM_SUPPORTED) && defined(PNG_WRITE_cHRM_SUPPORTED)
-#ifdef PNG_FIXED_POINT_SUPPORTED
-                {
-                    png_fixed_point white_x, white_y, red_x, red_y,
-                        green_x, green_y, blue_x, blue_y;
-
-                    if (found_cHRM && png_get_cHRM_fixed
-                        (read_ptr, read_info_ptr, &white_x, &white_y,
-                         &red_x, &red_y, &green_x, &green_y, &blue_x,
-                         &blue_y))
-                        {
-                          if (keep_chunk("cHRM", argv))
-                          {
-                                png_set_cHRM_fixed(write_ptr,
-                                                   write_info_ptr, white_x,
-                                                   white_y, red_x, red_y,
-                                                   green_x, green_y,
-                                                   blue_x, blue_y);
-                          }
-                        }
-                }
-#else
-                {
-                    double white_x, white_y, red_x, red_y, green_x,
-                        green_y, blue_x, blue_y;
+#ifdef PNGCRUSH_LOCO
+            if (new_mng)
+            {
 
-                    if (found_cHRM && png_get_cHRM
-                        (read_ptr, read_info_ptr, &white_x, &white_y,
-                         &red_x, &red_y, &green_x, &green_y, &blue_x,
-                         &blue_y)) {
-                        if (keep_chunk("cHRM", argv))
-                        {
-                                png_set_cHRM(write_ptr, write_info_ptr,
-                                             white_x, white_y, red_x,
-                                             red_y, green_x, green_y,
-                                             blue_x, blue_y);
-                        }
-                    }
-                }
-#endif /* PNG_FIXED_POINT_SUPPORTED */
-#endif /* PNG_READ_cHRM_SUPPORTED && PNG_WRITE_cHRM_SUPPORTED */
+#  ifdef PNG_USER_MEM_SUPPORTED
+               if (verbose > 0)
+                  mng_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING,
+                    (png_voidp) NULL, (png_error_ptr) pngcrush_cexcept_error,
+                    (png_error_ptr) pngcrush_warning, (png_voidp) NULL, 
+                    (png_malloc_ptr) pngcrush_debug_malloc,
+                    (png_free_ptr) pngcrush_debug_free);
+               else
+#  endif
+                  mng_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                    (png_voidp) NULL,
+                    (png_error_ptr) pngcrush_cexcept_error,
+                    (png_error_ptr) pngcrush_warning);
+               if (mng_ptr == NULL)
+                  fprintf(STDERR, "pngcrush could not create mng_ptr");
 
-#if defined(PNG_READ_gAMA_SUPPORTED) && defined(PNG_WRITE_gAMA_SUPPORTED)
-                {
-                    if (force_specified_gamma)
-                    {
-                        if (last_trial)
-                        {
-                            if (verbose > 0)
-                                fprintf(STDERR, "   Inserting gAMA chunk with "
-#ifdef PNG_FIXED_POINT_SUPPORTED
-                                  "gamma=(%d/100000)\n",
-#else
-                                  "gamma=%f\n",
-#endif
-                                  force_specified_gamma);
-                        }
-#ifdef PNG_FIXED_POINT_SUPPORTED
-                        png_set_gAMA_fixed(write_ptr, write_info_ptr,
-                                           (png_fixed_point)
-                                           force_specified_gamma);
-                        file_gamma =
-                            (png_fixed_point) force_specified_gamma;
-#else
-                        png_set_gAMA(write_ptr, write_info_ptr,
-                                     force_specified_gamma);
-                        file_gamma = force_specified_gamma;
-#endif
-                    }
-#ifdef PNG_FIXED_POINT_SUPPORTED
-                    else if (found_gAMA && png_get_gAMA_fixed
-                             (read_ptr, read_info_ptr, &file_gamma))
-#else
-                    else if (found_gAMA && png_get_gAMA
-                             (read_ptr, read_info_ptr, &file_gamma))
-#endif
-                    {
-                        if (keep_chunk("gAMA", argv))
-                        {
-                            if (image_specified_gamma)
-                                file_gamma = image_specified_gamma;
-                            if (verbose > 1 && last_trial)
-#ifdef PNG_FIXED_POINT_SUPPORTED
-                                fprintf(STDERR, "   gamma=(%d/100000)\n",
-                                        (int) file_gamma);
-                            if (double_gamma)
-                                file_gamma += file_gamma;
-                            png_set_gAMA_fixed(write_ptr, write_info_ptr,
-                                               file_gamma);
-#else
-                                fprintf(STDERR, "   gamma=%f\n",
-                                        file_gamma);
-                            if (double_gamma)
-                                file_gamma += file_gamma;
-                            png_set_gAMA(write_ptr, write_info_ptr,
-                                         file_gamma);
-#endif
-                        }
-                    }
-                    else if (specified_gamma)
-                    {
-                        if (last_trial)
-                        {
-                            if (verbose > 0)
-                                fprintf(STDERR, "   Inserting gAMA chunk with "
-#ifdef PNG_FIXED_POINT_SUPPORTED
-                                  "gamma=(%d/100000)\n",
-#else
-                                  "gamma=%f\n",
-#endif
-                                  specified_gamma);
-                        }
-#ifdef PNG_FIXED_POINT_SUPPORTED
-                        png_set_gAMA_fixed(write_ptr, write_info_ptr,
-                                           specified_gamma);
-                        file_gamma = (png_fixed_point) specified_gamma;
-#else
-                        png_set_gAMA(write_ptr, write_info_ptr,
-                                     specified_gamma);
-                        file_gamma = specified_gamma;
-#endif
-                    }
-                }
-#endif /* PNG_READ_gAMA_SUPPORTED && PNG_WRITE_gAMA_SUPPORTED */
+               if ((mng_out = FOPEN(mngname, "wb")) == NULL)
+               {
+                  fprintf(STDERR,
+                      "pngcrush: could not open output file %s\n",
+                      mngname);
+                  if (fpin)
+                      FCLOSE(fpin);
+                  exit(1);
+               }
+               number_of_open_files++;
+               png_init_io(mng_ptr, mng_out);
+               png_set_write_fn(mng_ptr, (png_voidp) mng_out,
+                                (png_rw_ptr) pngcrush_write_png,
+                                pngcrush_flush);
+            }
+#endif /* PNGCRUSH_LOCO */
 
-#if defined(PNG_READ_sRGB_SUPPORTED) && defined(PNG_WRITE_sRGB_SUPPORTED)
-                {
-                    int file_intent;
+            trace_phase_us = pngcrush_trace_now();
+            idat_length[0] = measure_idats(fpin);
+            pngcrush_keep_raw_chunks(argv);
+            pngcrush_trace("measure_idats", "io", trace_phase_us,
+                pngcrush_trace_now(), NULL);
 
-                    if (png_get_sRGB
-                        (read_ptr, read_info_ptr, &file_intent))
-                    {
-                        if (keep_chunk("sRGB", argv))
-                        {
-                            png_set_sRGB(write_ptr, write_info_ptr,
-                                         file_intent);
-                            intent = file_intent;
-                        }
-                    }
-                    else if (found_sRGB)
-                    {
-#ifdef PNG_gAMA_SUPPORTED
-#  ifdef PNG_FIXED_POINT_SUPPORTED
-                        if (file_gamma >= 45000L && file_gamma <= 46000L)
-#  else
-                        if (file_gamma >= 0.45000 && file_gamma <= 0.46000)
-#  endif
-                        {
-                            if (verbose > 0 && last_trial)
-                                fprintf(STDERR,
-                                  "   Inserting sRGB chunk with intent=%d\n",
-                                  intent);
-                            png_set_sRGB(write_ptr, write_info_ptr,
-                                         intent);
-                        }
-                        else if (file_gamma != 0)
-                        {
-                            if (verbose > 0 && last_trial)
-                            {
-                                fprintf(STDERR, "   Ignoring sRGB request; "
-#  ifdef PNG_FIXED_POINT_SUPPORTED
-                                  "gamma=(%lu/100000)"
-                                  " is not approx. 0.455\n",
-                                  (unsigned long)file_gamma);
-#  else
-                                  "gamma=%f"
-                                  " is not approx. 0.455\n",
-                                  file_gamma);
-#  endif
-                            }
-                        }
-#endif /* PNG_gAMA_SUPPORTED */
-                    }
-                }
-#endif /* PNG_READ_sRGB_SUPPORTED && PNG_WRITE_sRGB_SUPPORTED */
+            trace_phase_us = pngcrush_trace_now();
+            pngcrush_recompress_raw_chunks();
+            pngcrush_trace("recompress_chunks", "deflate", trace_phase_us,
+                pngcrush_trace_now(), NULL);
 
-#if defined(PNG_READ_iCCP_SUPPORTED) && defined(PNG_WRITE_iCCP_SUPPORTED)
-                if (intent < 0) {  /* ignore iCCP if sRGB is being written */
-                    png_charp name;
-#if PNGCRUSH_LIBPNG_VER < 10500
-                    png_charp profile;
-#else
-                    png_bytep profile;
+#ifdef PNGCRUSH_LOCO
+            if (new_mng)
+            {
+                    png_destroy_write_struct(&mng_ptr, NULL);
+                    FCLOSE(mng_out);
+            }
 #endif
-                    png_uint_32 proflen;
-                    int compression_method;
 
-                    if (found_iCCP && png_get_iCCP
-                        (read_ptr, read_info_ptr, &name,
-                         &compression_method, &profile, &proflen))
-                    {
-                        P1("Got iCCP chunk, proflen=%lu\n",
-                            (unsigned long)proflen);
-                        if (iccp_length)
-                            P0("Will not replace existing iCCP chunk.\n");
-                        if (keep_chunk("iCCP", argv))
-                            png_set_iCCP(write_ptr, write_info_ptr,
-#if PNGCRUSH_LIBPNG_VER < 10500
-                                                           name,
-#else
-                                         (png_const_charp) name,
-#endif
-                                         compression_method, profile,
-                                         proflen);
+            if (fpin)
+                FCLOSE(fpin);
 
-                    }
-#ifdef PNG_iCCP_SUPPORTED
-                    else if (iccp_length)
-                    {
-                        png_set_iCCP(write_ptr, write_info_ptr, iccp_name,
-                                     0,
-#if PNGCRUSH_LIBPNG_VER < 10500
-                                     iccp_text,
-#else
-                                     (png_const_bytep) iccp_text,
-#endif
-                                     iccp_length);
-                        P1("Wrote iCCP chunk, proflen=%d\n", iccp_length);
-                    }
-#endif /* PNG_iCCP_SUPPORTED */
 
+            if (verbose >= 0 && bench < 2)
+            {
+                if (nosave)
+                {
+                  fprintf(STDERR, "  %s:\n", inname);
                 }
-#endif /* PNG_READ_iCCP_SUPPORTED && PNG_WRITE_iCCP_SUPPORTED */
-
-#if defined(PNG_READ_oFFs_SUPPORTED) && defined(PNG_WRITE_oFFs_SUPPORTED)
+                else if (overwrite)
                 {
-                    png_int_32 offset_x, offset_y;
-                    int unit_type;
-
-                    if (png_get_oFFs
-                        (read_ptr, read_info_ptr, &offset_x, &offset_y,
-                         &unit_type)) {
-                        if (offset_x == 0 && offset_y == 0)
-                        {
-                            if (verbose > 0 && last_trial)
-                                fprintf(STDERR,
-                                  "   Deleting useless oFFs 0 0 chunk\n");
-                        }
-                        else
-                        {
-                            if (keep_chunk("oFFs", argv))
-                                png_set_oFFs(write_ptr, write_info_ptr,
-                                             offset_x, offset_y,
-                                             unit_type);
-                        }
-                    }
+                  fprintf(STDERR,
+                    "  Recompressing IDAT chunks in %s\n", inname);
                 }
-#endif /* PNG_READ_oFFs_SUPPORTED && PNG_WRITE_oFFs_SUPPORTED */
-
-#if defined(PNG_READ_pCAL_SUPPORTED) && defined(PNG_WRITE_pCAL_SUPPORTED)
+                else
                 {
-                    png_charp purpose, units;
-                    png_charpp params;
-                    png_int_32 X0, X1;
-                    int type, nparams;
-
-                    if (png_get_pCAL
-                        (read_ptr, read_info_ptr, &purpose, &X0, &X1,
-                         &type, &nparams, &units, &params))
-                    {
-                        if (keep_chunk("pCAL", argv))
-                            png_set_pCAL(write_ptr, write_info_ptr,
-                                         purpose, X0, X1, type, nparams,
-                                         units, params);
-                    }
+                  fprintf(STDERR,
+                    "  Recompressing IDAT chunks in %s to %s\n",
+                    inname, outname);
                 }
-#endif /* pCAL_SUPPORTED */
+                fprintf(STDERR,
+                  "   Total length of data found in critical chunks        "
+                  "    =%10lu\n", (unsigned long)idat_length[0]);
+                fflush(STDERR);
+            }
 
-#if defined(PNG_READ_pHYs_SUPPORTED) && defined(PNG_WRITE_pHYs_SUPPORTED)
-                {
-                    png_uint_32 res_x, res_y;
-                    int unit_type;
+            if (idat_length[0] == 0)
+            {
+                if (bench < 2)
+                    pngcrush_journal_record("ERR", input_length, 0,
+                        pngcrush_clock_ms() - file_start_ms);
+                continue;
+            }
 
-                    if (resolution == 0)
-                    {
-                        if (png_get_pHYs
-                            (read_ptr, read_info_ptr, &res_x, &res_y,
-                             &unit_type))
-                        {
-                            if (res_x == 0 && res_y == 0)
-                            {
-                                if (verbose > 0 && last_trial)
-                                    fprintf(STDERR,
-                                      "   Deleting useless pHYs 0 0 chunk\n");
-                            }
-                            else
-                            {
-                                if (keep_chunk("pHYs", argv))
-                                    png_set_pHYs(write_ptr, write_info_ptr,
-                                                 res_x, res_y, unit_type);
-                            }
-                        }
-                    } else {
-                        unit_type = 1;
-                        res_x = res_y =
-                            (png_uint_32) ((resolution / .0254 + 0.5));
-                        png_set_pHYs(write_ptr, write_info_ptr, res_x,
-                                     res_y, unit_type);
-                        if (verbose > 0 && last_trial)
-                            fprintf(STDERR, "   Added pHYs %lu %lu 1 chunk\n",
-                            (unsigned long)res_x,
-                            (unsigned long)res_y);
-                    }
-                }
-#endif
+            if (verify && nosave == 0 && !stdout_output)
+                pngcrush_verify_start();
+        }
 
-#if defined(PNG_READ_hIST_SUPPORTED) && defined(PNG_WRITE_hIST_SUPPORTED)
-                {
-                    png_uint_16p hist;
+        else
+            idat_length[0] = 1;
 
-                    if (png_get_hIST(read_ptr, read_info_ptr, &hist))
-                    {
-                        if (keep_chunk("hIST", argv))
-                            png_set_hIST(write_ptr, write_info_ptr, hist);
-                    }
-                }
-#endif /* hIST_SUPPORTED */
+        if (image_is_immutable)
+        {
+            fprintf(STDERR,
+              "   Image %s has a dSIG chunk and is immutable.\n", inname);
+        }
 
-#if defined(PNG_READ_tRNS_SUPPORTED) && defined(PNG_WRITE_tRNS_SUPPORTED)
-                {
-                    if (png_get_tRNS
-                        (read_ptr, read_info_ptr, &trans, &num_trans,
-                         &trans_values))
-                    {
-                        if (verbose > 1 && last_trial)
-                            fprintf(STDERR,
-                              "  Found tRNS chunk in input file.\n");
-                        if (have_trns == 1)
-                        {
-                            P0("  Will not overwrite existing tRNS chunk.\n");
-                        }
-                        if (keep_chunk("tRNS", argv))
-                        {
-                            int last_nonmax = -1;
-                            trns_red = trans_values->red;
-                            trns_green = trans_values->green;
-                            trns_blue = trans_values->blue;
-                            trns_gray = trans_values->gray;
-                            if (output_color_type == 3)
-                            {
-                                for (ia = 0; ia < num_trans; ia++)
-                                    trns_array[ia] = trans[ia];
-                                for (; ia < 256; ia++)
-                                    trns_array[ia] = 255;
-                                for (ia = 0; ia < 256; ia++)
-                                {
-                                    if (trns_array[ia] != 255)
-                                        last_nonmax = ia;
-                                }
-                                if (last_trial && verbose > 0)
-                                {
-                                    if (last_nonmax < 0)
-                                        fprintf(STDERR, "   Deleting "
-                                          "all-opaque tRNS chunk.\n");
-                                    else if (last_nonmax + 1 < num_trans)
-                                        fprintf(STDERR,
-                                          "   Truncating trailing opaque "
-                                          "entries from tRNS chunk.\n");
-                                }
-                                num_trans = last_nonmax + 1;
-                            }
-                            else
-                            {
-                               /* color type is 0 or 2 */
-                               if (input_bit_depth == 16 &&
-                                   output_bit_depth == 8)
-                               {
-                                 /* zero out the high byte */
-                                 trans_values->red &= 0x00ff;
-                                 trans_values->green &= 0x00ff;
-                                 trans_values->blue &= 0x00ff;
-                                 trans_values->gray &= 0x00ff;
-                               }
+        if (!image_is_immutable)
+        {
 
-                            }
-                            if (verbose > 1)
-                                fprintf(STDERR,
-                                  "   png_set_tRNS, num_trans=%d\n",
-                                  num_trans);
-                            if (output_color_type < 3 || num_trans)
-                                png_set_tRNS(write_ptr, write_info_ptr,
-                                             trans, num_trans,
-                                             trans_values);
-                        }
-                    }
-                    else if (have_trns == 1)
-                    {
-                        /* will not overwrite existing trns data */
-                        png_color_16 trans_data;
-                        png_byte index_data = (png_byte) trns_index;
-                        num_trans = index_data + 1;
-                        if (verbose > 1)
-                            fprintf(STDERR, "Have_tRNS, num_trans=%d\n",
-                                    num_trans);
-                        if (output_color_type == 3)
-                        {
-                            trans_values = NULL;
-                            for (ia = 0; ia < num_trans; ia++)
-                                trns_array[ia] = trans_in[ia];
-                            for (; ia < 256; ia++)
-                                trns_array[ia] = 255;
-                        } else {
-                            for (ia = 0; ia < 256; ia++)
-                                trns_array[ia] = 255;
-                            trns_array[index_data] = 0;
+        if (force_output_color_type != 8 &&
+            force_output_color_type != 0 &&
+            force_output_color_type != 2 &&
+            force_output_color_type != 3 &&
+            force_output_color_type != 4 &&
+            force_output_color_type != 6)
+        {
+            fprintf(STDERR, "\n  Ignoring invalid color_type: %d\n",
+              force_output_color_type);
+            force_output_color_type=8;
+        }
+        output_color_type = force_output_color_type;
 
-                            trans_data.index = index_data;
-                            trans_data.red = trns_red;
-                            trans_data.green = trns_green;
-                            trans_data.blue = trns_blue;
-                            trans_data.gray = trns_gray;
-                            trans_values = &trans_data;
-                        }
+        output_bit_depth = force_output_bit_depth;
 
-                        P0("  Adding a tRNS chunk\n");
-                        png_set_tRNS(write_ptr, write_info_ptr, trns_array,
-                                     num_trans, trans_values);
-                    }
-                    else
-                    {
-                        for (ia = 0; ia < 256; ia++)
-                            trns_array[ia] = 255;
-                    }
-                    if (verbose > 1 && last_trial)
-                    {
-                        int last = -1;
-                        for (ia = 0; ia < num_palette; ia++)
-                            if (trns_array[ia] != 255)
-                                last = ia;
-                        if (last >= 0) {
-                            fprintf(STDERR, "   Transparency:\n");
-                            if (output_color_type == 3)
-                                for (ia = 0; ia < num_palette; ia++)
-                                    fprintf(STDERR, "      %4d %4d\n", ia,
-                                            trns_array[ia]);
-                            else if (output_color_type == 0)
-                                fprintf(STDERR, "      %d\n", trns_gray);
-                            else if (output_color_type == 2)
-                                fprintf(STDERR, "      %d %d %d\n",
-                                        trns_red, trns_green, trns_blue);
-                        }
-                    }
-                }
-#endif /* PNG_READ_tRNS_SUPPORTED && PNG_WRITE_tRNS_SUPPORTED */
-            }  /* End of ancillary chunk handling */
+        best_of_three = 1;
+        pngcrush_best_byte_count=0xffffffff;
 
-                if (png_get_PLTE
-                    (read_ptr, read_info_ptr, &palette, &num_palette))
-                {
-                    if (plte_len > 0)
-                        num_palette = plte_len;
-                    if (do_pplt)
-                    {
-                        fprintf(STDERR,"PPLT: %s\n", pplt_string);
-                        fprintf(STDERR,"Sorry, PPLT is not implemented yet.\n");
-                    }
-
-                    if (nosave == 0)
-                    {
-                    if (output_color_type == 3)
-                        png_set_PLTE(write_ptr, write_info_ptr, palette,
-                                     num_palette);
-                    else if (keep_chunk("PLTE", argv))
-                        png_set_PLTE(write_ptr, write_info_ptr, palette,
-                                     num_palette);
+        if (blacken == 1 || make_gray == 1 || make_opaque == 1 ||
+            reduce_palette == 1)
+        {
+           try_method[0] = 0;
+        }
 
-                    }
-                    if (verbose > 1 && last_trial)
-                    {
-                        png_colorp p = palette;
-                        fprintf(STDERR, "   Palette:\n");
-                        fprintf(STDERR,
-                          "      I    R    G    B ( color )    A\n");
-                        for (i = 0; i < num_palette; i++)
-                        {
-                            fprintf(STDERR,
-                              "   %4d %4d %4d %4d (#%2.2x%2.2x%2.2x) %4d\n",
-                              i, p->red, p->green, p->blue, p->red,
-                              p->green, p->blue, trns_array[i]);
-                            p++;
-                        }
-                    }
-                }
+        make_trns = 0;
+        trns_key_found = 0;
+        if (reduce_trns && make_opaque == 1)
+        {
+           if (found_tRNS || found_acTL_chunk == 1)
+           {
+              P1("Cannot replace the alpha channel with a tRNS key when"
+                 " tRNS or acTL chunk is present\n");
+           }
+           else
+              make_trns = 1;
+        }
 
+        /*
+         * From the PNG spec, various dependencies among chunk types
+         *   must be accounted for during any reduction of color type
+         *   or bit depth:
+         *
+         * IHDR valid bit depth depends on color type
+         *   valid filter type depends on color type (for MNG extensions)
+         * tRNS depends on color type
+         *   depends on num_palette for color type 3 (palette)
+         * iCCP valid profile depends on color type
+         * sBIT depends on color type and bit depth
+         * bKGD depends on color type and bit depth
+         * hIST depends on num_palette
+         *
+         * Chunk types present have been detected in the first pass over
+         *   the file, in the measure_idat() function.
+         */
 
-            /* Handle ancillary chunks */
-            if (last_trial == 1)
-            {
-#if defined(PNG_READ_sBIT_SUPPORTED) && defined(PNG_WRITE_sBIT_SUPPORTED)
-                {
-                    png_color_8p sig_bit;
+        if (make_gray)
+        {
+           if ((found_iCCP && keep_unknown_chunk("iCCP", argv)) ||
+               (found_color_bKGD && keep_unknown_chunk("bKGD", argv)) ||
+               found_acTL_chunk == 1 ||
+               (found_sBIT_different_RGB_bits &&
+               keep_unknown_chunk("sBIT", argv)))
+           {
+              P1 ("Cannot change colortype to gray when iCCP,"
+                  " acTL, bKGD with color, or sBIT chunk is present\n");
+              make_gray = 0;
+           }
+           else
+           {
+              make_gray = 1;
+              try_method[0] = 0;
+           }
+        }
 
-                    /* If we are reducing a truecolor PNG to grayscale, and the
-                     * RGB sBIT values aren't identical, we'll lose sBIT info.
-                     */
-                    if (png_get_sBIT(read_ptr, read_info_ptr, &sig_bit))
-                    {
-                        if (keep_chunk("sBIT", argv))
-                        {
-                            if ((input_color_type == 0
-                                 || input_color_type == 4)
-                                && (output_color_type == 2
-                                    || output_color_type == 6
-                                    || output_color_type == 3))
-                                sig_bit->red = sig_bit->green =
-                                    sig_bit->blue = sig_bit->gray;
-                            if ((input_color_type == 2
-                                 || input_color_type == 6
-                                 || output_color_type == 3)
-                                && (output_color_type == 0
-                                    || output_color_type == 4))
-                                sig_bit->gray = sig_bit->green;
+        if (make_opaque)
+        {
+           if (found_tRNS || found_acTL_chunk == 1)
+           {
+             P1("Cannot remove the alpha channel when tRNS"
+                  " or acTL chunk is present\n");
+             make_opaque = 0;
+           }
+           else
+           {
+             make_opaque = 1;
+             try_method[0] = 0;
+           }
+        }
 
-                            if ((input_color_type == 0
-                                 || input_color_type == 2)
-                                && (output_color_type == 4
-                                    || output_color_type == 6))
-                                sig_bit->alpha = 1;
+        if (make_8_bit)
+        {
+           if ((found_bKGD && keep_unknown_chunk("bKGD", argv)) ||
+              found_acTL_chunk == 1 ||
+              (found_sBIT_max > 8 && keep_unknown_chunk("sBIT", argv)))
+           {
+              P1 ("Cannot reduce bit depth to 8 when bKGD,"
+                  " sBIT or acTL chunk is present\n");
+              make_8_bit = 0;
+           }
+           else
+           {
+             make_8_bit = 1;
+             try_method[0] = 0;
+           }
+        }
 
-                            if (nosave == 0)
-                               png_set_sBIT(write_ptr, write_info_ptr,
-                                         sig_bit);
-                        }
-                    }
-                }
-#endif /* PNG_READ_sBIT_SUPPORTED)&& PNG_WRITE_sBIT_SUPPORTED */
+        interlace_trials = 0;
+        depth_trials = 0;
+        decoded_image_ready = 0;
+        tune_trials = tune_search;
+        if (interlace_search || force_interlace >= 0)
+        {
+           if (found_acTL_chunk != 0)
+           {
+              P1("Cannot change interlacing when acTL chunk is present\n");
+           }
+           else
+              interlace_trials = interlace_search;
+        }
 
-#ifdef PNG_sCAL_SUPPORTED
-#  ifdef PNG_FLOATING_POINT_SUPPORTED
-                {
-                    int unit;
-                    double scal_width, scal_height;
+        gray_bit_depth = -1;
+        if (reduce_gray_depth)
+        {
+           if ((found_bKGD && keep_unknown_chunk("bKGD", argv)) ||
+              found_tRNS || found_acTL_chunk == 1 ||
+              (found_sBIT && keep_unknown_chunk("sBIT", argv)))
+           {
+              P1 ("Cannot reduce gray bit depth when bKGD, tRNS,"
+                  " sBIT or acTL chunk is present\n");
+           }
+           else
+           {
+             gray_bit_depth = 1;
+             try_method[0] = 0;
+           }
+        }
 
-                    if (png_get_sCAL
-                        (read_ptr, read_info_ptr, &unit, &scal_width,
-                         &scal_height))
-                    {
-                        png_set_sCAL(write_ptr, write_info_ptr, unit,
-                                     scal_width, scal_height);
-                    }
-                }
-#  else
-#    ifdef PNG_FIXED_POINT_SUPPORTED
-                {
-                    int unit;
-                    png_charp scal_width, scal_height;
+        if (input_color_type == 3 && reduce_palette)
+        {
+           if ((found_hIST && keep_unknown_chunk("hIST", argv)) ||
+              found_acTL_chunk == 1)
+           {
+             P1("Cannot reduce palette length when hIST"
+                 " or acTL chunk is present\n");
+             reduce_palette = 0;
+             plte_len = -1;
+           }
+           else
+           {
+             try_method[0] = 0;
+             plte_len = 0;
+           }
+        }
 
-                    if (png_get_sCAL_s
-                        (read_ptr, read_info_ptr, &unit, &scal_width,
-                         &scal_height))
-                    {
-                        if (keep_chunk("sCAL", argv))
-                            png_set_sCAL_s(write_ptr, write_info_ptr, unit,
-                                           scal_width, scal_height);
-                    }
-                }
-#    endif
-#  endif /* PNG_FLOATING_POINT_SUPPORTED */
-#endif /* PNG_sCAL_SUPPORTED */
+        /* Handle specified brute_force options */
+        if (brute_force_level || brute_force_filter || brute_force_strategy)
+        {
+           for (method = 1; method < num_methods; method++)
+           {
+             int option;
 
-#ifdef PNG_sPLT_SUPPORTED
-                {
-                    png_sPLT_tp entries;
-                    int num_entries;
+             try_method[method]=1;
+             if (brute_force_level)
+             {
+                for (option = 0; option < 10; option++)
+                   if (option == lv[method])
+                      try_method[method]=brute_force_levels[option];
+             }
 
-                    num_entries =
-                        (int) png_get_sPLT(read_ptr, read_info_ptr,
-                                           &entries);
-                    if (num_entries)
-                    {
-                        if (keep_chunk("sPLT", argv))
-                            png_set_sPLT(write_ptr, write_info_ptr,
-                                         entries, num_entries);
-                    }
-                }
-#endif
+             if ((try_method[method] == 0) && brute_force_filter)
+             {
+                for (option = 0; option < 6; option++)
+                   if (option == fm[method])
+                      try_method[method]=brute_force_filters[option];
+             }
 
-#ifdef PNG_TEXT_SUPPORTED
-                {
-                    png_textp text_ptr;
-                    int num_text = 0;
+             if ((try_method[method] == 0) && brute_force_strategy)
+             {
+                for (option = 0; option < NUM_STRATEGIES; option++)
+                   if (option == zs[method])
+                      try_method[method]=brute_force_strategies[option];
+             }
 
-                    if (png_get_text
-                        (read_ptr, read_info_ptr, &text_ptr, &num_text) > 0
-                        || text_inputs)
-                    {
-                        int ntext;
-                        P1( "Handling %d tEXt/zTXt chunks before IDAT\n",
-                                   num_text);
+             if (method && method < 11)
+                try_method[method] = 1;
+           }
 
-                        if (verbose > 1 && last_trial && num_text > 0)
-                        {
-                            for (ntext = 0; ntext < num_text; ntext++)
-                            {
-                                fprintf(STDERR, "%d  %s", ntext,
-                                        text_ptr[ntext].key);
-                                if (text_ptr[ntext].text_length)
-                                    fprintf(STDERR, ": %s\n",
-                                            text_ptr[ntext].text);
-#ifdef PNG_iTXt_SUPPORTED
-                                else if (text_ptr[ntext].itxt_length)
-                                {
-                                    fprintf(STDERR, " (%s: %s): \n",
-                                            text_ptr[ntext].lang,
-                                            text_ptr[ntext].lang_key);
-                                    fprintf(STDERR, "%s\n",
-                                            text_ptr[ntext].text);
-                                }
-#endif
-                                else
-                                    fprintf(STDERR, "\n");
-                            }
-                        }
-
-                        if (num_text > 0)
-                        {
-                            if (keep_chunk("text", argv))
-                            {
-                                int num_to_write = num_text;
-                                for (ntext = 0; ntext < num_text; ntext++)
-                                {
-                                    if (last_trial)
-                                        P2("Text chunk before IDAT, "
-                                          "compression=%d\n",
-                                          text_ptr[ntext].compression);
-                                    if (text_ptr[ntext].compression ==
-                                        PNG_TEXT_COMPRESSION_NONE) {
-                                        if (!keep_chunk("tEXt", argv))
-                                        {
-                                            text_ptr[ntext].key[0] = '\0';
-                                            num_to_write--;
-                                        }
-                                    }
-                                    if (text_ptr[ntext].compression ==
-                                        PNG_TEXT_COMPRESSION_zTXt)
-                                    {
-                                        if (!keep_chunk("zTXt", argv))
-                                        {
-                                            text_ptr[ntext].key[0] = '\0';
-                                            num_to_write--;
-                                        }
-                                    }
-#ifdef PNG_iTXt_SUPPORTED
-                                    if (text_ptr[ntext].compression ==
-                                        PNG_ITXT_COMPRESSION_NONE
-                                        || text_ptr[ntext].compression ==
-                                        PNG_ITXT_COMPRESSION_zTXt)
-                                    {
-                                        if (!keep_chunk("iTXt", argv))
-                                        {
-                                            text_ptr[ntext].key[0] = '\0';
-                                            num_to_write--;
-                                        }
-                                    }
-#endif
-                                }
-                                if (num_to_write > 0)
-                                    png_set_text(write_ptr, write_info_ptr,
-                                                 text_ptr, num_text);
-                            }
-                        }
-                        for (ntext = 0; ntext < text_inputs; ntext++)
-                        {
-                            if (text_where[ntext] == 1)
-                            {
-                                png_textp added_text;
-                                added_text = (png_textp) png_malloc(write_ptr,
-                                               (png_uint_32) sizeof(png_text));
-                                added_text[0].key = &text_keyword[ntext * 80];
-#ifdef PNG_iTXt_SUPPORTED
-                                added_text[0].lang = &text_lang[ntext * 80];
-                                added_text[0].lang_key =
-                                    &text_lang_key[ntext * 80];
-#endif
-                                added_text[0].text = 
-                                    &text_text[ntext * STR_BUF_SIZE];
-                                added_text[0].compression =
-                                    text_compression[ntext];
-                                png_set_text(write_ptr, write_info_ptr,
-                                             added_text, 1);
-                                if (verbose > 0 && last_trial)
-                                {
-                                  if (added_text[0].compression < 0)
-                                      fprintf(STDERR,
-                                         "   Added a tEXt chunk.\n");
-                                  else if (added_text[0].compression == 0)
-                                      fprintf(STDERR,
-                                         "   Added a zTXt chunk.\n");
-#ifdef PNG_iTXt_SUPPORTED
-                                  else
-                                      fprintf(STDERR,
-                                         "   Added a%scompressed iTXt chunk"
-                                        ".\n", (added_text[0].compression == 1)?
-                                        "n un" : " ");
-#endif
-                                }
-                                png_free(write_ptr, added_text);
-                                added_text = (png_textp) NULL;
-                            }
-                        }
-                    }
-                }
-#endif /* defined(PNG_TEXT_SUPPORTED) */
+           if (speed)
+           {
+             /* Do not try AVG or PAETH */
+             for (method = 1; method < num_methods; method++)
+             {
+               if (try_method[method] == 0 && (fm[method] == 3 ||
+                   fm[method] == 4 || fm[method] == 5))
+                     try_method[method] = 1;
+             }
+           }
+         }
 
-#if defined(PNG_READ_tIME_SUPPORTED) && defined(PNG_WRITE_tIME_SUPPORTED)
-                {
-                    png_timep mod_time;
+        if (methods_specified == 0 || try10 != 0)
+        {
+            for (i = 0; i <= DEFAULT_METHODS; i++)
+                try_method[i] = 0;
 
-                    if (png_get_tIME(read_ptr, read_info_ptr, &mod_time))
-                    {
-                        if (keep_chunk("tIME", argv))
-                            png_set_tIME(write_ptr, write_info_ptr, mod_time);
-                    }
-                }
-#endif
+            try_method[6] = try10;
+        }
 
-#ifdef PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED
-                /* This section handles pCAL and tIME (at least, in default
-                 * build), gIFx/gIFg/gIFt, private Fireworks chunks, etc. */
-                {
-                    png_unknown_chunkp unknowns;   /* allocated by libpng */
-                    int num_unknowns;
+        for (i = 1; i <= MAX_METHODS; i++)
+        {
+           methods_enabled += (1 - try_method[i]);
+        }
+        P1("%d methods enabled\n",methods_enabled);
+/* Skip trial 0 when a single method was specified and -reduce was not */
+        if (methods_specified != 0 && noreduce != 0)
+        {
+          if (methods_enabled == 1)
+          {
+             try_method[0] = 1;
+             make_opaque = 0;
+             make_gray = 0;
+             make_8_bit = 0;
+             reduce_palette = 0;
+          }
+        }
 
-                    num_unknowns = (int)png_get_unknown_chunks(read_ptr,
-                      read_info_ptr, &unknowns);
+        last_method = 0;
+        for (i = 1; i <= MAX_METHODS; i++)
+        {
+           if (try_method[i] == 0)
+              last_method = i;
+        }
 
-                    if (nosave == 0 && ster_mode >= 0)
-                    {
-                        /* Add sTER chunk */
-                        png_unknown_chunkp ster;
-                        P1("Handling sTER as unknown chunk %d\n", num_unknowns);
-                        ster = (png_unknown_chunk*)png_malloc(read_ptr,
-                            (png_uint_32) sizeof(png_unknown_chunk));
-                        png_memcpy((char *)ster[0].name, "sTER",5);
-                        ster[0].size = 1;
-                        ster[0].data = (png_byte*)png_malloc(read_ptr, 1);
-                        ster[0].data[0] = (png_byte)ster_mode;
-                        png_set_unknown_chunks(read_ptr, read_info_ptr,
-                         ster, 1);
-                        png_free(read_ptr,ster[0].data);
-                        png_free(read_ptr,ster);
-                        num_unknowns++;
-                    }
+        if (methods_enabled > 1)
+           last_method++;
 
-#ifndef PNG_HAVE_IHDR
-#define PNG_HAVE_IHDR 0x01
-#endif
-                    if (ster_mode >= 0)
-                        png_set_unknown_chunk_location(read_ptr, read_info_ptr,
-                           num_unknowns - 1, (int)PNG_HAVE_IHDR);
+        P1("   pngcrush: methods     = %d\n",methods_enabled);
+        P1("   pngcrush: last_method = %d\n",last_method);
+        
+        if (methods_enabled == 1 && last_method == 176)
+           copy_idat = 1;
 
-                    P1("Found %d unknown chunks\n", num_unknowns);
+        best_of_three = 1;
 
-                    if (nosave == 0 && num_unknowns)
-                    {
-                        png_unknown_chunkp unknowns_keep; /* allocated by us */
-                        int num_unknowns_keep;
+#ifndef __riscos
+        if (stdin_input)
+            input_length = (unsigned long) stdin_data_length;
+        else
+        {
+            /* COVERITY complains about TOCTOU when inname is used later */
+            struct stat stat_buf;
+            stat(inname, &stat_buf);
+            input_length = (unsigned long) stat_buf.st_size;
+        }
+#else
+        input_length = (unsigned long) filesize(inname);
+#endif
+#if PNGCRUSH_TIMERS > 0
+        if (bench_sample >= 0)
+            bench_bytes[bench_sample] += (double) input_length;
+#endif
 
-                        unknowns_keep = (png_unknown_chunk*)png_malloc(
-                          write_ptr, (png_uint_32) num_unknowns
-                          *sizeof(png_unknown_chunk));
+        /* ////////////////////////////////////////////////////////////////////
+        ////////////////                                   ////////////////////
+        ////////////////  START OF MAIN LOOP OVER METHODS  ////////////////////
+        ////////////////                                   ////////////////////
+        //////////////////////////////////////////////////////////////////// */
 
-                        P1("malloc for %d unknown chunks\n", num_unknowns);
-                        num_unknowns_keep = 0;
+        /* MAX_METHODS is 177 */
+        P1("\n\nENTERING MAIN LOOP OVER %d METHODS\n", MAX_METHODS);
+        pngcrush_schedule_trials(last_method, fm, lv, zs);
+        repeat_trial = -1;
+        for (trial_pos = 0; trial_pos <= last_method; trial_pos++)
+        {
+            trial = trial_order[trial_pos];
+            repeat = (trial == repeat_trial) ? repeat + 1 : 0;
+            repeat_trial = -1;
+            depth_flip = depth_trials ? (repeat & 1) : 0;
+            interlace_flip = interlace_trials ?
+                ((repeat >> depth_trials) & 1) : 0;
+            deflate_tune = repeat >> (interlace_trials + depth_trials);
+            projected_bail = 0;
+            image_reused = 0;
 
-                        /* make an array of only those chunks we want to keep */
-                        for (i = 0; i < num_unknowns; i++)
-                        {
-                            P1("Handling unknown chunk %d %s\n", i,
-                               (char *)unknowns[i].name);
-                            /* not EBCDIC-safe, but neither is keep_chunks(): */
-                            P2("   unknown[%d] = %s (%lu bytes, location %d)\n",
-                              i, unknowns[i].name,
-                              (unsigned long)unknowns[i].size,
-                              unknowns[i].location);
-                            if (keep_chunk((char *)unknowns[i].name, argv))
-                            {
-                                png_memcpy(&unknowns_keep[num_unknowns_keep],
-                                  &unknowns[i], sizeof(png_unknown_chunk));
-                                ++num_unknowns_keep;
-                            }
-                        }
+            if (nosave || trial == last_method)
+               last_trial = 1;
 
-                        P1("Keeping %d unknown chunks\n", num_unknowns_keep);
-                        png_set_unknown_chunks(write_ptr, write_info_ptr,
-                          unknowns_keep, num_unknowns_keep);
+            if (verbose > 1)
+            fprintf(STDERR, "pngcrush: trial = %d\n",trial);
 
-                        /* relevant location bits:
-                         *   (1) !PNG_HAVE_PLTE && !PNG_HAVE_IDAT (before PLTE)
-                         *   (2)  PNG_HAVE_PLTE && !PNG_HAVE_IDAT (between)
-                         *   (3)  PNG_AFTER_IDAT                  (after IDAT)
-                         * PNG_HAVE_PLTE  = 0x02
-                         * PNG_HAVE_IDAT  = 0x04
-                         * PNG_AFTER_IDAT = 0x08
-                         */
-                        for (i = 0; i < num_unknowns_keep; i++)
-                        {
-                            png_set_unknown_chunk_location(write_ptr,
-                              write_info_ptr, i,
-                              (int)unknowns_keep[i].location);
-                        }
+            pngcrush_write_byte_count=0;
+#ifdef PNGCRUSH_H
+# if ZLIB_VERNUM > 0x1240
+            if (last_trial == 0)
+               pngcrush_write_byte_count=6; /* zlib header that isn't written */
+# endif
+#endif
 
-                        /* png_set_unknown_chunks() makes own copy, so nuke
-                         * ours */
-                        png_free(write_ptr, unknowns_keep);
-                    }
-                }
-              P1( "Finished handling ancillary chunks after IDAT\n");
-#endif /* PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED */
-            }  /* End of ancillary chunk handling */
+            found_IDAT = 0;
 
-                /* } GRR added for quick %-navigation (1) */
+            if (trial != 0 && repeat == 0)
+               idat_length[trial] = (png_uint_32) 0xffffffff;
+            bail_row[trial] = 0;
 
-                /*
-                 * Would be useful to have a libpng fix, that either exports
-                 * png_read_transform_info() or provides a generic API that
-                 * can set any png_ptr->flag, or, simpler, provides an API
-                 * to set the PNG_FLAG_ROW_INIT flag.
-                 *
-                 * Starting in libpng-1.5.6beta06, png_read_update_info()
-                 * does not check the PNG_FLAG_ROW_INIT flag and does not
-                 * initialize the row or issue a warning.
-                 *
-                 */
-#ifdef PNGCRUSH_H
-                png_read_transform_info(read_ptr, read_info_ptr);
-#else
-                /* Some pngcrush capabilities are lacking when the system
-                 * libpng is used instead of the one bundled with pngcrush
-                 *
-                 * To do: list those capabilities here
-                 */
+            /* this part of if-block is for final write-the-best-file
+               iteration */
+            if (trial == last_method)
+            {
+                png_uint_32 best_length;
 
-                /* pngcrush fails to read interlaced PNGs properly
-                 * when png_read_update_info() is called here.
-                 */
+                if (methods_enabled == 1)
+                {
+                   best = trial;
+                   best_length = idat_length[trial];
+                }
+                else
+                {
+                   int j;
 
-                /* png_read_update_info(read_ptr, read_info_ptr); */
+                   /* check lengths */
+                   best = 0;  /* i.e., input file */
+                   best_length = (png_uint_32) 0xffffffff;
+                   for (j = 0; j <= last_method; j++)
+                   {
+                       if (best == 0 && best_length == idat_length[j])
+                       {
+                           /* If no change, report the first match */
+                           best = j;
+                       }
+                       if ((force == 0 || j != 0) &&
+                            best_length > idat_length[j])
+                       {
+                           best_length = idat_length[j];
+                           best = j;
+                       }
+                       if (j > 148 && j < 176 && best_length == idat_length[j])
+                       {
+                           /* break ties in favor of method 6 */
+                           best = j;
+                       }
+                   }
 
-                /* Workaround is to multiply rowbytes by 8/bit_depth
-                 * to allow for unpacking, wherever we allocate a
-                 * row buffer.  This results in too large a value for
-                 * rowbytes under some conditions, e.g., when increasing
-                 * a sub-8-bit file to RGBA, but this is rare and harmless.
-                 */
-#endif
+                   if (trials_skipped &&
+                       best_length == (png_uint_32) 0xffffffff)
+                   {
+                       /* The time budget ran out before any method was
+                        * measured; use the first one that was scheduled.
+                        */
+                       for (j = 1; j < last_method; j++)
+                       {
+                           if (try_method[trial_order[j]] == 0)
+                           {
+                               best = trial_order[j];
+                               break;
+                           }
+                       }
+                   }
+                }
 
-                /* This is the default case (nosave == 1 -> perf-testing
-                   only) */
-                if (nosave == 0)
+                if (image_is_immutable ||
+                     (idat_length[best] == idat_length[0] &&
+                     force == 0 && nosave == 0))
                 {
-                    if (filter_type == 0)
-                        png_set_filter(write_ptr, 0, PNG_FILTER_NONE);
-                    else if (filter_type == 1)
-                        png_set_filter(write_ptr, 0, PNG_FILTER_SUB);
-                    else if (filter_type == 2)
-                        png_set_filter(write_ptr, 0, PNG_FILTER_UP);
-                    else if (filter_type == 3)
-                        png_set_filter(write_ptr, 0, PNG_FILTER_AVG);
-                    else if (filter_type == 4)
-                        png_set_filter(write_ptr, 0, PNG_FILTER_PAETH);
-                    else if (filter_type == 5)
-                            png_set_filter(write_ptr, 0, PNG_ALL_FILTERS);
-                    else if (filter_type == 6) /* speedy */
-                            png_set_filter(write_ptr, 0, PNG_FILTER_NONE |
-                               PNG_FILTER_SUB | PNG_FILTER_UP);
-                    else
-                        png_set_filter(write_ptr, 0, PNG_FILTER_NONE);
+                    /* just copy input to output */
 
-#ifdef PNGCRUSH_LOCO
-                    if (do_loco) {
-                        png_byte buff[30];
-                        const png_byte png_MHDR[5] = { 77, 72, 68, 82, '\0' };
-                        png_byte mng_signature[8] =
-                            { 138, 77, 78, 71, 13, 10, 26, 10 };
-                        /* write the MNG 8-byte signature */
-                        if (outname[strlen(outname) - 3] == 'p')
-                            pngcrush_warning(read_ptr,
-                              "  Writing a MNG file with a .png extension");
-                        pngcrush_write_png(write_ptr, &mng_signature[0],
-                                  (png_size_t) 8);
-                        png_set_sig_bytes(write_ptr, 8);
+                    P2("prepare to copy input to output\n");
+                    pngcrush_pause();
 
-                        /* Write a MHDR chunk */
+                    if (!stdin_input)
+                    {
+                        if ((fpin = FOPEN(inname, "rb")) == NULL)
+                        {
+                            fprintf(STDERR, "Could not find input file %s\n",
+                                    inname);
+                            continue;
+                        }
 
-                        buff[0] = (png_byte) ((width >> 24) & 0xff);
-                        buff[1] = (png_byte) ((width >> 16) & 0xff);
-                        buff[2] = (png_byte) ((width >> 8) & 0xff);
-                        buff[3] = (png_byte) ((width) & 0xff);
-                        buff[4] = (png_byte) ((height >> 24) & 0xff);
-                        buff[5] = (png_byte) ((height >> 16) & 0xff);
-                        buff[6] = (png_byte) ((height >> 8) & 0xff);
-                        buff[7] = (png_byte) ((height) & 0xff);
-                        for (i = 8; i < 27; i++)
-                            buff[i] = 0x00;
-                        buff[15] = 2; /* layer count */
-                        buff[19] = 1; /* frame count */
-                        if (output_color_type == 6)
-                            buff[27] = 0x09; /* profile: MNG-VLC with trans. */
-                        else
-                            buff[27] = 0x01;  /* profile: MNG-VLC */
-                        png_write_chunk(write_ptr, (png_bytep) png_MHDR,
-                                        buff, (png_size_t) 28);
+                        number_of_open_files++;
+                    }
+                    if ((fpout = pngcrush_open_output()) == NULL)
+                    {
+                        fprintf(STDERR,
+                           "pngcrush: could not open output file %s\n",
+                           outname);
+                        if (fpin)
+                            FCLOSE(fpin);
+                        exit(1);
                     }
-#endif /* PNGCRUSH_LOCO */
 
-                    pngcrush_pause();
+                    number_of_open_files++;
+                    P2("copying input to output...");
 
-                    if (found_CgBI)
+                    if (stdin_input)
                     {
-                        pngcrush_warning(read_ptr,
-                            "Cannot read Xcode CgBI PNG");
+                        if (fwrite(stdin_data, 1, stdin_data_length, fpout) !=
+                            stdin_data_length)
+                            P2("copy error.\n");
                     }
-                    P1( "\nWriting info struct\n");
-
-                    if (copy_idat == 0)
+                    else for (;;)
                     {
+                        png_size_t num_in, num_out;
 
-#if 0 /* doesn't work; compression level has to be the same as in IDAT */
-                    /* if zTXt other compressed chunk */
-                    png_set_compression_level(write_ptr, 9);
-                    png_set_compression_window_bits(write_ptr, 15);
-#endif /* 0 */
-
+                        num_in = fread((void *)buffer, 1, 1, fpin);
+                        if (!num_in)
+                            break;
+                        num_out = fwrite(buffer, 1, 1, fpout);
+                        if (num_out != num_in)
+                            P2("copy error.\n");
+                    }
+                    P2("copy complete.\n");
                     pngcrush_pause();
-                      {
-                        png_uint_32 zbuf_size;
-                        png_uint_32 required_window;
-                        int channels = 0;
-                        png_set_compression_strategy(write_ptr,
-                                                     z_strategy);
-                        png_set_compression_mem_level(write_ptr,
-                                                      compression_mem_level);
+                    pngcrush_write_byte_count = input_length;
+                    if (fpin)
+                        FCLOSE(fpin);
+                    pngcrush_close_output();
+                    setfiletype(outname);
+                    break;
+                }
 
-                        if (output_color_type == 0)
-                            channels = 1;
-                        if (output_color_type == 2)
-                            channels = 3;
-                        if (output_color_type == 3)
-                            channels = 1;
-                        if (output_color_type == 4)
-                            channels = 2;
-                        if (output_color_type == 6)
-                            channels = 4;
+                filter_type = fm[best];
+                zlib_level = lv[best];
+                if (zs[best] == 1)
+                    z_strategy = Z_FILTERED;
+                else if (zs[best] == 2)
+                    z_strategy = Z_HUFFMAN_ONLY;
+#ifdef Z_RLE
+                else if (zs[best] == 3)
+                    z_strategy = Z_RLE;
+#endif
+                else /* if (zs[best] == 0) */
+                    z_strategy = Z_DEFAULT_STRATEGY;
+                if (tune_trials && best > 0 && best < last_method)
+                    deflate_tune = trial_tune[best];
+                if (depth_trials && best > 0 && best < last_method)
+                    depth_flip = trial_depth_flip[best];
+            }
 
-                        /* This method was copied from libpng to find maximum
-                         * data size.  Only return sizes up to the maximum of
-                         * a png_uint_32, by limiting the width and height used
-                         * to 15 bits.
-                         */
-                        png_uint_32 rowbytes;
-                        png_uint_32 h = height;
+            else /* Trial < last_method */
+            {
+                if (trial > 2 && trial < 5 && idat_length[trial - 1]
+                    < idat_length[best_of_three])
+                    best_of_three = trial - 1;
 
-                        /* FIX THIS, does not work with libpng-1.7.0
-                         * because info_ptr->bit_depth has not been
-                         * updated yet.
-                         */
-                        rowbytes = png_get_rowbytes(read_ptr, read_info_ptr);
-#ifndef PNGCRUSH_H
-                        /* We must do this because we could not call
-                         * png_read_update_info().
-                         */
-                        if (input_bit_depth < 8)
-                          rowbytes *= 8/input_bit_depth;
-#endif
-                        if (rowbytes < 16384 && h < 16384)
-                        {
-                          if (rowbytes * h < 16384)
-                          {
-                             if (interlace_method)
-                             {
-                                /* Interlacing makes the uncompressed data
-                                 * larger because of the replication of both
-                                 * the filter byte and the padding to a byte
-                                 * boundary.
-                                 */
-                                png_uint_32 w = width;
-                                unsigned int pd = channels * output_bit_depth;
-#if (PNGCRUSH_LIBPNG_VER < 10400)
-                                png_size_t cb_base;
-#else
-                                png_alloc_size_t cb_base;
-#endif
-                                int interlace_pass;
-
-                                for (cb_base=0, interlace_pass=0;
-                                     interlace_pass<=6; ++interlace_pass)
-                                {
-                                   png_uint_32 pw = PNG_PASS_COLS(w,
-                                     interlace_pass);
-
-                                   if (pw > 0)
-                                      cb_base += (PNGCRUSH_ROWBYTES(pd, pw)+1) *
-                                          PNG_PASS_ROWS(h, interlace_pass);
-                                }
-
-                                max_bytes = cb_base;
-                             }
-
-                             else
-                                max_bytes = (rowbytes+1) * h;
-                          }
-                          else
-                             max_bytes = 0x3fffffffU;
-                        }
-
-                        else
-                           max_bytes = 0x3fffffffU;
-
-                        required_window = (png_uint_32) (max_bytes + 262);
-
-                        zbuf_size =
-                            png_get_compression_buffer_size(write_ptr);
-
-                        /* reinitialize zbuf - compression buffer */
-                        if (zbuf_size != max_idat_size)
-                        {
-                            png_uint_32 max_possible_size =
-                                required_window;
-                            if (max_possible_size > max_idat_size)
-                                max_possible_size = max_idat_size;
-                            P2("reinitializing write zbuf to %lu.\n",
-                               (unsigned long)max_possible_size);
-                            png_set_compression_buffer_size(write_ptr,
-                                                            max_possible_size);
-                        }
-
-                        if (required_window <= 512)
-                            compression_window = 9;
-                        else if (required_window <= 1024)
-                            compression_window = 10;
-                        else if (required_window <= 2048)
-                            compression_window = 11;
-                        else if (required_window <= 4096)
-                            compression_window = 12;
-                        else if (required_window <= 8192)
-                            compression_window = 13;
-                        else if (required_window <= 16384)
-                            compression_window = 14;
-                        else
-                            compression_window = 15;
-                        if (compression_window > default_compression_window
-                            || force_compression_window)
-                            compression_window =
-                                default_compression_window;
-
-                        if (verbose > 1 && last_trial
-                            && (compression_window != 15
-                                || force_compression_window))
-                            fprintf(STDERR,
-                                    "   Compression window for output= %d\n",
-                                    1 << compression_window);
-
-                        png_set_compression_window_bits(write_ptr,
-                                                        compression_window);
-                      }
-
-                    png_set_compression_level(write_ptr, zlib_level);
-                    } /* copy_idat */
-
-                    png_write_info(write_ptr, write_info_ptr);
-                    P1( "\nWrote info struct\n");
+                if (try_method[trial])
+                {
+                    P2("skipping \"late\" trial %d\n", trial);
+                    continue;
+                }
 
-                    if (copy_idat == 1)
+                /* default behavior is to do the heuristics (6 of the first
+                 * 10 methods). try10 means try all of 1-10.
+                 */
+                if (!methods_specified && try10 == 0)
+                {
+                    if ((trial == 4 || trial == 7) && best_of_three != 1)
                     {
-                       /* No recompress, just copy IDATs. */
-                       png_set_compression_buffer_size(write_ptr,
-                                                       MAX_IDAT_SIZE);
+                        P2("skipping \"early\" trial %d\n", trial);
+                        continue;
                     }
-
-#ifdef PNG_WRITE_PACK_SUPPORTED
-                    if (output_bit_depth < 8)
+                    if ((trial == 5 || trial == 8) && best_of_three != 2)
                     {
-                        if (output_color_type == 0)
-                        {
-                            png_color_8 true_bits;
-                            true_bits.gray = (png_byte) (output_bit_depth);
-                            png_set_shift(write_ptr, &true_bits);
-                        }
-                        png_set_packing(write_ptr);
+                        P2("skipping \"early\" trial %d\n", trial);
+                        continue;
                     }
-#endif
-                } /* no save */
-
-#ifdef PNGCRUSH_MULTIPLE_ROWS
-                rows_at_a_time = max_rows_at_a_time;
-                if (rows_at_a_time == 0 || rows_at_a_time < height)
-                    rows_at_a_time = height;
-#endif
+                    if ((trial == 6 || trial == 9 || trial == 10)
+                        && best_of_three != 3)
+                    {
+                        P2("skipping \"early\" trial %d\n", trial);
+                        continue;
+                    }
+                }
 
-#ifndef PNGCRUSH_LARGE
+                /* Do not start a trial that would not finish, along with
+                 * the final write, before the -time_budget or
+                 * -batch_budget deadline.  The estimate is the average
+                 * duration of the trials run so far for this file.
+                 */
+                if (trial != 0 && (time_budget || batch_time_budget))
                 {
-                    png_uint_32 rowbytes_s;
-                    png_uint_32 rowbytes;
+                    unsigned long now = pngcrush_clock_ms();
+                    unsigned long need = trials_timed == 0 ? 0 :
+                        2 * (trial_ms_spent / trials_timed);
+
+                    if ((time_budget &&
+                        now + need - file_start_ms > time_budget) ||
+                        (batch_time_budget &&
+                        now + need - batch_start_ms > batch_time_budget))
+                    {
+                        P2("skipping trial %d, time budget exhausted\n",
+                           trial);
+                        trials_skipped++;
+                        continue;
+                    }
+                }
 
-                    rowbytes = png_get_rowbytes(read_ptr, read_info_ptr);
-#ifndef PNGCRUSH_H
-                    if (input_bit_depth < 8)
-                      rowbytes *= 8/input_bit_depth;
+                filter_type = fm[trial];
+                zlib_level = lv[trial];
+                if (zs[trial] == 1)
+                    z_strategy = Z_FILTERED;
+                else if (zs[trial] == 2)
+                    z_strategy = Z_HUFFMAN_ONLY;
+#ifdef Z_RLE
+                else if (zs[trial] == 3)
+                    z_strategy = Z_RLE;
 #endif
-
-                    P2("rowbytes = %lud\n",rowbytes;
-
-                    rowbytes_s = (png_size_t) rowbytes;
-                    if (rowbytes == (png_uint_32) rowbytes_s)
-#  ifdef PNGCRUSH_MULTIPLE_ROWS
-                        row_buf =
-                            png_malloc(read_ptr,
-                                       rows_at_a_time * rowbytes + 64);
-#  else
-                        row_buf = png_malloc(read_ptr, rowbytes + 64);
-#  endif
-                    else
-                        row_buf = NULL;
-                }
-#else /* PNGCRUSH_LARGE */
+                else /* if (zs[trial] == 0) */
+                    z_strategy = Z_DEFAULT_STRATEGY;
+                final_method = trial;
+                if (!nosave)
                 {
-                    png_uint_32 read_row_length, write_row_length;
-                    read_row_length =
-                        (png_uint_32) (png_get_rowbytes
-                                       (read_ptr, read_info_ptr));
-                    write_row_length =
-                        (png_uint_32) (png_get_rowbytes
-                                       (write_ptr, write_info_ptr));
-                    row_length =
-                        read_row_length >
-                        write_row_length ? read_row_length :
-                        write_row_length;
-#ifndef PNGCRUSH_H
-                    /* We must do this because we could not call
-                     * png_read_update_info().
-                     */
-                    if (input_bit_depth < 8)
-                          row_length *= 8/input_bit_depth;
-#endif
-#  ifdef PNGCRUSH_MULTIPLE_ROWS
-                    row_buf =
-                        (png_bytep) png_malloc(read_ptr,
-                                               rows_at_a_time *
-                                               row_length + 64);
-#  else
-                    row_buf =
-                        (png_bytep) png_malloc(read_ptr, row_length + 64);
-#  endif
+                    P2("\n\n------------------------------------------------\n"
+                       "Begin trial %d, filter %d, strategy %d, level %d\n",
+                       trial, filter_type, z_strategy, zlib_level);
                 }
-#endif /* PNGCRUSH_LARGE */
+            }
 
-                P2(" row_buf = %p\n",row_buf);
+            P2("prepare to open files.\n");
+            pngcrush_pause();
 
-                if (row_buf == NULL)
-                    png_error(read_ptr,
-                              "Insufficient memory to allocate row buffer");
+            trial_start_ms = pngcrush_clock_ms();
+            trace_trial_us = pngcrush_trace_now();
+            trial_mem_allocs = mem_file_allocs;
+            trial_mem_bytes = mem_file_bytes;
+#if PNGCRUSH_TIMERS > 0
+            trial_encode_nsec = pngcrush_timer_nsec[PNGCRUSH_TIMER_ENCODE];
+            trial_decode_nsec = pngcrush_timer_nsec[PNGCRUSH_TIMER_DECODE];
+#endif
 
+            if (!stdin_input)
+            {
+                if ((fpin = FOPEN(inname, "rb")) == NULL)
                 {
-                    /* Check for sufficient memory: we need 2*zlib_window and,
-                     * if filter_type == 5, 4*rowbytes in separate allocations.
-                     * If it's not enough we can drop the "average" filter and
-                     * we can reduce the zlib_window for writing.  We can't
-                     * change the input zlib_window because the input file
-                     * might have used the full 32K sliding window. (To do)
-                     */
+                    fprintf(STDERR, "Could not find input file %s\n",
+                        inname);
+                    continue;
                 }
+                number_of_open_files++;
+                pngcrush_trace("open", "io", trace_trial_us,
+                    pngcrush_trace_now(), NULL);
+            }
 
-                P2("allocated rowbuf.\n");
-
-#ifdef PNGCRUSH_MULTIPLE_ROWS
-                row_pointers = (png_bytepp) png_malloc(read_ptr,
-                                                       rows_at_a_time *
-                                                       sizeof(png_bytepp));
-                P2("allocated row_pointers.\n");
-
-                for (i = 0; i < rows_at_a_time; i++)
-                    row_pointers[i] = row_buf + i * row_length;
-#endif
-
-                pngcrush_pause();
-
-                num_pass = png_set_interlace_handling(read_ptr);
-                if (nosave == 0)
-                    png_set_interlace_handling(write_ptr);
+            if (last_trial && nosave == 0)
+            {
+#ifndef __riscos
+                /* Can't sensibly check this on RISC OS without opening a file
+                   for update or output
+                 */
+                struct stat stat_in, stat_out;
+                if (last_trial && !nofilecheck && !stdin_input &&
+                    !stdout_output
 
-/* START_STOP */
-
-                for (pass = 0; pass < num_pass; pass++)
-                {
-#ifdef PNGCRUSH_MULTIPLE_ROWS
-                    png_uint_32 num_rows;
-#endif
-                    P1( "\nBegin interlace pass %d\n", pass);
-#ifdef PNGCRUSH_MULTIPLE_ROWS
-                    num_rows = rows_at_a_time;
-                    for (y = 0; y < height; y += rows_at_a_time)
-#else
-                    for (y = 0; y < height; y++)
-#endif
-                    {
-#if PNGCRUSH_TIMERS > 0
-                        if (verbose >= 0)
-                        {
-                           pngcrush_timer_stop(PNGCRUSH_TIMER_MISC);
-                           pngcrush_timer_start(PNGCRUSH_TIMER_DECODE);
-                        }
-#endif
-#ifdef PNGCRUSH_MULTIPLE_ROWS
-                        if (y + num_rows > height)
-                            num_rows = height - y;
-#  ifdef BLOCKY_DEINTERLACE
-                        png_read_rows(read_ptr, (png_bytepp) NULL,
-                                      row_pointers, num_rows);
-#  else /* SPARKLE */
-                        png_read_rows(read_ptr, row_pointers,
-                                      (png_bytepp) NULL, num_rows);
-#  endif
-#else
-#  ifdef BLOCKY_DEINTERLACE
-                        png_read_row(read_ptr, row_buf, (png_bytep) NULL);
-#  else /* SPARKLE */
-                        png_read_row(read_ptr, (png_bytep) NULL, row_buf);
-#  endif
-#endif
-                        if (nosave == 0)
-                        {
-#if PNGCRUSH_TIMERS > 0
-                        if (verbose >= 0)
-                        {
-                            pngcrush_timer_stop(PNGCRUSH_TIMER_DECODE);
-                            pngcrush_timer_start(PNGCRUSH_TIMER_ENCODE);
-                        }
-#endif
-#ifdef PNGCRUSH_MULTIPLE_ROWS
-                            /* To do: zero the padding bits */
-                            png_write_rows(write_ptr, row_pointers,
-                                           num_rows);
+                    && (stat(inname, &stat_in) == 0)
+                    && (stat(outname, &stat_out) == 0) &&
+#if defined(_MSC_VER) || defined(__MINGW32__)   /* maybe others? */
+                    /* MSVC++6.0 will erroneously return 0 for both files, so
+                       we simply check the size instead.  It is possible that
+                       we will erroneously reject the attempt when inputsize
+                       and outputsize are equal, for different files
+                     */
+                    (stat_in.st_size == stat_out.st_size) &&
 #else
-                            /* To do: zero the padding bits */
-                            png_write_row(write_ptr, row_buf);
+                    (stat_in.st_ino == stat_out.st_ino) &&
 #endif
-                        }
-#if PNGCRUSH_TIMERS > 0
-                        if (verbose >= 0)
-                        {
-                            if (nosave == 0)
-                                pngcrush_timer_stop(PNGCRUSH_TIMER_ENCODE);
-                            else
-                                pngcrush_timer_stop(PNGCRUSH_TIMER_DECODE);
-                            pngcrush_timer_start(PNGCRUSH_TIMER_MISC);
-                        }
+                    (stat_in.st_dev == stat_out.st_dev))
+                {
+                    fprintf(STDERR,
+                            "\n   pngcrush: cannot overwrite input file %s\n",
+                            outname);
+                    P1("   st_ino=%d, st_size=%d\n\n",
+                       (int) stat_in.st_ino, (int) stat_in.st_size);
+                    if (fpin)
+                        FCLOSE(fpin);
+                    exit(1);
+                }
 #endif
-                        /* Bail if byte count exceeds best so far */
-                        if (bail == 0 && trial != last_method &&
-                            pngcrush_write_byte_count >
-                            pngcrush_best_byte_count)
-                        {
-                           png_write_flush(write_ptr);
-                           break;
-                        }
-                    }
-                    P2( "End interlace pass %d\n\n", pass);
-                    if (bail == 0 && trial != last_method &&
-                        pngcrush_write_byte_count >
-                        pngcrush_best_byte_count)
-                       break;
+                if ((fpout = pngcrush_open_output()) == NULL)
+                {
+                    fprintf(STDERR,
+                            "pngcrush: could not open output file %s\n",
+                            outname);
+                    if (fpin)
+                        FCLOSE(fpin);
+                    exit(1);
                 }
 
-                if (color_type == 3)
-                  {
-                  if (trial == 0 && reduce_palette == 1)
-                     {
-                       int palette_length;
+                number_of_open_files++;
+            }
 
-                       palette_length = plte_len;
-                       P1("Measured palette length = %d\n", palette_length);
+            P2("files are opened.\n");
+            pngcrush_pause();
 
-#ifdef PNG_READ_bKGD_SUPPORTED
-                       {
-                         png_color_16p bkgd;
-                         if (png_get_bKGD(read_ptr, read_info_ptr, &bkgd))
-                         {
-                           bkgd_index = bkgd->index;
-                           P1("bKGD index = %d\n", bkgd_index);
-#if 1
-                           if (bkgd_index > palette_length)
-                           {
-                              bkgd_index = palette_length;
-                              have_bkgd = 1;
-                              fprintf(STDERR,
-                                  "   New bKGD index = %d\n", bkgd_index);
-                           }
-#endif
-                           if (bkgd->index >= palette_length)
-                              palette_length = (int) bkgd_index+1;
-                           P1("Total    palette length = %d\n", palette_length);
-                         }
-                       }
+/* OK to ignore any warning about the address of exception__prev in "Try" */
+            Try {
+                png_uint_32 row_length;
+                P1( "Allocating read and write structures\n");
+#ifdef PNG_USER_MEM_SUPPORTED
+                if (verbose > 0)
+                   read_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING,
+                     (png_voidp) NULL,
+                     (png_error_ptr) pngcrush_cexcept_error,
+                     (png_error_ptr) pngcrush_warning,
+                     (png_voidp) NULL,
+                     (png_malloc_ptr) pngcrush_debug_malloc,
+                     (png_free_ptr) pngcrush_debug_free);
+                else
+                   read_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING,
+                     (png_voidp) NULL,
+                     (png_error_ptr) pngcrush_cexcept_error,
+                     (png_error_ptr) pngcrush_warning,
+                     (png_voidp) NULL,
+                     (png_malloc_ptr) pngcrush_malloc,
+                     (png_free_ptr) pngcrush_free);
+#else
+                   read_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                     (png_voidp) NULL,
+                     (png_error_ptr) pngcrush_cexcept_error,
+                     (png_error_ptr) pngcrush_warning);
+#endif /* PNG_USER_MEM_SUPPORTED */
+                if (read_ptr == NULL)
+                    Throw "pngcrush could not create read_ptr";
+
+#ifdef PNG_BENIGN_ERRORS_SUPPORTED
+# if PNGCRUSH_LIBPNG_VER >= 10400
+                /* Allow certain errors in the input file to be handled
+                 * as warnings.
+                 */
+                png_set_benign_errors(read_ptr, 1);
+# endif
 #endif
-                       plte_len = palette_length;
-                       if (num_trans > plte_len)
-                       {
-                          num_trans = plte_len;
-                          png_set_tRNS(write_ptr, write_info_ptr, trns_array,
-                                     num_trans, trans_values);
-                        }
-                     }
-                  }
 
-#if defined(PNG_READ_RGB_TO_GRAY_SUPPORTED) && \
-    defined(PNG_FLOATING_POINT_SUPPORTED)
-                if ((color_type == 2 || color_type == 6 || color_type == 3)
-                    && (output_color_type == 0 || output_color_type == 4))
+#ifdef PNG_SET_USER_LIMITS_SUPPORTED
+                if (no_limits == 0)
                 {
-                    png_byte rgb_error =
-                        png_get_rgb_to_gray_status(read_ptr);
-                    if (last_trial && verbose > 0 && rgb_error)
-                        fprintf(STDERR,
-                          "   **** Converted non-gray image to gray. **** \n");
+# if PNGCRUSH_LIBPNG_VER >= 10400
+                   png_set_user_limits(read_ptr, 500000L, 500000L);
+                   png_set_chunk_cache_max(read_ptr, 500);
+# endif
+# if PNGCRUSH_LIBPNG_VER >= 10401
+                   png_set_chunk_malloc_max(read_ptr, 2000000L);
+# endif
+                }
+#endif /* PNG_SET_USER_LIMITS_SUPPORTED */
+
+#if defined(PNG_MAXIMUM_INFLATE_WINDOW) && defined(PNG_OPTION_ON)
+                if (salvage)
+                {
+                   P1(" Setting MAXIMUM_INFLATE_WINDOW\n");
+                   png_set_option(read_ptr, PNG_MAXIMUM_INFLATE_WINDOW,
+                       PNG_OPTION_ON);
                 }
 #endif
 
-#ifdef PNG_FREE_UNKN
-#  if defined(PNG_READ_UNKNOWN_CHUNKS_SUPPORTED)
-                png_free_data(read_ptr, read_info_ptr, PNG_FREE_UNKN, -1);
-#  endif
-#  if defined(PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED)
-                png_free_data(write_ptr, write_info_ptr, PNG_FREE_UNKN, -1);
-#  endif
-#else
-#  if defined(PNG_READ_UNKNOWN_CHUNKS_SUPPORTED)
-                png_free_unknown_chunks(read_ptr, read_info_ptr, -1);
-#  endif
-#  if defined(PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED)
-                png_free_unknown_chunks(write_ptr, write_info_ptr, -1);
-#  endif
-#endif /* PNG_FREE_UNKN */
+#if 0
+                /* Use a smaller decompression buffer for speed */
+                png_set_compression_buffer_size(read_ptr,
+                    (png_size_t)256);
+#endif /* 0 */
 
-                /* { GRR:  added for %-navigation (2) */
-                if (!(bail == 0 && trial != last_method &&
-                    pngcrush_write_byte_count >
-                    pngcrush_best_byte_count))
+    /* Change the underlying color of any fully transparent pixel to black.
+     * Remove the alpha channel from any fully-opaque image.
+     * Change any all-gray image to a gray colortype.
+     * Reduce 16-bit image to 8-bit if possible without loss.
+     */
+    if (trial == 0 &&
+        (blacken == 1 || make_gray == 1 || make_opaque == 1 ||
+        make_trns == 1 || make_8_bit == 1 || reduce_palette == 1 ||
+        gray_bit_depth == 1))
+    {
+      P1(" Examine image for possible lossless reductions\n");
+      png_set_read_user_transform_fn(read_ptr, pngcrush_examine_pixels_fn);
+    }
+#ifdef PNG_READ_UNKNOWN_CHUNKS_SUPPORTED
+                if (last_trial == 0)
                 {
-                   P1("   Reading and writing end_info data\n");
-                   png_read_end(read_ptr, end_info_ptr);
+                   png_set_keep_unknown_chunks(read_ptr,
+                        PNG_HANDLE_CHUNK_NEVER, (png_bytep) NULL, 0);
 
-            /* Handle ancillary chunks */
-            if (last_trial == 1)
-            {
-#if (defined(PNG_READ_tEXt_SUPPORTED) && defined(PNG_WRITE_tEXt_SUPPORTED)) \
- || (defined(PNG_READ_iTXt_SUPPORTED) && defined(PNG_WRITE_iTXt_SUPPORTED)) \
- || (defined(PNG_READ_zTXt_SUPPORTED) && defined(PNG_WRITE_zTXt_SUPPORTED))
+                   png_set_keep_unknown_chunks(read_ptr,
+                        PNG_HANDLE_CHUNK_NEVER, chunks_to_ignore,
+                        sizeof (chunks_to_ignore)/5);
+                }
+#endif
 
-                P1( "Check for iTXt/tEXt/zTXt chunks after IDAT\n");
+                if (nosave == 0)
                 {
-                    png_textp text_ptr;
-                    int num_text = 0;
-
-                    if (png_get_text (read_ptr,
-                        end_info_ptr, &text_ptr, &num_text) > 0
-                        || text_inputs)
-                    {
-                        int ntext;
-
-#ifdef PNG_iTXt_SUPPORTED
-                        P1( "Handling %d tEXt/zTXt/iTXt chunks after IDAT\n",
+#ifdef PNG_USER_MEM_SUPPORTED
+                   if (verbose > 0)
+                       write_ptr = png_create_write_struct_2(
+                         PNG_LIBPNG_VER_STRING,
+                         (png_voidp) NULL,
+                         (png_error_ptr) pngcrush_cexcept_error,
+                         (png_error_ptr) pngcrush_warning,
+                         (png_voidp) NULL,
+                         (png_malloc_ptr) pngcrush_debug_malloc,
+                         (png_free_ptr) pngcrush_debug_free);
+                    else
+                       write_ptr = png_create_write_struct_2(
+                         PNG_LIBPNG_VER_STRING,
+                         (png_voidp) NULL,
+                         (png_error_ptr) pngcrush_cexcept_error,
+                         (png_error_ptr) NULL,
+                         (png_voidp) NULL,
+                         (png_malloc_ptr) pngcrush_malloc,
+                         (png_free_ptr) pngcrush_free);
 #else
-                        P1( "Handling %d tEXt/zTXt chunks after IDAT\n",
+                       write_ptr = png_create_write_struct(
+                         PNG_LIBPNG_VER_STRING,
+                         (png_voidp) NULL,
+                         (png_error_ptr) pngcrush_cexcept_error,
+                         (png_error_ptr) NULL);
 #endif
-                                   num_text);
+                    if (write_ptr == NULL)
+                        Throw "pngcrush could not create write_ptr";
 
-                        if (verbose > 1 && last_trial && num_text > 0)
-                        {
-                            for (ntext = 0; ntext < num_text; ntext++)
-                            {
-                                fprintf(STDERR, "%d  %s", ntext,
-                                        text_ptr[ntext].key);
-                                if (text_ptr[ntext].text_length)
-                                    fprintf(STDERR, ": %s\n",
-                                            text_ptr[ntext].text);
-#ifdef PNG_iTXt_SUPPORTED
-                                else if (text_ptr[ntext].itxt_length)
-                                {
-                                    fprintf(STDERR, " (%s: %s): \n",
-                                            text_ptr[ntext].lang,
-                                            text_ptr[ntext].lang_key);
-                                    fprintf(STDERR, "%s\n",
-                                            text_ptr[ntext].text);
-                                }
-#endif
-                                else
-                                    fprintf(STDERR, "\n");
-                            }
-                        }
+                }
+                P1("Allocating read_info, write_info, end_info structures\n");
+                read_info_ptr = png_create_info_struct(read_ptr);
 
-                        if (last_trial)
-                        {
-                          if (num_text > 0)
-                          {
-                            if (keep_chunk("text", argv))
-                            {
-                                int num_to_write = num_text;
-                                for (ntext = 0; ntext < num_text; ntext++)
-                                {
-                                    if (verbose > 1)
-                                        P2("Text chunk after IDAT, "
-                                          "compression=%d\n",
-                                          text_ptr[ntext].compression);
-                                    if (text_ptr[ntext].compression ==
-                                        PNG_TEXT_COMPRESSION_NONE)
-                                    {
-                                        if (!keep_chunk("tEXt", argv))
-                                        {
-                                            text_ptr[ntext].key[0] = '\0';
-                                            num_to_write--;
-                                        }
-                                    }
-                                    if (text_ptr[ntext].compression ==
-                                        PNG_TEXT_COMPRESSION_zTXt)
-                                    {
-                                        if (!keep_chunk("zTXt", argv))
-                                        {
-                                            text_ptr[ntext].key[0] = '\0';
-                                            num_to_write--;
-                                        }
-                                    }
-#ifdef PNG_iTXt_SUPPORTED
-                                    if (text_ptr[ntext].compression ==
-                                        PNG_ITXT_COMPRESSION_NONE
-                                        || text_ptr[ntext].compression ==
-                                        PNG_ITXT_COMPRESSION_zTXt)
-                                    {
-                                        if (!keep_chunk("iTXt", argv))
-                                        {
-                                            text_ptr[ntext].key[0] = '\0';
-                                            num_to_write--;
-                                        }
-                                    }
-#endif
-                                }
-                                if (num_to_write > 0)
-                                    png_set_text(write_ptr,
-                                                 write_end_info_ptr,
-                                                 text_ptr, num_text);
-                            }
-                          }
+                if (read_info_ptr == NULL)
+                    Throw "pngcrush could not create read_info_ptr";
 
-                          P1( "text_inputs=%d\n",text_inputs);
-                          for (ntext = 0; ntext < text_inputs; ntext++)
-                          {
-                            P1( "  ntext=%d\n",ntext);
-                            if (text_where[ntext] == 2)
-                            {
-                                png_textp added_text;
-                                added_text = (png_textp)
-                                    png_malloc(write_ptr,
-                                               (png_uint_32)
-                                               sizeof(png_text));
-                                added_text[0].key =
-                                    &text_keyword[ntext * 80];
-#ifdef PNG_iTXt_SUPPORTED
-                                added_text[0].lang =
-                                    &text_lang[ntext * 80];
-                                added_text[0].lang_key =
-                                    &text_lang_key[ntext * 80];
-#endif
-                                added_text[0].text =
-                                    &text_text[ntext * STR_BUF_SIZE];
-                                added_text[0].compression =
-                                    text_compression[ntext];
-                                png_set_text(write_ptr, write_end_info_ptr,
-                                             added_text, 1);
+                end_info_ptr = png_create_info_struct(read_ptr);
+                if (end_info_ptr == NULL)
+                    Throw "pngcrush could not create end_info_ptr";
 
-                                if (verbose > 0 && last_trial)
-                                {
-                                  if (added_text[0].compression < 0)
-                                      fprintf(STDERR,
-                                          "   Added a tEXt chunk.\n");
-                                  else if (added_text[0].compression == 0)
-                                      fprintf(STDERR,
-                                          "   Added a zTXt chunk.\n");
-#ifdef PNG_iTXt_SUPPORTED
-                                  else if (added_text[0].compression == 1)
-                                      fprintf(STDERR,
-                                          "   Added an uncompressed iTXt "
-                                        "chunk.\n");
-                                  else
-                                      fprintf(STDERR,
-                                          "   Added a compressed iTXt "
-                                        "chunk.\n");
-#endif
-                                }
-                                png_free(write_ptr, added_text);
-                                added_text = (png_textp) NULL;
-                            }
-                          }
-                        } /* end of nosave block */
-                    }
-                }
-#endif /* (PNG_READ_tEXt_SUPPORTED and PNG_WRITE_tEXt_SUPPORTED) or */
-       /* (PNG_READ_iTXt_SUPPORTED and PNG_WRITE_iTXt_SUPPORTED) or */
-       /* (PNG_READ_zTXt_SUPPORTED and PNG_WRITE_zTXt_SUPPORTED) */
-#if defined(PNG_READ_tIME_SUPPORTED) && defined(PNG_WRITE_tIME_SUPPORTED)
+                if (nosave == 0)
                 {
-                    png_timep mod_time;
+                    write_info_ptr = png_create_info_struct(write_ptr);
+                    if (write_info_ptr == NULL)
+                        Throw "pngcrush could not create write_info_ptr";
 
-                    if (png_get_tIME(read_ptr, end_info_ptr, &mod_time))
-                    {
-                        P1( "Handling tIME chunk after IDAT\n");
-                        if (keep_chunk("tIME", argv))
-                            png_set_tIME(write_ptr, write_end_info_ptr,
-                                         mod_time);
-                    }
+                    write_end_info_ptr = png_create_info_struct(write_ptr);
+                    if (write_end_info_ptr == NULL)
+                        Throw
+                            "pngcrush could not create write_end_info_ptr";
                 }
-#endif
 
-#ifdef PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED
-                /* GRR FIXME?  this block may need same fix as above */
+                P2("structures created.\n");
+                pngcrush_pause();
+
+                P1( "Initializing input and output streams\n");
+                pngcrush_init_read(read_ptr, fpin);
+
+                if (nosave == 0)
+                    png_set_write_fn(write_ptr, (png_voidp) fpout,
+                        (png_rw_ptr) pngcrush_write_png, pngcrush_flush);
+
+                P2("io has been initialized.\n");
+                pngcrush_pause();
+
+#ifdef PNG_CRC_QUIET_USE
+                if (check_crc == 0)
                 {
-                    png_unknown_chunkp unknowns;
-                    int num_unknowns =
-                        (int) png_get_unknown_chunks(read_ptr,
-                                                     end_info_ptr,
-                                                     &unknowns);
-                    if (num_unknowns && nosave == 0)
-                    {
-                        fprintf(STDERR,
-                               "Handling %d unknown chunks after IDAT\n",
-                               num_unknowns);
-                        png_set_unknown_chunks(write_ptr,
-                                               write_end_info_ptr,
-                                               unknowns, num_unknowns);
-                        for (i = 0; i < num_unknowns; i++)
-                            png_set_unknown_chunk_location(write_ptr,
-                                                           write_end_info_ptr,
-                                                           i,
-                                                           (int)
-                                                           unknowns[i].
-                                                           location);
-                    }
+                    /* We don't need to check IDAT CRC's and ADLER32 because
+                     * they were already checked in the pngcrush_measure_idat
+                     * function
+                     */
+                    png_set_option(read_ptr, PNG_IGNORE_ADLER32,
+                        PNG_OPTION_ON);
+                    png_set_crc_action(read_ptr, PNG_CRC_QUIET_USE,
+                                       PNG_CRC_QUIET_USE);
                 }
 #endif
-            }  /* End of ancillary chunk handling */
-
-                if (nosave == 0) {
-#if 0 /* doesn't work; compression level has to be the same as in IDAT */
-                    /* if zTXt other compressed chunk */
-                    png_set_compression_level(write_ptr, 9);
-                    png_set_compression_window_bits(write_ptr, 15);
-                    png_set_compression_buffer_size(write_ptr,
-                                                    PNG_ZBUF_SIZE);
-                    png_set_compression_strategy(write_ptr, 0);
-#endif /* 0 */
-                    png_write_end(write_ptr, write_end_info_ptr);
-                }
-                }
-                /* } GRR:  added for %-navigation (2) */
 
-                P1( "Destroying read data structs\n");
-                if (row_buf != (png_bytep) NULL)
+#ifndef PNGCRUSH_CHECK_ADLER32
+# ifdef PNG_IGNORE_ADLER32
+                if (last_trial == 0)
                 {
-                    P2(" row_buf = %p\n",row_buf);
-                    P2( "Destroying row_buf\n");
-                    /* Crash has been observed here when using the
-                     * system libpng instead of the bundled one.
-                     * It seems to have to do with the workaround for
-                     * png_read_transform_info() not being exported
-                     * in libpng-1.5.6 and later.
+                    /* During trials other than the final output, avoid
+                     * calculating CRC and ADLER32 checksums (just write
+                     * a DEFLATE datastream)
                      */
-                    png_free(read_ptr, row_buf);
-                    row_buf = (png_bytep) NULL;
+                    png_set_option(write_ptr, PNG_IGNORE_ADLER32,
+                        PNG_OPTION_ON);
                 }
-                P2( "Destroyed data row_buf\n");
-#ifdef PNGCRUSH_MULTIPLE_ROWS
-                if (row_pointers != (png_bytepp) NULL)
+# endif
+#endif
+
+#ifdef PNG_READ_CHECK_FOR_INVALID_INDEX_SUPPORTED
+                /* Only run this test (new in libpng-1.5.10) during the
+                 * 0th and last trial
+                 */
+                if ((input_color_type == 3) &&
+                    ((last_trial && reduce_palette == 0) ||
+                    (trial == 0 && reduce_palette == 1)))
                 {
-                    P1( "Destroying row_pointers\n");
-                    png_free(read_ptr, row_pointers);
-                    row_pointers = (png_bytepp) NULL;
+                   P1(" Check the read palette\n");
+                   png_set_check_for_invalid_index (read_ptr, 1);
                 }
-                P2( "Destroyed data row_pointers\n");
 #endif
-                png_destroy_read_struct(&read_ptr, &read_info_ptr,
-                                        &end_info_ptr);
-                P2( "Destroyed data structs\n");
-                if (nosave == 0)
-                {
-#ifdef PNGCRUSH_LOCO
-                    if (do_loco)
-                    {
-                        const png_byte png_MEND[5] =
-                            { 77, 69, 78, 68, '\0' };
-                        /* write the MNG MEND chunk */
-                        png_write_chunk(write_ptr, (png_bytep) png_MEND,
-                                        NULL, (png_size_t) 0);
-                    }
+#ifdef PNG_WRITE_CHECK_FOR_INVALID_INDEX_SUPPORTED
+                if (last_trial && nosave == 0 && output_color_type == 3)
+                {
+                   P1(" Check the written palette\n");
+                   png_set_check_for_invalid_index (write_ptr, 1);
+                }
+#endif
+
+            if (last_trial == 1)
+            {
+
+#ifdef PNG_READ_UNKNOWN_CHUNKS_SUPPORTED
+                png_set_keep_unknown_chunks(read_ptr, PNG_HANDLE_CHUNK_ALWAYS,
+                                            (png_bytep) NULL, 0);
+
+                /* The captured chunks are copied verbatim, so libpng
+                 * need not read them again
+                 */
+                if (raw_chunk_types & PNGCRUSH_RAW_iCCP)
+                    png_set_keep_unknown_chunks(read_ptr,
+                        PNG_HANDLE_CHUNK_NEVER, (png_bytep) "iCCP", 1);
+                if (raw_chunk_types & PNGCRUSH_RAW_sPLT)
+                    png_set_keep_unknown_chunks(read_ptr,
+                        PNG_HANDLE_CHUNK_NEVER, (png_bytep) "sPLT", 1);
+                if (raw_chunk_types & PNGCRUSH_RAW_TEXT)
+                    png_set_keep_unknown_chunks(read_ptr,
+                        PNG_HANDLE_CHUNK_NEVER,
+                        (png_bytep) "tEXt\0zTXt\0iTXt", 3);
+#endif
+
+#ifdef PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED
+                if (nosave == 0)
+                {
+                    if (save_apng_chunks == 1)
+                    {
+                       /* To do: Why use write_ptr not read_ptr here? */
+                       png_set_keep_unknown_chunks(write_ptr,
+                                                PNG_HANDLE_CHUNK_ALWAYS,
+                                                (png_bytep) "acTL", 1);
+                       png_set_keep_unknown_chunks(write_ptr,
+                                                PNG_HANDLE_CHUNK_ALWAYS,
+                                                (png_bytep) "fcTL", 1);
+                       png_set_keep_unknown_chunks(write_ptr,
+                                                PNG_HANDLE_CHUNK_ALWAYS,
+                                                (png_bytep) "fdAT", 1);
+                    }
+
+                    if (found_any_chunk == 1)
+                       png_set_keep_unknown_chunks(write_ptr,
+                                                PNG_HANDLE_CHUNK_ALWAYS,
+                                                (png_bytep) "dSIG", 1);
+                    if (all_chunks_are_safe)
+                    {
+                        png_set_keep_unknown_chunks(write_ptr,
+                                                    PNG_HANDLE_CHUNK_ALWAYS,
+                                                    (png_bytep) NULL, 0);
+    printf("while saving, all_chunks_are_safe=\n");
+                        if (save_apng_chunks == 0)
+                        {
+                           png_set_keep_unknown_chunks(write_ptr,
+                                                PNG_HANDLE_CHUNK_ALWAYS,
+                                                (png_bytep) "acTL", 1);
+                           png_set_keep_unknown_chunks(write_ptr,
+                                                PNG_HANDLE_CHUNK_ALWAYS,
+                                                (png_bytep) "fcTL", 1);
+                           png_set_keep_unknown_chunks(write_ptr,
+                                                PNG_HANDLE_CHUNK_ALWAYS,
+                                                (png_bytep) "fdAT", 1);
+                        }
+                    }
+
+                    else
+                    {
+#if !defined(PNG_cHRM_SUPPORTED) || !defined(PNG_hIST_SUPPORTED) || \
+    !defined(PNG_iCCP_SUPPORTED) || !defined(PNG_sCAL_SUPPORTED) || \
+    !defined(PNG_pCAL_SUPPORTED) || !defined(PNG_sPLT_SUPPORTED) || \
+    !defined(PNG_sTER_SUPPORTED) || !defined(PNG_tIME_SUPPORTED)
+                        png_byte chunk_name[5];
+                        chunk_name[4] = '\0';
+#endif
+
+                        /* To do: Why use write_ptr not read_ptr here? */
+
+                        if (keep_unknown_chunk("alla", argv) &&
+                            keep_unknown_chunk("allb", argv))
+                            png_set_keep_unknown_chunks(write_ptr,
+                                                    PNG_HANDLE_CHUNK_IF_SAFE,
+                                                    (png_bytep) NULL,
+                                                    0);
+                        else
+                            png_set_keep_unknown_chunks(write_ptr,
+                                                    PNG_HANDLE_CHUNK_NEVER,
+                                                    (png_bytep) NULL,
+                                                    0);
+
+#ifndef PNG_cHRM_SUPPORTED
+                        if (keep_unknown_chunk("cHRM", argv))
+                        {
+                            pngcrush_save_uint_32(chunk_name, PNG_UINT_cHRM);
+                            png_set_keep_unknown_chunks(write_ptr,
+                                                    PNG_HANDLE_CHUNK_ALWAYS,
+                                                    chunk_name, 1);
+                        }
+#endif
+#ifndef PNG_hIST_SUPPORTED
+                        if (keep_unknown_chunk("hIST", argv))
+                        {
+                            pngcrush_save_uint_32(chunk_name, PNG_UINT_hIST);
+                            png_set_keep_unknown_chunks(write_ptr,
+                                                    PNG_HANDLE_CHUNK_ALWAYS,
+                                                    chunk_name, 1);
+                        }
+#endif
+#ifndef PNG_iCCP_SUPPORTED
+                        if (keep_unknown_chunk("iCCP", argv))
+                        {
+                            pngcrush_save_uint_32(chunk_name, PNG_UINT_iCCP);
+                            png_set_keep_unknown_chunks(write_ptr,
+                                                    PNG_HANDLE_CHUNK_ALWAYS,
+                                                    chunk_name, 1);
+                        }
+#endif
+#ifndef PNG_iTXt_SUPPORTED
+                        if (keep_unknown_chunk("iTXt", argv))
+                        {
+                            pngcrush_save_uint_32(chunk_name, PNG_UINT_iTXt);
+                            png_set_keep_unknown_chunks(write_ptr,
+                                                    PNG_HANDLE_CHUNK_ALWAYS,
+                                                    chunk_name, 1);
+                        }
+#endif
+#ifndef PNG_sCAL_SUPPORTED
+                        if (keep_unknown_chunk("sCAL", argv))
+                        {
+                            pngcrush_save_uint_32(chunk_name, PNG_UINT_sCAL);
+                            png_set_keep_unknown_chunks(write_ptr,
+                                                    PNG_HANDLE_CHUNK_ALWAYS,
+                                                    chunk_name, 1);
+                        }
+#endif
+#ifndef PNG_pCAL_SUPPORTED
+                        if (keep_unknown_chunk("pCAL", argv))
+                        {
+                            pngcrush_save_uint_32(chunk_name, PNG_UINT_pCAL);
+                            png_set_keep_unknown_chunks(write_ptr,
+                                                    PNG_HANDLE_CHUNK_ALWAYS,
+                                                    chunk_name, 1);
+                        }
+#endif
+#ifndef PNG_sPLT_SUPPORTED
+                        if (keep_unknown_chunk("sPLT", argv))
+                        {
+                            pngcrush_save_uint_32(chunk_name, PNG_UINT_sPLT);
+                            png_set_keep_unknown_chunks(write_ptr,
+                                                    PNG_HANDLE_CHUNK_ALWAYS,
+                                                    chunk_name, 1);
+                        }
+#endif
+#ifndef PNG_sTER_SUPPORTED
+                        if (keep_unknown_chunk("sTER", argv))
+                        {
+                            pngcrush_save_uint_32(chunk_name, PNG_UINT_sTER);
+                            png_set_keep_unknown_chunks(write_ptr,
+                                                    PNG_HANDLE_CHUNK_ALWAYS,
+                                                    chunk_name, 1);
+                        }
+#endif
+#ifndef PNG_tIME_SUPPORTED
+                        if (keep_unknown_chunk("tIME", argv))
+                        {
+                            pngcrush_save_uint_32(chunk_name, PNG_UINT_tIME);
+                            png_set_keep_unknown_chunks(write_ptr,
+                                                    PNG_HANDLE_CHUNK_ALWAYS,
+                                                    chunk_name, 1);
+                        }
+#endif
+                    }
+                } /* nosave == 0 */
+#endif /* PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED */
+            } /* last trial */
+
+/* To do: Remove this? We already did this in measure_idats */
+            P1("   Reading signature bytes\n");
+            {
+#ifdef PNGCRUSH_LOCO
+              png_byte mng_signature[8] =
+                  { 138, 77, 78, 71, 13, 10, 26, 10 };
+#endif
+              png_byte png_signature[8] =
+                  { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+              pngcrush_default_read_data(read_ptr, png_signature, 8);
+              png_set_sig_bytes(read_ptr, 8);
+
+#ifdef PNGCRUSH_LOCO
+              if (!(int)(png_memcmp(mng_signature, png_signature, 8)))
+              {
+                  /* Skip the MHDR */
+                  png_permit_mng_features(read_ptr,
+                                      PNG_FLAG_MNG_FILTER_64);
+                  png_skip_chunk(read_ptr);
+                  input_format = 1;
+              }
+
+              else
+#endif
+              if (png_sig_cmp(png_signature, 0, 8))
+              {
+                  if (png_sig_cmp(png_signature, 0, 4))
+                      png_error(read_ptr, "Not a PNG file!");
+              else
+                  png_error(read_ptr,
+                      "PNG file corrupted by ASCII conversion");
+              }
+              if (salvage && found_CgBI)
+              {
+                  /* Skip the CgBI chunk */
+
+                  png_skip_chunk(read_ptr);
+
+                  /* iCCP and zTXt are probably unreadable
+                   * because of the nonstandard deflate */
+
+#ifdef PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED
+                  png_set_keep_unknown_chunks(read_ptr,
+                      PNG_HANDLE_CHUNK_NEVER,
+                      (png_bytep)"iCCP", 1);
+                  png_set_keep_unknown_chunks(read_ptr,
+                      PNG_HANDLE_CHUNK_NEVER,
+                      (png_bytep)"zTXt", 1);
+#endif
+              }
+            }
+
+#ifndef PNG_READ_PREMULTIPLY_ALPHA_SUPPORTED
+            if (premultiply)
+                 png_error(read_ptr, "Premultiplied alpha is not supported");
+#endif
+
+            P1( "   Reading info struct\n");
+            trace_phase_us = pngcrush_trace_now();
+            png_read_info(read_ptr, read_info_ptr);
+            pngcrush_trace("read_info", "decode", trace_phase_us,
+                pngcrush_trace_now(), NULL);
+
+            if (trial != 0)
+            {
+               if (make_opaque == 1)
+               {
+                  P1(" Remove all-opaque alpha channel\n");
+                  if (output_color_type == 4)
+                     output_color_type = 0;
+                  if (output_color_type == 6)
+                     output_color_type = 2;
+               }
+               P1(" make_opaque=    %d\n",make_opaque);
+
+               if (trns_seen != NULL)
+               {
+                  free(trns_seen);
+                  trns_seen = NULL;
+               }
+               if (make_trns == 1 && (make_opaque == 1 || !trns_key_found))
+                  make_trns = 2;
+               if (make_trns == 1)
+               {
+                  P1(" Replace binary alpha channel with a tRNS key\n");
+                  if (output_color_type == 4)
+                     output_color_type = 0;
+                  if (output_color_type == 6)
+                     output_color_type = 2;
+               }
+               P1(" make_trns=      %d\n",make_trns);
+
+               if (make_gray == 1)
+               {
+                  /* Note: Take care that iCCP, sBIT, and bKGD data are not
+                   * lost or become invalid when reducing images from
+                   * truecolor to grayscale or when reducing the bit depth.
+                   * (To do: test this; it's probably OK)
+                   */
+                  /* To do: check bKGD color */
+
+                  P1(" Encode all-gray image with a gray colortype\n");
+                  if (output_color_type == 6)
+                     output_color_type = 4;
+                  if (output_color_type == 2)
+                     output_color_type = 0;
+               }
+               P1(" make_gray=      %d\n",make_gray);
+
+               if (make_8_bit == 1)
+               {
+                  /* Note: Take care that sBIT and bKGD data are not
+                   * lost or become invalid when reducing the bit depth.
+                   * (To do: test this; it's probably OK)
+                   */
+                  P1(" Reduce 16-bit image losslessly to 8-bit\n");
+               }
+               P1(" make_8_bit=     %d\n",make_8_bit);
+
+               if (make_opaque != 1 && make_trns != 1 && blacken == 2)
+               {
+                  P1(" Blacken the fully transparent pixels\n");
+                  png_set_read_user_transform_fn(read_ptr,
+                      pngcrush_transform_pixels_fn);
+               }
+               P1(" make_opaque=    %d\n",make_opaque);
+               P1(" blacken=        %d\n",blacken);
+
+               if (reduce_palette == 1)
+               {
+                  /* Note: Take care that sBIT and bKGD data are not
+                   * lost or become invalid when reducing the bit depth.
+                   * (To do: test this; it's probably OK)
+                   */
+                  P1(" Reduce palette by truncating unused entries\n");
+               }
+               P1(" reduce_palette= %d\n",reduce_palette);
+               P1("  new plte_len = %d\n",plte_len);
+            }
+
+            /* { GRR added for quick %-navigation (1) */
+
+            /* Start of chunk-copying/removal code, in order:
+             *  - IHDR
+             *  - bKGD
+             *  - cHRM
+             *  - gAMA
+             *  - sRGB
+             *  - iCCP
+             *  - oFFs
+             *  - pCAL
+             *  - pHYs
+             *  - hIST
+             *  - tRNS
+             *  - PLTE
+             *  - sBIT
+             *  - sCAL
+             *  - sPLT
+             *  - sTER
+             *  - tEXt/zTXt/iTXt
+             *  - tIME
+             *  - unknown chunks
+             */
+            {
+                int compression_method,
+                    filter_method;
+
+                P1( "Transferring info struct\n");
+
+                if (png_get_IHDR(read_ptr, read_info_ptr, &width, &height,
+                     &bit_depth, &color_type, &interlace_method,
+                     &compression_method, &filter_method))
+                {
+                    int need_expand = 0;
+                    input_color_type = color_type;
+                    input_bit_depth = bit_depth;
+
+                    if (output_color_type > 7)
+                    {
+                        output_color_type = input_color_type;
+                    }
+
+                    /* if (verbose > 1 && last_trial) */
+                    if (verbose > 1 && trial == 0)
+                    {
+                        fprintf(STDERR, "   IHDR chunk data:\n");
+                        fprintf(STDERR,
+                                "      Width=%lu, height=%lu\n",
+                                (unsigned long)width,
+                                (unsigned long)height);
+                        fprintf(STDERR, "      Bit depth =%d\n",
+                                bit_depth);
+                        fprintf(STDERR, "      Color type=%d\n",
+                                color_type);
+                        if (output_color_type != color_type)
+                            fprintf(STDERR,
+                                    "      Output color type=%d\n",
+                                    output_color_type);
+                        fprintf(STDERR, "      Interlace =%d\n",
+                                interlace_method);
+                    }
+
+                    output_bit_depth = input_bit_depth;
+
+                    if ((output_color_type != 3 || output_bit_depth > 8)
+                       && output_bit_depth >= 8
+                       && output_bit_depth > input_bit_depth)
+                      need_expand = 1;
+
+#ifdef PNG_READ_RGB_TO_GRAY_SUPPORTED
+                    if ((color_type == 2 ||
+                         color_type == 6 ||
+                         color_type == 3) &&
+                         (output_color_type == 0 ||
+                         output_color_type == 4))
+                    {
+                        if (verbose > 0 && last_trial)
+                        {
+                                fprintf(STDERR, "   Reducing truecolor "
+                                  "image to grayscale.\n");
+                        }
+#ifdef PNG_FIXED_POINT_SUPPORTED
+                        png_set_rgb_to_gray_fixed(read_ptr, 1,
+                           21260, 71520);
+#else
+                        png_set_rgb_to_gray(read_ptr, 1,
+                           0.21260, 0.71520);
+#endif
+                        if (output_bit_depth < 8)
+                            output_bit_depth = 8;
+                        if (color_type == 3)
+                            need_expand = 1;
+                    }
+#endif /* PNG_READ_RGB_TO_GRAY_SUPPORTED */
+
+                    if (color_type != 3 && output_color_type == 3)
+                    {
+                        fprintf(STDERR,"  Cannot change to indexed color "
+                          "(color_type 3)\n");
+                        output_color_type = input_color_type;
+                    }
+
+                    if ((color_type == 0 || color_type == 4) &&
+                        (output_color_type == 2
+                         || output_color_type == 6))
+                    {
+                        png_set_gray_to_rgb(read_ptr);
+                    }
+
+                    if ((color_type == 4 || color_type == 6) &&
+                        (output_color_type != 4
+                         && output_color_type != 6))
+                    {
+                        if (verbose > 0 && last_trial)
+                        {
+                            fprintf(STDERR,
+                              "   Stripping existing alpha channel.\n");
+                        }
+#ifdef PNG_READ_STRIP_ALPHA_SUPPORTED
+                        png_set_strip_alpha(read_ptr);
+#endif
+                    }
+
+                    if ((output_color_type == 4
+                         || output_color_type == 6) && (color_type != 4
+                                                        && color_type != 6))
+                    {
+                        if (verbose > 0 && last_trial)
+                            fprintf(STDERR,
+                              "   Adding an opaque alpha channel.\n");
+#ifdef PNG_READ_FILLER_SUPPORTED
+                        png_set_filler(read_ptr, (png_uint_32) 65535L,
+                                       PNG_FILLER_AFTER);
+#endif
+                        need_expand = 1;
+                    }
+
+                    if (output_color_type != 0 && output_color_type != 3 &&
+                        output_bit_depth < 8)
+                       output_bit_depth = 8;
+
+                    if ((output_color_type == 2
+                         || output_color_type == 6)
+                        && color_type == 3)
+                    {
+                        if (verbose > 0 && last_trial)
+                            fprintf(STDERR,
+                              "   Expanding indexed color file.\n");
+                        need_expand = 1;
+                    }
+#ifdef PNG_READ_EXPAND_SUPPORTED
+                    if (need_expand == 1)
+                        png_set_expand(read_ptr);
+#endif
+
+#ifdef PNG_READ_PACK_SUPPORTED
+                    if (input_bit_depth < 8)
+                    {
+                        png_set_packing(read_ptr);
+                    }
+#endif
+ 
+                    if (trial > 0)
+                    {
+                    if (make_8_bit == 1)
+                    {
+#if defined(PNG_READ_SCALE_16_TO_8_SUPPORTED) || \
+defined(PNG_READ_STRIP_16_TO_8_SUPPORTED)
+                       output_bit_depth = 8;
+                       force_output_bit_depth = 8;
+                       if (verbose > 0 && last_trial)
+                         fprintf(STDERR,
+                         "   Stripping 16-bit depth to 8, trial = %d\n",
+                         trial);
+
+#ifdef PNG_READ_STRIP_16_TO_8_SUPPORTED
+                       png_set_strip_16(read_ptr);
+#else
+#ifdef PNG_READ_SCALE_16_TO_8_SUPPORTED
+                       png_set_scale_16(read_ptr);
+#else
+                       fprintf(STDERR,
+                       "   PNG_READ_STRIP_16_TO_8 NOT SUPPORTED\n");
+#endif
+#endif
+#endif
+                    }
+                      P1("force_output_bit_depth=%d\n",force_output_bit_depth);
+                    }
+
+                    /* After any 16-to-8 reduction, so that 16-bit gray can
+                     * go on down to the gray_bit_depth of its 8-bit samples.
+                     */
+                    if (trial > 0)
+                    {
+                       int reduced_bit_depth = output_bit_depth;
+
+                       if (output_color_type == 0 && output_bit_depth == 8 &&
+                           gray_bit_depth > 0 && gray_bit_depth < 8)
+                          reduced_bit_depth = gray_bit_depth;
+
+                       else if (output_color_type == 3 &&
+                           color_type == 3 && reduce_palette == 1 &&
+                           plte_len > 0)
+                       {
+                          if (plte_len <= 2)
+                            reduced_bit_depth = 1;
+                          else if (plte_len <= 4)
+                            reduced_bit_depth = 2;
+                          else if (plte_len <= 16)
+                            reduced_bit_depth = 4;
+                       }
+
+                       if (repeat == 0 && !last_trial)
+                          depth_trials = reduced_bit_depth < output_bit_depth;
+                       if (reduced_bit_depth < output_bit_depth && !depth_flip)
+                       {
+                          if (verbose > 0 && last_trial)
+                            fprintf(STDERR,
+                              "   Reducing bit depth from %d to %d\n",
+                              output_bit_depth, reduced_bit_depth);
+                          output_bit_depth = reduced_bit_depth;
+                       }
+                    }
+
+#ifdef PNG_READ_SHIFT_SUPPORTED
+                    if (output_color_type == 0 && output_bit_depth < 8 &&
+                        output_bit_depth < input_bit_depth)
+                    {
+                        png_color_8 true_bits;
+                        true_bits.gray = (png_byte) (output_bit_depth);
+                        png_set_shift(read_ptr, &true_bits);
+                    }
+#endif
+
+
+                    if (last_trial == 1)
+                    {
+                    if (save_apng_chunks == 1 || found_acTL_chunk == 1)
+                    {
+                       if (save_apng_chunks == 0)
+                       {
+                          if (verbose > 0) fprintf(STDERR,
+                          "   pngcrush will only save APNG chunks in an\n");
+                          if (verbose > 0) fprintf(STDERR,
+                          "   output file with the \".apng\" extension\n");
+                       }
+                       if (input_color_type != output_color_type)
+                       {
+                          if (verbose > 0) fprintf(STDERR,
+                          "   Cannot save APNG chunks with a color_type\n");
+                          if (verbose > 0) fprintf(STDERR,
+                          "   different from that of the main image.\n");
+                          save_apng_chunks = 2;
+                       }
+                       if (input_bit_depth != output_bit_depth)
+                       {
+                          if (verbose > 0) fprintf(STDERR,
+                          "   Cannot save APNG chunks with a bit_depth\n");
+                          if (verbose > 0) fprintf(STDERR,
+                          "   different from that of the main image.\n");
+                          save_apng_chunks = 2;
+                       }
+                       if (save_apng_chunks != 1 && found_acTL_chunk == 1)
+                          found_acTL_chunk = 2;
+                    }
+                    }
+
+                    if (verbose > 1)
+                        fprintf(STDERR, "   Setting IHDR\n");
+
+#ifdef PNGCRUSH_LOCO
+                    output_format = 0;
+                    if (do_loco)
+                    {
+                        if (output_color_type == 2
+                            || output_color_type == 6)
+                        {
+                            output_format = 1;
+                            filter_method = 64;
+                            if (nosave == 0 && last_trial == 1)
+                               png_permit_mng_features(write_ptr,
+                                   PNG_FLAG_MNG_FILTER_64);
+
+                        }
+                    } else
+                        filter_method = 0;
+#endif
+
+                    output_interlace_method = interlace_method;
+                    if (trial != 0 && found_acTL_chunk == 0)
+                    {
+                       if (interlace_trials)
+                       {
+                          if (last_trial && best > 0 && best < last_method)
+                             output_interlace_method = trial_interlace[best];
+                          else if (interlace_flip)
+                             output_interlace_method = !interlace_method;
+                       }
+                       else if (force_interlace >= 0)
+                          output_interlace_method = force_interlace;
+                    }
+                    if (verbose > 0 && last_trial &&
+                        output_interlace_method != interlace_method)
+                       fprintf(STDERR, "   %s image.\n",
+                         interlace_method ? "Deinterlacing" : "Interlacing");
+
+                    png_set_IHDR(write_ptr, write_info_ptr, width,
+                                 height, output_bit_depth,
+                                 output_color_type, output_interlace_method,
+                                 compression_method, filter_method);
+
+                } /* IHDR */
+            }
+
+            if (premultiply == 1 || premultiply == 2)
+            {
+
+#ifdef PNG_READ_PREMULTIPLY_ALPHA_SUPPORTED
+              /* 0: not premultipled
+               * 1: premultiplied input (input has .pngp suffix and the
+               *    PNGP chunk is present)
+               * 2: premultiplied output (output has .pngp suffix and the
+               *    -premultiply option is present; PNGP chunk is added)
+               * 3: premultiplied input and output (both have .pngp suffix)
+               */
+               P1("Calling png_set_premultiply_alpha\n");
+               png_set_premultiply_alpha(read_ptr,output_bit_depth);
+#endif
+            }
+
+
+            /* Handle ancillary chunks */
+            if (last_trial == 1)
+            {
+#if defined(PNG_READ_bKGD_SUPPORTED) && defined(PNG_WRITE_bKGD_SUPPORTED)
+                {
+                    png_color_16p background;
+                    if (!have_bkgd
+                        && png_get_bKGD(read_ptr, read_info_ptr,
+                                        &background))
+                    {
+                        if (keep_chunk("bKGD", argv))
+                        {
+                            if ((input_color_type == 2 ||
+                                input_color_type == 6) &&
+                                (output_color_type == 0 ||
+                                output_color_type == 4))
+                              background->gray = background->green;
+
+                            png_set_bKGD(write_ptr, write_info_ptr,
+                                         background);
+                        }
+                    }
+                    if (have_bkgd)
+                    {
+                        /* If we are reducing an RGB image to grayscale, but
+                         * the background color isn't gray, the green channel
+                         * is written.  That's not spec-compliant.  We should
+                         * really check for a non-gray bKGD and refuse to do
+                         * the reduction if one is present.
+                         */
+                        png_color_16 backgd;
+                        png_color_16p backgrnd = &backgd;
+                        backgrnd->red = bkgd_red;
+                        backgrnd->green = bkgd_green;
+                        backgrnd->blue = bkgd_blue;
+                        backgrnd->gray = backgrnd->green;
+                        backgrnd->index = bkgd_index;
+                        png_set_bKGD(write_ptr, write_info_ptr,
+                                     backgrnd);
+                    }
+                }
+#endif /* PNG_READ_bKGD_SUPPORTED && PNG_WRITE_bKGD_SUPPORTED */
+
+#if defined(PNG_READ_cHRM_SUPPORTED) && defined(PNG_WRITE_cHRM_SUPPORTED)
+#ifdef PNG_FIXED_POINT_SUPPORTED
+                {
+                    png_fixed_point white_x, white_y, red_x, red_y,
+                        green_x, green_y, blue_x, blue_y;
+
+                    if (found_cHRM && png_get_cHRM_fixed
+                        (read_ptr, read_info_ptr, &white_x, &white_y,
+                         &red_x, &red_y, &green_x, &green_y, &blue_x,
+                         &blue_y))
+                        {
+                          if (keep_chunk("cHRM", argv))
+                          {
+                                png_set_cHRM_fixed(write_ptr,
+                                                   write_info_ptr, white_x,
+                                                   white_y, red_x, red_y,
+                                                   green_x, green_y,
+                                                   blue_x, blue_y);
+                          }
+                        }
+                }
+#else
+                {
+                    double white_x, white_y, red_x, red_y, green_x,
+                        green_y, blue_x, blue_y;
+
+                    if (found_cHRM && png_get_cHRM
+                        (read_ptr, read_info_ptr, &white_x, &white_y,
+                         &red_x, &red_y, &green_x, &green_y, &blue_x,
+                         &blue_y)) {
+                        if (keep_chunk("cHRM", argv))
+                        {
+                                png_set_cHRM(write_ptr, write_info_ptr,
+                                             white_x, white_y, red_x,
+                                             red_y, green_x, green_y,
+                                             blue_x, blue_y);
+                        }
+                    }
+                }
+#endif /* PNG_FIXED_POINT_SUPPORTED */
+#endif /* PNG_READ_cHRM_SUPPORTED && PNG_WRITE_cHRM_SUPPORTED */
+
+#if defined(PNG_READ_gAMA_SUPPORTED) && defined(PNG_WRITE_gAMA_SUPPORTED)
+                {
+                    if (force_specified_gamma)
+                    {
+                        if (last_trial)
+                        {
+                            if (verbose > 0)
+                                fprintf(STDERR, "   Inserting gAMA chunk with "
+#ifdef PNG_FIXED_POINT_SUPPORTED
+                                  "gamma=(%d/100000)\n",
+#else
+                                  "gamma=%f\n",
+#endif
+                                  force_specified_gamma);
+                        }
+#ifdef PNG_FIXED_POINT_SUPPORTED
+                        png_set_gAMA_fixed(write_ptr, write_info_ptr,
+                                           (png_fixed_point)
+                                           force_specified_gamma);
+                        file_gamma =
+                            (png_fixed_point) force_specified_gamma;
+#else
+                        png_set_gAMA(write_ptr, write_info_ptr,
+                                     force_specified_gamma);
+                        file_gamma = force_specified_gamma;
+#endif
+                    }
+#ifdef PNG_FIXED_POINT_SUPPORTED
+                    else if (found_gAMA && png_get_gAMA_fixed
+                             (read_ptr, read_info_ptr, &file_gamma))
+#else
+                    else if (found_gAMA && png_get_gAMA
+                             (read_ptr, read_info_ptr, &file_gamma))
+#endif
+                    {
+                        if (keep_chunk("gAMA", argv))
+                        {
+                            if (image_specified_gamma)
+                                file_gamma = image_specified_gamma;
+                            if (verbose > 1 && last_trial)
+#ifdef PNG_FIXED_POINT_SUPPORTED
+                                fprintf(STDERR, "   gamma=(%d/100000)\n",
+                                        (int) file_gamma);
+                            if (double_gamma)
+                                file_gamma += file_gamma;
+                            png_set_gAMA_fixed(write_ptr, write_info_ptr,
+                                               file_gamma);
+#else
+                                fprintf(STDERR, "   gamma=%f\n",
+                                        file_gamma);
+                            if (double_gamma)
+                                file_gamma += file_gamma;
+                            png_set_gAMA(write_ptr, write_info_ptr,
+                                         file_gamma);
+#endif
+                        }
+                    }
+                    else if (specified_gamma)
+                    {
+                        if (last_trial)
+                        {
+                            if (verbose > 0)
+                                fprintf(STDERR, "   Inserting gAMA chunk with "
+#ifdef PNG_FIXED_POINT_SUPPORTED
+                                  "gamma=(%d/100000)\n",
+#else
+                                  "gamma=%f\n",
+#endif
+                                  specified_gamma);
+                        }
+#ifdef PNG_FIXED_POINT_SUPPORTED
+                        png_set_gAMA_fixed(write_ptr, write_info_ptr,
+                                           specified_gamma);
+                        file_gamma = (png_fixed_point) specified_gamma;
+#else
+                        png_set_gAMA(write_ptr, write_info_ptr,
+                                     specified_gamma);
+                        file_gamma = specified_gamma;
+#endif
+                    }
+                }
+#endif /* PNG_READ_gAMA_SUPPORTED && PNG_WRITE_gAMA_SUPPORTED */
+
+#if defined(PNG_READ_sRGB_SUPPORTED) && defined(PNG_WRITE_sRGB_SUPPORTED)
+                {
+                    int file_intent;
+
+                    if (png_get_sRGB
+                        (read_ptr, read_info_ptr, &file_intent))
+                    {
+                        if (keep_chunk("sRGB", argv))
+                        {
+                            png_set_sRGB(write_ptr, write_info_ptr,
+                                         file_intent);
+                            intent = file_intent;
+                        }
+                    }
+                    else if (found_sRGB)
+                    {
+#ifdef PNG_gAMA_SUPPORTED
+#  ifdef PNG_FIXED_POINT_SUPPORTED
+                        if (file_gamma >= 45000L && file_gamma <= 46000L)
+#  else
+                        if (file_gamma >= 0.45000 && file_gamma <= 0.46000)
+#  endif
+                        {
+                            if (verbose > 0 && last_trial)
+                                fprintf(STDERR,
+                                  "   Inserting sRGB chunk with intent=%d\n",
+                                  intent);
+                            png_set_sRGB(write_ptr, write_info_ptr,
+                                         intent);
+                        }
+                        else if (file_gamma != 0)
+                        {
+                            if (verbose > 0 && last_trial)
+                            {
+                                fprintf(STDERR, "   Ignoring sRGB request; "
+#  ifdef PNG_FIXED_POINT_SUPPORTED
+                                  "gamma=(%lu/100000)"
+                                  " is not approx. 0.455\n",
+                                  (unsigned long)file_gamma);
+#  else
+                                  "gamma=%f"
+                                  " is not approx. 0.455\n",
+                                  file_gamma);
+#  endif
+                            }
+                        }
+#endif /* PNG_gAMA_SUPPORTED */
+                    }
+                }
+#endif /* PNG_READ_sRGB_SUPPORTED && PNG_WRITE_sRGB_SUPPORTED */
+
+#if defined(PNG_READ_iCCP_SUPPORTED) && defined(PNG_WRITE_iCCP_SUPPORTED)
+                /* Ignore iCCP if sRGB is being written, or if the input's
+                 * iCCP is being copied verbatim
+                 */
+                if (intent < 0 && !(raw_chunk_types & PNGCRUSH_RAW_iCCP)) {
+                    png_charp name;
+#if PNGCRUSH_LIBPNG_VER < 10500
+                    png_charp profile;
+#else
+                    png_bytep profile;
+#endif
+                    png_uint_32 proflen;
+                    int compression_method;
+
+                    if (found_iCCP && png_get_iCCP
+                        (read_ptr, read_info_ptr, &name,
+                         &compression_method, &profile, &proflen))
+                    {
+                        P1("Got iCCP chunk, proflen=%lu\n",
+                            (unsigned long)proflen);
+                        if (iccp_length)
+                            P0("Will not replace existing iCCP chunk.\n");
+                        if (keep_chunk("iCCP", argv))
+                            png_set_iCCP(write_ptr, write_info_ptr,
+#if PNGCRUSH_LIBPNG_VER < 10500
+                                                           name,
+#else
+                                         (png_const_charp) name,
+#endif
+                                         compression_method, profile,
+                                         proflen);
+
+                    }
+#ifdef PNG_iCCP_SUPPORTED
+                    else if (iccp_length)
+                    {
+                        png_set_iCCP(write_ptr, write_info_ptr, iccp_name,
+                                     0,
+#if PNGCRUSH_LIBPNG_VER < 10500
+                                     iccp_text,
+#else
+                                     (png_const_bytep) iccp_text,
+#endif
+                                     iccp_length);
+                        P1("Wrote iCCP chunk, proflen=%d\n", iccp_length);
+                    }
+#endif /* PNG_iCCP_SUPPORTED */
+
+                }
+#endif /* PNG_READ_iCCP_SUPPORTED && PNG_WRITE_iCCP_SUPPORTED */
+
+#if defined(PNG_READ_oFFs_SUPPORTED) && defined(PNG_WRITE_oFFs_SUPPORTED)
+                {
+                    png_int_32 offset_x, offset_y;
+                    int unit_type;
+
+                    if (png_get_oFFs
+                        (read_ptr, read_info_ptr, &offset_x, &offset_y,
+                         &unit_type)) {
+                        if (offset_x == 0 && offset_y == 0)
+                        {
+                            if (verbose > 0 && last_trial)
+                                fprintf(STDERR,
+                                  "   Deleting useless oFFs 0 0 chunk\n");
+                        }
+                        else
+                        {
+                            if (keep_chunk("oFFs", argv))
+                                png_set_oFFs(write_ptr, write_info_ptr,
+                                             offset_x, offset_y,
+                                             unit_type);
+                        }
+                    }
+                }
+#endif /* PNG_READ_oFFs_SUPPORTED && PNG_WRITE_oFFs_SUPPORTED */
+
+#if defined(PNG_READ_pCAL_SUPPORTED) && defined(PNG_WRITE_pCAL_SUPPORTED)
+                {
+                    png_charp purpose, units;
+                    png_charpp params;
+                    png_int_32 X0, X1;
+                    int type, nparams;
+
+                    if (png_get_pCAL
+                        (read_ptr, read_info_ptr, &purpose, &X0, &X1,
+                         &type, &nparams, &units, &params))
+                    {
+                        if (keep_chunk("pCAL", argv))
+                            png_set_pCAL(write_ptr, write_info_ptr,
+                                         purpose, X0, X1, type, nparams,
+                                         units, params);
+                    }
+                }
+#endif /* pCAL_SUPPORTED */
+
+#if defined(PNG_READ_pHYs_SUPPORTED) && defined(PNG_WRITE_pHYs_SUPPORTED)
+                {
+                    png_uint_32 res_x, res_y;
+                    int unit_type;
+
+                    if (resolution == 0)
+                    {
+                        if (png_get_pHYs
+                            (read_ptr, read_info_ptr, &res_x, &res_y,
+                             &unit_type))
+                        {
+                            if (res_x == 0 && res_y == 0)
+                            {
+                                if (verbose > 0 && last_trial)
+                                    fprintf(STDERR,
+                                      "   Deleting useless pHYs 0 0 chunk\n");
+                            }
+                            else
+                            {
+                                if (keep_chunk("pHYs", argv))
+                                    png_set_pHYs(write_ptr, write_info_ptr,
+                                                 res_x, res_y, unit_type);
+                            }
+                        }
+                    } else {
+                        unit_type = 1;
+                        res_x = res_y =
+                            (png_uint_32) ((resolution / .0254 + 0.5));
+                        png_set_pHYs(write_ptr, write_info_ptr, res_x,
+                                     res_y, unit_type);
+                        if (verbose > 0 && last_trial)
+                            fprintf(STDERR, "   Added pHYs %lu %lu 1 chunk\n",
+                            (unsigned long)res_x,
+                            (unsigned long)res_y);
+                    }
+                }
+#endif
+
+#if defined(PNG_READ_hIST_SUPPORTED) && defined(PNG_WRITE_hIST_SUPPORTED)
+                {
+                    png_uint_16p hist;
+
+                    if (png_get_hIST(read_ptr, read_info_ptr, &hist))
+                    {
+                        if (keep_chunk("hIST", argv))
+                            png_set_hIST(write_ptr, write_info_ptr, hist);
+                    }
+                }
+#endif /* hIST_SUPPORTED */
+
+#if defined(PNG_READ_tRNS_SUPPORTED) && defined(PNG_WRITE_tRNS_SUPPORTED)
+                {
+                    if (png_get_tRNS
+                        (read_ptr, read_info_ptr, &trans, &num_trans,
+                         &trans_values))
+                    {
+                        if (verbose > 1 && last_trial)
+                            fprintf(STDERR,
+                              "  Found tRNS chunk in input file.\n");
+                        if (have_trns == 1)
+                        {
+                            P0("  Will not overwrite existing tRNS chunk.\n");
+                        }
+                        if (keep_chunk("tRNS", argv))
+                        {
+                            int last_nonmax = -1;
+                            trns_red = trans_values->red;
+                            trns_green = trans_values->green;
+                            trns_blue = trans_values->blue;
+                            trns_gray = trans_values->gray;
+                            if (output_color_type == 3)
+                            {
+                                for (ia = 0; ia < num_trans; ia++)
+                                    trns_array[ia] = trans[ia];
+                                for (; ia < 256; ia++)
+                                    trns_array[ia] = 255;
+                                for (ia = 0; ia < 256; ia++)
+                                {
+                                    if (trns_array[ia] != 255)
+                                        last_nonmax = ia;
+                                }
+                                if (last_trial && verbose > 0)
+                                {
+                                    if (last_nonmax < 0)
+                                        fprintf(STDERR, "   Deleting "
+                                          "all-opaque tRNS chunk.\n");
+                                    else if (last_nonmax + 1 < num_trans)
+                                        fprintf(STDERR,
+                                          "   Truncating trailing opaque "
+                                          "entries from tRNS chunk.\n");
+                                }
+                                num_trans = last_nonmax + 1;
+                            }
+                            else
+                            {
+                               /* color type is 0 or 2 */
+                               if (input_bit_depth == 16 &&
+                                   output_bit_depth == 8)
+                               {
+                                 /* zero out the high byte */
+                                 trans_values->red &= 0x00ff;
+                                 trans_values->green &= 0x00ff;
+                                 trans_values->blue &= 0x00ff;
+                                 trans_values->gray &= 0x00ff;
+                               }
+
+                            }
+                            if (verbose > 1)
+                                fprintf(STDERR,
+                                  "   png_set_tRNS, num_trans=%d\n",
+                                  num_trans);
+                            if (output_color_type < 3 || num_trans)
+                                png_set_tRNS(write_ptr, write_info_ptr,
+                                             trans, num_trans,
+                                             trans_values);
+                        }
+                    }
+                    else if (make_trns == 1 &&
+                        (output_color_type == 0 || output_color_type == 2))
+                    {
+                        /* the key color found in the first trial */
+                        png_color_16 trans_data;
+
+                        trns_red = (png_uint_16) (trns_key >> 16);
+                        trns_green = (png_uint_16) ((trns_key >> 8) & 0xff);
+                        trns_blue = (png_uint_16) (trns_key & 0xff);
+                        trns_gray = output_color_type == 0 &&
+                            input_color_type == 6 ? trns_red :
+                            (png_uint_16) trns_key;
+                        if (output_color_type == 0 && output_bit_depth < 8)
+                            trns_gray >>= 8 - output_bit_depth;
+                        trans_data.index = 0;
+                        trans_data.red = trns_red;
+                        trans_data.green = trns_green;
+                        trans_data.blue = trns_blue;
+                        trans_data.gray = trns_gray;
+                        num_trans = 1;
+                        for (ia = 0; ia < 256; ia++)
+                            trns_array[ia] = 255;
+                        P0("  Adding a tRNS key color\n");
+                        png_set_tRNS(write_ptr, write_info_ptr, NULL,
+                                     num_trans, &trans_data);
+                    }
+                    else if (have_trns == 1)
+                    {
+                        /* will not overwrite existing trns data */
+                        png_color_16 trans_data;
+                        png_byte index_data = (png_byte) trns_index;
+                        num_trans = index_data + 1;
+                        if (verbose > 1)
+                            fprintf(STDERR, "Have_tRNS, num_trans=%d\n",
+                                    num_trans);
+                        if (output_color_type == 3)
+                        {
+                            trans_values = NULL;
+                            for (ia = 0; ia < num_trans; ia++)
+                                trns_array[ia] = trans_in[ia];
+                            for (; ia < 256; ia++)
+                                trns_array[ia] = 255;
+                        } else {
+                            for (ia = 0; ia < 256; ia++)
+                                trns_array[ia] = 255;
+                            trns_array[index_data] = 0;
+
+                            trans_data.index = index_data;
+                            trans_data.red = trns_red;
+                            trans_data.green = trns_green;
+                            trans_data.blue = trns_blue;
+                            trans_data.gray = trns_gray;
+                            trans_values = &trans_data;
+                        }
+
+                        P0("  Adding a tRNS chunk\n");
+                        png_set_tRNS(write_ptr, write_info_ptr, trns_array,
+                                     num_trans, trans_values);
+                    }
+                    else
+                    {
+                        for (ia = 0; ia < 256; ia++)
+                            trns_array[ia] = 255;
+                    }
+                    if (verbose > 1 && last_trial)
+                    {
+                        int last = -1;
+                        for (ia = 0; ia < num_palette; ia++)
+                            if (trns_array[ia] != 255)
+                                last = ia;
+                        if (last >= 0) {
+                            fprintf(STDERR, "   Transparency:\n");
+                            if (output_color_type == 3)
+                                for (ia = 0; ia < num_palette; ia++)
+                                    fprintf(STDERR, "      %4d %4d\n", ia,
+                                            trns_array[ia]);
+                            else if (output_color_type == 0)
+                                fprintf(STDERR, "      %d\n", trns_gray);
+                            else if (output_color_type == 2)
+                                fprintf(STDERR, "      %d %d %d\n",
+                                        trns_red, trns_green, trns_blue);
+                        }
+                    }
+                }
+#endif /* PNG_READ_tRNS_SUPPORTED && PNG_WRITE_tRNS_SUPPORTED */
+            }  /* End of ancillary chunk handling */
+
+                if (png_get_PLTE
+                    (read_ptr, read_info_ptr, &palette, &num_palette))
+                {
+                    if (plte_len > 0)
+                        num_palette = plte_len;
+                    if (do_pplt)
+                    {
+                        fprintf(STDERR,"PPLT: %s\n", pplt_string);
+                        fprintf(STDERR,"Sorry, PPLT is not implemented yet.\n");
+                    }
+
+                    if (nosave == 0)
+                    {
+                    if (output_color_type == 3)
+                        png_set_PLTE(write_ptr, write_info_ptr, palette,
+                                     num_palette);
+                    else if (keep_chunk("PLTE", argv))
+                        png_set_PLTE(write_ptr, write_info_ptr, palette,
+                                     num_palette);
+
+                    }
+                    if (verbose > 1 && last_trial)
+                    {
+                        png_colorp p = palette;
+                        fprintf(STDERR, "   Palette:\n");
+                        fprintf(STDERR,
+                          "      I    R    G    B ( color )    A\n");
+                        for (i = 0; i < num_palette; i++)
+                        {
+                            fprintf(STDERR,
+                              "   %4d %4d %4d %4d (#%2.2x%2.2x%2.2x) %4d\n",
+                              i, p->red, p->green, p->blue, p->red,
+                              p->green, p->blue, trns_array[i]);
+                            p++;
+                        }
+                    }
+                }
+
+
+            /* Handle ancillary chunks */
+            if (last_trial == 1)
+            {
+#if defined(PNG_READ_sBIT_SUPPORTED) && defined(PNG_WRITE_sBIT_SUPPORTED)
+                {
+                    png_color_8p sig_bit;
+
+                    /* If we are reducing a truecolor PNG to grayscale, and the
+                     * RGB sBIT values aren't identical, we'll lose sBIT info.
+                     */
+                    if (png_get_sBIT(read_ptr, read_info_ptr, &sig_bit))
+                    {
+                        if (keep_chunk("sBIT", argv))
+                        {
+                            if ((input_color_type == 0
+                                 || input_color_type == 4)
+                                && (output_color_type == 2
+                                    || output_color_type == 6
+                                    || output_color_type == 3))
+                                sig_bit->red = sig_bit->green =
+                                    sig_bit->blue = sig_bit->gray;
+                            if ((input_color_type == 2
+                                 || input_color_type == 6
+                                 || output_color_type == 3)
+                                && (output_color_type == 0
+                                    || output_color_type == 4))
+                                sig_bit->gray = sig_bit->green;
+
+                            if ((input_color_type == 0
+                                 || input_color_type == 2)
+                                && (output_color_type == 4
+                                    || output_color_type == 6))
+                                sig_bit->alpha = 1;
+
+                            if (nosave == 0)
+                               png_set_sBIT(write_ptr, write_info_ptr,
+                                         sig_bit);
+                        }
+                    }
+                }
+#endif /* PNG_READ_sBIT_SUPPORTED)&& PNG_WRITE_sBIT_SUPPORTED */
+
+#ifdef PNG_sCAL_SUPPORTED
+#  ifdef PNG_FLOATING_POINT_SUPPORTED
+                {
+                    int unit;
+                    double scal_width, scal_height;
+
+                    if (png_get_sCAL
+                        (read_ptr, read_info_ptr, &unit, &scal_width,
+                         &scal_height))
+                    {
+                        png_set_sCAL(write_ptr, write_info_ptr, unit,
+                                     scal_width, scal_height);
+                    }
+                }
+#  else
+#    ifdef PNG_FIXED_POINT_SUPPORTED
+                {
+                    int unit;
+                    png_charp scal_width, scal_height;
+
+                    if (png_get_sCAL_s
+                        (read_ptr, read_info_ptr, &unit, &scal_width,
+                         &scal_height))
+                    {
+                        if (keep_chunk("sCAL", argv))
+                            png_set_sCAL_s(write_ptr, write_info_ptr, unit,
+                                           scal_width, scal_height);
+                    }
+                }
+#    endif
+#  endif /* PNG_FLOATING_POINT_SUPPORTED */
+#endif /* PNG_sCAL_SUPPORTED */
+
+#ifdef PNG_sPLT_SUPPORTED
+                {
+                    png_sPLT_tp entries;
+                    int num_entries;
+
+                    num_entries =
+                        (int) png_get_sPLT(read_ptr, read_info_ptr,
+                                           &entries);
+                    if (num_entries)
+                    {
+                        if (keep_chunk("sPLT", argv))
+                            png_set_sPLT(write_ptr, write_info_ptr,
+                                         entries, num_entries);
+                    }
+                }
+#endif
+
+#ifdef PNG_TEXT_SUPPORTED
+                {
+                    png_textp text_ptr;
+                    int num_text = 0;
+
+                    if (png_get_text
+                        (read_ptr, read_info_ptr, &text_ptr, &num_text) > 0
+                        || text_inputs)
+                    {
+                        int ntext;
+                        P1( "Handling %d tEXt/zTXt chunks before IDAT\n",
+                                   num_text);
+
+                        if (verbose > 1 && last_trial && num_text > 0)
+                        {
+                            for (ntext = 0; ntext < num_text; ntext++)
+                            {
+                                fprintf(STDERR, "%d  %s", ntext,
+                                        text_ptr[ntext].key);
+                                if (text_ptr[ntext].text_length)
+                                    fprintf(STDERR, ": %s\n",
+                                            text_ptr[ntext].text);
+#ifdef PNG_iTXt_SUPPORTED
+                                else if (text_ptr[ntext].itxt_length)
+                                {
+                                    fprintf(STDERR, " (%s: %s): \n",
+                                            text_ptr[ntext].lang,
+                                            text_ptr[ntext].lang_key);
+                                    fprintf(STDERR, "%s\n",
+                                            text_ptr[ntext].text);
+                                }
+#endif
+                                else
+                                    fprintf(STDERR, "\n");
+                            }
+                        }
+
+                        if (num_text > 0)
+                        {
+                            if (keep_chunk("text", argv))
+                            {
+                                int num_to_write = num_text;
+                                for (ntext = 0; ntext < num_text; ntext++)
+                                {
+                                    if (last_trial)
+                                        P2("Text chunk before IDAT, "
+                                          "compression=%d\n",
+                                          text_ptr[ntext].compression);
+                                    if (text_ptr[ntext].compression ==
+                                        PNG_TEXT_COMPRESSION_NONE) {
+                                        if (!keep_chunk("tEXt", argv))
+                                        {
+                                            text_ptr[ntext].key[0] = '\0';
+                                            num_to_write--;
+                                        }
+                                    }
+                                    if (text_ptr[ntext].compression ==
+                                        PNG_TEXT_COMPRESSION_zTXt)
+                                    {
+                                        if (!keep_chunk("zTXt", argv))
+                                        {
+                                            text_ptr[ntext].key[0] = '\0';
+                                            num_to_write--;
+                                        }
+                                    }
+#ifdef PNG_iTXt_SUPPORTED
+                                    if (text_ptr[ntext].compression ==
+                                        PNG_ITXT_COMPRESSION_NONE
+                                        || text_ptr[ntext].compression ==
+                                        PNG_ITXT_COMPRESSION_zTXt)
+                                    {
+                                        if (!keep_chunk("iTXt", argv))
+                                        {
+                                            text_ptr[ntext].key[0] = '\0';
+                                            num_to_write--;
+                                        }
+                                    }
+#endif
+                                }
+                                if (num_to_write > 0)
+                                    png_set_text(write_ptr, write_info_ptr,
+                                                 text_ptr, num_text);
+                            }
+                        }
+                        for (ntext = 0; ntext < text_inputs; ntext++)
+                        {
+                            if (text_where[ntext] == 1)
+                            {
+                                png_textp added_text;
+                                added_text = (png_textp) png_malloc(write_ptr,
+                                               (png_uint_32) sizeof(png_text));
+                                added_text[0].key = &text_keyword[ntext * 80];
+#ifdef PNG_iTXt_SUPPORTED
+                                added_text[0].lang = &text_lang[ntext * 80];
+                                added_text[0].lang_key =
+                                    &text_lang_key[ntext * 80];
+#endif
+                                added_text[0].text = 
+                                    &text_text[ntext * STR_BUF_SIZE];
+                                added_text[0].compression =
+                                    text_compression[ntext];
+                                png_set_text(write_ptr, write_info_ptr,
+                                             added_text, 1);
+                                if (verbose > 0 && last_trial)
+                                {
+                                  if (added_text[0].compression < 0)
+                                      fprintf(STDERR,
+                                         "   Added a tEXt chunk.\n");
+                                  else if (added_text[0].compression == 0)
+                                      fprintf(STDERR,
+                                         "   Added a zTXt chunk.\n");
+#ifdef PNG_iTXt_SUPPORTED
+                                  else
+                                      fprintf(STDERR,
+                                         "   Added a%scompressed iTXt chunk"
+                                        ".\n", (added_text[0].compression == 1)?
+                                        "n un" : " ");
+#endif
+                                }
+                                png_free(write_ptr, added_text);
+                                added_text = (png_textp) NULL;
+                            }
+                        }
+                    }
+                }
+#endif /* defined(PNG_TEXT_SUPPORTED) */
+
+#if defined(PNG_READ_tIME_SUPPORTED) && defined(PNG_WRITE_tIME_SUPPORTED)
+                {
+                    png_timep mod_time;
+
+                    if (png_get_tIME(read_ptr, read_info_ptr, &mod_time))
+                    {
+                        if (keep_chunk("tIME", argv))
+                            png_set_tIME(write_ptr, write_info_ptr, mod_time);
+                    }
+                }
+#endif
+
+#ifdef PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED
+                /* This section handles pCAL and tIME (at least, in default
+                 * build), gIFx/gIFg/gIFt, private Fireworks chunks, etc. */
+                {
+                    png_unknown_chunkp unknowns;   /* allocated by libpng */
+                    int num_unknowns;
+
+                    num_unknowns = (int)png_get_unknown_chunks(read_ptr,
+                      read_info_ptr, &unknowns);
+
+                    if (nosave == 0 && ster_mode >= 0)
+                    {
+                        /* Add sTER chunk */
+                        png_unknown_chunkp ster;
+                        P1("Handling sTER as unknown chunk %d\n", num_unknowns);
+                        ster = (png_unknown_chunk*)png_malloc(read_ptr,
+                            (png_uint_32) sizeof(png_unknown_chunk));
+                        png_memcpy((char *)ster[0].name, "sTER",5);
+                        ster[0].size = 1;
+                        ster[0].data = (png_byte*)png_malloc(read_ptr, 1);
+                        ster[0].data[0] = (png_byte)ster_mode;
+                        png_set_unknown_chunks(read_ptr, read_info_ptr,
+                         ster, 1);
+                        png_free(read_ptr,ster[0].data);
+                        png_free(read_ptr,ster);
+                        num_unknowns++;
+                    }
+
+#ifndef PNG_HAVE_IHDR
+#define PNG_HAVE_IHDR 0x01
+#endif
+                    if (ster_mode >= 0)
+                        png_set_unknown_chunk_location(read_ptr, read_info_ptr,
+                           num_unknowns - 1, (int)PNG_HAVE_IHDR);
+
+                    P1("Found %d unknown chunks\n", num_unknowns);
+
+                    if (nosave == 0 && num_unknowns)
+                    {
+                        png_unknown_chunkp unknowns_keep; /* allocated by us */
+                        int num_unknowns_keep;
+
+                        unknowns_keep = (png_unknown_chunk*)png_malloc(
+                          write_ptr, (png_uint_32) num_unknowns
+                          *sizeof(png_unknown_chunk));
+
+                        P1("malloc for %d unknown chunks\n", num_unknowns);
+                        num_unknowns_keep = 0;
+
+                        /* make an array of only those chunks we want to keep */
+                        for (i = 0; i < num_unknowns; i++)
+                        {
+                            P1("Handling unknown chunk %d %s\n", i,
+                               (char *)unknowns[i].name);
+                            /* not EBCDIC-safe, but neither is keep_chunks(): */
+                            P2("   unknown[%d] = %s (%lu bytes, location %d)\n",
+                              i, unknowns[i].name,
+                              (unsigned long)unknowns[i].size,
+                              unknowns[i].location);
+                            if (keep_chunk((char *)unknowns[i].name, argv))
+                            {
+                                png_memcpy(&unknowns_keep[num_unknowns_keep],
+                                  &unknowns[i], sizeof(png_unknown_chunk));
+                                ++num_unknowns_keep;
+                            }
+                        }
+
+                        P1("Keeping %d unknown chunks\n", num_unknowns_keep);
+                        png_set_unknown_chunks(write_ptr, write_info_ptr,
+                          unknowns_keep, num_unknowns_keep);
+
+                        /* relevant location bits:
+                         *   (1) !PNG_HAVE_PLTE && !PNG_HAVE_IDAT (before PLTE)
+                         *   (2)  PNG_HAVE_PLTE && !PNG_HAVE_IDAT (between)
+                         *   (3)  PNG_AFTER_IDAT                  (after IDAT)
+                         * PNG_HAVE_PLTE  = 0x02
+                         * PNG_HAVE_IDAT  = 0x04
+                         * PNG_AFTER_IDAT = 0x08
+                         */
+                        for (i = 0; i < num_unknowns_keep; i++)
+                        {
+                            png_set_unknown_chunk_location(write_ptr,
+                              write_info_ptr, i,
+                              (int)unknowns_keep[i].location);
+                        }
+
+                        /* png_set_unknown_chunks() makes own copy, so nuke
+                         * ours */
+                        png_free(write_ptr, unknowns_keep);
+                    }
+                }
+              P1( "Finished handling ancillary chunks after IDAT\n");
+#endif /* PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED */
+            }  /* End of ancillary chunk handling */
+
+                /* } GRR added for quick %-navigation (1) */
+
+                /*
+                 * Would be useful to have a libpng fix, that either exports
+                 * png_read_transform_info() or provides a generic API that
+                 * can set any png_ptr->flag, or, simpler, provides an API
+                 * to set the PNG_FLAG_ROW_INIT flag.
+                 *
+                 * Starting in libpng-1.5.6beta06, png_read_update_info()
+                 * does not check the PNG_FLAG_ROW_INIT flag and does not
+                 * initialize the row or issue a warning.
+                 *
+                 */
+#ifdef PNGCRUSH_H
+                png_read_transform_info(read_ptr, read_info_ptr);
+#else
+                /* Some pngcrush capabilities are lacking when the system
+                 * libpng is used instead of the one bundled with pngcrush
+                 *
+                 * To do: list those capabilities here
+                 */
+
+                /* pngcrush fails to read interlaced PNGs properly
+                 * when png_read_update_info() is called here.
+                 */
+
+                /* png_read_update_info(read_ptr, read_info_ptr); */
+
+                /* Workaround is to multiply rowbytes by 8/bit_depth
+                 * to allow for unpacking, wherever we allocate a
+                 * row buffer.  This results in too large a value for
+                 * rowbytes under some conditions, e.g., when increasing
+                 * a sub-8-bit file to RGBA, but this is rare and harmless.
+                 */
+#endif
+
+                /* This is the default case (nosave == 1 -> perf-testing
+                   only) */
+                if (nosave == 0)
+                {
+                    if (filter_type == 0)
+                        png_set_filter(write_ptr, 0, PNG_FILTER_NONE);
+                    else if (filter_type == 1)
+                        png_set_filter(write_ptr, 0, PNG_FILTER_SUB);
+                    else if (filter_type == 2)
+                        png_set_filter(write_ptr, 0, PNG_FILTER_UP);
+                    else if (filter_type == 3)
+                        png_set_filter(write_ptr, 0, PNG_FILTER_AVG);
+                    else if (filter_type == 4)
+                        png_set_filter(write_ptr, 0, PNG_FILTER_PAETH);
+                    else if (filter_type == 5)
+                            png_set_filter(write_ptr, 0, PNG_ALL_FILTERS);
+                    else if (filter_type == 6) /* speedy */
+                            png_set_filter(write_ptr, 0, PNG_FILTER_NONE |
+                               PNG_FILTER_SUB | PNG_FILTER_UP);
+                    else
+                        png_set_filter(write_ptr, 0, PNG_FILTER_NONE);
+
+#ifdef PNGCRUSH_LOCO
+                    if (do_loco) {
+                        png_byte buff[30];
+                        const png_byte png_MHDR[5] = { 77, 72, 68, 82, '\0' };
+                        png_byte mng_signature[8] =
+                            { 138, 77, 78, 71, 13, 10, 26, 10 };
+                        /* write the MNG 8-byte signature */
+                        if (outname[strlen(outname) - 3] == 'p')
+                            pngcrush_warning(read_ptr,
+                              "  Writing a MNG file with a .png extension");
+                        pngcrush_write_png(write_ptr, &mng_signature[0],
+                                  (png_size_t) 8);
+                        png_set_sig_bytes(write_ptr, 8);
+
+                        /* Write a MHDR chunk */
+
+                        buff[0] = (png_byte) ((width >> 24) & 0xff);
+                        buff[1] = (png_byte) ((width >> 16) & 0xff);
+                        buff[2] = (png_byte) ((width >> 8) & 0xff);
+                        buff[3] = (png_byte) ((width) & 0xff);
+                        buff[4] = (png_byte) ((height >> 24) & 0xff);
+                        buff[5] = (png_byte) ((height >> 16) & 0xff);
+                        buff[6] = (png_byte) ((height >> 8) & 0xff);
+                        buff[7] = (png_byte) ((height) & 0xff);
+                        for (i = 8; i < 27; i++)
+                            buff[i] = 0x00;
+                        buff[15] = 2; /* layer count */
+                        buff[19] = 1; /* frame count */
+                        if (output_color_type == 6)
+                            buff[27] = 0x09; /* profile: MNG-VLC with trans. */
+                        else
+                            buff[27] = 0x01;  /* profile: MNG-VLC */
+                        png_write_chunk(write_ptr, (png_bytep) png_MHDR,
+                                        buff, (png_size_t) 28);
+                    }
+#endif /* PNGCRUSH_LOCO */
+
+                    pngcrush_pause();
+
+                    if (found_CgBI)
+                    {
+                        pngcrush_warning(read_ptr,
+                            "Cannot read Xcode CgBI PNG");
+                    }
+                    P1( "\nWriting info struct\n");
+
+                    if (copy_idat == 0)
+                    {
+
+#if 0 /* doesn't work; compression level has to be the same as in IDAT */
+                    /* if zTXt other compressed chunk */
+                    png_set_compression_level(write_ptr, 9);
+                    png_set_compression_window_bits(write_ptr, 15);
+#endif /* 0 */
+
+                    pngcrush_pause();
+                      {
+                        png_uint_32 zbuf_size;
+                        png_uint_32 required_window;
+                        int channels = 0;
+                        png_set_compression_strategy(write_ptr,
+                                                     z_strategy
+#ifdef Z_SPLIT_BLOCKS
+                            | (block_split ? Z_SPLIT_BLOCKS : 0)
+#endif
+#ifdef Z_OPTIMAL_HUFFMAN
+                            | (optimal_huffman ? Z_OPTIMAL_HUFFMAN : 0)
+#endif
+                            );
+                        png_set_compression_mem_level(write_ptr,
+                                                      compression_mem_level);
+
+                        if (output_color_type == 0)
+                            channels = 1;
+                        if (output_color_type == 2)
+                            channels = 3;
+                        if (output_color_type == 3)
+                            channels = 1;
+                        if (output_color_type == 4)
+                            channels = 2;
+                        if (output_color_type == 6)
+                            channels = 4;
+
+                        /* This method was copied from libpng to find maximum
+                         * data size.  Only return sizes up to the maximum of
+                         * a png_uint_32, by limiting the width and height used
+                         * to 15 bits.
+                         */
+                        png_uint_32 rowbytes;
+                        png_uint_32 h = height;
+
+                        /* FIX THIS, does not work with libpng-1.7.0
+                         * because info_ptr->bit_depth has not been
+                         * updated yet.
+                         */
+                        rowbytes = png_get_rowbytes(read_ptr, read_info_ptr);
+#ifndef PNGCRUSH_H
+                        /* We must do this because we could not call
+                         * png_read_update_info().
+                         */
+                        if (input_bit_depth < 8)
+                          rowbytes *= 8/input_bit_depth;
+#endif
+                        if (rowbytes < 16384 && h < 16384)
+                        {
+                          if (rowbytes * h < 16384)
+                          {
+                             if (output_interlace_method)
+                             {
+                                /* Interlacing makes the uncompressed data
+                                 * larger because of the replication of both
+                                 * the filter byte and the padding to a byte
+                                 * boundary.
+                                 */
+                                png_uint_32 w = width;
+                                unsigned int pd = channels * output_bit_depth;
+#if (PNGCRUSH_LIBPNG_VER < 10400)
+                                png_size_t cb_base;
+#else
+                                png_alloc_size_t cb_base;
+#endif
+                                int interlace_pass;
+
+                                for (cb_base=0, interlace_pass=0;
+                                     interlace_pass<=6; ++interlace_pass)
+                                {
+                                   png_uint_32 pw = PNG_PASS_COLS(w,
+                                     interlace_pass);
+
+                                   if (pw > 0)
+                                      cb_base += (PNGCRUSH_ROWBYTES(pd, pw)+1) *
+                                          PNG_PASS_ROWS(h, interlace_pass);
+                                }
+
+                                max_bytes = cb_base;
+                             }
+
+                             else
+                                max_bytes = (rowbytes+1) * h;
+                          }
+                          else
+                             max_bytes = 0x3fffffffU;
+                        }
+
+                        else
+                           max_bytes = 0x3fffffffU;
+
+                        required_window = (png_uint_32) (max_bytes + 262);
+
+                        zbuf_size =
+                            png_get_compression_buffer_size(write_ptr);
+
+                        /* reinitialize zbuf - compression buffer */
+                        if (zbuf_size != max_idat_size)
+                        {
+                            png_uint_32 max_possible_size =
+                                required_window;
+                            if (max_possible_size > max_idat_size)
+                                max_possible_size = max_idat_size;
+                            P2("reinitializing write zbuf to %lu.\n",
+                               (unsigned long)max_possible_size);
+                            png_set_compression_buffer_size(write_ptr,
+                                                            max_possible_size);
+                        }
+
+                        if (required_window <= 512)
+                            compression_window = 9;
+                        else if (required_window <= 1024)
+                            compression_window = 10;
+                        else if (required_window <= 2048)
+                            compression_window = 11;
+                        else if (required_window <= 4096)
+                            compression_window = 12;
+                        else if (required_window <= 8192)
+                            compression_window = 13;
+                        else if (required_window <= 16384)
+                            compression_window = 14;
+                        else
+                            compression_window = 15;
+                        if (compression_window > default_compression_window
+                            || force_compression_window)
+                            compression_window =
+                                default_compression_window;
+
+                        if (verbose > 1 && last_trial
+                            && (compression_window != 15
+                                || force_compression_window))
+                            fprintf(STDERR,
+                                    "   Compression window for output= %d\n",
+                                    1 << compression_window);
+
+                        png_set_compression_window_bits(write_ptr,
+                                                        compression_window);
+                      }
+
+                    png_set_compression_level(write_ptr, zlib_level);
+                    } /* copy_idat */
+
+                    png_write_info_before_PLTE(write_ptr, write_info_ptr);
+                    pngcrush_write_raw_chunks(write_ptr, 0);
+                    png_write_info(write_ptr, write_info_ptr);
+                    pngcrush_write_raw_chunks(write_ptr, 1);
+                    P1( "\nWrote info struct\n");
+
+                    if (copy_idat == 1)
+                    {
+                       /* No recompress, just copy IDATs. */
+                       png_set_compression_buffer_size(write_ptr,
+                                                       MAX_IDAT_SIZE);
+                    }
+
+#ifdef PNG_WRITE_PACK_SUPPORTED
+                    if (output_bit_depth < 8)
+                    {
+                        if (output_color_type == 0)
+                        {
+                            png_color_8 true_bits;
+                            true_bits.gray = (png_byte) (output_bit_depth);
+                            png_set_shift(write_ptr, &true_bits);
+                        }
+                        png_set_packing(write_ptr);
+                    }
+#endif
+                } /* no save */
+
+#ifdef PNGCRUSH_MULTIPLE_ROWS
+                rows_at_a_time = max_rows_at_a_time;
+                if (rows_at_a_time == 0 || rows_at_a_time < height)
+                    rows_at_a_time = height;
+#endif
+
+#ifndef PNGCRUSH_LARGE
+                {
+                    png_uint_32 rowbytes_s;
+                    png_uint_32 rowbytes;
+
+                    rowbytes = png_get_rowbytes(read_ptr, read_info_ptr);
+#ifndef PNGCRUSH_H
+                    if (input_bit_depth < 8)
+                      rowbytes *= 8/input_bit_depth;
+#endif
+
+                    P2("rowbytes = %lud\n",rowbytes;
+
+                    rowbytes_s = (png_size_t) rowbytes;
+                    if (rowbytes == (png_uint_32) rowbytes_s)
+#  ifdef PNGCRUSH_MULTIPLE_ROWS
+                        row_buf =
+                            png_malloc(read_ptr,
+                                       rows_at_a_time * rowbytes + 64);
+#  else
+                        row_buf = png_malloc(read_ptr, rowbytes + 64);
+#  endif
+                    else
+                        row_buf = NULL;
+                }
+#else /* PNGCRUSH_LARGE */
+                {
+                    png_uint_32 read_row_length, write_row_length;
+                    read_row_length =
+                        (png_uint_32) (png_get_rowbytes
+                                       (read_ptr, read_info_ptr));
+                    write_row_length =
+                        (png_uint_32) (png_get_rowbytes
+                                       (write_ptr, write_info_ptr));
+                    row_length =
+                        read_row_length >
+                        write_row_length ? read_row_length :
+                        write_row_length;
+#ifndef PNGCRUSH_H
+                    /* We must do this because we could not call
+                     * png_read_update_info().
+                     */
+                    if (input_bit_depth < 8)
+                          row_length *= 8/input_bit_depth;
+#endif
+#  ifdef PNGCRUSH_MULTIPLE_ROWS
+                    row_buf =
+                        (png_bytep) png_malloc(read_ptr,
+                                               rows_at_a_time *
+                                               row_length + 64);
+#  else
+                    row_buf =
+                        (png_bytep) png_malloc(read_ptr, row_length + 64);
+#  endif
+                }
+#endif /* PNGCRUSH_LARGE */
+
+                P2(" row_buf = %p\n",row_buf);
+
+                if (row_buf == NULL)
+                    png_error(read_ptr,
+                              "Insufficient memory to allocate row buffer");
+
+                {
+                    /* Check for sufficient memory: we need 2*zlib_window and,
+                     * if filter_type == 5, 4*rowbytes in separate allocations.
+                     * If it's not enough we can drop the "average" filter and
+                     * we can reduce the zlib_window for writing.  We can't
+                     * change the input zlib_window because the input file
+                     * might have used the full 32K sliding window. (To do)
+                     */
+                }
+
+                P2("allocated rowbuf.\n");
+
+#ifdef PNGCRUSH_MULTIPLE_ROWS
+                row_pointers = (png_bytepp) png_malloc(read_ptr,
+                                                       rows_at_a_time *
+                                                       sizeof(png_bytepp));
+                P2("allocated row_pointers.\n");
+
+                for (i = 0; i < rows_at_a_time; i++)
+                    row_pointers[i] = row_buf + i * row_length;
+#endif
+
+                pngcrush_pause();
+
+                num_pass = png_set_interlace_handling(read_ptr);
+                if (nosave == 0)
+                    num_write_pass = png_set_interlace_handling(write_ptr);
+
+/* START_STOP */
+
+                trace_phase_us = pngcrush_trace_now();
+                if (nosave == 0 && trial != 0 &&
+                    (output_interlace_method != interlace_method ||
+                    interlace_trials))
+                {
+                    /* Read the whole image (or reuse the one read by an
+                     * earlier trial), then write it with the output
+                     * interlacing.
+                     */
+                    png_size_t size = (png_size_t) height * row_length;
+
+                    if (row_length != 0 && size / row_length != height)
+                        png_error(read_ptr, "Image is too large to buffer");
+                    if (decoded_image_size != size)
+                    {
+                        free(decoded_image);
+                        decoded_image = (png_bytep) malloc(size);
+                        decoded_image_size = decoded_image ? size : 0;
+                        decoded_image_ready = 0;
+                    }
+                    if (decoded_image == NULL)
+                        png_error(read_ptr,
+                            "Insufficient memory to allocate image buffer");
+
+                    if (decoded_image_ready && !last_trial &&
+                        decoded_image_depth == output_bit_depth)
+                        image_reused = 1;
+                    else
+                    {
+#if PNGCRUSH_TIMERS > 0
+                        if (verbose >= 0)
+                        {
+                           pngcrush_timer_stop(PNGCRUSH_TIMER_MISC);
+                           pngcrush_timer_start(PNGCRUSH_TIMER_DECODE);
+                        }
+#endif
+                        for (pass = 0; pass < num_pass; pass++)
+                        {
+                            for (y = 0; y < height; y++)
+                                png_read_row(read_ptr,
+                                    decoded_image + y * row_length, NULL);
+                        }
+#if PNGCRUSH_TIMERS > 0
+                        if (verbose >= 0)
+                        {
+                           pngcrush_timer_stop(PNGCRUSH_TIMER_DECODE);
+                           pngcrush_timer_start(PNGCRUSH_TIMER_MISC);
+                        }
+#endif
+                        decoded_image_ready = !(alpha_fill && blacken == 2);
+                        decoded_image_depth = output_bit_depth;
+                    }
+
+#if PNGCRUSH_TIMERS > 0
+                    if (verbose >= 0)
+                    {
+                       pngcrush_timer_stop(PNGCRUSH_TIMER_MISC);
+                       pngcrush_timer_start(PNGCRUSH_TIMER_ENCODE);
+                    }
+#endif
+                    for (pass = 0; pass < num_write_pass; pass++)
+                    {
+                        for (y = 0; y < height; y++)
+                        {
+                            png_write_row(write_ptr,
+                                decoded_image + y * row_length);
+
+                            /* Bail if byte count exceeds best so far */
+                            if (bail == 0 && trial != last_method &&
+                                (pngcrush_write_byte_count >
+                                pngcrush_best_byte_count ||
+                                (num_write_pass == 1 &&
+                                pngcrush_bail_projected(y + 1, height))))
+                            {
+                               png_write_flush(write_ptr);
+                               bail_row[trial] = y + 1;
+                               bail_pass[trial] = pass;
+                               break;
+                            }
+                        }
+                        if (bail == 0 && trial != last_method &&
+                            (pngcrush_write_byte_count >
+                            pngcrush_best_byte_count || projected_bail))
+                           break;
+                    }
+#if PNGCRUSH_TIMERS > 0
+                    if (verbose >= 0)
+                    {
+                       pngcrush_timer_stop(PNGCRUSH_TIMER_ENCODE);
+                       pngcrush_timer_start(PNGCRUSH_TIMER_MISC);
+                    }
+#endif
+                }
+                else
+                {
+                if (scan && trial == 0 && num_pass == 1 &&
+                    output_color_type == input_color_type &&
+                    output_bit_depth == input_bit_depth)
+                    pngcrush_scan_begin();
+                for (pass = 0; pass < num_pass; pass++)
+                {
+#ifdef PNGCRUSH_MULTIPLE_ROWS
+                    png_uint_32 num_rows;
+#endif
+                    P1( "\nBegin interlace pass %d\n", pass);
+#ifdef PNGCRUSH_MULTIPLE_ROWS
+                    num_rows = rows_at_a_time;
+                    for (y = 0; y < height; y += rows_at_a_time)
+#else
+                    for (y = 0; y < height; y++)
+#endif
+                    {
+#if PNGCRUSH_TIMERS > 0
+                        if (verbose >= 0)
+                        {
+                           pngcrush_timer_stop(PNGCRUSH_TIMER_MISC);
+                           pngcrush_timer_start(PNGCRUSH_TIMER_DECODE);
+                        }
+#endif
+#ifdef PNGCRUSH_MULTIPLE_ROWS
+                        if (y + num_rows > height)
+                            num_rows = height - y;
+#  ifdef BLOCKY_DEINTERLACE
+                        png_read_rows(read_ptr, (png_bytepp) NULL,
+                                      row_pointers, num_rows);
+#  else /* SPARKLE */
+                        png_read_rows(read_ptr, row_pointers,
+                                      (png_bytepp) NULL, num_rows);
+#  endif
+#else
+#  ifdef BLOCKY_DEINTERLACE
+                        png_read_row(read_ptr, row_buf, (png_bytep) NULL);
+#  else /* SPARKLE */
+                        png_read_row(read_ptr, (png_bytep) NULL, row_buf);
+#  endif
+#endif
+                        if (scan_active)
+                        {
+#ifdef PNGCRUSH_MULTIPLE_ROWS
+                            png_uint_32 row;
+
+                            for (row = 0; row < num_rows; row++)
+                                pngcrush_scan_row(row_pointers[row], y + row);
+#else
+                            pngcrush_scan_row(row_buf, y);
+#endif
+                        }
+                        if (nosave == 0)
+                        {
+#if PNGCRUSH_TIMERS > 0
+                        if (verbose >= 0)
+                        {
+                            pngcrush_timer_stop(PNGCRUSH_TIMER_DECODE);
+                            pngcrush_timer_start(PNGCRUSH_TIMER_ENCODE);
+                        }
+#endif
+#ifdef PNGCRUSH_MULTIPLE_ROWS
+                            /* To do: zero the padding bits */
+                            png_write_rows(write_ptr, row_pointers,
+                                           num_rows);
+#else
+                            /* To do: zero the padding bits */
+                            png_write_row(write_ptr, row_buf);
+#endif
+                        }
+#if PNGCRUSH_TIMERS > 0
+                        if (verbose >= 0)
+                        {
+                            if (nosave == 0)
+                                pngcrush_timer_stop(PNGCRUSH_TIMER_ENCODE);
+                            else
+                                pngcrush_timer_stop(PNGCRUSH_TIMER_DECODE);
+                            pngcrush_timer_start(PNGCRUSH_TIMER_MISC);
+                        }
+#endif
+                        /* Bail if byte count exceeds best so far */
+                        if (bail == 0 && trial != last_method &&
+                            (pngcrush_write_byte_count >
+                            pngcrush_best_byte_count ||
+                            (num_pass == 1 &&
+                            pngcrush_bail_projected(y + 1, height))))
+                        {
+                           png_write_flush(write_ptr);
+                           bail_row[trial] = y + 1;
+                           bail_pass[trial] = pass;
+                           if (trace_json != NULL)
+                           {
+                              char args[64];
+
+                              sprintf(args, "\"row\":%lu,\"pass\":%d",
+                                  (unsigned long) y, pass);
+                              pngcrush_trace("bail", "trial",
+                                  pngcrush_trace_now(), -1, args);
+                           }
+                           break;
+                        }
+                    }
+                    P2( "End interlace pass %d\n\n", pass);
+                    if (bail == 0 && trial != last_method &&
+                        (pngcrush_write_byte_count >
+                        pngcrush_best_byte_count || projected_bail))
+                       break;
+                }
+                if (scan)
+                {
+                    pngcrush_scan_end();
+                    scan_read_ok = 1;
+                }
+                }
+                pngcrush_trace(nosave == 0 ? "decode+encode rows" :
+                    "decode rows", "rows", trace_phase_us,
+                    pngcrush_trace_now(), NULL);
+
+                if (color_type == 3)
+                  {
+                  if (trial == 0 && reduce_palette == 1)
+                     {
+                       int palette_length;
+
+                       palette_length = plte_len;
+                       P1("Measured palette length = %d\n", palette_length);
+
+#ifdef PNG_READ_bKGD_SUPPORTED
+                       {
+                         png_color_16p bkgd;
+                         if (png_get_bKGD(read_ptr, read_info_ptr, &bkgd))
+                         {
+                           bkgd_index = bkgd->index;
+                           P1("bKGD index = %d\n", bkgd_index);
+#if 1
+                           if (bkgd_index > palette_length)
+                           {
+                              bkgd_index = palette_length;
+                              have_bkgd = 1;
+                              fprintf(STDERR,
+                                  "   New bKGD index = %d\n", bkgd_index);
+                           }
+#endif
+                           if (bkgd->index >= palette_length)
+                              palette_length = (int) bkgd_index+1;
+                           P1("Total    palette length = %d\n", palette_length);
+                         }
+                       }
+#endif
+                       plte_len = palette_length;
+                       if (num_trans > plte_len)
+                       {
+                          num_trans = plte_len;
+                          png_set_tRNS(write_ptr, write_info_ptr, trns_array,
+                                     num_trans, trans_values);
+                        }
+                     }
+                  }
+
+#if defined(PNG_READ_RGB_TO_GRAY_SUPPORTED) && \
+    defined(PNG_FLOATING_POINT_SUPPORTED)
+                if ((color_type == 2 || color_type == 6 || color_type == 3)
+                    && (output_color_type == 0 || output_color_type == 4))
+                {
+                    png_byte rgb_error =
+                        png_get_rgb_to_gray_status(read_ptr);
+                    if (last_trial && verbose > 0 && rgb_error)
+                        fprintf(STDERR,
+                          "   **** Converted non-gray image to gray. **** \n");
+                }
+#endif
+
+#ifdef PNG_FREE_UNKN
+#  if defined(PNG_READ_UNKNOWN_CHUNKS_SUPPORTED)
+                png_free_data(read_ptr, read_info_ptr, PNG_FREE_UNKN, -1);
+#  endif
+#  if defined(PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED)
+                png_free_data(write_ptr, write_info_ptr, PNG_FREE_UNKN, -1);
+#  endif
+#else
+#  if defined(PNG_READ_UNKNOWN_CHUNKS_SUPPORTED)
+                png_free_unknown_chunks(read_ptr, read_info_ptr, -1);
+#  endif
+#  if defined(PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED)
+                png_free_unknown_chunks(write_ptr, write_info_ptr, -1);
+#  endif
+#endif /* PNG_FREE_UNKN */
+
+                /* { GRR:  added for %-navigation (2) */
+                /* A run that bailed has not written all of the IDAT data,
+                 * so it is not ended.
+                 */
+                if (!(bail == 0 && trial != last_method &&
+                    (pngcrush_write_byte_count >
+                    pngcrush_best_byte_count || projected_bail)))
+                {
+                   P1("   Reading and writing end_info data\n");
+                   trace_phase_us = pngcrush_trace_now();
+                   /* A trial that reused the decoded image has not read
+                    * the IDAT data; only the final write needs the chunks
+                    * after it.
+                    */
+                   if (!image_reused)
+                      png_read_end(read_ptr, end_info_ptr);
+
+            /* Handle ancillary chunks */
+            if (last_trial == 1)
+            {
+#if (defined(PNG_READ_tEXt_SUPPORTED) && defined(PNG_WRITE_tEXt_SUPPORTED)) \
+ || (defined(PNG_READ_iTXt_SUPPORTED) && defined(PNG_WRITE_iTXt_SUPPORTED)) \
+ || (defined(PNG_READ_zTXt_SUPPORTED) && defined(PNG_WRITE_zTXt_SUPPORTED))
+
+                P1( "Check for iTXt/tEXt/zTXt chunks after IDAT\n");
+                {
+                    png_textp text_ptr;
+                    int num_text = 0;
+
+                    if (png_get_text (read_ptr,
+                        end_info_ptr, &text_ptr, &num_text) > 0
+                        || text_inputs)
+                    {
+                        int ntext;
+
+#ifdef PNG_iTXt_SUPPORTED
+                        P1( "Handling %d tEXt/zTXt/iTXt chunks after IDAT\n",
+#else
+                        P1( "Handling %d tEXt/zTXt chunks after IDAT\n",
+#endif
+                                   num_text);
+
+                        if (verbose > 1 && last_trial && num_text > 0)
+                        {
+                            for (ntext = 0; ntext < num_text; ntext++)
+                            {
+                                fprintf(STDERR, "%d  %s", ntext,
+                                        text_ptr[ntext].key);
+                                if (text_ptr[ntext].text_length)
+                                    fprintf(STDERR, ": %s\n",
+                                            text_ptr[ntext].text);
+#ifdef PNG_iTXt_SUPPORTED
+                                else if (text_ptr[ntext].itxt_length)
+                                {
+                                    fprintf(STDERR, " (%s: %s): \n",
+                                            text_ptr[ntext].lang,
+                                            text_ptr[ntext].lang_key);
+                                    fprintf(STDERR, "%s\n",
+                                            text_ptr[ntext].text);
+                                }
+#endif
+                                else
+                                    fprintf(STDERR, "\n");
+                            }
+                        }
+
+                        if (last_trial)
+                        {
+                          if (num_text > 0)
+                          {
+                            if (keep_chunk("text", argv))
+                            {
+                                int num_to_write = num_text;
+                                for (ntext = 0; ntext < num_text; ntext++)
+                                {
+                                    if (verbose > 1)
+                                        P2("Text chunk after IDAT, "
+                                          "compression=%d\n",
+                                          text_ptr[ntext].compression);
+                                    if (text_ptr[ntext].compression ==
+                                        PNG_TEXT_COMPRESSION_NONE)
+                                    {
+                                        if (!keep_chunk("tEXt", argv))
+                                        {
+                                            text_ptr[ntext].key[0] = '\0';
+                                            num_to_write--;
+                                        }
+                                    }
+                                    if (text_ptr[ntext].compression ==
+                                        PNG_TEXT_COMPRESSION_zTXt)
+                                    {
+                                        if (!keep_chunk("zTXt", argv))
+                                        {
+                                            text_ptr[ntext].key[0] = '\0';
+                                            num_to_write--;
+                                        }
+                                    }
+#ifdef PNG_iTXt_SUPPORTED
+                                    if (text_ptr[ntext].compression ==
+                                        PNG_ITXT_COMPRESSION_NONE
+                                        || text_ptr[ntext].compression ==
+                                        PNG_ITXT_COMPRESSION_zTXt)
+                                    {
+                                        if (!keep_chunk("iTXt", argv))
+                                        {
+                                            text_ptr[ntext].key[0] = '\0';
+                                            num_to_write--;
+                                        }
+                                    }
+#endif
+                                }
+                                if (num_to_write > 0)
+                                    png_set_text(write_ptr,
+                                                 write_end_info_ptr,
+                                                 text_ptr, num_text);
+                            }
+                          }
+
+                          P1( "text_inputs=%d\n",text_inputs);
+                          for (ntext = 0; ntext < text_inputs; ntext++)
+                          {
+                            P1( "  ntext=%d\n",ntext);
+                            if (text_where[ntext] == 2)
+                            {
+                                png_textp added_text;
+                                added_text = (png_textp)
+                                    png_malloc(write_ptr,
+                                               (png_uint_32)
+                                               sizeof(png_text));
+                                added_text[0].key =
+                                    &text_keyword[ntext * 80];
+#ifdef PNG_iTXt_SUPPORTED
+                                added_text[0].lang =
+                                    &text_lang[ntext * 80];
+                                added_text[0].lang_key =
+                                    &text_lang_key[ntext * 80];
+#endif
+                                added_text[0].text =
+                                    &text_text[ntext * STR_BUF_SIZE];
+                                added_text[0].compression =
+                                    text_compression[ntext];
+                                png_set_text(write_ptr, write_end_info_ptr,
+                                             added_text, 1);
+
+                                if (verbose > 0 && last_trial)
+                                {
+                                  if (added_text[0].compression < 0)
+                                      fprintf(STDERR,
+                                          "   Added a tEXt chunk.\n");
+                                  else if (added_text[0].compression == 0)
+                                      fprintf(STDERR,
+                                          "   Added a zTXt chunk.\n");
+#ifdef PNG_iTXt_SUPPORTED
+                                  else if (added_text[0].compression == 1)
+                                      fprintf(STDERR,
+                                          "   Added an uncompressed iTXt "
+                                        "chunk.\n");
+                                  else
+                                      fprintf(STDERR,
+                                          "   Added a compressed iTXt "
+                                        "chunk.\n");
+#endif
+                                }
+                                png_free(write_ptr, added_text);
+                                added_text = (png_textp) NULL;
+                            }
+                          }
+                        } /* end of nosave block */
+                    }
+                }
+#endif /* (PNG_READ_tEXt_SUPPORTED and PNG_WRITE_tEXt_SUPPORTED) or */
+       /* (PNG_READ_iTXt_SUPPORTED and PNG_WRITE_iTXt_SUPPORTED) or */
+       /* (PNG_READ_zTXt_SUPPORTED and PNG_WRITE_zTXt_SUPPORTED) */
+#if defined(PNG_READ_tIME_SUPPORTED) && defined(PNG_WRITE_tIME_SUPPORTED)
+                {
+                    png_timep mod_time;
+
+                    if (png_get_tIME(read_ptr, end_info_ptr, &mod_time))
+                    {
+                        P1( "Handling tIME chunk after IDAT\n");
+                        if (keep_chunk("tIME", argv))
+                            png_set_tIME(write_ptr, write_end_info_ptr,
+                                         mod_time);
+                    }
+                }
+#endif
+
+#ifdef PNG_WRITE_UNKNOWN_CHUNKS_SUPPORTED
+                /* GRR FIXME?  this block may need same fix as above */
+                {
+                    png_unknown_chunkp unknowns;
+                    png_unknown_chunkp apng_chunks = NULL;
+                    int num_apng_chunks = 0;
+                    int num_unknowns =
+                        (int) png_get_unknown_chunks(read_ptr,
+                                                     end_info_ptr,
+                                                     &unknowns);
+                    if (num_unknowns && nosave == 0 && save_apng_chunks == 1)
+                    {
+                        /* Recompress the frames with the best method */
+                        num_apng_chunks = pngcrush_apng_recompress(write_ptr,
+                            unknowns, num_unknowns, &apng_chunks,
+                            best ? fm[best] : 5, best ? lv[best] : 9,
+                            best ? zs[best] : 0);
+                        if (num_apng_chunks > 0)
+                        {
+                            unknowns = apng_chunks;
+                            num_unknowns = num_apng_chunks;
+                        }
+                        if (verbose >= 0 && apng_frames > 0)
+                            fprintf(STDERR, "   Recompressed %d APNG frame%s,"
+                                " fdAT data %lu -> %lu bytes\n", apng_frames,
+                                apng_frames > 1 ? "s" : "", apng_fdat_in,
+                                apng_fdat_out);
+                    }
+                    if (num_unknowns && nosave == 0)
+                    {
+                        fprintf(STDERR,
+                               "Handling %d unknown chunks after IDAT\n",
+                               num_unknowns);
+                        png_set_unknown_chunks(write_ptr,
+                                               write_end_info_ptr,
+                                               unknowns, num_unknowns);
+                        for (i = 0; i < num_unknowns; i++)
+                            png_set_unknown_chunk_location(write_ptr,
+                                                           write_end_info_ptr,
+                                                           i,
+                                                           (int)
+                                                           unknowns[i].
+                                                           location);
+                    }
+                    if (num_apng_chunks > 0)
+                        pngcrush_apng_free(write_ptr, apng_chunks,
+                            num_apng_chunks);
+                }
+#endif
+            }  /* End of ancillary chunk handling */
+
+                if (nosave == 0) {
+#if 0 /* doesn't work; compression level has to be the same as in IDAT */
+                    /* if zTXt other compressed chunk */
+                    png_set_compression_level(write_ptr, 9);
+                    png_set_compression_window_bits(write_ptr, 15);
+                    png_set_compression_buffer_size(write_ptr,
+                                                    PNG_ZBUF_SIZE);
+                    png_set_compression_strategy(write_ptr, 0);
+#endif /* 0 */
+                    pngcrush_write_raw_chunks(write_ptr, 2);
+                    png_write_end(write_ptr, write_end_info_ptr);
+                    if (last_trial)
+                        pngcrush_free_raw_chunks();
+                }
+                pngcrush_trace("end", "rows", trace_phase_us,
+                    pngcrush_trace_now(), NULL);
+                }
+                /* } GRR:  added for %-navigation (2) */
+
+                P1( "Destroying read data structs\n");
+                if (row_buf != (png_bytep) NULL)
+                {
+                    P2(" row_buf = %p\n",row_buf);
+                    P2( "Destroying row_buf\n");
+                    /* Crash has been observed here when using the
+                     * system libpng instead of the bundled one.
+                     * It seems to have to do with the workaround for
+                     * png_read_transform_info() not being exported
+                     * in libpng-1.5.6 and later.
+                     */
+                    png_free(read_ptr, row_buf);
+                    row_buf = (png_bytep) NULL;
+                }
+                P2( "Destroyed data row_buf\n");
+#ifdef PNGCRUSH_MULTIPLE_ROWS
+                if (row_pointers != (png_bytepp) NULL)
+                {
+                    P1( "Destroying row_pointers\n");
+                    png_free(read_ptr, row_pointers);
+                    row_pointers = (png_bytepp) NULL;
+                }
+                P2( "Destroyed data row_pointers\n");
+#endif
+                png_destroy_read_struct(&read_ptr, &read_info_ptr,
+                                        &end_info_ptr);
+                P2( "Destroyed data structs\n");
+                if (nosave == 0)
+                {
+#ifdef PNGCRUSH_LOCO
+                    if (do_loco)
+                    {
+                        const png_byte png_MEND[5] =
+                            { 77, 69, 78, 68, '\0' };
+                        /* write the MNG MEND chunk */
+                        png_write_chunk(write_ptr, (png_bytep) png_MEND,
+                                        NULL, (png_size_t) 0);
+                    }
+#endif
+                    png_destroy_info_struct(write_ptr,
+                                            &write_end_info_ptr);
+                    png_destroy_write_struct(&write_ptr, &write_info_ptr);
+                }
+            }
+            Catch(msg) {
+                if (nosave == 0)
+                    fprintf(stderr, "While converting %s to %s:\n", inname,
+                      outname);
+                else
+                    fprintf(stderr, "While reading %s:\n", inname);
+                fprintf(stderr,
+                  "  pngcrush caught libpng error:\n   %s\n\n", msg);
+                if (scan)
+                    pngcrush_scan_end();
+                if (row_buf)
+                {
+                    png_free(read_ptr, row_buf);
+                    row_buf = (png_bytep) NULL;
+                }
+#ifdef PNGCRUSH_MULTIPLE_ROWS
+                if (row_pointers != (png_bytepp) NULL)
+                {
+                    png_free(read_ptr, row_pointers);
+                    row_pointers = (png_bytepp) NULL;
+                }
+#endif
+                if (nosave == 0)
+                {
+                    png_destroy_info_struct(write_ptr,
+                                            &write_end_info_ptr);
+                    png_destroy_write_struct(&write_ptr, &write_info_ptr);
+                    setfiletype(outname);
+                }
+                png_destroy_read_struct(&read_ptr, &read_info_ptr,
+                                        &end_info_ptr);
+                if (verbose > 1)
+                    fprintf(stderr, "returning after cleanup\n");
+                trial = last_method + 1;
+                trial_pos = last_method + 1;
+            }
+
+            read_ptr = NULL;
+            write_ptr = NULL;
+            if (fpin)
+                FCLOSE(fpin);
+            if (last_trial && nosave == 0)
+            {
+                pngcrush_close_output();
+                setfiletype(outname);
+            }
+
+            trial_ms_spent += pngcrush_clock_ms() - trial_start_ms;
+            trials_timed++;
+            if (trial <= last_method)
+            {
+                mem_trial_allocs[trial] = mem_file_allocs - trial_mem_allocs;
+                mem_trial_bytes[trial] = mem_file_bytes - trial_mem_bytes;
+            }
+#if PNGCRUSH_TIMERS > 0
+            if (bench_sample >= 0 && trial <= last_method)
+                bench_method_samples[(trial == last_method ? 0 : trial) *
+                    benchmark_iterations + bench_sample] +=
+                    (double) (pngcrush_timer_nsec[PNGCRUSH_TIMER_ENCODE] -
+                    trial_encode_nsec) / 1000000000.;
+#endif
+            if (trace_json != NULL && trial <= last_method)
+            {
+                char name[32], args[256];
+
+                if (trial == 0)
+                    sprintf(name, "examine");
+                else if (last_trial)
+                    sprintf(name, "final write");
+                else
+                    sprintf(name, "method %d", trial);
+                sprintf(args, "\"method\":%d,\"filter\":%d,\"level\":%d,"
+                    "\"strategy\":%d,\"interlace\":%d,\"tune\":%d,"
+                    "\"bytes\":%lu,\"bail_row\":%lu",
+                    last_trial ? best : trial, fm[last_trial ? best : trial],
+                    lv[last_trial ? best : trial], zs[last_trial ? best : trial],
+                    output_interlace_method, deflate_tune,
+                    (unsigned long) pngcrush_write_byte_count,
+                    (unsigned long) bail_row[trial]);
+#if PNGCRUSH_TIMERS > 0
+                sprintf(args + strlen(args),
+                    ",\"decode_ms\":%.3f,\"encode_ms\":%.3f",
+                    (double) (pngcrush_timer_nsec[PNGCRUSH_TIMER_DECODE] -
+                    trial_decode_nsec) / 1000000.,
+                    (double) (pngcrush_timer_nsec[PNGCRUSH_TIMER_ENCODE] -
+                    trial_encode_nsec) / 1000000.);
+#endif
+                pngcrush_trace(name, "trial", trace_trial_us,
+                    pngcrush_trace_now(), args);
+            }
+
+            if (nosave)
+                break;
+
+            if (trial == 0)
+                continue;
+
+            /* A run that bailed on its projected length may have written
+             * less than the best so far, so its count is not kept.
+             */
+            if (repeat == 0 || (!projected_bail &&
+                pngcrush_write_byte_count < idat_length[trial]))
+            {
+                idat_length[trial] = pngcrush_write_byte_count;
+                trial_interlace[trial] = output_interlace_method;
+                trial_tune[trial] = deflate_tune;
+                trial_depth_flip[trial] = depth_flip;
+            }
+            if (last_trial && idat_length[best] == (png_uint_32) 0xffffffff)
+                idat_length[best] = pngcrush_write_byte_count;
+
+            if (!projected_bail &&
+                pngcrush_write_byte_count < pngcrush_best_byte_count)
+               pngcrush_best_byte_count = pngcrush_write_byte_count;
+
+            if (verbose > 0 && trial != last_method)
+            {
+                if (bail == 0 && (projected_bail ||
+                    pngcrush_write_byte_count > pngcrush_best_byte_count))
+                   fprintf(STDERR,
+                     "   Critical chunk length, method %3d"
+                     " (ws %d fm %d zl %d zs %d) >%10lu\n",
+                     trial, compression_window,
+                     filter_type, zlib_level, z_strategy,
+                     (unsigned long)pngcrush_best_byte_count);
+                else
+                   fprintf(STDERR,
+                     "   Critical chunk length, method %3d"
+                     " (ws %d fm %d zl %d zs %d) =%10lu\n",
+                     trial, compression_window,
+                     filter_type, zlib_level, z_strategy,
+                     (unsigned long)pngcrush_write_byte_count);
+                if (depth_trials)
+                   fprintf(STDERR, "     (bit depth %d)\n",
+                     output_bit_depth);
+                if (interlace_trials)
+                   fprintf(STDERR, "     (interlace %d%s)\n",
+                     output_interlace_method,
+                     image_reused ? ", reused decoded image" : "");
+                if (deflate_tune > 0)
+                   fprintf(STDERR, "     (deflateTune profile %d%s)\n",
+                     deflate_tune,
+                     projected_bail ? ", bailed on projected length" : "");
+                fflush(STDERR);
+            }
+
+            /* Run each method again at the unreduced bit depth, with the
+             * other interlacing, and with each deflateTune() profile if it
+             * uses lazy matching.
+             */
+            tune_runs = 1;
+            if (tune_trials && zlib_level >= 4 &&
+                (z_strategy == Z_DEFAULT_STRATEGY || z_strategy == Z_FILTERED))
+               tune_runs += NUM_TUNE_PROFILES;
+            if (!last_trial &&
+                repeat + 1 < (tune_runs << (interlace_trials + depth_trials)))
+            {
+                repeat_trial = trial;
+                trial_pos--;
+            }
+
+        } /* end of trial-loop */
+
+        P1("\n\nFINISHED MAIN LOOP OVER %d METHODS\n\n\n", last_method);
+
+        free(decoded_image);
+        decoded_image = NULL;
+        decoded_image_size = 0;
+        decoded_image_ready = 0;
+
+        if (trials_skipped && verbose > 0)
+        {
+            fprintf(STDERR,
+              "   Time budget exhausted after %lu ms; skipped %d methods\n",
+              pngcrush_clock_ms() - file_start_ms, trials_skipped);
+        }
+
+        /* ////////////////////////////////////////////////////////////////////
+        //////////////////                                 ////////////////////
+        //////////////////  END OF MAIN LOOP OVER METHODS  ////////////////////
+        //////////////////                                 ////////////////////
+        //////////////////////////////////////////////////////////////////// */
+        }
+
+        if (fpin)
+        {
+            FCLOSE(fpin);
+        }
+        if (scan && scan_read_ok && idat_length[0] != 0)
+            pngcrush_scan_report(argv);
+        if (last_trial && nosave == 0 && fpout)
+        {
+            pngcrush_close_output();
+            setfiletype(outname);
+        }
+        if (verify && last_trial && nosave == 0 && !stdout_output)
+        {
+            trace_phase_us = pngcrush_trace_now();
+            pngcrush_verify_output();
+            pngcrush_trace("verify", "io", trace_phase_us,
+                pngcrush_trace_now(), NULL);
+        }
+
+        if (last_trial && nosave == 0 && overwrite != 0)
+        {
+            /* rename the new file , outname = inname */
+            trace_phase_us = pngcrush_trace_now();
+            if (
+#if (defined(_Windows) || defined(_WINDOWS) || defined(WIN32) ||  \
+   defined(_WIN32) || defined(__WIN32__) || defined(__CYGWIN__) || \
+   defined(__DJGPP__) || defined(CYGWIN))
+              remove(inname) != 0 ||
+#endif
+              rename(outname, inname) != 0 )
+            {
+                fprintf(STDERR,
+                    "error while renaming \"%s\" to \"%s\" \n",outname,inname);
+                exit (1);
+            }
+            else
+                P2("rename %s to %s complete.\n",outname,inname);
+            pngcrush_trace("rename", "io", trace_phase_us,
+                pngcrush_trace_now(), NULL);
+        }
+
+        if (last_trial && nosave == 0)
+        {
+            png_uint_32 output_length;
+#ifndef __riscos
+            struct stat stat_buf;
+            struct utimbuf utim;
+
+            if (stdout_output)
+            {
+                output_length = pngcrush_write_byte_count;
+            }
+            else
+            {
+            stat(inname, &stat_buf);
+            utim.actime  = stat_buf.st_atime;
+            utim.modtime = stat_buf.st_mtime;
+            stat(outname, &stat_buf);
+            output_length = (unsigned long) stat_buf.st_size;
+            if (new_time_stamp == 0 && !stdin_input)
+            {
+              /* set file timestamp (no big deal if fails) */
+              utime(outname, &utim);
+            }
+            }
+#else
+            output_length = (unsigned long) filesize(outname);
+#endif
+            if (verbose >= 0 && bench < 2)
+            {
+                total_input_length += input_length + output_length;
+
+                if (best == 0)
+                {
+                  fprintf(STDERR,
+                  "   Best pngcrush method = 0 (settings undetermined)\n");
+                }
+
+#if 0 /* disabled */
+                else if (!already_crushed && !image_is_immutable)
+#else
+                else if (!image_is_immutable)
+#endif
+                {
+                fprintf(STDERR,
+                  "   Best pngcrush method        = %3d "
+                  "(ws %d fm %d zl %d zs %d) =%10lu\n",
+                  best, compression_window, fm[best], lv[best], zs[best],
+                  (unsigned long)idat_length[best]);
+                }
+
+                if (verbose > 0)
+                {
+                if (idat_length[0] == idat_length[best])
+                    fprintf(STDERR, "     (no critical chunk change)\n");
+                else if (idat_length[0] > idat_length[best])
+                    fprintf(STDERR, "     (%4.2f%% critical chunk reduction)\n",
+                      (100.0 - (100.0 * idat_length[best]) / idat_length[0]));
+                else
+                    fprintf(STDERR, "     (%4.2f%% critical chunk increase)\n",
+                      -(100.0 - (100.0 * idat_length[best]) / idat_length[0]));
+                if (input_length == output_length)
+                    fprintf(STDERR, "     (no filesize change)\n");
+                else if (input_length > output_length)
+                    fprintf(STDERR, "     (%4.2f%% filesize reduction)\n",
+                      (100.0 - (100.0 * output_length) / input_length));
+                else
+                    fprintf(STDERR, "     (%4.2f%% filesize increase)\n",
+                      -(100.0 - (100.0 * output_length) / input_length));
+
+                fprintf(STDERR, "     (memory: peak %lu bytes, largest"
+                  " allocation %lu, %lu allocations of %lu bytes)\n\n",
+                  mem_file_peak, mem_file_largest, mem_file_allocs,
+                  mem_file_bytes);
+
+                if (verbose > 2)
+                    fprintf(STDERR, "   Number of open files=%d\n",
+                      number_of_open_files);
+
+                }
+            }
+
+            if (stats_json != NULL && bench < 2)
+                pngcrush_write_stats(overwrite ? inname : outname,
+                    output_length, last_method, fm, lv, zs);
+            if (bench < 2)
+                pngcrush_journal_record("OK", input_length, output_length,
+                    pngcrush_clock_ms() - file_start_ms);
+        }
+        else
+        {
+            if (stats_json != NULL && bench < 2 && idat_length[0] != 0)
+                pngcrush_write_stats(NULL, 0, last_method, fm, lv, zs);
+            if (bench < 2)
+                pngcrush_journal_record(nosave ? "READ" : "ERR",
+                    input_length, 0, pngcrush_clock_ms() - file_start_ms);
+        }
+
+        if (trace_json != NULL)
+        {
+            char args[128];
+
+            sprintf(args, "\"input_bytes\":%lu,\"method\":%d,\"trials\":%d,"
+                "\"skipped\":%d", (unsigned long) input_length, best,
+                trials_timed, trials_skipped);
+            pngcrush_trace(inname, "file", trace_file_us,
+                pngcrush_trace_now(), args);
+        }
+
+        if ((pngcrush_mode == DEFAULT_MODE ||
+            pngcrush_mode == OVERWRITE_MODE) && !file_list)
+        {
+            if (png_row_filters != NULL)
+            {
+                free(png_row_filters);
+                png_row_filters = NULL;
+            }
+#if PNGCRUSH_TIMERS > 0
+            pngcrush_timer_stop(PNGCRUSH_TIMER_MISC);
+            pngcrush_timer_stop(PNGCRUSH_TIMER_TOTAL);
+#endif
+            if (verbose >= 0)
+            {
+                show_result();
+            }
+#ifdef PNG_iCCP_SUPPORTED
+            if (iccp_length)
+            {
+                free(iccp_text);
+                iccp_text = NULL;
+                iccp_length = 0;
+            }
+#endif
+            break;
+        }
+    } /* end of loop on input files */
+
+#if PNGCRUSH_TIMERS > 0
+    for (pc_timer = 0; pc_timer < PNGCRUSH_TIMERS; pc_timer++)
+    {
+        unsigned long ts,tn;
+
+        if (bench_sample >= 0)
+            bench_samples[pc_timer * benchmark_iterations + bench_sample] =
+                (double) pngcrush_timer_nsec[pc_timer] / 1000000000.;
+
+        if (bench > 0 && bench <= benchmark_warmup)
+        {
+            pngcrush_timer_reset(pc_timer);
+            continue;
+        }
+
+        ts=pngcrush_timer_get_seconds(pc_timer);
+        tn=pngcrush_timer_get_nanoseconds(pc_timer);
+        if (ts < pngcrush_timer_min_secs[pc_timer])
+        {
+            pngcrush_timer_min_secs[pc_timer] = ts;
+            pngcrush_timer_min_nsec[pc_timer] = tn;
+        }
+        else
+        {
+        if (tn < pngcrush_timer_min_nsec[pc_timer])
+            pngcrush_timer_min_nsec[pc_timer] = tn;
+        }
+
+        pngcrush_timer_reset(pc_timer);
+    }
+#endif
+
+    } /* end of benchmark_iteration loop */
+    if (verbose >= 0)
+    {
+#if (PNGCRUSH_TIMERS > 0)
+    for (pc_timer=0;pc_timer < PNGCRUSH_TIMERS; pc_timer++)
+    {
+      filter_count[pc_timer]+=pngcrush_timer_get_hits(pc_timer);
+      t_sec=pngcrush_timer_min_secs[pc_timer];
+      t_nsec=pngcrush_timer_min_nsec[pc_timer];
+      t_filter[pc_timer] = (float)t_nsec/1000000000.;
+      if (t_sec)
+        t_filter[pc_timer] += (float)t_sec;
+    }
+
+#  if PNGCRUSH_TIMERS >= 3
+    fprintf(STDERR, "CPU time decode %.6f,", t_filter[1]);
+    fprintf(STDERR, " encode %.6f,", t_filter[2]);
+    fprintf(STDERR, " other %.6f,", t_filter[3]);
+    fprintf(STDERR, " total %.6f sec\n", t_filter[0]);
+#  endif
+    if (phase_timers && benchmark_iterations > 0)
+        pngcrush_show_phases(t_filter);
+    if (benchmark_iterations > 0)
+        pngcrush_bench_report(last_method, fm, lv, zs);
+
+#  if PNGCRUSH_USE_CLOCK_GETTIME != 0
+   if (benchmark_iterations > 0)
+   {
+#  if PNGCRUSH_TIMERS > 9
+    {
+    float total_t_filter=0;
+    float total_filter_count=0;
+    for (pc_timer = 5; pc_timer < 10; pc_timer++)
+    {
+      total_t_filter+=t_filter[pc_timer];
+      total_filter_count+=filter_count[pc_timer];
+    }
+    if (total_filter_count > 0)
+    {
+      for (pc_timer = 5; pc_timer < 10; pc_timer++)
+      {
+        fprintf(STDERR, "     filter[%u] defilter time = %15.9f, count = %lu\n",
+            pc_timer-5, t_filter[pc_timer],
+           (unsigned long)filter_count[pc_timer]);
+      }
+      fprintf(STDERR, "     total defilter time     = %15.9f, count = %lu\n",
+        total_t_filter, (unsigned long) total_filter_count);
+      }
+    }
+#  endif
+#  if PNGCRUSH_TIMERS > 4
+    {
+      if (filter_count[4] > 0)
+        fprintf(STDERR, "     deinterlace time        = %15.9f, count = %lu\n",
+             t_filter[4], (unsigned long)filter_count[4]);
+    }
+#  endif
+#  if PNGCRUSH_TIMERS > 1
+    {
+      fprintf(STDERR, "     total decode time       = %15.9f, count = %lu\n",
+           t_filter[1], (unsigned long)filter_count[1]);
+    }
+#  endif
+#  if PNGCRUSH_TIMERS > 10
+    {
+      if (filter_count[10] > 0)
+        fprintf(STDERR, "     filter setup time       = %15.9f, count = %lu\n",
+             t_filter[10], (unsigned long)filter_count[10]);
+    }
+#  endif
+#  if PNGCRUSH_TIMERS > 2
+    {
+      fprintf(STDERR, "     total encode time       = %15.9f, count = %lu\n",
+           t_filter[2], (unsigned long)filter_count[2]);
+    }
+#  endif
+#  if PNGCRUSH_TIMERS > 3
+    {
+      fprintf(STDERR, "     total misc time         = %15.9f, count = %lu\n",
+           t_filter[3], (unsigned long)filter_count[3]);
+    }
+#  endif
+#  if PNGCRUSH_TIMERS > 0
+    {
+      fprintf(STDERR, "     total time              = %15.9f, count = %lu\n",
+           t_filter[0], (unsigned long)filter_count[0]);
+    }
+#  endif
+    }
+#endif
+#endif
+    }
+
+    if (pngcrush_must_exit)
+       exit(0);
+    return 0;  /* just in case */
+
+} /* end of main() */
+
+
+
+
+png_uint_32 measure_idats(FILE * fp_in)
+{
+    /* Copyright (C) 1999-2002, 2006-2015 Glenn Randers-Pehrson
+       (glennrp at users.sf.net).  See notice in pngcrush.c for conditions of
+       use and distribution */
+    P2("\nmeasure_idats:\n");
+    pngcrush_free_raw_chunks();
+    scan_chunks = 0;
+    scan_estimate = 0;
+    scan_read_ok = 0;
+    scan_plte_bytes = 0;
+    P1( "Allocating read structure\n");
+/* OK to ignore any warning about the address of exception__prev in "Try" */
+    Try {
+#ifdef PNG_USER_MEM_SUPPORTED
+        read_ptr =
+            png_create_read_struct_2(PNG_LIBPNG_VER_STRING, (png_voidp) NULL,
+                                   (png_error_ptr) pngcrush_cexcept_error,
+                                   (png_error_ptr) NULL, (png_voidp) NULL,
+                                   (png_malloc_ptr) pngcrush_malloc,
+                                   (png_free_ptr) pngcrush_free);
+#else
+        read_ptr =
+            png_create_read_struct(PNG_LIBPNG_VER_STRING, (png_voidp) NULL,
+                                   (png_error_ptr) pngcrush_cexcept_error,
+                                   (png_error_ptr) NULL);
+#endif
+        P1( "Allocating read_info,  end_info structures\n");
+        read_info_ptr = png_create_info_struct(read_ptr);
+        end_info_ptr = png_create_info_struct(read_ptr);
+
+        pngcrush_init_read(read_ptr, fp_in);
+
+        png_set_sig_bytes(read_ptr, 0);
+        measured_idat_length = pngcrush_measure_idat(read_ptr);
+        P2("measure_idats: IDAT length=%lu\n",
+          (unsigned long)measured_idat_length);
+        P1( "Destroying data structs\n");
+        png_destroy_read_struct(&read_ptr, &read_info_ptr, &end_info_ptr);
+    }
+    Catch(msg) {
+        fprintf(STDERR, "\nWhile measuring IDATs in %s ", inname);
+        fprintf(STDERR, "pngcrush caught libpng error:\n   %s\n\n", msg);
+        png_destroy_read_struct(&read_ptr, &read_info_ptr, &end_info_ptr);
+        P1( "Destroyed data structs\n");
+        pngcrush_free_raw_chunks();
+        measured_idat_length = 0;
+    }
+    return measured_idat_length;
+}
+
+
+
+
+#define PNGCRUSH_a  97
+#define PNGCRUSH_z 122
+#define PNGCRUSH_A  65
+#define PNGCRUSH_Z  90 
+
+png_uint_32 pngcrush_measure_idat(png_structp png_ptr)
+{
+    /* Copyright (C) 1999-2002, 2006-2015 Glenn Randers-Pehrson
+       (glennrp at users.sf.net)
+       See notice in pngcrush.c for conditions of use and distribution */
+
+    /* Signature + IHDR + IEND; we'll add PLTE + IDAT lengths */
+    png_uint_32 sum_idat_length = 45;
+
+    png_byte *bb = NULL;
+    png_uint_32 malloced_length=0;
+
+    /* Where captured chunks were found, and the end of the list */
+    int raw_where = 0;
+    pngcrush_raw_chunk **raw_tail = &raw_chunks;
+
+    {
+        png_byte png_signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+#ifdef PNGCRUSH_LOCO
+        png_byte mng_signature[8] = { 138, 77, 78, 71, 13, 10, 26, 10 };
+#endif
+
+        pngcrush_default_read_data(png_ptr, png_signature, 8);
+        png_set_sig_bytes(png_ptr, 8);
+
+#ifdef PNGCRUSH_LOCO
+        if (!(int) (png_memcmp(mng_signature, png_signature, 8)))
+        {
+            const png_byte png_MHDR[5] = { 77, 72, 68, 82, '\0' };
+
+            int ib;
+            png_byte buff[28] = { 0, 0, 0, 0, 0,  0, 0, 0, 0, 0,
+                                  0, 0, 0, 0, 0,  0, 0, 0, 0, 0,
+                                  0, 0, 0, 0, 0,  0, 0, 0 };
+            unsigned long length;
+            /* read the MHDR */
+            pngcrush_default_read_data(png_ptr, buff, 4);
+
+            length = pngcrush_get_uint_31(png_ptr,buff);
+            if (length > 28)
+              png_error(png_ptr, "MHDR length too long");
+
+            pngcrush_default_read_data(png_ptr, buff, 4);
+
+            /* To do: combine with checking for valid PNG chunk_name, below */
+            /* Check for valid chunk name [A-Za-z][A-Za-z][A-Z][A-Za-z] */
+            if (!(((buff[0] >= PNGCRUSH_a && buff[0] <= PNGCRUSH_z)  ||
+                   (buff[0] >= PNGCRUSH_A && buff[0] <= PNGCRUSH_Z)) &&
+                  ((buff[1] >= PNGCRUSH_a && buff[1] <= PNGCRUSH_z)  ||
+                   (buff[1] >= PNGCRUSH_A && buff[1] <= PNGCRUSH_Z)) &&
+                  ((buff[2] >= PNGCRUSH_A && buff[2] <= PNGCRUSH_Z)) &&
+                  ((buff[3] >= PNGCRUSH_a && buff[3] <= PNGCRUSH_z)  ||
+                   (buff[3] >= PNGCRUSH_A && buff[3] <= PNGCRUSH_Z))))
+            {
+               int i;
+               fprintf (STDERR,"Invalid MNG chunk name: \"");
+               for (i=0; i<4; i++)
+               {
+                 if ((buff[i] >= PNGCRUSH_a && buff[i] <= PNGCRUSH_z) ||
+                     (buff[i] >= PNGCRUSH_A && buff[i] <= PNGCRUSH_Z) ||
+                     (buff[i] >= '0' && buff[i] <= '9'))
+                    fprintf(STDERR,"%c",buff[i]);
+                 else
+                    fprintf(STDERR,"?");
+               }
+               fprintf(STDERR,"\" (0x%2x 0x%2x 0x%2x 0x%2x)\n",
+                  buff[0],buff[1],buff[2],buff[3]);
+            }
+            else
+               if (verbose > 1)
+                 printf("   Reading %c%c%c%c chunk.\n",buff[0],buff[1],buff[2],
+                   buff[3]);
+
+            pngcrush_default_read_data(png_ptr, buff, length);
+
+            if (length < 28)
+              for (ib=27; ib >= length; ib--) 
+                 buff[ib] = 0;
+
+            if (verbose > 0) {
+              printf("  width=%lu\n",
+                (unsigned long) pngcrush_get_uint_31(png_ptr,buff));
+              printf("  height=%lu\n",
+                (unsigned long) pngcrush_get_uint_31(png_ptr,&buff[4]));
+              printf("  ticksps=%lu\n",
+                (unsigned long) pngcrush_get_uint_31(png_ptr,&buff[8]));
+              printf("  nomlayc=%lu\n",
+                (unsigned long) pngcrush_get_uint_31(png_ptr,&buff[12]));
+              printf("  nomfram=%lu\n",
+                (unsigned long) pngcrush_get_uint_31(png_ptr,&buff[16]));
+              printf("  nomplay=%lu\n",
+                (unsigned long) pngcrush_get_uint_31(png_ptr,&buff[20]));
+              printf("  profile=%lu\n",
+                (unsigned long) pngcrush_get_uint_31(png_ptr,&buff[24]));
+            }
+
+            if (new_mng)
+            {
+                /* write the MNG 8-byte signature */
+                pngcrush_write_png(mng_ptr, &mng_signature[0],
+                                  (png_size_t) 8);
+
+                /* Write a MHDR chunk */
+                png_write_chunk(mng_ptr, (png_bytep) png_MHDR,
+                            buff, (png_size_t) 28);
+            }
+
+            pngcrush_default_read_data(png_ptr, buff, 4);
+            input_format = 1;
+
+        }
+        else
+#endif
+        if (png_sig_cmp(png_signature, 0, 8))
+        {
+            if (png_sig_cmp(png_signature, 0, 4))
+                png_error(png_ptr, "Not a PNG file..");
+            else
+                png_error(png_ptr,
+                          "PNG file corrupted by ASCII conversion");
+        }
+    }
+
+    if (salvage)
+    {
+#ifdef INFLATE_ALLOW_INVALID_DISTANCE_TOOFAR_ARRR
+        /* The warning here about deprecated access to png_ptr->zstream
+         * is unavoidable.  This will not work with libpng-1.5.x and later.
+         */
+        inflateUndermine(&png_ptr->zstream, 1);
+#endif
+    }
+
+    for (;;)
+    {
+#ifndef PNG_UINT_IDAT
+#  ifdef PNG_USE_LOCAL_ARRAYS
+        PNG_IDAT;
+        PNG_IEND;
+        PNG_IHDR;
+        PNG_acTL;
+#    ifdef PNG_iCCP_SUPPORTED
+        PNG_iCCP;
+#    endif
+#  else
+#    ifdef PNG_iCCP_SUPPORTED
+        const png_byte png_iCCP[5] = { 105, 67, 67, 80, '\0' };
+#    endif
+        const png_byte png_acTL[5] = {  97, 99, 84, 76, '\0' };
+#  endif
+#endif
+
+        png_byte chunk_name[5];
+        png_byte chunk_length[4];
+        png_byte buff[32];
+        png_uint_32 length;
+        int raw_type = 0;
+
+        pngcrush_default_read_data(png_ptr, chunk_length, 4);
+        length = pngcrush_get_uint_31(png_ptr,chunk_length);
+
+        pngcrush_reset_crc(png_ptr);
+        pngcrush_crc_read(png_ptr, chunk_name, 4);
+        chunk_name[4]='\0';
+
+/* Check for valid chunk name [A-Za-z][A-Za-z][A-Z][A-Za-z] */
+        if (!(((chunk_name[0] >= PNGCRUSH_a && chunk_name[0] <= PNGCRUSH_z)  ||
+               (chunk_name[0] >= PNGCRUSH_A && chunk_name[0] <= PNGCRUSH_Z)) &&
+              ((chunk_name[1] >= PNGCRUSH_a && chunk_name[1] <= PNGCRUSH_z)  ||
+               (chunk_name[2] >= PNGCRUSH_A && chunk_name[2] <= PNGCRUSH_Z)) &&
+              ((chunk_name[2] >= PNGCRUSH_A && chunk_name[2] <= PNGCRUSH_Z)) &&
+              ((chunk_name[3] >= PNGCRUSH_a && chunk_name[3] <= PNGCRUSH_z)  ||
+               (chunk_name[3] >= PNGCRUSH_A && chunk_name[3] <= PNGCRUSH_Z))))
+        {
+           int i;
+
+           fprintf (STDERR,"Invalid chunk name: \"");
+               for (i=0; i<4; i++)
+               {
+                 if ((chunk_name[i] >= PNGCRUSH_a &&
+                      chunk_name[i] <= PNGCRUSH_z) ||
+                     (chunk_name[i] >= PNGCRUSH_A &&
+                      chunk_name[i] <= PNGCRUSH_Z)||
+                     (chunk_name[i] >= '0' &&
+                      chunk_name[i] <= '9'))
+                    fprintf(STDERR,"%c",chunk_name[i]);
+                 else
+                    fprintf(STDERR,"?");
+               }
+               fprintf(STDERR,"\" (0x%2x 0x%2x 0x%2x 0x%2x)\n",
+                  chunk_name[0],chunk_name[1],chunk_name[2],chunk_name[3]);
+        }
+        else
+           if (verbose > 1)
+              printf("   Reading %c%c%c%c chunk.\n",
+                  chunk_name[0],chunk_name[1],chunk_name[2],chunk_name[3]);
+
+        if (new_mng)
+        {
+          const png_byte png_DHDR[5] = {  68, 72, 68, 82, '\0' };
+          const png_byte png_DEFI[5] = {  68, 69, 70, 73, '\0' };
+          const png_byte png_FRAM[5] = {  70, 82, 65, 77, '\0' };
+          const png_byte png_nEED[5] = { 110, 69, 69, 68, '\0' };
+
+          if (!png_memcmp(chunk_name, png_nEED, 4))
+          {
+              /* Skip the nEED chunk */
+              if (verbose > 0)
+                printf ("  skipping MNG %c%c%c%c chunk, %lu bytes\n",
+                  chunk_name[0],
+                  chunk_name[1],chunk_name[2],chunk_name[3],
+                  (unsigned long)length);
+          }
+          else
+          {
+              /* copy the chunk. */
+              if (verbose > 0)
+                printf ("  reading MNG %c%c%c%c chunk, %lu bytes\n",
+                   chunk_name[0],
+                   chunk_name[1],chunk_name[2],chunk_name[3],
+                   (unsigned long)length);
+              if (length+1 > malloced_length)
+              {
+                  png_free(mng_ptr,bb);
+                  if (verbose > 0)
+                    printf ("  png_malloc %lu bytes.\n",(unsigned long)length);
+                  bb=(png_byte*)png_malloc(mng_ptr, length+1);
+                  malloced_length=length+1;
+              }
+              pngcrush_crc_read(png_ptr, bb, length);
+              bb[length]='\0';
+              png_write_chunk(mng_ptr, chunk_name,
+                            bb, (png_size_t) length);
+
+              if (verbose > 1 && !png_memcmp(chunk_name, png_DHDR, 4))
+              {
+                  if (length > 19)
+                  {
+                    printf("  objid=%lu\n",(unsigned long)(bb[1]+(bb[0]<<8)));
+                    printf("  itype=%lu\n",(unsigned long)(bb[2]));
+                    printf("  dtype=%lu\n",(unsigned long)(bb[3]));
+                    printf("  width=%lu\n",
+                      (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[4]));
+                    printf("  height=%lu\n",
+                      (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[8]));
+                    printf("  xloc=%lu\n",
+                      (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[12]));
+                    printf("  yloc=%lu\n",
+                      (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[16]));
+                  }
+              }
+
+              if (verbose > 1 && !png_memcmp(chunk_name, png_DEFI, 4))
+              {
+                  if (length > 3)
+                  {
+                    printf("  objid=%lu\n",(unsigned long)(bb[1]+(bb[0]<<8)));
+                    printf("  do_not_show=%lu\n",(unsigned long)(bb[2]));
+                    printf("  concrete=%lu\n",(unsigned long)(bb[3]));
+                  }
+                  if (length > 19)
+                  {
+                      printf("  xloc=%lu\n",
+                        (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[12]));
+                      printf("  yloc=%lu\n",
+                        (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[16]));
+                    if (length > 28)
+                    {
+                      printf("  l_cb=%lu\n",
+                        (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[20]));
+                      printf("  r_cb=%lu\n",
+                        (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[24]));
+                    }
+                  }
+              }
+              if (verbose > 1 && !png_memcmp(chunk_name, png_FRAM, 4))
+              {
+                  printf("  mode=%lu\n",(unsigned long)bb[0]);
+                  if (length > 1)
+                  {
+                      int ib;
+                      printf("  name = ");
+                      bb[length]='\0';
+                      for (ib=0; bb[ib]; ib++)
+                      {
+                        printf ("%c", bb[ib]);
+                      }
+                      printf ("\n");
+                  }
+                  length=0;
+              }
+          }
+        }
+
+#ifdef PNG_UINT_acTL
+        else if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_acTL)
+#else
+        else if (!png_memcmp(chunk_name, png_acTL, 4))
+#endif
+        {
+           found_acTL_chunk = 1;
+        }
+
+#ifdef PNG_UINT_IDAT
+            if ((pngcrush_get_uint_32(chunk_name) == PNG_UINT_IDAT) ||
+#endif
+#ifndef PNG_UINT_IDAT
+            if ((!png_memcmp(chunk_name, png_IDAT, 4)) ||
+#endif
+#ifdef PNG_UINT_PLTE
+               (pngcrush_get_uint_32(chunk_name) == PNG_UINT_PLTE))
+#endif
+#ifndef PNG_UINT_PLTE
+               (!png_memcmp(chunk_name, png_PLTE, 4)))
+#endif
+            {
+                sum_idat_length += (length + 12);
+#if 0 /* disabled */
+                if (length > crushed_idat_size)
+                    already_crushed++;
 #endif
-                    png_destroy_info_struct(write_ptr,
-                                            &write_end_info_ptr);
-                    png_destroy_write_struct(&write_ptr, &write_info_ptr);
-                }
             }
-            Catch(msg) {
-                if (nosave == 0)
-                    fprintf(stderr, "While converting %s to %s:\n", inname,
-                      outname);
-                else
-                    fprintf(stderr, "While reading %s:\n", inname);
-                fprintf(stderr,
-                  "  pngcrush caught libpng error:\n   %s\n\n", msg);
-                if (row_buf)
-                {
-                    png_free(read_ptr, row_buf);
-                    row_buf = (png_bytep) NULL;
-                }
-#ifdef PNGCRUSH_MULTIPLE_ROWS
-                if (row_pointers != (png_bytepp) NULL)
+
+            if (verbose > 1)
+            {
+                chunk_name[4] = '\0';
+                fprintf(STDERR, "   Reading %s chunk, length = %lu.\n",
+                  chunk_name, (unsigned long)length);
+            }
+
+            if (scan && chunk_name[0] >= PNGCRUSH_a &&
+                chunk_name[0] <= PNGCRUSH_z &&
+                pngcrush_get_uint_32(chunk_name) != PNG_UINT_acTL &&
+                pngcrush_get_uint_32(chunk_name) != PNG_UINT_fcTL &&
+                pngcrush_get_uint_32(chunk_name) != PNG_UINT_fdAT)
+                pngcrush_scan_chunk(chunk_name, length);
+            if (scan && pngcrush_get_uint_32(chunk_name) == PNG_UINT_PLTE)
+                scan_plte_bytes = (unsigned long) length + 12;
+
+            if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_CgBI)
+            {
+                fprintf(STDERR,
+                    " This is an Xcode CgBI file, not a PNG file.\n");
+                if (salvage)
                 {
-                    png_free(read_ptr, row_pointers);
-                    row_pointers = (png_bytepp) NULL;
+                    fprintf (STDERR, " Removing the CgBI chunk.\n");
                 }
-#endif
-                if (nosave == 0)
+                else
                 {
-                    png_destroy_info_struct(write_ptr,
-                                            &write_end_info_ptr);
-                    png_destroy_write_struct(&write_ptr, &write_info_ptr);
-                    setfiletype(outname);
+                    fprintf (STDERR,
+                    " Try \"pngcrush -fix ...\" to attempt to read it.\n");
                 }
-                png_destroy_read_struct(&read_ptr, &read_info_ptr,
-                                        &end_info_ptr);
-                if (verbose > 1)
-                    fprintf(stderr, "returning after cleanup\n");
-                trial = last_method + 1;
+                found_CgBI++;
+                nosave++;
             }
 
-            read_ptr = NULL;
-            write_ptr = NULL;
-            FCLOSE(fpin);
-            if (last_trial && nosave == 0)
+
+#ifdef PNG_UINT_IHDR
+            if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_IHDR)
+#else
+            if (!png_memcmp(chunk_name, png_IHDR, 4))
+#endif
             {
-                FCLOSE(fpout);
-                setfiletype(outname);
+                /* get the color type */
+                pngcrush_crc_read(png_ptr, buff, 13);
+                length -= 13;
+                input_color_type = buff[9];
             }
+            else if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_dSIG)
+            {
+                if (found_any_chunk == 0 && !all_chunks_are_safe)
+                {
+                   image_is_immutable=1;
+                }
+            }
+            else
+                found_any_chunk=1;
 
-            if (nosave)
-                break;
-
-            if (trial == 0)
-                continue;
-
-            idat_length[trial] = pngcrush_write_byte_count;
-
-            if (pngcrush_write_byte_count < pngcrush_best_byte_count)
-               pngcrush_best_byte_count = pngcrush_write_byte_count;
+#ifdef PNG_gAMA_SUPPORTED
+#ifdef PNG_UINT_gAMA
+        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_gAMA)
+#else
+        if (!png_memcmp(chunk_name, png_gAMA, 4))
+#endif
+          found_gAMA=1;
+#endif /* PNG_gAMA_SUPPORTED */
 
-            if (verbose > 0 && trial != last_method)
+#ifdef PNG_bKGD_SUPPORTED
+#ifdef PNG_UINT_bKGD
+        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_bKGD)
+#else
+        if (!png_memcmp(chunk_name, png_bKGD, 4))
+#endif
+          if (length == 6)
             {
-                if (bail == 0 &&
-                    pngcrush_write_byte_count > pngcrush_best_byte_count)
-                   fprintf(STDERR,
-                     "   Critical chunk length, method %3d"
-                     " (ws %d fm %d zl %d zs %d) >%10lu\n",
-                     trial, compression_window,
-                     filter_type, zlib_level, z_strategy,
-                     (unsigned long)pngcrush_best_byte_count);
-                else
-                   fprintf(STDERR,
-                     "   Critical chunk length, method %3d"
-                     " (ws %d fm %d zl %d zs %d) =%10lu\n",
-                     trial, compression_window,
-                     filter_type, zlib_level, z_strategy,
-                     (unsigned long)idat_length[trial]);
-                fflush(STDERR);
+                /* Set found_color_bKGD if the components are different,
+                 * so we do not do reduction of color-type from color to gray
+                 */
+                pngcrush_crc_read(png_ptr, buff, 6);
+                length -= 6;
+                if ((buff[0] != buff[2]) && (buff[0] != buff[4]) &&
+                    (buff[1] != buff[3]) && (buff[0] != buff[5]))
+                  found_color_bKGD=1;
             }
+#endif /* PNG_bKGD_SUPPORTED */
 
-        } /* end of trial-loop */
-
-        P1("\n\nFINISHED MAIN LOOP OVER %d METHODS\n\n\n", last_method);
+#ifdef PNG_cHRM_SUPPORTED
+#ifdef PNG_UINT_cHRM
+        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_cHRM)
+#else
+        if (!png_memcmp(chunk_name, png_cHRM, 4))
+#endif
+          found_cHRM=1;
+#endif /* PNG_cHRM_SUPPORTED */
 
-        /* ////////////////////////////////////////////////////////////////////
-        //////////////////                                 ////////////////////
-        //////////////////  END OF MAIN LOOP OVER METHODS  ////////////////////
-        //////////////////                                 ////////////////////
-        //////////////////////////////////////////////////////////////////// */
-        }
+#ifdef PNG_hIST_SUPPORTED
+#ifdef PNG_UINT_hIST
+        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_hIST)
+#else
+        if (!png_memcmp(chunk_name, png_hIST, 4))
+#endif
+          found_hIST=1;
+#endif /* PNG_hIST_SUPPORTED */
 
-        if (fpin)
-        {
-            FCLOSE(fpin);
-        }
-        if (last_trial && nosave == 0 && fpout)
+#ifdef PNG_iCCP_SUPPORTED
+        /* check for bad Photoshop iCCP chunk */
+#ifdef PNG_UINT_iCCP
+        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_iCCP)
+#else
+        if (!png_memcmp(chunk_name, png_iCCP, 4))
+#endif
         {
-            FCLOSE(fpout);
-            setfiletype(outname);
-        }
+            found_iCCP = 1;
 
-        if (last_trial && nosave == 0 && overwrite != 0)
-        {
-            /* rename the new file , outname = inname */
-            if (
-#if (defined(_Windows) || defined(_WINDOWS) || defined(WIN32) ||  \
-   defined(_WIN32) || defined(__WIN32__) || defined(__CYGWIN__) || \
-   defined(__DJGPP__) || defined(CYGWIN))
-              remove(inname) != 0 ||
-#endif
-              rename(outname, inname) != 0 )
+            /* Check for bad Photoshop iCCP chunk.  Libpng will reject the
+             * bad chunk because the Adler-32 bytes are missing, but we check
+             * here to see if it's really the sRGB profile, and if so, set the
+             * "intent" flag and gamma so pngcrush will write an sRGB chunk
+             * and a gamma chunk.
+             */
+            if (length == 2615)
             {
-                fprintf(STDERR,
-                    "error while renaming \"%s\" to \"%s\" \n",outname,inname);
-                exit (1);
+                pngcrush_crc_read(png_ptr, buff, 22);
+                length -= 22;
+                buff[23] = 0;
+                if (!strncmp((png_const_charp) buff, "Photoshop ICC profile",
+                     21))
+                {
+                    fprintf(STDERR,
+                      "   Replacing bad Photoshop iCCP chunk with an "
+                      "sRGB chunk\n");
+#ifdef PNG_gAMA_SUPPORTED
+#  ifdef PNG_FIXED_POINT_SUPPORTED
+                    image_specified_gamma = 45455L;
+#  else
+                    image_specified_gamma = 0.45455;
+#  endif
+#endif /* PNG_gAMA_SUPPORTED */
+                    found_iCCP = 0;
+                    found_sRGB = 1;
+                    intent = 0;
+                }
             }
-            else
-                P2("rename %s to %s complete.\n",outname,inname);
+            /* To do: recognize other sRGB iCCP chunks and replace them with
+             * sRGB chunk
+             */
         }
+#endif /* PNG_iCCP_SUPPORTED */
 
-        if (last_trial && nosave == 0)
+#ifdef PNG_sBIT_SUPPORTED
+#ifdef PNG_UINT_sBIT
+        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_sBIT)
+#else
+        if (!png_memcmp(chunk_name, png_sBIT, 4))
+#endif
         {
-            png_uint_32 output_length;
-#ifndef __riscos
-            struct stat stat_buf;
-            struct utimbuf utim;
+          if (length <= 4)
+          {
+            int i;
+            pngcrush_crc_read(png_ptr, buff, length);
+            found_sBIT_max=0;
+            for (i=length; i; i--)
+              if (buff[i] > found_sBIT_max)
+                 found_sBIT_max=buff[i];
+
+            if (length > 2)
+              if (buff[0] != buff[1] || buff[0] != buff[2])
+                found_sBIT_different_RGB_bits = 1;
+
+            found_sBIT = 1;
+            length = 0;
+          }
+        }
+#endif /* PNG_sBIT_SUPPORTED */
 
-            stat(inname, &stat_buf);
-            utim.actime  = stat_buf.st_atime;
-            utim.modtime = stat_buf.st_mtime;
-            stat(outname, &stat_buf);
-            output_length = (unsigned long) stat_buf.st_size;
-            if (new_time_stamp == 0)
-            {
-              /* set file timestamp (no big deal if fails) */
-              utime(outname, &utim);
-            }
+#ifdef PNG_tRNS_SUPPORTED
+#ifdef PNG_UINT_tRNS
+        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_tRNS)
 #else
-            output_length = (unsigned long) filesize(outname);
+        if (!png_memcmp(chunk_name, png_tRNS, 4))
 #endif
-            if (verbose >= 0 && bench < 2)
-            {
-                total_input_length += input_length + output_length;
-
-                if (best == 0)
-                {
-                  fprintf(STDERR,
-                  "   Best pngcrush method = 0 (settings undetermined)\n");
-                }
+          found_tRNS=1;
+#endif /* PNG_tRNS_SUPPORTED */
 
-#if 0 /* disabled */
-                else if (!already_crushed && !image_is_immutable)
+#ifdef PNG_UINT_PLTE
+        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_PLTE)
 #else
-                else if (!image_is_immutable)
+        if (!png_memcmp(chunk_name, png_PLTE, 4))
 #endif
-                {
-                fprintf(STDERR,
-                  "   Best pngcrush method        = %3d "
-                  "(ws %d fm %d zl %d zs %d) =%10lu\n",
-                  best, compression_window, fm[best], lv[best], zs[best],
-                  (unsigned long)idat_length[best]);
-                }
-
-                if (verbose > 0)
-                {
-                if (idat_length[0] == idat_length[best])
-                    fprintf(STDERR, "     (no critical chunk change)\n");
-                else if (idat_length[0] > idat_length[best])
-                    fprintf(STDERR, "     (%4.2f%% critical chunk reduction)\n",
-                      (100.0 - (100.0 * idat_length[best]) / idat_length[0]));
-                else
-                    fprintf(STDERR, "     (%4.2f%% critical chunk increase)\n",
-                      -(100.0 - (100.0 * idat_length[best]) / idat_length[0]));
-                if (input_length == output_length)
-                    fprintf(STDERR, "     (no filesize change)\n\n");
-                else if (input_length > output_length)
-                    fprintf(STDERR, "     (%4.2f%% filesize reduction)\n\n",
-                      (100.0 - (100.0 * output_length) / input_length));
-                else
-                    fprintf(STDERR, "     (%4.2f%% filesize increase)\n\n",
-                      -(100.0 - (100.0 * output_length) / input_length));
-
-                if (verbose > 2)
-                    fprintf(STDERR, "   Number of open files=%d\n",
-                      number_of_open_files);
+          raw_where = 1;
 
-                }
-            }
-        }
+#ifdef PNG_UINT_IDAT
+        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_IDAT)
+#else
+        if (!png_memcmp(chunk_name, png_IDAT, 4))
+#endif
+          raw_where = 2;
 
-        if (pngcrush_mode == DEFAULT_MODE || pngcrush_mode == OVERWRITE_MODE)
+        /* Capture iCCP, sPLT and text chunks whole, for copying to the
+         * final output; a chunk we have already started reading (a
+         * suspected bad Photoshop iCCP) is left to libpng.
+         */
+        if (nosave == 0 && input_format == 0)
+          raw_type = pngcrush_raw_chunk_type(chunk_name);
+        if (raw_type != 0)
         {
-            if (png_row_filters != NULL)
+            pngcrush_raw_chunk *chunk = NULL;
+
+            if (length == pngcrush_get_uint_32(chunk_length))
+                chunk = (pngcrush_raw_chunk *) malloc(sizeof *chunk);
+            if (chunk != NULL &&
+                (chunk->data = (png_bytep) malloc(length + 1)) == NULL)
             {
-                free(png_row_filters);
-                png_row_filters = NULL;
+                free(chunk);
+                chunk = NULL;
             }
-#if PNGCRUSH_TIMERS > 0
-            pngcrush_timer_stop(PNGCRUSH_TIMER_MISC);
-            pngcrush_timer_stop(PNGCRUSH_TIMER_TOTAL);
-#endif
-            if (verbose >= 0)
+            if (chunk == NULL)
             {
-                show_result();
+                raw_chunk_refused |= raw_type;
+                raw_type = 0;
             }
-#ifdef PNG_iCCP_SUPPORTED
-            if (iccp_length)
+            else
             {
-                free(iccp_text);
-                iccp_text = NULL;
-                iccp_length = 0;
+                pngcrush_crc_read(png_ptr, chunk->data, length);
+                png_memcpy(chunk->name, chunk_name, 5);
+                chunk->where = raw_where;
+                chunk->length = length;
+                chunk->next = NULL;
+                *raw_tail = chunk;
+                raw_tail = &chunk->next;
+                raw_chunk_types |= raw_type;
+                length = 0;
             }
-#endif
-            break;
         }
-    } /* end of loop on input files */
 
-#if PNGCRUSH_TIMERS > 0
-    for (pc_timer = 0; pc_timer < PNGCRUSH_TIMERS; pc_timer++)
-    {
-        unsigned long ts,tn;
+        if (pngcrush_crc_finish(png_ptr, length) && raw_type != 0)
+            raw_chunk_refused |= raw_type;
 
-        ts=pngcrush_timer_get_seconds(pc_timer);
-        tn=pngcrush_timer_get_nanoseconds(pc_timer);
-        if (ts < pngcrush_timer_min_secs[pc_timer])
+#ifdef PNGCRUSH_LOCO
+#  ifdef PNG_UINT_MEND
+        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_MEND)
+            return sum_idat_length;
+#  else
         {
-            pngcrush_timer_min_secs[pc_timer] = ts;
-            pngcrush_timer_min_nsec[pc_timer] = tn;
+            const png_byte png_MEND[5] =
+                { 77, 69, 78, 68, '\0' };
+            if (!png_memcmp(chunk_name, png_MEND, 4))
+            {
+                if (new_mng)
+                {
+                    png_free(mng_ptr,bb);
+                    return (0);
+                }
+                return sum_idat_length;
+            }
         }
-        else
+#  endif
+#endif
+
+
+#ifdef PNGCRUSH_LOCO
+        if (input_format == 0)
+#endif
         {
-        if (tn < pngcrush_timer_min_nsec[pc_timer])
-            pngcrush_timer_min_nsec[pc_timer] = tn;
+#ifdef PNG_UINT_IEND
+            if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_IEND)
+#else
+            if (!png_memcmp(chunk_name, png_IEND, 4))
+#endif
+            {
+                if (!salvage && found_CgBI)
+                    return 0;
+                else
+                    return sum_idat_length;
+            }
         }
-
-        pngcrush_timer_reset(pc_timer);
     }
-#endif
+}
 
-    } /* end of benchmark_iteration loop */
-    if (verbose >= 0)
-    {
-#if (PNGCRUSH_TIMERS > 0)
-    for (pc_timer=0;pc_timer < PNGCRUSH_TIMERS; pc_timer++)
-    {
-      filter_count[pc_timer]+=pngcrush_timer_get_hits(pc_timer);
-      t_sec=pngcrush_timer_min_secs[pc_timer];
-      t_nsec=pngcrush_timer_min_nsec[pc_timer];
-      t_filter[pc_timer] = (float)t_nsec/1000000000.;
-      if (t_sec)
-        t_filter[pc_timer] += (float)t_sec;
-    }
 
-#  if PNGCRUSH_TIMERS >= 3
-    fprintf(STDERR, "CPU time decode %.6f,", t_filter[1]);
-    fprintf(STDERR, " encode %.6f,", t_filter[2]);
-    fprintf(STDERR, " other %.6f,", t_filter[3]);
-    fprintf(STDERR, " total %.6f sec\n", t_filter[0]);
-#  endif
+#ifdef PNGCRUSH_RECURSIVE
+/* -recursive: crush every *.png file in a directory tree.
+ *
+ * The tree is walked as the files are needed, so that the names never have
+ * to fit on a command line, or in memory all at once.  Only the entries of
+ * the directories on the current path are kept: each directory's entries
+ * are all read before any file in it is crushed, so that the files written
+ * into it (with -e or -ow) are not found by the walk and crushed again.
+ * The next -readahead files found are kept in a queue, and each is passed
+ * to posix_fadvise() with POSIX_FADV_WILLNEED as it joins the queue, so
+ * that the kernel reads it in while the files ahead of it are being
+ * crushed.  With -d, the subdirectories are mirrored under the output
+ * directory, which is itself skipped if it lies inside the tree.
+ */
 
-#  if PNGCRUSH_USE_CLOCK_GETTIME != 0
-   if (benchmark_iterations > 0)
-   {
-#  if PNGCRUSH_TIMERS > 9
-    {
-    float total_t_filter=0;
-    float total_filter_count=0;
-    for (pc_timer = 5; pc_timer < 10; pc_timer++)
-    {
-      total_t_filter+=t_filter[pc_timer];
-      total_filter_count+=filter_count[pc_timer];
-    }
-    if (total_filter_count > 0)
-    {
-      for (pc_timer = 5; pc_timer < 10; pc_timer++)
-      {
-        fprintf(STDERR, "     filter[%u] defilter time = %15.9f, count = %lu\n",
-            pc_timer-5, t_filter[pc_timer],
-           (unsigned long)filter_count[pc_timer]);
-      }
-      fprintf(STDERR, "     total defilter time     = %15.9f, count = %lu\n",
-        total_t_filter, (unsigned long) total_filter_count);
-      }
-    }
-#  endif
-#  if PNGCRUSH_TIMERS > 4
+#define PNGCRUSH_WALK_DEPTH 64
+
+static char **walk_names[PNGCRUSH_WALK_DEPTH]; /* the entries at each level */
+static size_t walk_names_count[PNGCRUSH_WALK_DEPTH];
+static size_t walk_names_next[PNGCRUSH_WALK_DEPTH];
+static size_t walk_len[PNGCRUSH_WALK_DEPTH];  /* walk_path at each level */
+static char walk_path[STR_BUF_SIZE];
+static int walk_depth = -1;
+static struct stat walk_skip;
+static int walk_skip_valid = 0;
+static const char *walk_skip_dir = NULL;
+static char *walk_queue[PNGCRUSH_READAHEAD_MAX + 1];
+static int walk_head = 0;
+static int walk_count = 0;
+static char *walk_current = NULL;
+
+/* Read the entries of the directory walk_path into level "depth",
+ * returning 0 if it cannot be opened
+ */
+static int pngcrush_walk_read(int depth)
+{
+    DIR *dir = opendir(walk_path);
+    struct dirent *entry;
+    char **names = NULL;
+    size_t count = 0, size = 0;
+
+    if (dir == NULL)
+        return 0;
+    while ((entry = readdir(dir)) != NULL)
     {
-      if (filter_count[4] > 0)
-        fprintf(STDERR, "     deinterlace time        = %15.9f, count = %lu\n",
-             t_filter[4], (unsigned long)filter_count[4]);
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        if (count == size)
+        {
+            char **bigger = (char **) realloc(names,
+                (size ? 2 * size : 64) * sizeof (char *));
+
+            if (bigger == NULL)
+                break;
+            names = bigger;
+            size = size ? 2 * size : 64;
+        }
+        if ((names[count] = (char *) malloc(strlen(entry->d_name) + 1)) ==
+            NULL)
+            break;
+        strcpy(names[count++], entry->d_name);
     }
-#  endif
-#  if PNGCRUSH_TIMERS > 1
+    closedir(dir);
+    walk_names[depth] = names;
+    walk_names_count[depth] = count;
+    walk_names_next[depth] = 0;
+    return 1;
+}
+
+/* Free the entries of the deepest level not yet walked, and leave it */
+static void pngcrush_walk_up(void)
+{
+    while (walk_names_next[walk_depth] < walk_names_count[walk_depth])
+        free(walk_names[walk_depth][walk_names_next[walk_depth]++]);
+    free(walk_names[walk_depth]);
+    walk_names[walk_depth] = NULL;
+    walk_depth--;
+}
+
+/* Start walking "dir", returning 0 if it cannot be opened */
+int pngcrush_walk_start(const char *dir, const char *skip_dir)
+{
+    size_t len = strlen(dir);
+
+    while (walk_depth >= 0)
+        pngcrush_walk_up();
+    while (walk_count > 0)
     {
-      fprintf(STDERR, "     total decode time       = %15.9f, count = %lu\n",
-           t_filter[1], (unsigned long)filter_count[1]);
+        free(walk_queue[walk_head]);
+        walk_head = (walk_head + 1) % (PNGCRUSH_READAHEAD_MAX + 1);
+        walk_count--;
     }
-#  endif
-#  if PNGCRUSH_TIMERS > 10
+    free(walk_current);
+    walk_current = NULL;
+
+    while (len > 1 && dir[len - 1] == '/')
+        len--;
+    if (len >= STR_BUF_SIZE)
     {
-      if (filter_count[10] > 0)
-        fprintf(STDERR, "     filter setup time       = %15.9f, count = %lu\n",
-             t_filter[10], (unsigned long)filter_count[10]);
+        fprintf(STDERR, "pngcrush: directory %s is too long for buffer\n",
+            dir);
+        return 0;
     }
-#  endif
-#  if PNGCRUSH_TIMERS > 2
+    memcpy(walk_path, dir, len);
+    walk_path[len] = '\0';
+    walk_skip_dir = skip_dir;
+    walk_skip_valid = 0;
+    if (!pngcrush_walk_read(0))
     {
-      fprintf(STDERR, "     total encode time       = %15.9f, count = %lu\n",
-           t_filter[2], (unsigned long)filter_count[2]);
+        fprintf(STDERR, "pngcrush: could not open directory %s\n", dir);
+        return 0;
     }
-#  endif
-#  if PNGCRUSH_TIMERS > 3
+    walk_len[0] = len;
+    walk_depth = 0;
+    return 1;
+}
+
+static int pngcrush_walk_is_png(const char *name)
+{
+    size_t len = strlen(name);
+
+    return len > 4 && name[len - 4] == '.' &&
+        (name[len - 3] | 0x20) == 'p' && (name[len - 2] | 0x20) == 'n' &&
+        (name[len - 1] | 0x20) == 'g';
+}
+
+/* Return the next PNG file in the tree, in a new buffer, or NULL */
+static char *pngcrush_walk_find(void)
+{
+    while (walk_depth >= 0)
     {
-      fprintf(STDERR, "     total misc time         = %15.9f, count = %lu\n",
-           t_filter[3], (unsigned long)filter_count[3]);
+        char *entry;
+        struct stat st;
+        size_t len, n;
+        int is_png;
+
+        if (walk_names_next[walk_depth] == walk_names_count[walk_depth])
+        {
+            pngcrush_walk_up();
+            continue;
+        }
+        entry = walk_names[walk_depth][walk_names_next[walk_depth]++];
+
+        len = walk_len[walk_depth];
+        n = strlen(entry);
+        if (len + n + 1 >= STR_BUF_SIZE)
+        {
+            fprintf(STDERR, "pngcrush: path %s/%s is too long for buffer\n",
+                walk_path, entry);
+            free(entry);
+            continue;
+        }
+        walk_path[len] = '/';
+        strcpy(walk_path + len + 1, entry);
+        is_png = pngcrush_walk_is_png(entry);
+        free(entry);
+
+        if (lstat(walk_path, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+        {
+            /* The output directory may not exist until the first file */
+            if (!walk_skip_valid && walk_skip_dir != NULL)
+                walk_skip_valid = stat(walk_skip_dir, &walk_skip) == 0;
+            if (walk_skip_valid && st.st_dev == walk_skip.st_dev &&
+                st.st_ino == walk_skip.st_ino)
+                continue;
+            if (walk_depth + 1 < PNGCRUSH_WALK_DEPTH &&
+                pngcrush_walk_read(walk_depth + 1))
+                walk_len[++walk_depth] = len + n + 1;
+            else
+                fprintf(STDERR, "pngcrush: could not open directory %s\n",
+                    walk_path);
+        }
+        else if (S_ISREG(st.st_mode) && is_png)
+        {
+            char *name = (char *) malloc(len + n + 2);
+
+            if (name != NULL)
+                strcpy(name, walk_path);
+            return name;
+        }
     }
-#  endif
-#  if PNGCRUSH_TIMERS > 0
+    return NULL;
+}
+
+/* Return the next file to crush, or NULL at the end of the tree.  The name
+ * stays valid until the next call.
+ */
+char *pngcrush_walk_next(void)
+{
+    free(walk_current);
+    walk_current = NULL;
+
+    while (walk_count <= readahead)
     {
-      fprintf(STDERR, "     total time              = %15.9f, count = %lu\n",
-           t_filter[0], (unsigned long)filter_count[0]);
-    }
-#  endif
-    }
+        char *name = pngcrush_walk_find();
+#ifdef POSIX_FADV_WILLNEED
+        int fd;
 #endif
+
+        if (name == NULL)
+            break;
+#ifdef POSIX_FADV_WILLNEED
+        if ((fd = open(name, O_RDONLY)) >= 0)
+        {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
 #endif
+        walk_queue[(walk_head + walk_count) % (PNGCRUSH_READAHEAD_MAX + 1)] =
+            name;
+        walk_count++;
     }
 
-    if (pngcrush_must_exit)
-       exit(0);
-    return 0;  /* just in case */
+    if (walk_count == 0)
+        return NULL;
+    walk_current = walk_queue[walk_head];
+    walk_head = (walk_head + 1) % (PNGCRUSH_READAHEAD_MAX + 1);
+    walk_count--;
+    return walk_current;
+}
 
-} /* end of main() */
+/* The part of a name from the walk below the -recursive directory */
+const char *pngcrush_walk_relative(const char *name)
+{
+    return name + walk_len[0] + 1;
+}
 
+/* Create the directories of "out" after its first "outlen" characters */
+void pngcrush_walk_mirror(char *out, int outlen)
+{
+    char *p;
 
+    for (p = out + outlen; (p = strchr(p, '/')) != NULL; p++)
+    {
+        *p = '\0';
+        if (mkdir(out, 0755) && errno != EEXIST)
+            fprintf(STDERR, "pngcrush: could not create directory %s\n",
+                out);
+        *p = '/';
+    }
+}
+#endif /* PNGCRUSH_RECURSIVE */
 
 
-png_uint_32 measure_idats(FILE * fp_in)
+/* -manifest, -shard and -journal: batch runs that can be split across
+ * processes or hosts, and resumed.
+ *
+ * -manifest reads the input names from a file, one per line, as they are
+ * needed.  -shard i/N keeps only the files whose name (below the
+ * -recursive directory, for a tree) hashes to i modulo N, so that N runs
+ * given the same files share them out between them without talking to
+ * each other.  -journal appends a line for each file as it is finished:
+ *
+ *   status TAB input_bytes TAB output_bytes TAB milliseconds TAB name
+ *
+ * where status is OK, READ (with -n) or ERR, and is flushed to disk before
+ * the next file is started.  When the run is started again with the same
+ * journal, the files already in it are skipped, except those that failed,
+ * which are tried again, so at most the file that was being crushed is
+ * lost.  At the end, and with -journal_merge for the
+ * journals of several shards, the totals are shown as by show_result().
+ */
+
+typedef struct pngcrush_journal_entry_struct
 {
-    /* Copyright (C) 1999-2002, 2006-2015 Glenn Randers-Pehrson
-       (glennrp at users.sf.net).  See notice in pngcrush.c for conditions of
-       use and distribution */
-    P2("\nmeasure_idats:\n");
-    P1( "Allocating read structure\n");
-/* OK to ignore any warning about the address of exception__prev in "Try" */
-    Try {
-        read_ptr =
-            png_create_read_struct(PNG_LIBPNG_VER_STRING, (png_voidp) NULL,
-                                   (png_error_ptr) pngcrush_cexcept_error,
-                                   (png_error_ptr) NULL);
-        P1( "Allocating read_info,  end_info structures\n");
-        read_info_ptr = png_create_info_struct(read_ptr);
-        end_info_ptr = png_create_info_struct(read_ptr);
+    char *name;
+    char status;                  /* 'O', 'R' or 'E' */
+    unsigned long in, out, ms;
+} pngcrush_journal_entry;
 
-#ifdef PNG_STDIO_SUPPORTED
-        png_init_io(read_ptr, fp_in);
-#else
-        png_set_read_fn(read_ptr, (png_voidp) fp_in, (png_rw_ptr) NULL);
-#endif
+static pngcrush_journal_entry *journal_table = NULL;
+static unsigned long journal_size = 0;  /* a power of 2, or 0 */
+static unsigned long journal_used = 0;
 
-        png_set_sig_bytes(read_ptr, 0);
-        measured_idat_length = pngcrush_measure_idat(read_ptr);
-        P2("measure_idats: IDAT length=%lu\n",
-          (unsigned long)measured_idat_length);
-        P1( "Destroying data structs\n");
-        png_destroy_read_struct(&read_ptr, &read_info_ptr, &end_info_ptr);
-    }
-    Catch(msg) {
-        fprintf(STDERR, "\nWhile measuring IDATs in %s ", inname);
-        fprintf(STDERR, "pngcrush caught libpng error:\n   %s\n\n", msg);
-        png_destroy_read_struct(&read_ptr, &read_info_ptr, &end_info_ptr);
-        P1( "Destroyed data structs\n");
-        measured_idat_length = 0;
-    }
-    return measured_idat_length;
+/* FNV-1a, which gives every host the same shards */
+static png_uint_32 pngcrush_name_hash(const char *name)
+{
+    png_uint_32 h = 2166136261U;
+
+    while (*name != '\0')
+        h = (h ^ (png_byte) *name++) * 16777619U;
+    return h;
 }
 
+/* Find the journal entry for "name", adding it if "add" is set */
+static pngcrush_journal_entry *pngcrush_journal_find(const char *name,
+    int add)
+{
+    unsigned long i;
 
+    if (add && 2 * (journal_used + 1) > journal_size)
+    {
+        unsigned long old_size = journal_size, j;
+        pngcrush_journal_entry *old = journal_table;
 
+        journal_size = old_size ? 2 * old_size : 1024;
+        journal_table = (pngcrush_journal_entry *) calloc(journal_size,
+            sizeof (pngcrush_journal_entry));
+        if (journal_table == NULL)
+        {
+            fprintf(STDERR, "pngcrush: out of memory for the journal\n");
+            exit(1);
+        }
+        for (j = 0; j < old_size; j++)
+            if (old[j].name != NULL)
+            {
+                i = pngcrush_name_hash(old[j].name) & (journal_size - 1);
+                while (journal_table[i].name != NULL)
+                    i = (i + 1) & (journal_size - 1);
+                journal_table[i] = old[j];
+            }
+        free(old);
+    }
+    if (journal_size == 0)
+        return NULL;
 
-#define PNGCRUSH_a  97
-#define PNGCRUSH_z 122
-#define PNGCRUSH_A  65
-#define PNGCRUSH_Z  90 
+    i = pngcrush_name_hash(name) & (journal_size - 1);
+    while (journal_table[i].name != NULL)
+    {
+        if (!strcmp(journal_table[i].name, name))
+            return &journal_table[i];
+        i = (i + 1) & (journal_size - 1);
+    }
+    if (!add)
+        return NULL;
+    journal_table[i].name = (char *) malloc(strlen(name) + 1);
+    if (journal_table[i].name == NULL)
+    {
+        fprintf(STDERR, "pngcrush: out of memory for the journal\n");
+        exit(1);
+    }
+    strcpy(journal_table[i].name, name);
+    journal_used++;
+    return &journal_table[i];
+}
 
-png_uint_32 pngcrush_measure_idat(png_structp png_ptr)
+/* The next name from the manifest, or NULL at its end */
+char *pngcrush_manifest_next(void)
 {
-    /* Copyright (C) 1999-2002, 2006-2015 Glenn Randers-Pehrson
-       (glennrp at users.sf.net)
-       See notice in pngcrush.c for conditions of use and distribution */
+    while (manifest_fp != NULL &&
+        fgets(manifest_line, sizeof manifest_line, manifest_fp) != NULL)
+    {
+        size_t len = strlen(manifest_line);
 
-    /* Signature + IHDR + IEND; we'll add PLTE + IDAT lengths */
-    png_uint_32 sum_idat_length = 45;
+        while (len > 0 && (manifest_line[len - 1] == '\n' ||
+            manifest_line[len - 1] == '\r'))
+            manifest_line[--len] = '\0';
+        if (len > 0)
+            return manifest_line;
+    }
+    if (manifest_fp != NULL && manifest_fp != stdin)
+        fclose(manifest_fp);
+    manifest_fp = NULL;
+    return NULL;
+}
 
-    png_byte *bb = NULL;
-    png_uint_32 malloced_length=0;
+/* Whether "name" belongs to another shard, or is already in the journal
+ * with a result other than ERR
+ */
+int pngcrush_batch_skip(const char *name)
+{
+    const char *key = name;
+    pngcrush_journal_entry *entry;
 
-    {
-        png_byte png_signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
-#ifdef PNGCRUSH_LOCO
-        png_byte mng_signature[8] = { 138, 77, 78, 71, 13, 10, 26, 10 };
+#ifdef PNGCRUSH_RECURSIVE
+    if (recursive_dir != NULL)
+        key = pngcrush_walk_relative(name);
 #endif
+    if (shard_count > 1 &&
+        (long) (pngcrush_name_hash(key) % (png_uint_32) shard_count) !=
+        shard_index)
+        return 1;
+    if (journal_fp != NULL && (entry = pngcrush_journal_find(name, 0)) !=
+        NULL && entry->status != 'E')
+    {
+        P1("Skipping %s, which is in the journal\n", name);
+        return 1;
+    }
+    return 0;
+}
 
-        pngcrush_default_read_data(png_ptr, png_signature, 8);
-        png_set_sig_bytes(png_ptr, 8);
+/* Read a journal into the table, returning 0 if it cannot be opened.  A
+ * later line for the same file replaces an earlier one, and a line cut
+ * short by an interrupted run is ignored.
+ */
+int pngcrush_journal_load(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    char line[STR_BUF_SIZE + 64];
 
-#ifdef PNGCRUSH_LOCO
-        if (!(int) (png_memcmp(mng_signature, png_signature, 8)))
+    if (fp == NULL)
+        return 0;
+    while (fgets(line, sizeof line, fp) != NULL)
+    {
+        char *p = line, *name;
+        unsigned long v[3];
+        pngcrush_journal_entry *entry;
+        size_t len = strlen(line);
+        int j;
+
+        if (len == 0 || line[len - 1] != '\n')
+            continue;
+        line[--len] = '\0';
+        if (len > 0 && line[len - 1] == '\r')
+            line[--len] = '\0';
+        if (strncmp(line, "OK\t", 3) && strncmp(line, "READ\t", 5) &&
+            strncmp(line, "ERR\t", 4))
+            continue;
+        p = strchr(p, '\t');
+        for (j = 0; j < 3 && p != NULL; j++)
         {
-            const png_byte png_MHDR[5] = { 77, 72, 68, 82, '\0' };
+            char *end;
 
-            int ib;
-            png_byte buff[28] = { 0, 0, 0, 0, 0,  0, 0, 0, 0, 0,
-                                  0, 0, 0, 0, 0,  0, 0, 0, 0, 0,
-                                  0, 0, 0, 0, 0,  0, 0, 0 };
-            unsigned long length;
-            /* read the MHDR */
-            pngcrush_default_read_data(png_ptr, buff, 4);
+            v[j] = strtoul(p + 1, &end, 10);
+            p = *end == '\t' ? end : NULL;
+        }
+        if (p == NULL || p[1] == '\0')
+            continue;
+        name = p + 1;
+        entry = pngcrush_journal_find(name, 1);
+        entry->status = line[0];
+        entry->in = v[0];
+        entry->out = v[1];
+        entry->ms = v[2];
+    }
+    fclose(fp);
+    return 1;
+}
 
-            length = pngcrush_get_uint_31(png_ptr,buff);
-            if (length > 28)
-              png_error(png_ptr, "MHDR length too long");
+/* Load the -journal, then open it to append the files finished from now */
+void pngcrush_journal_open(void)
+{
+    FILE *fp;
 
-            pngcrush_default_read_data(png_ptr, buff, 4);
+    if (pngcrush_journal_load(journal_name) && verbose >= 0)
+        fprintf(STDERR, "   Resuming: %lu files are in %s\n", journal_used,
+            journal_name);
 
-            /* To do: combine with checking for valid PNG chunk_name, below */
-            /* Check for valid chunk name [A-Za-z][A-Za-z][A-Z][A-Za-z] */
-            if (!(((buff[0] >= PNGCRUSH_a && buff[0] <= PNGCRUSH_z)  ||
-                   (buff[0] >= PNGCRUSH_A && buff[0] <= PNGCRUSH_Z)) &&
-                  ((buff[1] >= PNGCRUSH_a && buff[1] <= PNGCRUSH_z)  ||
-                   (buff[1] >= PNGCRUSH_A && buff[1] <= PNGCRUSH_Z)) &&
-                  ((buff[2] >= PNGCRUSH_A && buff[2] <= PNGCRUSH_Z)) &&
-                  ((buff[3] >= PNGCRUSH_a && buff[3] <= PNGCRUSH_z)  ||
-                   (buff[3] >= PNGCRUSH_A && buff[3] <= PNGCRUSH_Z))))
+    /* Cut off a line left short by an interrupted run, so that the next
+     * line is not appended to it
+     */
+    if ((fp = fopen(journal_name, "rb")) != NULL)
+    {
+        long size = 0, keep = 0;
+        int c;
+
+        while ((c = getc(fp)) != EOF)
+        {
+            size++;
+            if (c == '\n')
+                keep = size;
+        }
+        if (keep < size)
+        {
+#if defined(__unix__) || defined(__APPLE__)
+            fclose(fp);
+            if ((fp = fopen(journal_name, "r+b")) == NULL ||
+                ftruncate(fileno(fp), (off_t) keep) != 0)
+                keep = -1;
+#else
+            char *kept = (char *) malloc((size_t) keep + 1);
+
+            if (kept == NULL || fseek(fp, 0L, SEEK_SET) != 0 ||
+                fread(kept, 1, (size_t) keep, fp) != (size_t) keep)
+                keep = -1;
+            fclose(fp);
+            fp = NULL;
+            if (keep >= 0 && ((fp = fopen(journal_name, "wb")) == NULL ||
+                fwrite(kept, 1, (size_t) keep, fp) != (size_t) keep))
+                keep = -1;
+            free(kept);
+#endif
+            if (keep < 0)
             {
-               int i;
-               fprintf (STDERR,"Invalid MNG chunk name: \"");
-               for (i=0; i<4; i++)
-               {
-                 if ((buff[i] >= PNGCRUSH_a && buff[i] <= PNGCRUSH_z) ||
-                     (buff[i] >= PNGCRUSH_A && buff[i] <= PNGCRUSH_Z) ||
-                     (buff[i] >= '0' && buff[i] <= '9'))
-                    fprintf(STDERR,"%c",buff[i]);
-                 else
-                    fprintf(STDERR,"?");
-               }
-               fprintf(STDERR,"\" (0x%2x 0x%2x 0x%2x 0x%2x)\n",
-                  buff[0],buff[1],buff[2],buff[3]);
+                fprintf(STDERR, "pngcrush: could not repair %s\n",
+                    journal_name);
+                exit(1);
             }
-            else
-               if (verbose > 1)
-                 printf("   Reading %c%c%c%c chunk.\n",buff[0],buff[1],buff[2],
-                   buff[3]);
-
-            pngcrush_default_read_data(png_ptr, buff, length);
+        }
+        if (fp != NULL)
+            fclose(fp);
+    }
 
-            if (length < 28)
-              for (ib=27; ib >= length; ib--) 
-                 buff[ib] = 0;
+    if ((journal_fp = fopen(journal_name, "ab")) == NULL)
+    {
+        fprintf(STDERR, "pngcrush: could not open %s\n", journal_name);
+        exit(1);
+    }
+}
 
-            if (verbose > 0) {
-              printf("  width=%lu\n",
-                (unsigned long) pngcrush_get_uint_31(png_ptr,buff));
-              printf("  height=%lu\n",
-                (unsigned long) pngcrush_get_uint_31(png_ptr,&buff[4]));
-              printf("  ticksps=%lu\n",
-                (unsigned long) pngcrush_get_uint_31(png_ptr,&buff[8]));
-              printf("  nomlayc=%lu\n",
-                (unsigned long) pngcrush_get_uint_31(png_ptr,&buff[12]));
-              printf("  nomfram=%lu\n",
-                (unsigned long) pngcrush_get_uint_31(png_ptr,&buff[16]));
-              printf("  nomplay=%lu\n",
-                (unsigned long) pngcrush_get_uint_31(png_ptr,&buff[20]));
-              printf("  profile=%lu\n",
-                (unsigned long) pngcrush_get_uint_31(png_ptr,&buff[24]));
-            }
+/* Append the result for the current file to the journal */
+void pngcrush_journal_record(const char *status, unsigned long in,
+    unsigned long out, unsigned long ms)
+{
+    pngcrush_journal_entry *entry;
 
-            if (new_mng)
-            {
-                /* write the MNG 8-byte signature */
-                pngcrush_write_png(mng_ptr, &mng_signature[0],
-                                  (png_size_t) 8);
+    if (journal_fp == NULL)
+        return;
+    fprintf(journal_fp, "%s\t%lu\t%lu\t%lu\t%s\n", status, in, out, ms,
+        inname);
+    fflush(journal_fp);
+#if defined(__unix__) || defined(__APPLE__)
+    fsync(fileno(journal_fp));
+#endif
+    entry = pngcrush_journal_find(inname, 1);
+    entry->status = status[0];
+    entry->in = in;
+    entry->out = out;
+    entry->ms = ms;
+}
 
-                /* Write a MHDR chunk */
-                png_write_chunk(mng_ptr, (png_bytep) png_MHDR,
-                            buff, (png_size_t) 28);
-            }
+/* Show the totals of the journal table */
+void pngcrush_journal_summary(void)
+{
+    unsigned long i, crushed = 0, examined = 0, failed = 0;
+    unsigned long in = 0, out = 0;
+    double ms = 0;
 
-            pngcrush_default_read_data(png_ptr, buff, 4);
-            input_format = 1;
+    for (i = 0; i < journal_size; i++)
+    {
+        pngcrush_journal_entry *entry = &journal_table[i];
 
-        }
-        else
-#endif
-        if (png_sig_cmp(png_signature, 0, 8))
+        if (entry->name == NULL)
+            continue;
+        ms += entry->ms;
+        if (entry->status == 'O')
         {
-            if (png_sig_cmp(png_signature, 0, 4))
-                png_error(png_ptr, "Not a PNG file..");
-            else
-                png_error(png_ptr,
-                          "PNG file corrupted by ASCII conversion");
+            crushed++;
+            in += entry->in;
+            out += entry->out;
         }
+        else if (entry->status == 'R')
+            examined++;
+        else
+            failed++;
     }
+    fprintf(STDERR, "   Journal: %lu files crushed, %lu examined,"
+        " %lu failed, %.1f seconds\n", crushed, examined, failed,
+        ms / 1000.);
+    if (out)
+        pngcrush_show_overall(in, out);
+}
 
-    if (salvage)
+
+#ifdef PNGCRUSH_SERVER
+/* -server: crush files on request without starting a new pngcrush each time.
+ *
+ * Requests are read one line at a time, from stdin with replies on stdout
+ * when the address is "-", or else from connections to a Unix domain socket
+ * created at the address.  The words of a request are separated by blanks
+ * (so filenames cannot contain blanks):
+ *
+ *   CRUSH [options] infile outfile
+ *     reply "OK status input_bytes output_bytes milliseconds"
+ *
+ *   DATA nbytes [options]
+ *     followed by nbytes of PNG datastream; the reply is the same "OK" line
+ *     followed by output_bytes of the crushed PNG datastream
+ *
+ *   QUIT
+ *
+ * A request that produced no output gets "ERR status" instead.  The options
+ * given on the command line along with -server are used for every request,
+ * ahead of the request's own options.  A request may not use the options
+ * that read or write files other than its own infile and outfile, such
+ * as -ow, -d, -e or -stats_json.  The socket is created with mode 0600,
+ * so only the server's own user can connect to it.  Each request runs in a
+ * process forked from the server, so it starts with the server's
+ * already-loaded program and heap, and a request that fails cannot take
+ * the server down.
+ * Socket connections are served concurrently, up to -workers at a time.
+ * With -mem_budget, a request is only started when its estimated memory
+ * use fits in what the requests already running have left of the budget.
+ *
+ * For example
+ *   printf 'CRUSH -brute in.png out.png\nQUIT\n' | pngcrush -server -
+ */
+
+#define PNGCRUSH_SERVER_MAX_ARGS 256
+
+static int server_base_argc = 0;
+static char *server_base_argv[PNGCRUSH_SERVER_MAX_ARGS];
+static unsigned long server_requests = 0;
+static int server_workers = 1;
+static pid_t *server_worker_pid = NULL; /* by slot, 0 for a free slot */
+
+/* The options a request may not use, matched as main() matches them: the
+ * first "length" characters, which include the '\0' for an exact match.
+ */
+static const struct
+{
+    const char *name;
+    size_t length;
+} server_denied_options[] =
+{
+    {"-d", 3}, {"-dir", 4}, {"-e", 3}, {"-ext", 4}, {"-ow", 3},
+    {"-iccp", 5}, {"-mng", 4}, {"-stats_json", 11}, {"-stats-json", 11},
+    {"-trace", 7}, {"-journal", 9}, {"-journal_merge", 15},
+    {"-journal-merge", 15}, {"-manifest", 10}, {"-recursive", 11},
+    {"-server", 8}
+};
+
+/* -mem_budget: the total of the estimates of the running requests is kept
+ * in a small file mapped by all of the workers and guarded with a fcntl()
+ * lock, along with a slot for each worker holding its share of the budget,
+ * or its ticket while it waits for one.  Requests are started in the order
+ * of their tickets, so a large one is not passed over for ever by smaller
+ * ones; one larger than the whole budget runs when nothing else is.  When
+ * the server reaps a worker, it gives back whatever the worker still held,
+ * so a worker that is killed does not keep its share.
+ */
+typedef struct
+{
+    unsigned long used;           /* the total of the shares taken */
+    unsigned long next_ticket;
+} pngcrush_budget_page;
+typedef struct
+{
+    unsigned long bytes;          /* the share taken, or 0 */
+    unsigned long ticket;         /* the ticket while waiting, or 0 */
+} pngcrush_budget_slot;
+static unsigned long server_budget = 0;    /* bytes, or 0 for no budget */
+static pngcrush_budget_page *server_budget_page = NULL;
+static pngcrush_budget_slot *server_budget_slots = NULL; /* one per worker */
+static int server_budget_fd = -1;
+static int server_slot = 0;       /* the slot of this worker */
+
+/* Estimate the memory needed to crush a PNG file from its IHDR: the image,
+ * which some trials keep whole, a copy of it, the zlib streams at the
+ * largest window, and a margin for libpng; 0 if it is not a PNG file.
+ */
+static unsigned long pngcrush_server_footprint(const char *name)
+{
+    png_byte buf[29];
+    FILE *fp = fopen(name, "rb");
+    size_t n = 0;
+    double channels, rowbytes, bytes;
+
+    if (fp != NULL)
     {
-#ifdef INFLATE_ALLOW_INVALID_DISTANCE_TOOFAR_ARRR
-        /* The warning here about deprecated access to png_ptr->zstream
-         * is unavoidable.  This will not work with libpng-1.5.x and later.
-         */
-        inflateUndermine(&png_ptr->zstream, 1);
-#endif
+        n = fread(buf, 1, sizeof buf, fp);
+        fclose(fp);
     }
+    if (n < sizeof buf || png_sig_cmp(buf, 0, 8) ||
+        pngcrush_get_uint_32(buf + 12) != PNG_UINT_IHDR)
+        return 0;
 
-    for (;;)
+    switch (buf[25])
     {
-#ifndef PNG_UINT_IDAT
-#  ifdef PNG_USE_LOCAL_ARRAYS
-        PNG_IDAT;
-        PNG_IEND;
-        PNG_IHDR;
-        PNG_acTL;
-#    ifdef PNG_iCCP_SUPPORTED
-        PNG_iCCP;
-#    endif
-#  else
-#    ifdef PNG_iCCP_SUPPORTED
-        const png_byte png_iCCP[5] = { 105, 67, 67, 80, '\0' };
-#    endif
-        const png_byte png_acTL[5] = {  97, 99, 84, 76, '\0' };
-#  endif
-#endif
+        case 2:  channels = 3; break;
+        case 4:  channels = 2; break;
+        case 6:  channels = 4; break;
+        default: channels = 1; break;
+    }
+    rowbytes = ((double) pngcrush_get_uint_32(buf + 16) * channels * buf[24]
+        + 7) / 8 + 1;
+    bytes = 2 * rowbytes * pngcrush_get_uint_32(buf + 20) +
+        (1L << 17) + (1L << 18) + (1L << 15) + 1048576L;
+    return bytes < (double) PNG_UINT_31_MAX ? (unsigned long) bytes :
+        (unsigned long) PNG_UINT_31_MAX;
+}
 
-        png_byte chunk_name[5];
-        png_byte chunk_length[4];
-        png_byte buff[32];
-        png_uint_32 length;
+static void pngcrush_server_budget_lock(int type)
+{
+    struct flock lock;
+
+    memset(&lock, 0, sizeof lock);
+    lock.l_type = (short) type;
+    lock.l_whence = SEEK_SET;
+    while (fcntl(server_budget_fd, F_SETLKW, &lock) < 0 && errno == EINTR)
+        ;
+}
+
+/* Wait until this worker's ticket is the oldest one and "need" bytes of
+ * the budget are free, then take them
+ */
+static void pngcrush_server_budget_take(unsigned long need)
+{
+    pngcrush_budget_slot *slot = &server_budget_slots[server_slot];
+    struct timespec pause;
+    int waited = 0;
+
+    pause.tv_sec = 0;
+    pause.tv_nsec = 20000000L;
+    pngcrush_server_budget_lock(F_WRLCK);
+    slot->ticket = ++server_budget_page->next_ticket;
+    pngcrush_server_budget_lock(F_UNLCK);
+    for (;;)
+    {
+        int j, first = 1;
+
+        pngcrush_server_budget_lock(F_WRLCK);
+        for (j = 0; j < server_workers; j++)
+            if (server_budget_slots[j].ticket != 0 &&
+                server_budget_slots[j].ticket < slot->ticket)
+                first = 0;
+        if (first && (server_budget_page->used == 0 ||
+            (need <= server_budget &&
+            server_budget_page->used <= server_budget - need)))
+        {
+            server_budget_page->used += need;
+            slot->bytes = need;
+            slot->ticket = 0;
+            pngcrush_server_budget_lock(F_UNLCK);
+            return;
+        }
+        pngcrush_server_budget_lock(F_UNLCK);
+        if (verbose > 0 && !waited++)
+            fprintf(STDERR, "pngcrush: request for %lu bytes waits for"
+                " -mem_budget\n", need);
+        nanosleep(&pause, NULL);
+    }
+}
 
-        pngcrush_default_read_data(png_ptr, chunk_length, 4);
-        length = pngcrush_get_uint_31(png_ptr,chunk_length);
+/* Give back the share of the budget held by the worker in slot "j", and
+ * its ticket if it is still waiting
+ */
+static void pngcrush_server_budget_give(int j)
+{
+    pngcrush_server_budget_lock(F_WRLCK);
+    server_budget_page->used -= server_budget_slots[j].bytes;
+    server_budget_slots[j].bytes = 0;
+    server_budget_slots[j].ticket = 0;
+    pngcrush_server_budget_lock(F_UNLCK);
+}
 
-        pngcrush_reset_crc(png_ptr);
-        pngcrush_crc_read(png_ptr, chunk_name, 4);
-        chunk_name[4]='\0';
+/* Run one request in a child process, returning its exit status */
+static int pngcrush_server_run(int argc, char *argv[])
+{
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+    fflush(STDERR);
+    pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0)
+    {
+        /* stdout may be the reply channel; keep P1 and P2 output off it */
+        dup2(2, 1);
+        argv[argc] = NULL;
+        exit(main(argc, argv));
+    }
+    if (waitpid(pid, &status, 0) < 0)
+        return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
 
-/* Check for valid chunk name [A-Za-z][A-Za-z][A-Z][A-Za-z] */
-        if (!(((chunk_name[0] >= PNGCRUSH_a && chunk_name[0] <= PNGCRUSH_z)  ||
-               (chunk_name[0] >= PNGCRUSH_A && chunk_name[0] <= PNGCRUSH_Z)) &&
-              ((chunk_name[1] >= PNGCRUSH_a && chunk_name[1] <= PNGCRUSH_z)  ||
-               (chunk_name[2] >= PNGCRUSH_A && chunk_name[2] <= PNGCRUSH_Z)) &&
-              ((chunk_name[2] >= PNGCRUSH_A && chunk_name[2] <= PNGCRUSH_Z)) &&
-              ((chunk_name[3] >= PNGCRUSH_a && chunk_name[3] <= PNGCRUSH_z)  ||
-               (chunk_name[3] >= PNGCRUSH_A && chunk_name[3] <= PNGCRUSH_Z))))
-        {
-           int i;
+/* Whether a request may use the option "word" */
+static int pngcrush_server_option_ok(const char *word)
+{
+    size_t j;
+
+    if (!strncmp(word, "--", 2))
+        word++;
+    for (j = 0; j < sizeof server_denied_options /
+        sizeof server_denied_options[0]; j++)
+        if (!strncmp(word, server_denied_options[j].name,
+            server_denied_options[j].length))
+            return 0;
+    return 1;
+}
 
-           fprintf (STDERR,"Invalid chunk name: \"");
-               for (i=0; i<4; i++)
-               {
-                 if ((chunk_name[i] >= PNGCRUSH_a &&
-                      chunk_name[i] <= PNGCRUSH_z) ||
-                     (chunk_name[i] >= PNGCRUSH_A &&
-                      chunk_name[i] <= PNGCRUSH_Z)||
-                     (chunk_name[i] >= '0' &&
-                      chunk_name[i] <= '9'))
-                    fprintf(STDERR,"%c",chunk_name[i]);
-                 else
-                    fprintf(STDERR,"?");
-               }
-               fprintf(STDERR,"\" (0x%2x 0x%2x 0x%2x 0x%2x)\n",
-                  chunk_name[0],chunk_name[1],chunk_name[2],chunk_name[3]);
-        }
-        else
-           if (verbose > 1)
-              printf("   Reading %c%c%c%c chunk.\n",
-                  chunk_name[0],chunk_name[1],chunk_name[2],chunk_name[3]);
+static unsigned long pngcrush_server_filesize(const char *name)
+{
+    struct stat stat_buf;
 
-        if (new_mng)
-        {
-          const png_byte png_DHDR[5] = {  68, 72, 68, 82, '\0' };
-          const png_byte png_DEFI[5] = {  68, 69, 70, 73, '\0' };
-          const png_byte png_FRAM[5] = {  70, 82, 65, 77, '\0' };
-          const png_byte png_nEED[5] = { 110, 69, 69, 68, '\0' };
+    if (stat(name, &stat_buf) != 0)
+        return 0;
+    return (unsigned long) stat_buf.st_size;
+}
 
-          if (!png_memcmp(chunk_name, png_nEED, 4))
-          {
-              /* Skip the nEED chunk */
-              if (verbose > 0)
-                printf ("  skipping MNG %c%c%c%c chunk, %lu bytes\n",
-                  chunk_name[0],
-                  chunk_name[1],chunk_name[2],chunk_name[3],
-                  (unsigned long)length);
-          }
-          else
-          {
-              /* copy the chunk. */
-              if (verbose > 0)
-                printf ("  reading MNG %c%c%c%c chunk, %lu bytes\n",
-                   chunk_name[0],
-                   chunk_name[1],chunk_name[2],chunk_name[3],
-                   (unsigned long)length);
-              if (length+1 > malloced_length)
-              {
-                  png_free(mng_ptr,bb);
-                  if (verbose > 0)
-                    printf ("  png_malloc %lu bytes.\n",(unsigned long)length);
-                  bb=(png_byte*)png_malloc(mng_ptr, length+1);
-                  malloced_length=length+1;
-              }
-              pngcrush_crc_read(png_ptr, bb, length);
-              bb[length]='\0';
-              png_write_chunk(mng_ptr, chunk_name,
-                            bb, (png_size_t) length);
+/* Answer requests read from "in" until QUIT or end of input */
+static void pngcrush_serve(FILE *in, FILE *out)
+{
+    char line[STR_BUF_SIZE];
+    char *args[PNGCRUSH_SERVER_MAX_ARGS + 1];
+    char tmp_in[STR_BUF_SIZE];
+    char tmp_out[STR_BUF_SIZE];
+    const char *tmpdir = getenv("TMPDIR");
 
-              if (verbose > 1 && !png_memcmp(chunk_name, png_DHDR, 4))
-              {
-                  if (length > 19)
-                  {
-                    printf("  objid=%lu\n",(unsigned long)(bb[1]+(bb[0]<<8)));
-                    printf("  itype=%lu\n",(unsigned long)(bb[2]));
-                    printf("  dtype=%lu\n",(unsigned long)(bb[3]));
-                    printf("  width=%lu\n",
-                      (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[4]));
-                    printf("  height=%lu\n",
-                      (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[8]));
-                    printf("  xloc=%lu\n",
-                      (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[12]));
-                    printf("  yloc=%lu\n",
-                      (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[16]));
-                  }
-              }
+    if (tmpdir == NULL || *tmpdir == '\0' || strlen(tmpdir) > 1024)
+        tmpdir = "/tmp";
 
-              if (verbose > 1 && !png_memcmp(chunk_name, png_DEFI, 4))
-              {
-                  if (length > 3)
-                  {
-                    printf("  objid=%lu\n",(unsigned long)(bb[1]+(bb[0]<<8)));
-                    printf("  do_not_show=%lu\n",(unsigned long)(bb[2]));
-                    printf("  concrete=%lu\n",(unsigned long)(bb[3]));
-                  }
-                  if (length > 19)
-                  {
-                      printf("  xloc=%lu\n",
-                        (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[12]));
-                      printf("  yloc=%lu\n",
-                        (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[16]));
-                    if (length > 28)
-                    {
-                      printf("  l_cb=%lu\n",
-                        (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[20]));
-                      printf("  r_cb=%lu\n",
-                        (unsigned long) pngcrush_get_uint_31(png_ptr,&bb[24]));
-                    }
-                  }
-              }
-              if (verbose > 1 && !png_memcmp(chunk_name, png_FRAM, 4))
-              {
-                  printf("  mode=%lu\n",(unsigned long)bb[0]);
-                  if (length > 1)
-                  {
-                      int ib;
-                      printf("  name = ");
-                      bb[length]='\0';
-                      for (ib=0; bb[ib]; ib++)
-                      {
-                        printf ("%c", bb[ib]);
-                      }
-                      printf ("\n");
-                  }
-                  length=0;
-              }
-          }
-        }
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        int nargs, status, is_data;
+        unsigned long data_len = 0, footprint = 0;
+        unsigned long start_ms = pngcrush_clock_ms();
+        char *word, *denied = NULL;
+        const char *request_in, *request_out;
+
+        word = strtok(line, " \t\r\n");
+        if (word == NULL)
+            continue;
+        if (!strcmp(word, "QUIT"))
+            break;
 
-#ifdef PNG_UINT_acTL
-        else if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_acTL)
-#else
-        else if (!png_memcmp(chunk_name, png_acTL, 4))
-#endif
+        is_data = !strcmp(word, "DATA");
+        if (!is_data && strcmp(word, "CRUSH"))
         {
-           found_acTL_chunk = 1;
+            fprintf(out, "ERR unknown request %s\n", word);
+            fflush(out);
+            continue;
         }
 
-#ifdef PNG_UINT_IDAT
-            if ((pngcrush_get_uint_32(chunk_name) == PNG_UINT_IDAT) ||
-#endif
-#ifndef PNG_UINT_IDAT
-            if ((!png_memcmp(chunk_name, png_IDAT, 4)) ||
-#endif
-#ifdef PNG_UINT_PLTE
-               (pngcrush_get_uint_32(chunk_name) == PNG_UINT_PLTE))
-#endif
-#ifndef PNG_UINT_PLTE
-               (!png_memcmp(chunk_name, png_PLTE, 4)))
-#endif
+        if (is_data)
+        {
+            word = strtok(NULL, " \t\r\n");
+            if (word == NULL || (data_len = strtoul(word, NULL, 10)) == 0)
             {
-                sum_idat_length += (length + 12);
-#if 0 /* disabled */
-                if (length > crushed_idat_size)
-                    already_crushed++;
-#endif
+                fprintf(out, "ERR missing DATA length\n");
+                fflush(out);
+                continue;
             }
+        }
 
-            if (verbose > 1)
-            {
-                chunk_name[4] = '\0';
-                fprintf(STDERR, "   Reading %s chunk, length = %lu.\n",
-                  chunk_name, (unsigned long)length);
-            }
+        for (nargs = 0; nargs < server_base_argc; nargs++)
+            args[nargs] = server_base_argv[nargs];
+        while ((word = strtok(NULL, " \t\r\n")) != NULL &&
+            nargs < PNGCRUSH_SERVER_MAX_ARGS - 2)
+        {
+            if (denied == NULL && !pngcrush_server_option_ok(word))
+                denied = word;
+            args[nargs++] = word;
+        }
 
-            if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_CgBI)
+        server_requests++;
+        if (is_data)
+        {
+            FILE *fp;
+            unsigned long n;
+            int fd;
+
+            sprintf(tmp_in, "%s/pngcrush-%ld-%lu-in.png", tmpdir,
+                (long) getpid(), server_requests);
+            sprintf(tmp_out, "%s/pngcrush-%ld-%lu-out.png", tmpdir,
+                (long) getpid(), server_requests);
+            fd = open(tmp_in, O_WRONLY | O_CREAT | O_EXCL, 0600);
+            fp = fd < 0 ? NULL : fdopen(fd, "wb");
+            if (fp == NULL && fd >= 0)
+                close(fd);
+
+            /* Read all of the data even when it cannot be kept, so that
+             * the next request is found where it should be.
+             */
+            for (n = 0; n < data_len; n++)
             {
-                fprintf(STDERR,
-                    " This is an Xcode CgBI file, not a PNG file.\n");
-                if (salvage)
-                {
-                    fprintf (STDERR, " Removing the CgBI chunk.\n");
-                }
-                else
-                {
-                    fprintf (STDERR,
-                    " Try \"pngcrush -fix ...\" to attempt to read it.\n");
-                }
-                found_CgBI++;
-                nosave++;
+                int c = getc(in);
+                if (c == EOF)
+                    break;
+                if (fp != NULL)
+                    putc(c, fp);
             }
-
-
-#ifdef PNG_UINT_IHDR
-            if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_IHDR)
-#else
-            if (!png_memcmp(chunk_name, png_IHDR, 4))
-#endif
+            if (fp != NULL && fclose(fp) != 0)
+                fp = NULL;
+            if (n < data_len)
             {
-                /* get the color type */
-                pngcrush_crc_read(png_ptr, buff, 13);
-                length -= 13;
-                input_color_type = buff[9];
+                remove(tmp_in);
+                fprintf(out, "ERR DATA ended after %lu bytes\n", n);
+                fflush(out);
+                continue;
             }
-            else if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_dSIG)
+            if (fp == NULL)
             {
-                if (found_any_chunk == 0 && !all_chunks_are_safe)
-                {
-                   image_is_immutable=1;
-                }
+                remove(tmp_in);
+                fprintf(out, "ERR could not create %s\n", tmp_in);
+                fflush(out);
+                continue;
             }
-            else
-                found_any_chunk=1;
-
-#ifdef PNG_gAMA_SUPPORTED
-#ifdef PNG_UINT_gAMA
-        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_gAMA)
-#else
-        if (!png_memcmp(chunk_name, png_gAMA, 4))
-#endif
-          found_gAMA=1;
-#endif /* PNG_gAMA_SUPPORTED */
-
-#ifdef PNG_bKGD_SUPPORTED
-#ifdef PNG_UINT_bKGD
-        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_bKGD)
-#else
-        if (!png_memcmp(chunk_name, png_bKGD, 4))
-#endif
-          if (length == 6)
+            if (denied != NULL)
             {
-                /* Set found_color_bKGD if the components are different,
-                 * so we do not do reduction of color-type from color to gray
-                 */
-                pngcrush_crc_read(png_ptr, buff, 6);
-                length -= 6;
-                if ((buff[0] != buff[2]) && (buff[0] != buff[4]) &&
-                    (buff[1] != buff[3]) && (buff[0] != buff[5]))
-                  found_color_bKGD=1;
-            }
-#endif /* PNG_bKGD_SUPPORTED */
-
-#ifdef PNG_cHRM_SUPPORTED
-#ifdef PNG_UINT_cHRM
-        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_cHRM)
-#else
-        if (!png_memcmp(chunk_name, png_cHRM, 4))
-#endif
-          found_cHRM=1;
-#endif /* PNG_cHRM_SUPPORTED */
+                remove(tmp_in);
+                fprintf(out, "ERR %s is not allowed in a request\n", denied);
+                fflush(out);
+                continue;
+            }
+            remove(tmp_out);
+            args[nargs++] = tmp_in;
+            args[nargs++] = tmp_out;
+        }
+        else if (nargs < server_base_argc + 2)
+        {
+            fprintf(out, "ERR CRUSH needs infile and outfile\n");
+            fflush(out);
+            continue;
+        }
+        else if (denied != NULL)
+        {
+            fprintf(out, "ERR %s is not allowed in a request\n", denied);
+            fflush(out);
+            continue;
+        }
 
-#ifdef PNG_hIST_SUPPORTED
-#ifdef PNG_UINT_hIST
-        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_hIST)
-#else
-        if (!png_memcmp(chunk_name, png_hIST, 4))
-#endif
-          found_hIST=1;
-#endif /* PNG_hIST_SUPPORTED */
+        request_in = args[nargs - 2];
+        request_out = args[nargs - 1];
+        if (server_budget_page != NULL &&
+            (footprint = pngcrush_server_footprint(request_in)) != 0)
+            pngcrush_server_budget_take(footprint);
+        status = pngcrush_server_run(nargs, args);
+        if (footprint != 0)
+            pngcrush_server_budget_give(server_slot);
 
-#ifdef PNG_iCCP_SUPPORTED
-        /* check for bad Photoshop iCCP chunk */
-#ifdef PNG_UINT_iCCP
-        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_iCCP)
-#else
-        if (!png_memcmp(chunk_name, png_iCCP, 4))
-#endif
+        if (pngcrush_server_filesize(request_out) == 0)
         {
-            found_iCCP = 1;
+            fprintf(out, "ERR %d\n", status);
+        }
+        else
+        {
+            fprintf(out, "OK %d %lu %lu %lu\n", status,
+                pngcrush_server_filesize(request_in),
+                pngcrush_server_filesize(request_out),
+                pngcrush_clock_ms() - start_ms);
 
-            /* Check for bad Photoshop iCCP chunk.  Libpng will reject the
-             * bad chunk because the Adler-32 bytes are missing, but we check
-             * here to see if it's really the sRGB profile, and if so, set the
-             * "intent" flag and gamma so pngcrush will write an sRGB chunk
-             * and a gamma chunk.
-             */
-            if (length == 2615)
+            if (is_data)
             {
-                pngcrush_crc_read(png_ptr, buff, 22);
-                length -= 22;
-                buff[23] = 0;
-                if (!strncmp((png_const_charp) buff, "Photoshop ICC profile",
-                     21))
+                FILE *fp = fopen(request_out, "rb");
+                int c;
+
+                if (fp != NULL)
                 {
-                    fprintf(STDERR,
-                      "   Replacing bad Photoshop iCCP chunk with an "
-                      "sRGB chunk\n");
-#ifdef PNG_gAMA_SUPPORTED
-#  ifdef PNG_FIXED_POINT_SUPPORTED
-                    image_specified_gamma = 45455L;
-#  else
-                    image_specified_gamma = 0.45455;
-#  endif
-#endif /* PNG_gAMA_SUPPORTED */
-                    found_iCCP = 0;
-                    found_sRGB = 1;
-                    intent = 0;
+                    while ((c = getc(fp)) != EOF)
+                        putc(c, out);
+                    fclose(fp);
                 }
             }
-            /* To do: recognize other sRGB iCCP chunks and replace them with
-             * sRGB chunk
-             */
         }
-#endif /* PNG_iCCP_SUPPORTED */
+        fflush(out);
 
-#ifdef PNG_sBIT_SUPPORTED
-#ifdef PNG_UINT_sBIT
-        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_sBIT)
-#else
-        if (!png_memcmp(chunk_name, png_sBIT, 4))
-#endif
+        if (is_data)
         {
-          if (length <= 4)
-          {
-            int i;
-            pngcrush_crc_read(png_ptr, buff, length);
-            found_sBIT_max=0;
-            for (i=length; i; i--)
-              if (buff[i] > found_sBIT_max)
-                 found_sBIT_max=buff[i];
+            remove(tmp_in);
+            remove(tmp_out);
+        }
+    }
+}
 
-            if (length > 2)
-              if (buff[0] != buff[1] || buff[0] != buff[2])
-                found_sBIT_different_RGB_bits = 1;
+/* Free the slot of a worker that has exited, with its share of the budget */
+static void pngcrush_server_reap(pid_t pid)
+{
+    int j;
 
-            found_sBIT = 1;
-            length = 0;
-          }
+    for (j = 0; j < server_workers; j++)
+        if (server_worker_pid[j] == pid)
+        {
+            server_worker_pid[j] = 0;
+            if (server_budget_page != NULL)
+                pngcrush_server_budget_give(j);
         }
-#endif /* PNG_sBIT_SUPPORTED */
+}
 
-#ifdef PNG_tRNS_SUPPORTED
-#ifdef PNG_UINT_tRNS
-        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_tRNS)
-#else
-        if (!png_memcmp(chunk_name, png_tRNS, 4))
-#endif
-          found_tRNS=1;
-#endif /* PNG_tRNS_SUPPORTED */
+/* Let accept() return when a worker exits, so that it is reaped at once */
+static void pngcrush_server_sigchld(int sig)
+{
+    (void) sig;
+}
+
+int pngcrush_server(int argc, char *argv[], int server_arg)
+{
+    const char *address;
+    int active = 0;
+    int fd, j;
+    struct sockaddr_un addr;
+    struct stat stat_buf;
+    struct sigaction action;
+    mode_t old_mask;
+
+    if (server_arg + 1 >= argc)
+    {
+        fprintf(STDERR, "pngcrush: -server needs an address\n");
+        exit(1);
+    }
+    address = argv[server_arg + 1];
 
-        pngcrush_crc_finish(png_ptr, length);
+    server_base_argv[server_base_argc++] = argv[0];
+    for (j = 1; j < argc; j++)
+    {
+        if (j == server_arg || j == server_arg + 1)
+            continue;
+        if (!strcmp(argv[j], "-workers") || !strcmp(argv[j], "--workers"))
+        {
+            if (j + 1 < argc)
+                server_workers = atoi(argv[++j]);
+            continue;
+        }
+        if (!strcmp(argv[j], "-mem_budget") || !strcmp(argv[j], "-mem-budget"))
+        {
+            /* in megabytes */
+            if (j + 1 < argc)
+                server_budget = strtoul(argv[++j], NULL, 10) << 20;
+            continue;
+        }
+        if (server_base_argc < PNGCRUSH_SERVER_MAX_ARGS / 2)
+            server_base_argv[server_base_argc++] = argv[j];
+    }
+    if (server_workers < 1)
+        server_workers = 1;
 
-#ifdef PNGCRUSH_LOCO
-#  ifdef PNG_UINT_MEND
-        if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_MEND)
-            return sum_idat_length;
-#  else
+    if (!strcmp(address, "-"))
+    {
+        pngcrush_serve(stdin, stdout);
+        return 0;
+    }
+
+    if (strlen(address) >= sizeof(addr.sun_path))
+    {
+        fprintf(STDERR, "pngcrush: socket name %s is too long\n", address);
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, address);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("pngcrush: socket");
+        exit(1);
+    }
+    /* Replace a socket left behind by an earlier server, but nothing else */
+    if (lstat(address, &stat_buf) == 0)
+    {
+        if (!S_ISSOCK(stat_buf.st_mode))
         {
-            const png_byte png_MEND[5] =
-                { 77, 69, 78, 68, '\0' };
-            if (!png_memcmp(chunk_name, png_MEND, 4))
+            fprintf(STDERR, "pngcrush: %s exists and is not a socket\n",
+                address);
+            exit(1);
+        }
+        remove(address);
+    }
+    old_mask = umask(0177);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(fd, 16) != 0)
+    {
+        perror("pngcrush: bind");
+        exit(1);
+    }
+    umask(old_mask);
+
+    /* Let a client that hangs up early cost only its own connection */
+    signal(SIGPIPE, SIG_IGN);
+
+    server_worker_pid = (pid_t *) calloc((size_t) server_workers,
+        sizeof (pid_t));
+    if (server_worker_pid == NULL)
+    {
+        fprintf(STDERR, "pngcrush: out of memory for -workers\n");
+        exit(1);
+    }
+    memset(&action, 0, sizeof action);
+    action.sa_handler = pngcrush_server_sigchld;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+
+    if (server_budget != 0)
+    {
+        char name[STR_BUF_SIZE];
+        const char *tmpdir = getenv("TMPDIR");
+        size_t size = sizeof (pngcrush_budget_page) +
+            server_workers * sizeof (pngcrush_budget_slot);
+        void *map = MAP_FAILED;
+
+        if (tmpdir == NULL || *tmpdir == '\0' || strlen(tmpdir) > 1024)
+            tmpdir = "/tmp";
+        sprintf(name, "%s/pngcrush-%ld-budget", tmpdir, (long) getpid());
+        server_budget_fd = open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (server_budget_fd >= 0)
+        {
+            remove(name);
+            if (ftruncate(server_budget_fd, (off_t) size) == 0)
+                map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    server_budget_fd, 0);
+        }
+        if (map == MAP_FAILED)
+        {
+            fprintf(STDERR, "pngcrush: could not set up -mem_budget\n");
+            exit(1);
+        }
+        memset(map, 0, size);
+        server_budget_page = (pngcrush_budget_page *) map;
+        server_budget_slots = (pngcrush_budget_slot *)
+            (server_budget_page + 1);
+    }
+
+    if (verbose > 0)
+        fprintf(STDERR, "pngcrush: serving on %s with %d workers\n",
+            address, server_workers);
+
+    for (;;)
+    {
+        int c, status;
+        pid_t pid;
+
+        while (active > 0 && (pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            pngcrush_server_reap(pid);
+            active--;
+        }
+        while (active >= server_workers)
+        {
+            if ((pid = wait(&status)) > 0)
             {
-                if (new_mng)
-                {
-                    png_free(mng_ptr,bb);
-                    return (0);
-                }
-                return sum_idat_length;
+                pngcrush_server_reap(pid);
+                active--;
             }
+            else if (errno != EINTR)
+                break;
         }
-#  endif
-#endif
 
+        c = accept(fd, NULL, NULL);
+        if (c < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("pngcrush: accept");
+            break;
+        }
 
-#ifdef PNGCRUSH_LOCO
-        if (input_format == 0)
-#endif
+        for (server_slot = 0; server_slot < server_workers - 1 &&
+            server_worker_pid[server_slot] != 0; server_slot++)
+            ;
+        fflush(STDERR);
+        pid = fork();
+        if (pid == 0)
         {
-#ifdef PNG_UINT_IEND
-            if (pngcrush_get_uint_32(chunk_name) == PNG_UINT_IEND)
-#else
-            if (!png_memcmp(chunk_name, png_IEND, 4))
-#endif
+            FILE *in, *out;
+
+            signal(SIGCHLD, SIG_DFL);
+            close(fd);
+            in = fdopen(c, "rb");
+            out = fdopen(dup(c), "wb");
+            if (in != NULL && out != NULL)
             {
-                if (!salvage && found_CgBI)
-                    return 0;
-                else
-                    return sum_idat_length;
+                pngcrush_serve(in, out);
+                fclose(out);
+                fclose(in);
             }
+            exit(0);
+        }
+        close(c);
+        if (pid > 0)
+        {
+            server_worker_pid[server_slot] = pid;
+            active++;
         }
     }
+
+    close(fd);
+    remove(address);
+    return 1;
 }
+#endif /* PNGCRUSH_SERVER */
 
 
 void print_version_info(void)
@@ -8838,11 +13620,29 @@ static const char *pngcrush_usage[] = {
     "       %s -e ext [other options] file.png ...\n",
     "       %s -d dir/ [other options] file.png ...\n",
     "       %s -ow [other options] file.png [tempfile.png]\n",
-    "       %s -n -v file.png ...\n"
+    "       %s -n -v file.png ...\n",
+    "       %s [other options] - - <infile.png >outfile.png\n"
 };
 
 struct options_help pngcrush_options[] = {
 
+    {0, "  -alpha_fill (predict samples underlying fully-transparent pixels)"},
+    {2, ""},
+    {2, "               Like \"-blacken\", but sets the color samples of"},
+    {2, "               fully-transparent pixels to the values predicted by"},
+    {2, "               the filter of each trial, so that they filter to"},
+    {2, "               zero.  The visible image is unchanged."},
+    {2, ""},
+
+    {0, " -apng_search (search filters and strategies for each APNG frame)"},
+    {2, ""},
+    {2, "               When the output file has the \".apng\" extension,"},
+    {2, "               the fdAT frame data is recompressed, normally with"},
+    {2, "               the best method found for the main image.  With"},
+    {2, "               this option filters 0-5 and strategies 0-1 are"},
+    {2, "               tried on each frame instead."},
+    {2, ""},
+
     {0, "         -bail (bail out of trial when size exceeds best size found"},
     {2, ""},
     {2, "               Default is to bail out and simply report that the"},
@@ -8851,6 +13651,22 @@ struct options_help pngcrush_options[] = {
     {2, "               option to prevent that."},
     {2, ""},
 
+    {0, " -batch_budget milliseconds (time limit for the whole run)"},
+    {2, ""},
+    {2, "               Like \"-time_budget\" but the deadline applies to"},
+    {2, "               all of the files together.  Once it has passed, each"},
+    {2, "               remaining file gets only the examine pass and the"},
+    {2, "               final write."},
+    {2, ""},
+
+    {0, "        -bench n (time n passes over all of the input files)"},
+    {2, ""},
+    {2, "               Reports the minimum, median, 95th percentile and"},
+    {2, "               standard deviation of each timer over the passes,"},
+    {2, "               the throughput in MB/s, and the encode time of"},
+    {2, "               each method.  See also \"-warmup\" and \"-timers\"."},
+    {2, ""},
+
     {0, "      -blacken (zero samples underlying fully-transparent pixels)"},
     {2, ""},
     {2, "               Changing the color samples to zero can improve the"},
@@ -8858,6 +13674,15 @@ struct options_help pngcrush_options[] = {
     {2, "               blackening is off by default."},
     {2, ""},
 
+#ifdef Z_SPLIT_BLOCKS
+    {0, "  -block_split (split IDAT into deflate blocks where it is smaller)"},
+    {2, ""},
+    {2, "               Every trial places its deflate block boundaries by"},
+    {2, "               comparing the exact sizes of the candidate blocks."},
+    {2, "               Slower, and needs the bundled zlib."},
+    {2, ""},
+#endif
+
 #ifdef Z_RLE
     {0, "        -brute (use brute-force: try 176 different methods)"},
 #else
@@ -8954,6 +13779,19 @@ struct options_help pngcrush_options[] = {
     {2, ""},
 #endif
 
+    {0, "    -interlace n (0: non-interlaced, 1: Adam7 interlaced output)"},
+    {2, ""},
+    {2, "               Default is to keep the interlacing of the input."},
+    {2, "               Interlacing is never changed in APNG files."},
+    {2, ""},
+
+    {0, "         -interlace_search"},
+    {2, ""},
+    {2, "               Try each method both interlaced and non-interlaced"},
+    {2, "               and keep the smaller.  The image is decoded once and"},
+    {2, "               reused by the trials."},
+    {2, ""},
+
 #ifdef PNG_iTXt_SUPPORTED
     {0, "         -itxt b[efore_IDAT]|a[fter_IDAT] \"keyword\""},
     {2, "               \"language_code\" \"translated_keyword\" \"text\""},
@@ -8962,6 +13800,21 @@ struct options_help pngcrush_options[] = {
     {2, ""},
 #endif
 
+    {0, "      -journal file (skip the files already in it; record the rest)"},
+    {2, ""},
+    {2, "               With -recursive, -manifest, -d, -e, or -n, append"},
+    {2, "               a line with the status, sizes, and time of each"},
+    {2, "               file as it is finished.  Run again with the same"},
+    {2, "               journal to resume an interrupted run; the files"},
+    {2, "               that failed are tried again."},
+    {2, ""},
+
+    {0, "-journal_merge file... (show the totals of the journals and exit)"},
+    {2, ""},
+    {2, "               Must be the last option.  Use with the journals of"},
+    {2, "               the shards of a -shard run."},
+    {2, ""},
+
     {0, "         -keep chunk_name"},
     {2, ""},
     {2, "               keep named chunk even when pngcrush makes"},
@@ -9004,9 +13857,25 @@ struct options_help pngcrush_options[] = {
     {2, ""},
     {2, FAKE_PAUSE_STRING},
 
+    {0, "     -manifest file (crush the files named in it, one per line)"},
+    {2, ""},
+    {2, "               Use instead of file names on the command line,"},
+    {2, "               along with -d, -e, -ow, or -n.  \"-\" reads the"},
+    {2, "               names from stdin."},
+    {2, ""},
+
     {0, "          -max maximum_IDAT_size [default "STRNGIFY(MAX_IDAT_SIZE)"]"},
     {2, ""},
 
+#ifdef PNGCRUSH_SERVER
+    {0, "   -mem_budget n (with -server, memory for running requests, MB)"},
+    {2, ""},
+    {2, "               Each request's memory use is estimated from its"},
+    {2, "               IHDR, and it waits until that much of the budget"},
+    {2, "               is free.  Requests start in the order they came."},
+    {2, ""},
+#endif
+
 #ifdef PNGCRUSH_LOCO
     {0, "          -mng (write a new MNG, do not crush embedded PNGs)"},
     {2, ""},
@@ -9063,6 +13932,16 @@ struct options_help pngcrush_options[] = {
     {0, " -oldtimestamp (Do not reset file modification time)"},
     {2, ""},
 
+#ifdef Z_OPTIMAL_HUFFMAN
+    {0, "-optimal_huffman (optimal length-limited Huffman codes in IDAT)"},
+    {2, ""},
+    {2, "               Builds optimal codes where zlib would shorten"},
+    {2, "               overlong ones heuristically, and sends the code"},
+    {2, "               lengths with the fewest bits.  Cheap enough to use"},
+    {2, "               for every trial; needs the bundled zlib."},
+    {2, ""},
+#endif
+
     {0, "           -ow (Overwrite)"},
     {2, ""},
     {2, "               Overwrite the input file.  The input file is removed"},
@@ -9082,6 +13961,21 @@ struct options_help pngcrush_options[] = {
     {2, "               and summary of results."},
     {2, ""},
 
+#ifdef PNGCRUSH_RECURSIVE
+    {0, "    -readahead n (with -recursive, prefetch the next n files)"},
+    {2, ""},
+    {2, "               Default 16; 0 turns the prefetching off."},
+    {2, ""},
+
+    {0, "   -recursive directory (crush every *.png file in the tree)"},
+    {2, ""},
+    {2, "               Use instead of file names on the command line,"},
+    {2, "               along with -d, -e, -ow, or -n.  With -d the"},
+    {2, "               subdirectories are recreated in the output"},
+    {2, "               directory."},
+    {2, ""},
+#endif
+
     {0, "       -reduce (do lossless color-type or bit-depth reduction)"},
     {2, ""},
     {2, "               (if possible).  Also reduces palette length if"},
@@ -9142,6 +14036,31 @@ struct options_help pngcrush_options[] = {
     {2, "               (Use \"-warn\" to show only warnings"},
     {2, ""},
 
+#ifdef PNGCRUSH_SERVER
+    {0, "       -server address (serve crush requests; see pngcrush.c)"},
+    {2, ""},
+    {2, "               Read requests from a Unix domain socket created at"},
+    {2, "               \"address\", or from stdin with replies on stdout if"},
+    {2, "               the address is \"-\".  A request is one line,"},
+    {2, "               either \"CRUSH [options] infile outfile\" or"},
+    {2, "               \"DATA nbytes [options]\" followed by the PNG"},
+    {2, "               datastream.  The reply is \"OK status input_bytes"},
+    {2, "               output_bytes milliseconds\", followed for DATA by"},
+    {2, "               the crushed datastream.  The other options on the"},
+    {2, "               command line apply to every request."},
+    {2, ""},
+#endif
+
+    {0, "   -stats_json file (append a JSON record for each input file)"},
+    {2, ""},
+    {2, "               Each line of the file is a JSON object with the"},
+    {2, "               input and output sizes, the chosen method and its"},
+    {2, "               filter, level, and strategy, the size reached by"},
+    {2, "               each trial and where it bailed out, the reductions"},
+    {2, "               applied, and the decode, encode, and misc times"},
+    {2, "               (not collected with \"-s\")."},
+    {2, ""},
+
     {0, "         -save (keep all copy-unsafe PNG chunks)"},
     {2, ""},
     {2, "               Save otherwise unknown ancillary chunks that would"},
@@ -9155,8 +14074,30 @@ struct options_help pngcrush_options[] = {
     {2, "               and the color_type and bit_depth are not changed."},
     {2, ""},
 
+    {0, "         -scan (report predicted savings; implies -n)"},
+    {2, ""},
+    {2, "               Runs only the examine pass, with a fast deflate of"},
+    {2, "               the rows instead of the trials, and writes one"},
+    {2, "               tab-separated line per file to stdout: the input and"},
+    {2, "               critical chunk bytes, the predicted critical bytes"},
+    {2, "               and total savings, the reductions available, and"},
+    {2, "               the ancillary chunk bytes and those that the -rem"},
+    {2, "               options would remove.  Interlaced files, or files"},
+    {2, "               with -c or -bit_depth, get no prediction (\"-\")."},
+    {2, "               The rows are deflated again after the reductions,"},
+    {2, "               except in images of over 64 MB, whose prediction"},
+    {2, "               with reductions is a lower bound."},
+    {2, ""},
+
     {0, FAKE_PAUSE_STRING},
 
+    {0, "        -shard i/N (crush only the i'th of N shares of the files)"},
+    {2, ""},
+    {2, "               The files are shared out by a hash of the name"},
+    {2, "               (below the directory with -recursive), so N runs"},
+    {2, "               with i = 0 to N-1 crush each file exactly once."},
+    {2, ""},
+
     {0, "        -speed Avoid the AVG and PAETH filters, for decoding speed"},
     {2, ""},
     {2, "               Useful for compressing PNG files that are expected"},
@@ -9184,6 +14125,30 @@ struct options_help pngcrush_options[] = {
     {2, "               ten tEXt, iTXt, or zTXt chunks per pngcrush run."},
     {2, ""},
 
+    {0, "  -time_budget milliseconds (time limit per file)"},
+    {2, ""},
+    {2, "               Run cheap methods before expensive ones, and do not"},
+    {2, "               start another trial unless it and the final write"},
+    {2, "               are expected to finish within the budget.  The best"},
+    {2, "               result found so far is written.  Default is 0 (no"},
+    {2, "               limit)."},
+    {2, ""},
+
+    {0, "      -timers (report time spent in each phase)"},
+    {2, ""},
+    {2, "               Time inflate, unfilter, deinterlace, transforms,"},
+    {2, "               filter selection, deflate, CRC and I/O, and report"},
+    {2, "               them with the results (and in -stats_json)."},
+    {2, ""},
+
+    {0, "       -trace file.json (append Trace Event Format spans)"},
+    {2, ""},
+    {2, "               Writes a span for each file, file open,"},
+    {2, "               measure_idats, trial, row loop and rename, and an"},
+    {2, "               event where a trial bails out, for loading into a"},
+    {2, "               trace viewer such as chrome://tracing or Perfetto."},
+    {2, ""},
+
 #ifdef PNG_tRNS_SUPPORTED
     {0, "   -trns_array n trns[0] trns[1] .. trns[n-1]"},
     {2, ""},
@@ -9199,6 +14164,18 @@ struct options_help pngcrush_options[] = {
     {2, ""},
 #endif
 
+#ifdef LIBPNG_UNIFIED
+    {0, "  -tune_search (also try each method with deflateTune() profiles)"},
+    {2, ""},
+    {2, "               Methods at levels 4 to 9 with strategy 0 or 1 are"},
+    {2, "               run again with each of a few profiles of longer hash"},
+    {2, "               chains and other lazy matching limits.  A profile run"},
+    {2, "               stops early when its IDAT, projected from the rows"},
+    {2, "               written so far, is larger than the best so far."},
+    {2, "               Use \"-brute -tune_search\" for the widest search."},
+    {2, ""},
+#endif
+
     {0, FAKE_PAUSE_STRING},
 
     {0, "            -v (display more detailed information)"},
@@ -9206,15 +14183,33 @@ struct options_help pngcrush_options[] = {
     {2, "               Repeat the option (use \"-v -v\") for even more."},
     {2, ""},
 
+    {0, "       -verify (check that the output has the input's pixels)"},
+    {2, ""},
+    {2, "               Decodes the input (in a separate process, while the"},
+    {2, "               trials run) and the written output to 16-bit RGBA,"},
+    {2, "               ignoring the color of fully transparent pixels, and"},
+    {2, "               compares their hashes.  If they differ, the output"},
+    {2, "               is replaced with a copy of the input.  Not done for"},
+    {2, "               output to stdout, or when -c drops alpha or color."},
+    {2, ""},
+
     {0, "      -version (display the pngcrush version)"},
     {2, ""},
     {2, "               Look for the most recent version of pngcrush at"},
     {2, "               http://pmt.sf.net"},
     {2, ""},
 
+    {0, "       -warmup n (with -bench, run n untimed passes first)"},
+    {2, ""},
+
     {0, "         -warn (only show warnings)"},
     {2, ""},
 
+#ifdef PNGCRUSH_SERVER
+    {0, "      -workers n (with -server, serve up to n connections at once)"},
+    {2, ""},
+#endif
+
     {0, "            -w compression_window_size [32, 16, 8, 4, 2, 1, 512]"},
     {2, ""},
     {2, "               Size of the sliding compression window, in kbytes"},
@@ -57,4 +57,19 @@
 #undef PNG_SIMPLIFIED_WRITE_BGR_SUPPORTED
 #undef PNG_SIMPLIFIED_WRITE_SUPPORTED
 
+/* Phase timer hooks in the bundled libpng.  pngcrush.c defines these before
+ * it includes the libpng sources (LIBPNG_UNIFIED); otherwise they do nothing.
+ */
+#ifndef PNGCRUSH_PHASE_START
+#  define PNGCRUSH_PHASE_START(n)
+#  define PNGCRUSH_PHASE_STOP(n)
+#endif
+
+/* Called by png_deflate_claim() in the bundled libpng once the zlib stream
+ * is ready for its new owner; pngcrush.c uses it for deflateTune().
+ */
+#ifndef PNGCRUSH_DEFLATE_CLAIMED
+#  define PNGCRUSH_DEFLATE_CLAIMED(png_ptr, owner)
+#endif
+
 #endif /* !PNGCRUSH_H */
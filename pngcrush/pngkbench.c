@@ -0,0 +1,674 @@
+/* pngkbench.c - microbenchmarks for the bundled libpng and zlib kernels
+ *
+ * This software is released under a license derived from the libpng
+ * license (see LICENSE, in pngcrush.c).
+ *
+ * Usage:
+ *
+ *    pngkbench [kernel ...]
+ *
+ * Times each kernel in isolation and reports cycles per byte (from the
+ * time-stamp counter where there is one, otherwise nanoseconds per byte)
+ * and MB/s, taking the fastest of several passes.  With arguments, only
+ * the kernels whose names begin with one of them are run.  The kernels
+ * are:
+ *
+ *    unfilter      png_read_filter_row_*(), generic and (when pngcrush is
+ *                  built with SSE2, NEON, MSA or VSX support) optimized
+ *    setup_row     png_setup_{sub,up,avg,paeth}_row()
+ *    find_filter   png_write_find_filter() with all filters enabled, less
+ *                  the cost of writing the same rows unfiltered
+ *    longest_match longest_match() at levels 6 and 9, one search for each
+ *                  position in a 64k window
+ *    inflate       inflate() with large buffers, which runs inflate_fast()
+ *    crc32, adler32
+ *
+ * across bytes per pixel, row widths and data patterns.  Like pngcrush.c
+ * with LIBPNG_UNIFIED, this includes the libpng sources, and deflate.c,
+ * so that their static functions can be called directly; link it with
+ * the other zlib objects.
+ */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 199309L /* for clock_gettime */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "deflate.c"
+
+#include "pngcrush.h"
+#include "png.c"
+#include "pngerror.c"
+#include "pngget.c"
+#include "pngmem.c"
+#include "pngpread.c"
+#include "pngread.c"
+#include "pngrio.c"
+#include "pngrtran.c"
+#include "pngrutil.c"
+#include "pngset.c"
+#include "pngtrans.c"
+#include "pngwio.c"
+#include "pngwrite.c"
+#include "pngwtran.c"
+#include "pngwutil.c"
+#ifdef PNGCRUSH_USE_ARM_NEON
+# include "arm_init.c"
+# include "filter_neon_intrinsics.c"
+#endif
+#ifdef PNGCRUSH_USE_MIPS_NSA
+# include "mips_init.c"
+# include "filter_msa_intrinsics.c"
+#endif
+#ifdef PNGCRUSH_USE_INTEL_SSE
+# include "intel_init.c"
+# include "filter_sse2_intrinsics.c"
+#endif
+#ifdef PNGCRUSH_USE_POWERPC_VSX
+# include "powerpc_init.c"
+# include "filter_vsx_intrinsics.c"
+#endif
+
+#if defined(_MSC_VER)
+typedef unsigned __int64 kbench_uint64;
+#  include <intrin.h>
+#elif defined(__GNUC__)
+__extension__ typedef unsigned long long kbench_uint64;
+#else
+typedef unsigned long long kbench_uint64;
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#  define KBENCH_TSC 1
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#  define KBENCH_TSC 1
+#else
+#  define KBENCH_TSC 0
+#endif
+
+/* Bytes processed per timed pass, and the minimum time spent per case */
+#define KBENCH_PASS_BYTES (256 * 1024)
+#define KBENCH_MIN_NSEC   20000000
+#define KBENCH_MIN_PASSES 5
+
+static kbench_uint64 kbench_nsec(void)
+{
+#if defined(__unix__) || defined(__APPLE__)
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (kbench_uint64)t.tv_sec * 1000000000 + (kbench_uint64)t.tv_nsec;
+#else
+   return (kbench_uint64)((double)clock() * (1.e9 / CLOCKS_PER_SEC));
+#endif
+}
+
+static kbench_uint64 kbench_ticks(void)
+{
+#if KBENCH_TSC && defined(_MSC_VER)
+   return __rdtsc();
+#elif KBENCH_TSC
+   unsigned int lo, hi;
+   __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+   return ((kbench_uint64)hi << 32) | lo;
+#else
+   return kbench_nsec();
+#endif
+}
+
+/* The fastest pass of the current case */
+static kbench_uint64 best_ticks, best_nsec, case_nsec;
+static int case_passes;
+
+static void kbench_start_case(void)
+{
+   best_ticks = best_nsec = (kbench_uint64)-1;
+   case_nsec = 0;
+   case_passes = 0;
+}
+
+/* Keep running passes until enough time has been spent */
+static int kbench_more(void)
+{
+   return case_passes < KBENCH_MIN_PASSES || case_nsec < KBENCH_MIN_NSEC;
+}
+
+static kbench_uint64 pass_ticks, pass_nsec;
+
+static void kbench_pass_start(void)
+{
+   pass_nsec = kbench_nsec();
+   pass_ticks = kbench_ticks();
+}
+
+static void kbench_pass_stop(void)
+{
+   kbench_uint64 ticks = kbench_ticks() - pass_ticks;
+   kbench_uint64 nsec = kbench_nsec() - pass_nsec;
+
+   if (ticks < best_ticks)
+      best_ticks = ticks;
+   if (nsec < best_nsec)
+      best_nsec = nsec;
+   case_nsec += nsec;
+   case_passes++;
+}
+
+/* Subtract a baseline pass from the best pass, for net figures */
+static void kbench_subtract(kbench_uint64 ticks, kbench_uint64 nsec)
+{
+   best_ticks = best_ticks > ticks ? best_ticks - ticks : 0;
+   best_nsec = best_nsec > nsec ? best_nsec - nsec : 0;
+}
+
+static void kbench_report(const char *kernel, const char *variant, int bpp,
+   unsigned long size, const char *pattern, unsigned long bytes)
+{
+   double per_byte = (double)best_ticks / bytes;
+   double mb_s = best_nsec > 0 ? bytes * 1.e3 / (double)best_nsec : 0;
+
+   char bpp_string[12]; /* an int, or "-" */
+
+   if (bpp > 0)
+      sprintf(bpp_string, "%d", bpp);
+   else
+      strcpy(bpp_string, "-");
+   printf("%-13s %-9s %3s %7lu  %-7s %9.3f %10.1f\n", kernel, variant,
+      bpp_string, size, pattern, per_byte, mb_s);
+   fflush(stdout);
+}
+
+/* Deterministic test data */
+static unsigned int kbench_hash(unsigned long i)
+{
+   unsigned long h = (i * 2654435761UL + 0x9e3779b9UL) & 0xffffffffUL;
+
+   h = ((h ^ (h >> 15)) * 2246822519UL) & 0xffffffffUL;
+   return (unsigned int)((h ^ (h >> 13)) & 0xffff);
+}
+
+#define KBENCH_PATTERNS 4
+static const char *pattern_name[KBENCH_PATTERNS] =
+   {"random", "smooth", "text", "zero"};
+
+static void kbench_fill(png_bytep buf, unsigned long size, int pattern)
+{
+   static const char *words[8] = {"the ", "png ", "crush ", "filter ",
+      "deflate ", "row ", "of ", "image "};
+   unsigned long i;
+
+   switch (pattern)
+   {
+      case 0: /* random */
+         for (i = 0; i < size; i++)
+            buf[i] = (png_byte)kbench_hash(i);
+         break;
+      case 1: /* like filtered rows of a photo: small differences */
+         for (i = 0; i < size; i++)
+            buf[i] = (png_byte)((kbench_hash(i) & 7) - 3);
+         break;
+      case 2: /* words */
+         for (i = 0; i < size;)
+         {
+            const char *w = words[kbench_hash(i) & 7];
+
+            while (*w && i < size)
+               buf[i++] = (png_byte)*w++;
+         }
+         break;
+      default:
+         memset(buf, 0, size);
+         break;
+   }
+}
+
+static int kbench_selected(int argc, char *argv[], const char *kernel)
+{
+   int i;
+
+   if (argc < 2)
+      return 1;
+   for (i = 1; i < argc; i++)
+      if (!strncmp(kernel, argv[i], strlen(argv[i])))
+         return 1;
+   return 0;
+}
+
+static void PNGCBAPI kbench_error(png_structp png_ptr, png_const_charp msg)
+{
+   (void)png_ptr;
+   fprintf(stderr, "pngkbench: %s\n", msg);
+   exit(1);
+}
+
+static void PNGCBAPI kbench_write(png_structp png_ptr, png_bytep data,
+   png_size_t length)
+{
+   (void)png_ptr;
+   (void)data;
+   (void)length;
+}
+
+static void PNGCBAPI kbench_flush(png_structp png_ptr)
+{
+   (void)png_ptr;
+}
+
+static const int bpp_list[] = {1, 2, 3, 4, 6, 8};
+static const unsigned long width_list[] = {32, 512, 4096};
+#define KBENCH_BPPS   (sizeof bpp_list / sizeof bpp_list[0])
+#define KBENCH_WIDTHS (sizeof width_list / sizeof width_list[0])
+
+static const char *filter_name[4] = {"sub", "up", "avg", "paeth"};
+
+/* Reverse the filter on every row of a KBENCH_PASS_BYTES image */
+static void kbench_unfilter(void)
+{
+   static png_struct pp;
+   png_bytep data = (png_bytep)malloc(KBENCH_PASS_BYTES);
+   png_bytep image = (png_bytep)malloc(KBENCH_PASS_BYTES);
+   unsigned int b, w, f, impl;
+   int pattern;
+
+   if (data == NULL || image == NULL)
+      return;
+
+   for (b = 0; b < KBENCH_BPPS; b++)
+   {
+      void (*generic[4])(png_row_infop, png_bytep, png_const_bytep);
+
+      memset(&pp, 0, sizeof pp);
+      pp.pixel_depth = (png_byte)(8 * bpp_list[b]);
+      generic[0] = png_read_filter_row_sub;
+      generic[1] = png_read_filter_row_up;
+      generic[2] = png_read_filter_row_avg;
+      generic[3] = bpp_list[b] == 1 ? png_read_filter_row_paeth_1byte_pixel :
+         png_read_filter_row_paeth_multibyte_pixel;
+      png_init_filter_functions(&pp);
+
+      for (w = 0; w < KBENCH_WIDTHS; w++)
+      for (pattern = 0; pattern < 2; pattern++)
+      for (f = 0; f < 4; f++)
+      for (impl = 0; impl < 2; impl++)
+      {
+         void (*fn)(png_row_infop, png_bytep, png_const_bytep) =
+            impl ? pp.read_filter[f] : generic[f];
+         png_row_info row_info;
+         char variant[16];
+         png_size_t rowbytes = width_list[w] * bpp_list[b];
+         unsigned long rows = KBENCH_PASS_BYTES / rowbytes;
+         unsigned long y;
+
+         if (impl && fn == generic[f])
+            continue;
+
+         row_info.width = (png_uint_32)width_list[w];
+         row_info.rowbytes = rowbytes;
+         row_info.pixel_depth = pp.pixel_depth;
+         row_info.channels = (png_byte)bpp_list[b];
+         row_info.bit_depth = 8;
+         row_info.color_type = 0;
+
+         kbench_fill(data, KBENCH_PASS_BYTES, pattern);
+         kbench_start_case();
+         while (kbench_more())
+         {
+            memcpy(image, data, rows * rowbytes);
+            kbench_pass_start();
+            for (y = 1; y < rows; y++)
+               (*fn)(&row_info, image + y * rowbytes,
+                  image + (y - 1) * rowbytes);
+            kbench_pass_stop();
+         }
+         sprintf(variant, "%s%s", filter_name[f], impl ? "-opt" : "");
+         kbench_report("unfilter", variant, bpp_list[b],
+            (unsigned long)rowbytes, pattern_name[pattern],
+            (rows - 1) * rowbytes);
+      }
+   }
+   free(data);
+   free(image);
+}
+
+/* Filter every row of a KBENCH_PASS_BYTES image into try_row */
+static void kbench_setup_row(void)
+{
+   static png_struct pp;
+   png_bytep data = (png_bytep)malloc(KBENCH_PASS_BYTES);
+   png_bytep try_row = (png_bytep)malloc(4096 * 8 + 1);
+   unsigned int b, w, f;
+   int pattern;
+
+   if (data == NULL || try_row == NULL)
+      return;
+
+   memset(&pp, 0, sizeof pp);
+   pp.try_row = try_row;
+
+   for (b = 0; b < KBENCH_BPPS; b++)
+   for (w = 0; w < KBENCH_WIDTHS; w++)
+   for (pattern = 0; pattern < 2; pattern++)
+   {
+      png_size_t rowbytes = width_list[w] * bpp_list[b];
+      unsigned long rows = KBENCH_PASS_BYTES / (rowbytes + 1);
+      png_uint_32 bpp = (png_uint_32)bpp_list[b];
+
+      kbench_fill(data, KBENCH_PASS_BYTES, pattern);
+      for (f = 0; f < 4; f++)
+      {
+         unsigned long y;
+         png_size_t sum = 0;
+
+         kbench_start_case();
+         while (kbench_more())
+         {
+            kbench_pass_start();
+            for (y = 1; y < rows; y++)
+            {
+               /* row_buf and prev_row point at the filter byte */
+               pp.row_buf = data + y * (rowbytes + 1);
+               pp.prev_row = data + (y - 1) * (rowbytes + 1);
+               switch (f)
+               {
+                  case 0:
+                     sum += png_setup_sub_row(&pp, bpp, rowbytes,
+                        PNG_SIZE_MAX);
+                     break;
+                  case 1:
+                     sum += png_setup_up_row(&pp, rowbytes, PNG_SIZE_MAX);
+                     break;
+                  case 2:
+                     sum += png_setup_avg_row(&pp, bpp, rowbytes,
+                        PNG_SIZE_MAX);
+                     break;
+                  default:
+                     sum += png_setup_paeth_row(&pp, bpp, rowbytes,
+                        PNG_SIZE_MAX);
+                     break;
+               }
+            }
+            kbench_pass_stop();
+         }
+         if (sum == 0 && pattern == 0)
+            printf("(no sum)\n"); /* keep the calls */
+         kbench_report("setup_row", filter_name[f], bpp_list[b],
+            (unsigned long)rowbytes, pattern_name[pattern],
+            (rows - 1) * rowbytes);
+      }
+   }
+   free(data);
+   free(try_row);
+}
+
+/* Write an image with png_write_row(), at zlib level 0, with the given
+ * filters; returns in pass_ticks/pass_nsec the time for the rows only.
+ */
+static void kbench_write_rows(png_bytep data, png_uint_32 width,
+   png_uint_32 height, int color_type, int filters)
+{
+   png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+      NULL, kbench_error, NULL);
+   png_infop info_ptr = png_create_info_struct(png_ptr);
+   png_size_t rowbytes;
+   png_uint_32 y;
+
+   png_set_write_fn(png_ptr, NULL, kbench_write, kbench_flush);
+   png_set_IHDR(png_ptr, info_ptr, width, height, 8, color_type,
+      PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+   png_set_compression_level(png_ptr, 0);
+   png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, filters);
+   png_write_info(png_ptr, info_ptr);
+   rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+
+   kbench_pass_start();
+   for (y = 0; y < height; y++)
+      png_write_row(png_ptr, data + y * rowbytes);
+   kbench_pass_stop();
+
+   png_write_end(png_ptr, NULL);
+   png_destroy_write_struct(&png_ptr, &info_ptr);
+}
+
+static void kbench_find_filter(void)
+{
+   static const int color_type[4] = {0, 4, 2, 6};
+   png_bytep data = (png_bytep)malloc(KBENCH_PASS_BYTES);
+   unsigned int b, w;
+   int pattern;
+
+   if (data == NULL)
+      return;
+
+   for (b = 0; b < 4; b++)
+   for (w = 0; w < KBENCH_WIDTHS; w++)
+   for (pattern = 0; pattern < 2; pattern++)
+   {
+      png_uint_32 width = (png_uint_32)width_list[w];
+      png_uint_32 height = (png_uint_32)(KBENCH_PASS_BYTES /
+         (width * (b + 1)));
+      kbench_uint64 none_ticks, none_nsec;
+
+      kbench_fill(data, KBENCH_PASS_BYTES, pattern);
+
+      kbench_start_case();
+      while (kbench_more())
+         kbench_write_rows(data, width, height, color_type[b],
+            PNG_FILTER_NONE);
+      none_ticks = best_ticks;
+      none_nsec = best_nsec;
+
+      kbench_start_case();
+      while (kbench_more())
+         kbench_write_rows(data, width, height, color_type[b],
+            PNG_ALL_FILTERS);
+      kbench_subtract(none_ticks, none_nsec);
+
+      kbench_report("find_filter", "all", (int)b + 1,
+         (unsigned long)width * (b + 1), pattern_name[pattern],
+         (unsigned long)height * width * (b + 1));
+   }
+   free(data);
+}
+
+static voidpf kbench_zalloc(voidpf opaque, uInt items, uInt size)
+{
+   (void)opaque;
+   return calloc(items, size);
+}
+
+static void kbench_zfree(voidpf opaque, voidpf address)
+{
+   (void)opaque;
+   free(address);
+}
+
+/* Search for a match at every position of a full window, the way
+ * deflate_slow() does, but without emitting anything.
+ */
+static void kbench_longest_match(void)
+{
+   static const int levels[2] = {6, 9};
+   int l, pattern;
+
+   for (l = 0; l < 2; l++)
+   for (pattern = 0; pattern < KBENCH_PATTERNS; pattern++)
+   {
+      z_stream zs;
+      deflate_state *s;
+      unsigned long length, sum = 0;
+      kbench_uint64 insert_ticks = 0, insert_nsec = 0;
+      int match;
+
+      memset(&zs, 0, sizeof zs);
+      zs.zalloc = kbench_zalloc;
+      zs.zfree = kbench_zfree;
+      if (deflateInit(&zs, levels[l]) != Z_OK)
+         return;
+      s = (deflate_state *)zs.state;
+      length = s->window_size;
+      kbench_fill(s->window, length, pattern);
+
+      /* Time the hash insertion alone first, then with the searches */
+      for (match = 0; match < 2; match++)
+      {
+         kbench_start_case();
+         while (kbench_more())
+         {
+            IPos hash_head;
+
+            CLEAR_HASH(s);
+            s->ins_h = s->window[0];
+            UPDATE_HASH(s, s->ins_h, s->window[1]);
+            kbench_pass_start();
+            for (s->strstart = 1; s->strstart < length - MIN_LOOKAHEAD;
+                 s->strstart++)
+            {
+               INSERT_STRING(s, s->strstart, hash_head);
+               if (match && hash_head != NIL &&
+                   s->strstart - hash_head <= MAX_DIST(s))
+               {
+                  s->lookahead = (uInt)(length - s->strstart);
+                  s->prev_length = MIN_MATCH - 1;
+                  sum += longest_match(s, hash_head);
+               }
+            }
+            kbench_pass_stop();
+         }
+         if (match == 0)
+         {
+            insert_ticks = best_ticks;
+            insert_nsec = best_nsec;
+         }
+      }
+      kbench_subtract(insert_ticks, insert_nsec);
+      if (sum == 0 && pattern == 0)
+         printf("(no matches)\n"); /* keep the calls */
+      kbench_report("longest_match", levels[l] == 6 ? "level 6" : "level 9",
+         0, length, pattern_name[pattern], length - MIN_LOOKAHEAD - 1);
+      s->strstart = 0;
+      deflateEnd(&zs);
+   }
+}
+
+/* Inflate a 1 MB stream with large buffers, so inflate_fast() does the
+ * work.
+ */
+static void kbench_inflate(void)
+{
+   unsigned long size = 4 * KBENCH_PASS_BYTES;
+   png_bytep data = (png_bytep)malloc(size);
+   png_bytep zbuf = (png_bytep)malloc(size + size / 8 + 1024);
+   png_bytep out = (png_bytep)malloc(size);
+   int pattern;
+
+   if (data == NULL || zbuf == NULL || out == NULL)
+      return;
+
+   for (pattern = 1; pattern < KBENCH_PATTERNS; pattern++)
+   {
+      z_stream zs;
+      unsigned long zlen;
+
+      kbench_fill(data, size, pattern);
+
+      memset(&zs, 0, sizeof zs);
+      zs.zalloc = kbench_zalloc;
+      zs.zfree = kbench_zfree;
+      if (deflateInit(&zs, 9) != Z_OK)
+         break;
+      zs.next_in = data;
+      zs.avail_in = (uInt)size;
+      zs.next_out = zbuf;
+      zs.avail_out = (uInt)(size + size / 8 + 1024);
+      deflate(&zs, Z_FINISH);
+      zlen = zs.total_out;
+      deflateEnd(&zs);
+
+      memset(&zs, 0, sizeof zs);
+      zs.zalloc = kbench_zalloc;
+      zs.zfree = kbench_zfree;
+      if (inflateInit(&zs) != Z_OK)
+         break;
+      kbench_start_case();
+      while (kbench_more())
+      {
+         inflateReset(&zs);
+         zs.next_in = zbuf;
+         zs.avail_in = (uInt)zlen;
+         zs.next_out = out;
+         zs.avail_out = (uInt)size;
+         kbench_pass_start();
+         inflate(&zs, Z_FINISH);
+         kbench_pass_stop();
+      }
+      inflateEnd(&zs);
+      if (memcmp(data, out, size))
+         fprintf(stderr, "pngkbench: inflate mismatch\n");
+      kbench_report("inflate", "fast", 0, zlen, pattern_name[pattern], size);
+   }
+   free(data);
+   free(zbuf);
+   free(out);
+}
+
+static void kbench_checksums(int argc, char *argv[])
+{
+   static const unsigned long sizes[3] = {64, 1024, 65536};
+   png_bytep data = (png_bytep)malloc(KBENCH_PASS_BYTES);
+   int which, i;
+
+   if (data == NULL)
+      return;
+   kbench_fill(data, KBENCH_PASS_BYTES, 0);
+
+   for (which = 0; which < 2; which++)
+   {
+      const char *kernel = which ? "adler32" : "crc32";
+
+      if (!kbench_selected(argc, argv, kernel))
+         continue;
+      for (i = 0; i < 3; i++)
+      {
+         unsigned long n = KBENCH_PASS_BYTES / sizes[i];
+         unsigned long j;
+         uLong check = 0;
+
+         kbench_start_case();
+         while (kbench_more())
+         {
+            kbench_pass_start();
+            for (j = 0; j < n; j++)
+               check = which ?
+                  adler32(check, data + j * sizes[i], (uInt)sizes[i]) :
+                  crc32(check, data + j * sizes[i], (uInt)sizes[i]);
+            kbench_pass_stop();
+         }
+         if (check == 0)
+            printf("(zero check)\n"); /* keep the calls */
+         kbench_report(kernel, "zlib", 0, sizes[i], "random",
+            n * sizes[i]);
+      }
+   }
+   free(data);
+}
+
+int main(int argc, char *argv[])
+{
+   printf("%-13s %-9s %3s %7s  %-7s %9s %10s\n", "kernel", "variant", "bpp",
+      "bytes", "data", KBENCH_TSC ? "cycles/B" : "ns/B", "MB/s");
+
+   if (kbench_selected(argc, argv, "unfilter"))
+      kbench_unfilter();
+   if (kbench_selected(argc, argv, "setup_row"))
+      kbench_setup_row();
+   if (kbench_selected(argc, argv, "find_filter"))
+      kbench_find_filter();
+   if (kbench_selected(argc, argv, "longest_match"))
+      kbench_longest_match();
+   if (kbench_selected(argc, argv, "inflate"))
+      kbench_inflate();
+   kbench_checksums(argc, argv);
+   return 0;
+}
@@ -545,8 +545,12 @@ png_read_row(png_structrp png_ptr, png_bytep row, png_bytep dsp_row)
    if (png_ptr->row_buf[0] > PNG_FILTER_VALUE_NONE)
    {
       if (png_ptr->row_buf[0] < PNG_FILTER_VALUE_LAST)
+      {
+         PNGCRUSH_PHASE_START(PNGCRUSH_TIMER_UNFILTER + png_ptr->row_buf[0]);
          png_read_filter_row(png_ptr, &row_info, png_ptr->row_buf + 1,
              png_ptr->prev_row + 1, png_ptr->row_buf[0]);
+         PNGCRUSH_PHASE_STOP(PNGCRUSH_TIMER_UNFILTER + png_ptr->row_buf[0]);
+      }
       else
          png_error(png_ptr, "bad adaptive filter value");
    }
@@ -569,7 +573,11 @@ png_read_row(png_structrp png_ptr, png_bytep row, png_bytep dsp_row)
 
 #ifdef PNG_READ_TRANSFORMS_SUPPORTED
    if (png_ptr->transformations)
+   {
+      PNGCRUSH_PHASE_START(PNGCRUSH_TIMER_TRANSFORM);
       png_do_read_transformations(png_ptr, &row_info);
+      PNGCRUSH_PHASE_STOP(PNGCRUSH_TIMER_TRANSFORM);
+   }
 #endif
 
    /* The transformed pixel depth should match the depth now in row_info. */
@@ -589,8 +597,12 @@ png_read_row(png_structrp png_ptr, png_bytep row, png_bytep dsp_row)
       (png_ptr->transformations & PNG_INTERLACE) != 0)
    {
       if (png_ptr->pass < 6)
+      {
+         PNGCRUSH_PHASE_START(PNGCRUSH_TIMER_DEINTERLACE);
          png_do_read_interlace(&row_info, png_ptr->row_buf + 1, png_ptr->pass,
              png_ptr->transformations);
+         PNGCRUSH_PHASE_STOP(PNGCRUSH_TIMER_DEINTERLACE);
+      }
 
       if (dsp_row != NULL)
          png_combine_row(png_ptr, dsp_row, 1/*display*/);
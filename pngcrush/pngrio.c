@@ -34,7 +34,11 @@ png_read_data(png_structrp png_ptr, png_bytep data, png_size_t length)
    png_debug1(4, "reading %d bytes", (int)length);
 
    if (png_ptr->read_data_fn != NULL)
+   {
+      PNGCRUSH_PHASE_START(PNGCRUSH_TIMER_IO);
       (*(png_ptr->read_data_fn))(png_ptr, data, length);
+      PNGCRUSH_PHASE_STOP(PNGCRUSH_TIMER_IO);
+   }
 
    else
       png_error(png_ptr, "Call to NULL read function");
@@ -464,7 +464,14 @@ png_zlib_inflate(png_structrp png_ptr, int flush)
       png_ptr->zstream_start = 0;
    }
 
-   return inflate(&png_ptr->zstream, flush);
+   {
+      int ret;
+
+      PNGCRUSH_PHASE_START(PNGCRUSH_TIMER_INFLATE);
+      ret = inflate(&png_ptr->zstream, flush);
+      PNGCRUSH_PHASE_STOP(PNGCRUSH_TIMER_INFLATE);
+      return ret;
+   }
 }
 #endif /* Zlib >= 1.2.4 */
 
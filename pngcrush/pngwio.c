@@ -34,8 +34,12 @@ png_write_data(png_structrp png_ptr, png_const_bytep data, png_size_t length)
 {
    /* NOTE: write_data_fn must not change the buffer! */
    if (png_ptr->write_data_fn != NULL )
+   {
+      PNGCRUSH_PHASE_START(PNGCRUSH_TIMER_IO);
       (*(png_ptr->write_data_fn))(png_ptr, png_constcast(png_bytep,data),
           length);
+      PNGCRUSH_PHASE_STOP(PNGCRUSH_TIMER_IO);
+   }
 
    else
       png_error(png_ptr, "Call to NULL write function");
@@ -859,7 +859,11 @@ png_write_row(png_structrp png_ptr, png_const_bytep row)
 #ifdef PNG_WRITE_TRANSFORMS_SUPPORTED
    /* Handle other transformations */
    if (png_ptr->transformations != 0)
+   {
+      PNGCRUSH_PHASE_START(PNGCRUSH_TIMER_TRANSFORM);
       png_do_write_transformations(png_ptr, &row_info);
+      PNGCRUSH_PHASE_STOP(PNGCRUSH_TIMER_TRANSFORM);
+   }
 #endif
 
    /* At this point the row_info pixel depth must match the 'transformed' depth,
@@ -426,7 +426,10 @@ png_deflate_claim(png_structrp png_ptr, png_uint_32 owner,
        * pretty much the same set of error codes.
        */
       if (ret == Z_OK)
+      {
          png_ptr->zowner = owner;
+         PNGCRUSH_DEFLATE_CLAIMED(png_ptr, owner);
+      }
 
       else
          png_zstream_error(png_ptr, ret);
@@ -578,8 +581,10 @@ png_text_compress(png_structrp png_ptr, png_uint_32 chunk_name,
          }
 
          /* Compress the data */
+         PNGCRUSH_PHASE_START(PNGCRUSH_TIMER_DEFLATE);
          ret = deflate(&png_ptr->zstream,
              input_len > 0 ? Z_NO_FLUSH : Z_FINISH);
+         PNGCRUSH_PHASE_STOP(PNGCRUSH_TIMER_DEFLATE);
 
          /* Claw back input data that was not consumed (because avail_in is
           * reset above every time round the loop).
@@ -979,7 +984,9 @@ png_compress_IDAT(png_structrp png_ptr, png_const_bytep input,
       png_ptr->zstream.avail_in = avail;
       input_len -= avail;
 
+      PNGCRUSH_PHASE_START(PNGCRUSH_TIMER_DEFLATE);
       ret = deflate(&png_ptr->zstream, input_len > 0 ? Z_NO_FLUSH : flush);
+      PNGCRUSH_PHASE_STOP(PNGCRUSH_TIMER_DEFLATE);
 
       /* Include as-yet unconsumed input */
       input_len += png_ptr->zstream.avail_in;
@@ -2564,6 +2571,8 @@ png_write_find_filter(png_structrp png_ptr, png_row_infop row_info)
 
    png_debug(1, "in png_write_find_filter");
 
+   PNGCRUSH_PHASE_START(PNGCRUSH_TIMER_FILTER);
+
    /* Find out how many bytes offset each pixel is */
    bpp = (row_info->pixel_depth + 7) >> 3;
 
@@ -2738,6 +2747,8 @@ png_write_find_filter(png_structrp png_ptr, png_row_infop row_info)
       }
    }
 
+   PNGCRUSH_PHASE_STOP(PNGCRUSH_TIMER_FILTER);
+
    /* Do the actual writing of the filtered row data from the chosen filter. */
    png_write_filtered_row(png_ptr, best_row, row_info->rowbytes+1);
 
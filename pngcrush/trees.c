@@ -131,6 +131,35 @@ local const static_tree_desc  static_d_desc =
 local const static_tree_desc  static_bl_desc =
 {(const ct_data *)0, extra_blbits, 0,   BL_CODES, MAX_BL_BITS};
 
+/* ===========================================================================
+ * Work area for Z_OPTIMAL_HUFFMAN, allocated when first used.
+ */
+#define PM_ITEMS  (2*L_CODES)     /* most items in a package-merge list */
+#define LEN_CODES (L_CODES+D_CODES)
+
+typedef struct huff_work_s {
+    ulg weight[2][PM_ITEMS];      /* package-merge item weights, two levels */
+    uch leaf[MAX_BITS][PM_ITEMS]; /* whether each item is a leaf, per level */
+    int sorted[L_CODES];          /* leaves by increasing frequency */
+    uch bits[L_CODES];            /* package-merge bit lengths of sorted[] */
+    ulg cost[LEN_CODES+1];        /* fewest bits for the first n lengths */
+    ush step[LEN_CODES+1];        /* last token for those: (code<<8) + run */
+    ush token[2][LEN_CODES];      /* tokens found: (code<<8) + extra bits */
+    int send;                     /* which token[] send_all_trees() sends */
+} huff_work;
+
+local huff_work *huff_alloc OF((deflate_state *s));
+local unsigned rle_search   OF((deflate_state *s, huff_work *w, int lcodes,
+                                int dcodes, const int *bits, ush *token));
+
+local huff_work *huff_alloc(s)
+    deflate_state *s;
+{
+    if (s->huff_buf == Z_NULL)
+        s->huff_buf = (uchf *) ZALLOC(s->strm, 1, sizeof(huff_work));
+    return (huff_work *)s->huff_buf;
+}
+
 /* ===========================================================================
  * Local (static) routines in this file.
  */
@@ -139,15 +168,19 @@ local void tr_static_init OF((void));
 local void init_block     OF((deflate_state *s));
 local void pqdownheap     OF((deflate_state *s, ct_data *tree, int k));
 local void gen_bitlen     OF((deflate_state *s, tree_desc *desc));
+local int  pm_bitlen      OF((deflate_state *s, tree_desc *desc));
 local void gen_codes      OF((ct_data *tree, int max_code, ushf *bl_count));
 local void build_tree     OF((deflate_state *s, tree_desc *desc));
 local void scan_tree      OF((deflate_state *s, ct_data *tree, int max_code));
 local void send_tree      OF((deflate_state *s, ct_data *tree, int max_code));
 local int  build_bl_tree  OF((deflate_state *s));
+local int  rle_optimize   OF((deflate_state *s, int max_blindex,
+                              ulg tree_len));
 local void send_all_trees OF((deflate_state *s, int lcodes, int dcodes,
                               int blcodes));
 local void compress_block OF((deflate_state *s, const ct_data *ltree,
-                              const ct_data *dtree));
+                              const ct_data *dtree, const ushf *d_buf,
+                              const uchf *l_buf, unsigned last_lit));
 local int  detect_data_type OF((deflate_state *s));
 local unsigned bi_reverse OF((unsigned value, int length));
 local void bi_windup      OF((deflate_state *s));
@@ -524,6 +557,7 @@ local void gen_bitlen(s, desc)
         if (stree) s->static_len += (ulg)f * (unsigned)(stree[n].Len + xbits);
     }
     if (overflow == 0) return;
+    if (s->opt_huffman && pm_bitlen(s, desc)) return;
 
     Tracev((stderr,"\nbit length overflow\n"));
     /* This happens for example on obj2 and pic of the Calgary corpus */
@@ -561,6 +595,90 @@ local void gen_bitlen(s, desc)
     }
 }
 
+/* ===========================================================================
+ * Replace the bit lengths that gen_bitlen() found to overflow with the
+ * optimal lengths limited to max_length, for Z_OPTIMAL_HUFFMAN.  This is
+ * the package-merge algorithm: the list at each level merges the leaves
+ * with pairs of items from the list of the level below, the first 2n-2
+ * items at the top level make up the code, and the bit length of a leaf is
+ * the number of levels at which it is among the items used.  Since leaves
+ * are merged in order of frequency, the items used at each level are the
+ * first few leaves and the first few packages, so only the number of leaves
+ * needs to be kept for each level.
+ * IN assertion: as for gen_bitlen(), and the first pass of gen_bitlen()
+ *     has been done.
+ * Return false, with nothing changed, if the work area cannot be allocated.
+ */
+local int pm_bitlen(s, desc)
+    deflate_state *s;
+    tree_desc *desc;    /* the tree descriptor */
+{
+    ct_data *tree        = desc->dyn_tree;
+    int max_code         = desc->max_code;
+    int max_length       = desc->stat_desc->max_length;
+    huff_work *w         = huff_alloc(s);
+    ulg *prev, *cur;    /* lists of the level below and this level */
+    ulg pair;           /* weight of the next package */
+    int n = 0;          /* number of leaves */
+    int items;          /* number of items in the list below */
+    int used;           /* number of items used at a level */
+    int leaves;         /* number of leaves among them */
+    int lev, h, i, j, k;
+
+    if (w == Z_NULL) return 0;
+
+    /* heap[heap_max+1..HEAP_SIZE-1] holds the nodes by decreasing frequency */
+    for (h = HEAP_SIZE-1; h > s->heap_max; h--) {
+        if (s->heap[h] <= max_code) w->sorted[n++] = s->heap[h];
+    }
+
+    /* The deepest level has only the leaves */
+    prev = w->weight[0];
+    cur = w->weight[1];
+    for (i = 0; i < n; i++) {
+        prev[i] = tree[w->sorted[i]].Freq;
+        w->leaf[max_length-1][i] = 1;
+    }
+    items = n;
+    for (lev = max_length-2; lev >= 0; lev--) {
+        i = j = k = 0;
+        while (i < n || j < items/2) {
+            pair = j < items/2 ? prev[2*j] + prev[2*j+1] : 0;
+            if (j >= items/2 || (i < n && tree[w->sorted[i]].Freq <= pair)) {
+                cur[k] = tree[w->sorted[i++]].Freq;
+                w->leaf[lev][k++] = 1;
+            } else {
+                cur[k] = pair;
+                w->leaf[lev][k++] = 0;
+                j++;
+            }
+        }
+        items = k;
+        prev = cur;
+        cur = w->weight[cur == w->weight[0]];
+    }
+
+    /* Count the levels at which each leaf is used */
+    for (i = 0; i < n; i++) w->bits[i] = 0;
+    used = 2*n - 2;
+    for (lev = 0; lev < max_length && used > 0; lev++) {
+        for (leaves = 0, k = 0; k < used; k++) leaves += w->leaf[lev][k];
+        for (i = 0; i < leaves; i++) w->bits[i]++;
+        used = 2*(used - leaves);
+    }
+
+    for (k = 0; k <= MAX_BITS; k++) s->bl_count[k] = 0;
+    for (i = 0; i < n; i++) {
+        int m = w->sorted[i];
+
+        Tracev((stderr,"code %d bits %d->%d\n", m, tree[m].Len, w->bits[i]));
+        s->opt_len += ((ulg)w->bits[i] - tree[m].Len) * tree[m].Freq;
+        tree[m].Len = (ush)w->bits[i];
+        s->bl_count[w->bits[i]]++;
+    }
+    return 1;
+}
+
 /* ===========================================================================
  * Generate the codes for a given tree and bit counts (which need not be
  * optimal).
@@ -800,10 +918,12 @@ local int build_bl_tree(s)
     deflate_state *s;
 {
     int max_blindex;  /* index of last bit length code of non zero freq */
+    ulg tree_len;     /* opt_len before the tree representations */
 
     /* Determine the bit length frequencies for literal and distance trees */
     scan_tree(s, (ct_data *)s->dyn_ltree, s->l_desc.max_code);
     scan_tree(s, (ct_data *)s->dyn_dtree, s->d_desc.max_code);
+    tree_len = s->opt_len;
 
     /* Build the bit length tree: */
     build_tree(s, (tree_desc *)(&(s->bl_desc)));
@@ -820,12 +940,145 @@ local int build_bl_tree(s)
     }
     /* Update opt_len to include the bit length tree and counts */
     s->opt_len += 3*((ulg)max_blindex+1) + 5+5+4;
+
+    s->rle_tokens = 0;
+    if (s->opt_huffman)
+        max_blindex = rle_optimize(s, max_blindex, s->opt_len - tree_len);
     Tracev((stderr, "\ndyn trees: dyn %ld, stat %ld",
             s->opt_len, s->static_len));
 
     return max_blindex;
 }
 
+/* ===========================================================================
+ * Find the fewest bits to send the literal and distance code lengths with
+ * the bit length codes, if each code costs bits[code] including its extra
+ * bits.  The two sets of lengths are searched as the one sequence they are
+ * in the block header, so that repeats can cross from one to the other.
+ * Return the number of tokens put in token[].
+ */
+local unsigned rle_search(s, w, lcodes, dcodes, bits, token)
+    deflate_state *s;
+    huff_work *w;
+    int lcodes, dcodes;  /* number of codes for each tree */
+    const int *bits;     /* cost of each bit length code */
+    ush *token;          /* tokens to send, in order */
+{
+    int total = lcodes + dcodes;
+    int i, k, run, code, prev;
+    unsigned n = 0;
+    ulg c;
+
+#define RLE_LEN(i) ((i) < lcodes ? s->dyn_ltree[i].Len : \
+                    s->dyn_dtree[(i)-lcodes].Len)
+#define RLE_STEP(k, c, code, run) \
+    if ((c) < w->cost[k]) \
+        w->cost[k] = (c), w->step[k] = (ush)(((code) << 8) + (run))
+
+    w->cost[0] = 0;
+    for (i = 1; i <= total; i++) w->cost[i] = ~(ulg)0;
+
+    for (i = 0; i < total; i++) {
+        code = RLE_LEN(i);
+        c = w->cost[i] + bits[code];
+        RLE_STEP(i+1, c, code, 1);
+
+        /* Repeat the previous length 3 to 6 times */
+        if (i > 0) {
+            prev = RLE_LEN(i-1);
+            c = w->cost[i] + bits[REP_3_6];
+            for (k = 1; k <= 6 && i+k <= total && RLE_LEN(i+k-1) == prev; k++) {
+                if (k >= 3) RLE_STEP(i+k, c, REP_3_6, k);
+            }
+        }
+
+        /* Repeat a zero length 3 to 138 times */
+        if (code == 0) {
+            for (k = 1; k <= 138 && i+k <= total && RLE_LEN(i+k-1) == 0; k++) {
+                if (k >= 11) {
+                    c = w->cost[i] + bits[REPZ_11_138];
+                    RLE_STEP(i+k, c, REPZ_11_138, k);
+                } else if (k >= 3) {
+                    c = w->cost[i] + bits[REPZ_3_10];
+                    RLE_STEP(i+k, c, REPZ_3_10, k);
+                }
+            }
+        }
+    }
+#undef RLE_STEP
+#undef RLE_LEN
+
+    for (i = total; i > 0; i -= w->step[i] & 0xff) n++;
+    k = (int)n;
+    for (i = total; i > 0; i -= run) {
+        code = w->step[i] >> 8;
+        run = w->step[i] & 0xff;
+        token[--k] = (ush)((code << 8) + (code == REPZ_11_138 ? run - 11 :
+                                          code >= REP_3_6 ? run - 3 : 0));
+    }
+    return n;
+}
+
+/* ===========================================================================
+ * For Z_OPTIMAL_HUFFMAN, look for a cheaper way to send the literal and
+ * distance code lengths than the one scan_tree() found, and if there is one
+ * make the bit length tree for it and save its tokens for send_all_trees().
+ * Two searches are made, the first with the costs of the bit length tree
+ * from scan_tree(), the second with those of the tree from the first.
+ * Return the index in bl_order of the last bit length code to send.
+ */
+local int rle_optimize(s, max_blindex, tree_len)
+    deflate_state *s;
+    int max_blindex;  /* as found for the codes from scan_tree() */
+    ulg tree_len;     /* bits for the header with those codes */
+{
+    huff_work *w = huff_alloc(s);
+    ulg base = s->opt_len - tree_len;
+    ct_data best_tree[BL_CODES];
+    int best_max_code = s->bl_desc.max_code;
+    int lcodes = s->l_desc.max_code+1;
+    int dcodes = s->d_desc.max_code+1;
+    int bits[BL_CODES];
+    int pass, n, blindex;
+    unsigned ntok, t;
+    ulg len;
+
+    if (w == Z_NULL) return max_blindex;
+    zmemcpy((Bytef *)best_tree, (Bytef *)s->bl_tree, sizeof(best_tree));
+
+    for (pass = 0; pass < 2; pass++) {
+        /* A code not in the tree yet is guessed to cost the most */
+        for (n = 0; n < BL_CODES; n++) {
+            bits[n] = (s->bl_tree[n].Len != 0 ? s->bl_tree[n].Len :
+                       MAX_BL_BITS) + extra_blbits[n];
+        }
+        ntok = rle_search(s, w, lcodes, dcodes, bits, w->token[pass]);
+
+        for (n = 0; n < BL_CODES; n++) s->bl_tree[n].Freq = 0;
+        for (t = 0; t < ntok; t++) s->bl_tree[w->token[pass][t] >> 8].Freq++;
+        s->opt_len = 0L;
+        build_tree(s, (tree_desc *)(&(s->bl_desc)));
+        for (blindex = BL_CODES-1; blindex >= 3; blindex--) {
+            if (s->bl_tree[bl_order[blindex]].Len != 0) break;
+        }
+        len = s->opt_len + 3*((ulg)blindex+1) + 5+5+4;
+
+        if (len < tree_len) {
+            tree_len = len;
+            max_blindex = blindex;
+            s->rle_tokens = ntok;
+            w->send = pass;
+            zmemcpy((Bytef *)best_tree, (Bytef *)s->bl_tree,
+                    sizeof(best_tree));
+            best_max_code = s->bl_desc.max_code;
+        }
+    }
+    zmemcpy((Bytef *)s->bl_tree, (Bytef *)best_tree, sizeof(best_tree));
+    s->bl_desc.max_code = best_max_code;
+    s->opt_len = base + tree_len;
+    return max_blindex;
+}
+
 /* ===========================================================================
  * Send the header for a block using dynamic Huffman trees: the counts, the
  * lengths of the bit length codes, the literal tree and the distance tree.
@@ -850,6 +1103,22 @@ local void send_all_trees(s, lcodes, dcodes, blcodes)
     }
     Tracev((stderr, "\nbl tree: sent %ld", s->bits_sent));
 
+    if (s->rle_tokens != 0) {
+        /* Tokens saved by rle_optimize() for both trees */
+        huff_work *w = (huff_work *)s->huff_buf;
+        unsigned t;
+
+        for (t = 0; t < s->rle_tokens; t++) {
+            int code = w->token[w->send][t] >> 8;
+
+            send_code(s, code, s->bl_tree);
+            if (code >= REP_3_6)
+                send_bits(s, w->token[w->send][t] & 0xff, extra_blbits[code]);
+        }
+        Tracev((stderr, "\nlit and dist trees: sent %ld", s->bits_sent));
+        return;
+    }
+
     send_tree(s, (ct_data *)s->dyn_ltree, lcodes-1); /* literal tree */
     Tracev((stderr, "\nlit tree: sent %ld", s->bits_sent));
 
@@ -904,6 +1173,272 @@ void ZLIB_INTERNAL _tr_align(s)
     bi_flush(s);
 }
 
+/* ===========================================================================
+ * Block splitting, for Z_SPLIT_BLOCKS.  The symbols of the current block are
+ * copied to s->split_buf, and the code frequencies are accumulated there at
+ * every SPLIT_CHUNK symbols, so that the exact size of any run of chunks as
+ * one block can be found by building its trees.  Boundaries are chosen top
+ * down: a run is split at the chunk boundary that gives the smallest total
+ * size, if that is smaller than the size of the run as a single block.
+ */
+#define SPLIT_CHUNK  1024   /* granularity of block boundaries, in symbols */
+#define SPLIT_BLOCKS 32     /* most blocks made from one buffer of symbols */
+#define SPLIT_CODES  (L_CODES+D_CODES)
+
+typedef struct split_data_s {
+    ulg *bytes;         /* input bytes before each chunk */
+    unsigned *freq;     /* code frequencies before each chunk */
+    ushf *d_buf;        /* copy of s->d_buf */
+    uchf *l_buf;        /* copy of s->l_buf */
+    unsigned nchunks;   /* number of chunks in the block */
+} split_data;
+
+local int  split_setup  OF((deflate_state *s, split_data *sd));
+local void split_load   OF((deflate_state *s, split_data *sd, unsigned a,
+                            unsigned b));
+local ulg  split_cost   OF((deflate_state *s, split_data *sd, unsigned a,
+                            unsigned b, charf *buf, int *type,
+                            int *max_blindex));
+local void split_search OF((deflate_state *s, split_data *sd, unsigned a,
+                            unsigned b, charf *buf, unsigned *bounds,
+                            unsigned *nb));
+local void split_send   OF((deflate_state *s, split_data *sd, unsigned a,
+                            unsigned b, charf *buf, int last));
+local int  split_block  OF((deflate_state *s, charf *buf, int last));
+
+/* ===========================================================================
+ * Copy the symbols of the current block and count their codes per chunk.
+ * Return false if the work area cannot be allocated.
+ */
+local int split_setup(s, sd)
+    deflate_state *s;
+    split_data *sd;
+{
+    unsigned max_chunks = (s->lit_bufsize + SPLIT_CHUNK - 1)/SPLIT_CHUNK + 1;
+    unsigned *f;
+    unsigned c, lx, end;
+    ulg bytes = 0;
+
+    if (s->split_buf == Z_NULL) {
+        ulg size = max_chunks * (sizeof(ulg) + SPLIT_CODES*sizeof(unsigned))
+                   + (ulg)s->lit_bufsize * (sizeof(ush) + 1);
+
+        s->split_buf = (uchf *) ZALLOC(s->strm, (uInt)size, 1);
+        if (s->split_buf == Z_NULL) return 0;
+    }
+    sd->bytes = (ulg *)s->split_buf;
+    sd->freq = (unsigned *)(sd->bytes + max_chunks);
+    sd->d_buf = (ushf *)(sd->freq + max_chunks * SPLIT_CODES);
+    sd->l_buf = (uchf *)(sd->d_buf + s->lit_bufsize);
+    sd->nchunks = (s->last_lit + SPLIT_CHUNK - 1) / SPLIT_CHUNK;
+
+    zmemcpy((Bytef *)sd->d_buf, (Bytef *)s->d_buf, s->last_lit*sizeof(ush));
+    zmemcpy(sd->l_buf, s->l_buf, s->last_lit);
+
+    f = sd->freq;
+    zmemzero((Bytef *)f, SPLIT_CODES*sizeof(unsigned));
+    sd->bytes[0] = 0;
+    for (c = 0; c < sd->nchunks; c++) {
+        zmemcpy((Bytef *)(f + SPLIT_CODES), (Bytef *)f,
+                SPLIT_CODES*sizeof(unsigned));
+        f += SPLIT_CODES;
+        end = (c + 1) * SPLIT_CHUNK;
+        if (end > s->last_lit) end = s->last_lit;
+        for (lx = c * SPLIT_CHUNK; lx < end; lx++) {
+            unsigned dist = sd->d_buf[lx];
+            unsigned lc = sd->l_buf[lx];
+
+            if (dist == 0) {
+                f[lc]++;
+                bytes++;
+            } else {
+                f[_length_code[lc]+LITERALS+1]++;
+                f[L_CODES + d_code(dist - 1)]++;
+                bytes += lc + MIN_MATCH;
+            }
+        }
+        sd->bytes[c + 1] = bytes;
+    }
+    return 1;
+}
+
+/* ===========================================================================
+ * Set the code frequencies to those of chunks a up to b, as _tr_tally()
+ * would have left them for a block of just those symbols.
+ */
+local void split_load(s, sd, a, b)
+    deflate_state *s;
+    split_data *sd;
+    unsigned a, b;
+{
+    const unsigned *lo = sd->freq + a * SPLIT_CODES;
+    const unsigned *hi = sd->freq + b * SPLIT_CODES;
+    int n;
+
+    for (n = 0; n < L_CODES; n++)
+        s->dyn_ltree[n].Freq = (ush)(hi[n] - lo[n]);
+    for (n = 0; n < D_CODES; n++)
+        s->dyn_dtree[n].Freq = (ush)(hi[L_CODES + n] - lo[L_CODES + n]);
+    for (n = 0; n < BL_CODES; n++) s->bl_tree[n].Freq = 0;
+    s->dyn_ltree[END_BLOCK].Freq = 1;
+    s->opt_len = s->static_len = 0L;
+}
+
+/* ===========================================================================
+ * Return the size in bits of chunks a up to b sent as one block, and the
+ * cheapest block type for them.  The dynamic trees are left built for
+ * these chunks.
+ */
+local ulg split_cost(s, sd, a, b, buf, type, max_blindex)
+    deflate_state *s;
+    split_data *sd;
+    unsigned a, b;
+    charf *buf;       /* input block, or NULL if too old */
+    int *type;        /* STORED_BLOCK, STATIC_TREES or DYN_TREES */
+    int *max_blindex;
+{
+    ulg cost, stored_len = sd->bytes[b] - sd->bytes[a];
+
+    split_load(s, sd, a, b);
+    build_tree(s, (tree_desc *)(&(s->l_desc)));
+    build_tree(s, (tree_desc *)(&(s->d_desc)));
+    *max_blindex = build_bl_tree(s);
+
+    *type = DYN_TREES;
+    cost = s->opt_len + 3;
+    if (s->static_len + 3 <= cost) {
+        *type = STATIC_TREES;
+        cost = s->static_len + 3;
+    }
+    /* 3 bits of block type, up to 7 to align, and two words of lengths */
+    if (buf != (charf *)0 && stored_len <= 0xffff &&
+        (stored_len + 4) * 8 + 3 + 7 <= cost) {
+        *type = STORED_BLOCK;
+        cost = (stored_len + 4) * 8 + 3 + 7;
+    }
+    return cost;
+}
+
+/* ===========================================================================
+ * Find the boundaries for splitting chunks a up to b, and add them to
+ * bounds[] in increasing order.
+ */
+local void split_search(s, sd, a, b, buf, bounds, nb)
+    deflate_state *s;
+    split_data *sd;
+    unsigned a, b;
+    charf *buf;
+    unsigned *bounds;
+    unsigned *nb;
+{
+    ulg best, cost;
+    unsigned c, best_c = 0;
+    int type, max_blindex;
+
+    if (b - a < 2 || *nb >= SPLIT_BLOCKS) return;
+
+    best = split_cost(s, sd, a, b, buf, &type, &max_blindex);
+    for (c = a + 1; c < b; c++) {
+        cost = split_cost(s, sd, a, c, buf, &type, &max_blindex);
+        if (cost >= best) continue;
+        cost += split_cost(s, sd, c, b, buf, &type, &max_blindex);
+        if (cost < best) {
+            best = cost;
+            best_c = c;
+        }
+    }
+    if (best_c == 0) return;
+
+    split_search(s, sd, a, best_c, buf, bounds, nb);
+    if (*nb >= SPLIT_BLOCKS) return;
+    bounds[(*nb)++] = best_c;
+    split_search(s, sd, best_c, b, buf, bounds, nb);
+}
+
+/* ===========================================================================
+ * Send chunks a up to b as one block.
+ */
+local void split_send(s, sd, a, b, buf, last)
+    deflate_state *s;
+    split_data *sd;
+    unsigned a, b;
+    charf *buf;
+    int last;
+{
+    unsigned first = a * SPLIT_CHUNK;
+    unsigned end = b * SPLIT_CHUNK;
+    int type, max_blindex;
+
+    if (end > s->last_lit) end = s->last_lit;
+    split_cost(s, sd, a, b, buf, &type, &max_blindex);
+
+    if (type == STORED_BLOCK) {
+        _tr_stored_block(s, buf + sd->bytes[a], sd->bytes[b] - sd->bytes[a],
+                         last);
+    } else if (type == STATIC_TREES) {
+        send_bits(s, (STATIC_TREES<<1)+last, 3);
+        compress_block(s, (const ct_data *)static_ltree,
+                       (const ct_data *)static_dtree, sd->d_buf + first,
+                       sd->l_buf + first, end - first);
+#ifdef ZLIB_DEBUG
+        s->compressed_len += 3 + s->static_len;
+#endif
+    } else {
+        send_bits(s, (DYN_TREES<<1)+last, 3);
+        send_all_trees(s, s->l_desc.max_code+1, s->d_desc.max_code+1,
+                       max_blindex+1);
+        compress_block(s, (const ct_data *)s->dyn_ltree,
+                       (const ct_data *)s->dyn_dtree, sd->d_buf + first,
+                       sd->l_buf + first, end - first);
+#ifdef ZLIB_DEBUG
+        s->compressed_len += 3 + s->opt_len;
+#endif
+    }
+}
+
+/* ===========================================================================
+ * Send the current block as several blocks, if that is smaller.  Return
+ * false, with the block untouched, if it is not split.
+ */
+local int split_block(s, buf, last)
+    deflate_state *s;
+    charf *buf;       /* input block, or NULL if too old */
+    int last;         /* one if this is the last block for a file */
+{
+    split_data sd;
+    unsigned bounds[SPLIT_BLOCKS + 1];
+    unsigned nb = 0, i;
+
+    if (!split_setup(s, &sd)) return 0;
+
+    /* Check if the file is binary or text, before the counts are changed */
+    if (s->strm->data_type == Z_UNKNOWN)
+        s->strm->data_type = detect_data_type(s);
+
+    bounds[nb++] = 0;
+    split_search(s, &sd, 0, sd.nchunks, buf, bounds, &nb);
+    if (nb == 1) {
+        split_load(s, &sd, 0, sd.nchunks);
+        return 0;
+    }
+    bounds[nb] = sd.nchunks;
+    Tracev((stderr, "\nsplit %u symbols into %u blocks", s->last_lit, nb));
+
+    for (i = 0; i < nb; i++)
+        split_send(s, &sd, bounds[i], bounds[i + 1], buf,
+                   last && i == nb - 1);
+    Assert (s->compressed_len == s->bits_sent, "bad compressed size");
+
+    init_block(s);
+    if (last) {
+        bi_windup(s);
+#ifdef ZLIB_DEBUG
+        s->compressed_len += 7;  /* align on byte boundary */
+#endif
+    }
+    return 1;
+}
+
 /* ===========================================================================
  * Determine the best encoding for the current block: dynamic trees, static
  * trees or store, and write out the encoded block.
@@ -917,6 +1452,11 @@ void ZLIB_INTERNAL _tr_flush_block(s, buf, stored_len, last)
     ulg opt_lenb, static_lenb; /* opt_len and static_len in bytes */
     int max_blindex = 0;  /* index of last bit length code of non zero freq */
 
+    /* Split the block if Z_SPLIT_BLOCKS was given and that is smaller */
+    if (s->block_split && s->level > 0 && s->strategy != Z_FIXED &&
+        s->last_lit >= 2 * SPLIT_CHUNK && split_block(s, buf, last))
+        return;
+
     /* Build the Huffman trees unless a stored block is forced */
     if (s->level > 0) {
 
@@ -977,7 +1517,8 @@ void ZLIB_INTERNAL _tr_flush_block(s, buf, stored_len, last)
 #endif
         send_bits(s, (STATIC_TREES<<1)+last, 3);
         compress_block(s, (const ct_data *)static_ltree,
-                       (const ct_data *)static_dtree);
+                       (const ct_data *)static_dtree, s->d_buf, s->l_buf,
+                       s->last_lit);
 #ifdef ZLIB_DEBUG
         s->compressed_len += 3 + s->static_len;
 #endif
@@ -986,7 +1527,8 @@ void ZLIB_INTERNAL _tr_flush_block(s, buf, stored_len, last)
         send_all_trees(s, s->l_desc.max_code+1, s->d_desc.max_code+1,
                        max_blindex+1);
         compress_block(s, (const ct_data *)s->dyn_ltree,
-                       (const ct_data *)s->dyn_dtree);
+                       (const ct_data *)s->dyn_dtree, s->d_buf, s->l_buf,
+                       s->last_lit);
 #ifdef ZLIB_DEBUG
         s->compressed_len += 3 + s->opt_len;
 #endif
@@ -1061,10 +1603,13 @@ int ZLIB_INTERNAL _tr_tally (s, dist, lc)
 /* ===========================================================================
  * Send the block data compressed using the given Huffman trees
  */
-local void compress_block(s, ltree, dtree)
+local void compress_block(s, ltree, dtree, d_buf, l_buf, last_lit)
     deflate_state *s;
     const ct_data *ltree; /* literal tree */
     const ct_data *dtree; /* distance tree */
+    const ushf *d_buf;    /* distances, normally s->d_buf */
+    const uchf *l_buf;    /* literals or lengths, normally s->l_buf */
+    unsigned last_lit;    /* number of symbols */
 {
     unsigned dist;      /* distance of matched string */
     int lc;             /* match length or unmatched char (if dist == 0) */
@@ -1072,9 +1617,9 @@ local void compress_block(s, ltree, dtree)
     unsigned code;      /* the code to send */
     int extra;          /* number of extra bits to send */
 
-    if (s->last_lit != 0) do {
-        dist = s->d_buf[lx];
-        lc = s->l_buf[lx++];
+    if (last_lit != 0) do {
+        dist = d_buf[lx];
+        lc = l_buf[lx++];
         if (dist == 0) {
             send_code(s, lc, ltree); /* send a literal byte */
             Tracecv(isgraph(lc), (stderr," '%c' ", lc));
@@ -1100,10 +1645,11 @@ local void compress_block(s, ltree, dtree)
         } /* literal or match pair ? */
 
         /* Check that the overlay between pending_buf and d_buf+l_buf is ok: */
-        Assert((uInt)(s->pending) < s->lit_bufsize + 2*lx,
+        Assert(d_buf != s->d_buf ||
+               (uInt)(s->pending) < s->lit_bufsize + 2*lx,
                "pendingBuf overflow");
 
-    } while (lx < s->last_lit);
+    } while (lx < last_lit);
 
     send_code(s, END_BLOCK, ltree);
 }
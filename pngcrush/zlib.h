@@ -199,6 +199,12 @@ typedef gz_header FAR *gz_headerp;
 #define Z_FIXED               4
 #define Z_DEFAULT_STRATEGY    0
 /* compression strategy; see deflateInit2() below for details */
+#define Z_SPLIT_BLOCKS     0x100
+/* pngcrush extension: or'ed into a strategy, choose block boundaries by
+   estimated cost (see deflateInit2() below) */
+#define Z_OPTIMAL_HUFFMAN  0x200
+/* pngcrush extension: or'ed into a strategy, build optimal length-limited
+   codes (see deflateInit2() below) */
 
 #define Z_BINARY   0
 #define Z_TEXT     1
@@ -600,6 +606,21 @@ ZEXTERN int ZEXPORT deflateInit2 OF((z_streamp strm,
    Z_FIXED prevents the use of dynamic Huffman codes, allowing for a simpler
    decoder for special applications.
 
+     The pngcrush copy of zlib also accepts Z_SPLIT_BLOCKS or'ed into any
+   strategy but Z_FIXED.  The symbols collected for each block (up to
+   1 << (memLevel + 6) of them) are then split into smaller blocks wherever
+   that reduces the total size, and each block is sent stored, with fixed
+   codes or with dynamic codes, whichever is smallest.  This takes extra
+   time and about (memLevel == 9 ? 140K : 70K) bytes of memory.  The output
+   is an ordinary deflate stream.
+
+     Z_OPTIMAL_HUFFMAN, also or'ed into the strategy, makes the Huffman codes
+   optimal when some would be longer than the deflate limit (zlib otherwise
+   shortens them with a heuristic), using the package-merge algorithm, and
+   sends the code lengths in each block header with the fewest bits instead
+   of with a fixed run-length rule.  This costs little time and about 24K
+   bytes of memory, and the output is again an ordinary deflate stream.
+
      deflateInit2 returns Z_OK if success, Z_MEM_ERROR if there was not enough
    memory, Z_STREAM_ERROR if any parameter is invalid (such as an invalid
    method), or Z_VERSION_ERROR if the zlib library version (zlib_version) is